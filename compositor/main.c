@@ -652,6 +652,8 @@ usage(int error_code)
 		"  --shell=MODULE\tShell module, defaults to desktop-shell.so\n"
 		"  -S, --socket=NAME\tName of socket to listen on\n"
 		"  -i, --idle-time=SECS\tIdle time in seconds\n"
+		"  --pixman-threads=N\tThreads the pixman renderer paints with\n"
+		"  --parallel-repaint\tPaint the outputs due at the same time in parallel\n"
 #if defined(BUILD_XWAYLAND)
 		"  --xwayland\t\tLoad the xwayland module\n"
 #endif
@@ -717,6 +719,8 @@ usage(int error_code)
 		"  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
 		"  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
 		"  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
+		"  --max-unacked-frames=N\tFrames an RDP peer may be sent ahead of its acks,\n"
+		"\t\t\t0 for no limit\n"
 		"\n");
 #endif
 
@@ -1088,8 +1092,32 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	} else {
 		ec->repaint_msec = repaint_msec;
 	}
-	weston_log("Output repaint window is %d ms maximum.\n",
-		   ec->repaint_msec);
+	weston_config_section_get_bool(s, "adaptive-repaint-window",
+				       &ec->adaptive_repaint_window, false);
+	if (ec->adaptive_repaint_window)
+		weston_log("Output repaint windows adapt to repaint costs, "
+			   "starting at %d ms.\n", ec->repaint_msec);
+	else
+		weston_log("Output repaint window is %d ms maximum.\n",
+			   ec->repaint_msec);
+
+	weston_config_section_get_int(s, "occluded-frame-interval",
+				      &ec->occluded_frame_msec, 0);
+	if (ec->occluded_frame_msec > 0)
+		weston_log("Frame callbacks of hidden surfaces are sent every "
+			   "%d ms.\n", ec->occluded_frame_msec);
+
+	weston_config_section_get_int(s, "damage-rects-max",
+				      &ec->damage_rects_max, 32);
+	weston_config_section_get_int(s, "damage-waste-max",
+				      &ec->damage_waste_max, 25);
+	if (ec->damage_rects_max < 0)
+		ec->damage_rects_max = 0;
+	if (ec->damage_waste_max < 0 || ec->damage_waste_max > 100) {
+		weston_log("Invalid damage-waste-max value in config: %d\n",
+			   ec->damage_waste_max);
+		ec->damage_waste_max = 25;
+	}
 
 	/* weston.ini [libinput] */
 	s = weston_config_get_section(config, "libinput", NULL, NULL);
@@ -1261,6 +1289,39 @@ allow_content_protection(struct weston_output *output,
 	weston_output_allow_protection(output, allow_hdcp);
 }
 
+static void
+wet_output_set_shader_prewarm(struct weston_output *output,
+			      struct weston_config_section *section)
+{
+	bool shader_prewarm = false;
+
+	if (section)
+		weston_config_section_get_bool(section, "shader-prewarm",
+					       &shader_prewarm, false);
+
+	weston_output_set_shader_prewarm(output, shader_prewarm);
+}
+
+static void
+wet_output_set_repaint_window(struct weston_output *output,
+			      struct weston_config_section *section)
+{
+	int repaint_msec;
+
+	if (!section ||
+	    weston_config_section_get_int(section, "repaint-window",
+					  &repaint_msec, 0) < 0)
+		return;
+
+	if (repaint_msec < -10 || repaint_msec > 1000) {
+		weston_log("Invalid repaint-window value %d for output %s\n",
+			   repaint_msec, output->name);
+		return;
+	}
+
+	weston_output_set_repaint_window(output, repaint_msec);
+}
+
 static int
 wet_configure_windowed_output_from_config(struct weston_output *output,
 					  struct wet_output_config *defaults)
@@ -1299,6 +1360,8 @@ wet_configure_windowed_output_from_config(struct weston_output *output,
 	}
 
 	allow_content_protection(output, section);
+	wet_output_set_shader_prewarm(output, section);
+	wet_output_set_repaint_window(output, section);
 
 	if (parsed_options->width)
 		width = parsed_options->width;
@@ -1764,6 +1827,8 @@ drm_backend_output_configure(struct weston_output *output,
 	free(seat);
 
 	allow_content_protection(output, section);
+	wet_output_set_shader_prewarm(output, section);
+	wet_output_set_repaint_window(output, section);
 
 	return 0;
 }
@@ -2234,6 +2299,7 @@ drm_backend_remoted_output_configure(struct weston_output *output,
 	char *seat = NULL;
 	char *host = NULL;
 	char *pipeline = NULL;
+	uint32_t queue_depth, keepalive;
 	int port, ret;
 
 	ret = api->set_mode(output, modeline);
@@ -2261,6 +2327,16 @@ drm_backend_remoted_output_configure(struct weston_output *output,
 	api->set_seat(output, seat);
 	free(seat);
 
+	weston_config_section_get_uint(section, "frame-queue-depth",
+				       &queue_depth,
+				       WESTON_VIRTUAL_OUTPUT_FRAME_QUEUE_DEPTH);
+	api->set_frame_queue_depth(output, queue_depth);
+
+	weston_config_section_get_uint(section, "keepalive-interval",
+				       &keepalive,
+				       WESTON_REMOTING_KEEPALIVE_INTERVAL);
+	api->set_keepalive_interval(output, keepalive);
+
 	weston_config_section_get_string(section, "gst-pipeline", &pipeline,
 					 NULL);
 	if (pipeline) {
@@ -2385,6 +2461,7 @@ drm_backend_pipewire_output_configure(struct weston_output *output,
 				     const struct weston_pipewire_api *api)
 {
 	char *seat = NULL;
+	uint32_t queue_depth;
 	int ret;
 
 	ret = api->set_mode(output, modeline);
@@ -2407,6 +2484,11 @@ drm_backend_pipewire_output_configure(struct weston_output *output,
 	api->set_seat(output, seat);
 	free(seat);
 
+	weston_config_section_get_uint(section, "frame-queue-depth",
+				       &queue_depth,
+				       WESTON_VIRTUAL_OUTPUT_FRAME_QUEUE_DEPTH);
+	api->set_frame_queue_depth(output, queue_depth);
+
 	return 0;
 }
 
@@ -2699,6 +2781,7 @@ weston_rdp_backend_config_init(struct weston_rdp_backend_config *config)
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
 	config->force_no_compression = 0;
+	config->max_unacked_frames = 2;
 }
 
 static int
@@ -2725,6 +2808,7 @@ load_rdp_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
 		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key },
 		{ WESTON_OPTION_BOOLEAN, "force-no-compression", 0, &config.force_no_compression },
+		{ WESTON_OPTION_INTEGER, "max-unacked-frames", 0, &config.max_unacked_frames },
 	};
 
 	parse_options(rdp_options, ARRAY_LENGTH(rdp_options), argc, argv);
@@ -3142,6 +3226,8 @@ wet_main(int argc, char *argv[])
 	char *flight_rec_scopes = NULL;
 	char *server_socket = NULL;
 	int32_t idle_time = -1;
+	int32_t pixman_threads = -1;
+	bool parallel_repaint = false;
 	int32_t help = 0;
 	char *socket_name = NULL;
 	int32_t version = 0;
@@ -3168,6 +3254,8 @@ wet_main(int argc, char *argv[])
 		{ WESTON_OPTION_STRING, "shell", 0, &shell },
 		{ WESTON_OPTION_STRING, "socket", 'S', &socket_name },
 		{ WESTON_OPTION_INTEGER, "idle-time", 'i', &idle_time },
+		{ WESTON_OPTION_INTEGER, "pixman-threads", 0, &pixman_threads },
+		{ WESTON_OPTION_BOOLEAN, "parallel-repaint", 0, &parallel_repaint },
 #if defined(BUILD_XWAYLAND)
 		{ WESTON_OPTION_BOOLEAN, "xwayland", 0, &xwayland },
 #endif
@@ -3316,6 +3404,16 @@ wet_main(int argc, char *argv[])
 	weston_config_section_get_bool(section, "require-input",
 				       &wet.compositor->require_input, true);
 
+	if (pixman_threads < 0)
+		weston_config_section_get_int(section, "pixman-threads",
+					      &pixman_threads, 1);
+	wet.compositor->pixman_threads = pixman_threads;
+
+	if (!parallel_repaint)
+		weston_config_section_get_bool(section, "parallel-repaint",
+					       &parallel_repaint, false);
+	wet.compositor->parallel_repaint = parallel_repaint;
+
 	if (load_backend(wet.compositor, backend, &argc, argv, config) < 0) {
 		weston_log("fatal: failed to create compositor backend\n");
 		goto out;
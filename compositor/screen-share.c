@@ -79,8 +79,23 @@ struct shared_output {
 
 	int cache_dirty;
 	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+
+	/* Damage not read back yet, in output coordinates */
+	pixman_region32_t pending_damage;
+	/* struct ss_readback::link, oldest first */
+	struct wl_list readback_list;
+};
+
+/* A frame's damage on its way back from the renderer */
+struct ss_readback {
+	struct shared_output *output;
+	struct wl_list link;
+
+	/* In output coordinates */
+	pixman_region32_t damage;
+	/* In buffer coordinates, and the extents read back */
+	pixman_region32_t buffer_damage;
+	pixman_box32_t area;
 };
 
 struct ss_seat {
@@ -574,42 +589,6 @@ output_compute_transform(struct weston_output *output,
 static void
 shared_output_destroy(struct shared_output *so);
 
-static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
-{
-	pixman_box32_t *ext;
-	size_t size;
-
-	if (!pixman_region32_not_empty(region))
-		return 0;
-
-	ext = pixman_region32_extents(region);
-
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
-
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
-
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
-		return -1;
-	}
-
-	so->tmp_data_size = size;
-
-	return 0;
-}
-
 static void
 shared_output_update(struct shared_output *so);
 
@@ -652,8 +631,6 @@ shared_output_update(struct shared_output *so)
 	output_compute_transform(so->output, &transform);
 	pixman_image_set_transform(so->cache_image, &transform);
 
-	pixman_image_set_clip_region32(sb->pm_image, &sb->damage);
-
 	if (so->output->current_scale == 1) {
 		pixman_image_set_filter(so->cache_image,
 					PIXMAN_FILTER_NEAREST, NULL, 0);
@@ -662,23 +639,21 @@ shared_output_update(struct shared_output *so)
 					PIXMAN_FILTER_BILINEAR, NULL, 0);
 	}
 
-	pixman_image_composite32(PIXMAN_OP_SRC,
-				 so->cache_image, /* src */
-				 NULL, /* mask */
-				 sb->pm_image, /* dest */
-				 0, 0, /* src_x, src_y */
-				 0, 0, /* mask_x, mask_y */
-				 0, 0, /* dest_x, dest_y */
-				 so->output->width, /* width */
-				 so->output->height /* height */);
-
-	pixman_image_set_transform(sb->pm_image, NULL);
-	pixman_image_set_clip_region32(sb->pm_image, NULL);
-
+	/* Only what changed since this buffer was last shown */
 	r = pixman_region32_rectangles(&sb->damage, &nrects);
-	for (i = 0; i < nrects; ++i)
+	for (i = 0; i < nrects; ++i) {
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 so->cache_image, /* src */
+					 NULL, /* mask */
+					 sb->pm_image, /* dest */
+					 r[i].x1, r[i].y1, /* src_x, src_y */
+					 0, 0, /* mask_x, mask_y */
+					 r[i].x1, r[i].y1, /* dest_x, dest_y */
+					 r[i].x2 - r[i].x1, /* width */
+					 r[i].y2 - r[i].y1 /* height */);
 		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
 				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+	}
 
 	wl_surface_attach(so->parent.surface, sb->buffer, 0, 0);
 
@@ -686,13 +661,13 @@ shared_output_update(struct shared_output *so)
 	wl_callback_add_listener(so->parent.frame_cb,
 				 &shared_output_frame_listener, so);
 
+	/* The frame callback paces the next update */
 	wl_surface_commit(so->parent.surface);
-	wl_callback_destroy(wl_display_sync(so->parent.display));
 	wl_display_flush(so->parent.display);
 
 	/* Clear the buffer damage */
-	pixman_region32_fini(&sb->damage);
-	pixman_region32_init(&sb->damage);
+	pixman_region32_clear(&sb->damage);
+	so->cache_dirty = 0;
 }
 
 static void
@@ -813,23 +788,98 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+static void
+ss_readback_destroy(struct ss_readback *rb)
+{
+	pixman_region32_fini(&rb->damage);
+	pixman_region32_fini(&rb->buffer_damage);
+	free(rb);
+}
+
+/* Copies the damaged boxes of a read-back into the cache */
+static void
+shared_output_copy_damage(struct shared_output *so, struct ss_readback *rb,
+			  const uint32_t *src)
+{
+	pixman_box32_t *r, *area = &rb->area;
+	uint32_t *cache = pixman_image_get_data(so->cache_image);
+	int cache_stride = pixman_image_get_stride(so->cache_image) / 4;
+	int area_width = area->x2 - area->x1;
+	bool yflip = so->output->compositor->capabilities &
+		     WESTON_CAP_CAPTURE_YFLIP;
+	int i, nrects, y, row;
+
+	/* The mode may have changed since the read-back started */
+	pixman_region32_intersect_rect(&rb->buffer_damage, &rb->buffer_damage,
+				       0, 0,
+				       pixman_image_get_width(so->cache_image),
+				       pixman_image_get_height(so->cache_image));
+
+	r = pixman_region32_rectangles(&rb->buffer_damage, &nrects);
+	for (i = 0; i < nrects; i++) {
+		for (y = r[i].y1; y < r[i].y2; y++) {
+			/* Rows were read bottom up with y-flip */
+			if (yflip)
+				row = area->y2 - y - 1;
+			else
+				row = y - area->y1;
+			memcpy(cache + cache_stride * y + r[i].x1,
+			       src + area_width * row + r[i].x1 - area->x1,
+			       (r[i].x2 - r[i].x1) * 4);
+		}
+	}
+}
+
+static void
+shared_output_read_done(void *data, const void *pixels)
+{
+	struct ss_readback *rb = data;
+	struct shared_output *so = rb->output;
+	struct ss_shm_buffer *sb;
+
+	/* The share ended while the pixels were on their way */
+	if (!so) {
+		ss_readback_destroy(rb);
+		return;
+	}
+
+	wl_list_remove(&rb->link);
+
+	if (!pixels) {
+		/* Read again with the next frame */
+		weston_log("Screen share: failed to read back a frame\n");
+		pixman_region32_translate(&rb->damage,
+					  so->output->x, so->output->y);
+		pixman_region32_union(&so->pending_damage,
+				      &so->pending_damage, &rb->damage);
+		ss_readback_destroy(rb);
+		return;
+	}
+
+	shared_output_copy_damage(so, rb, pixels);
+
+	/* Apply damage to all buffers */
+	wl_list_for_each(sb, &so->shm.buffers, link)
+		pixman_region32_union(&sb->damage, &sb->damage, &rb->damage);
+
+	ss_readback_destroy(rb);
+
+	so->cache_dirty = 1;
+	shared_output_update(so);
+}
+
 static void
 shared_output_repainted(struct wl_listener *listener, void *data)
 {
 	struct shared_output *so =
 		container_of(listener, struct shared_output, frame_listener);
-	pixman_region32_t damage;
 	pixman_region32_t *current_damage = data;
-	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip, y_orig;
-	pixman_box32_t *r;
-	pixman_image_t *damaged_image;
-	pixman_transform_t transform;
+	struct ss_readback *rb;
+	pixman_box32_t *area;
+	int32_t width, height, y_orig;
 
 	width = so->output->current_mode->width;
 	height = so->output->current_mode->height;
-	stride = width;
 
 	if (!so->cache_image ||
 	    pixman_image_get_width(so->cache_image) != width ||
@@ -840,88 +890,71 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		so->cache_image =
 			pixman_image_create_bits(PIXMAN_a8r8g8b8,
 						 width, height, NULL,
-						 stride);
+						 width * 4);
 		if (!so->cache_image)
 			goto err_shared_output;
 
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
+		pixman_region32_union(&so->pending_damage,
+				      &so->pending_damage,
+				      &so->output->region);
 	} else {
-		/* Damage in output coordinates */
-		pixman_region32_init(&damage);
-		pixman_region32_intersect(&damage, &so->output->region, current_damage);
-		pixman_region32_translate(&damage, -so->output->x, -so->output->y);
+		pixman_region32_union(&so->pending_damage,
+				      &so->pending_damage, current_damage);
 	}
 
-	/* Apply damage to all buffers */
-	wl_list_for_each(sb, &so->shm.buffers, link)
-		pixman_region32_union(&sb->damage, &sb->damage, &damage);
+	rb = zalloc(sizeof *rb);
+	if (!rb)
+		goto err_shared_output;
+
+	/* Damage in output coordinates */
+	pixman_region32_init(&rb->damage);
+	pixman_region32_intersect(&rb->damage, &so->output->region,
+				  &so->pending_damage);
+	pixman_region32_translate(&rb->damage, -so->output->x, -so->output->y);
+	pixman_region32_clear(&so->pending_damage);
 
 	/* Transform to buffer coordinates */
+	pixman_region32_init(&rb->buffer_damage);
 	weston_transformed_region(so->output->width, so->output->height,
 				  so->output->transform,
 				  so->output->current_scale,
-				  &damage, &damage);
-
-	if (shared_output_ensure_tmp_data(so, &damage) < 0)
-		goto err_pixman_init;
-
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip)
-			y_orig = so->output->current_mode->height - r[i].y2;
-		else
-			y_orig = y;
-
-		so->output->compositor->renderer->read_pixels(
-			so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-			x, y_orig, width, height);
-
-		damaged_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
-							 width, height,
-							 so->tmp_data,
-				(PIXMAN_FORMAT_BPP(PIXMAN_a8r8g8b8) / 8) * width);
-		if (!damaged_image)
-			goto err_pixman_init;
-
-		if (do_yflip) {
-			pixman_transform_init_scale(&transform,
-						    pixman_fixed_1,
-						    pixman_fixed_minus_1);
-
-			pixman_transform_translate(&transform, NULL,
-						   0,
-						   pixman_int_to_fixed(height));
-
-			pixman_image_set_transform(damaged_image, &transform);
-		}
+				  &rb->damage, &rb->buffer_damage);
 
-		pixman_image_composite32(PIXMAN_OP_SRC,
-					 damaged_image,
-					 NULL,
-					 so->cache_image,
-					 0, 0,
-					 0, 0,
-					 x, y,
-					 width, height);
-		pixman_image_unref(damaged_image);
+	if (!pixman_region32_not_empty(&rb->buffer_damage)) {
+		ss_readback_destroy(rb);
+		return;
 	}
 
-	so->cache_dirty = 1;
-
-	pixman_region32_fini(&damage);
-	shared_output_update(so);
+	/* One read-back of the extents, not one per rectangle, and without
+	 * waiting for the renderer */
+	area = pixman_region32_extents(&rb->buffer_damage);
+	rb->area = *area;
+	if (so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
+		y_orig = height - area->y2;
+	else
+		y_orig = area->y1;
+
+	rb->output = so;
+	wl_list_insert(so->readback_list.prev, &rb->link);
+
+	/* Renderers that cannot defer it are done before this returns, and
+	 * so may be the share */
+	if (weston_output_read_pixels_async(so->output, PIXMAN_a8r8g8b8,
+					    area->x1, y_orig,
+					    area->x2 - area->x1,
+					    area->y2 - area->y1,
+					    shared_output_read_done, rb) < 0) {
+		wl_list_remove(&rb->link);
+		weston_log("Screen share: failed to read back a frame\n");
+		pixman_region32_translate(&rb->damage,
+					  so->output->x, so->output->y);
+		pixman_region32_union(&so->pending_damage,
+				      &so->pending_damage, &rb->damage);
+		ss_readback_destroy(rb);
+	}
 
 	return;
 
-err_pixman_init:
-	pixman_region32_fini(&damage);
 err_shared_output:
 	shared_output_destroy(so);
 }
@@ -1006,6 +1039,8 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	wl_list_init(&so->readback_list);
+	pixman_region32_init(&so->pending_damage);
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -1033,9 +1068,17 @@ static void
 shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
+	struct ss_readback *rb, *rbnext;
 
 	weston_output_disable_planes_decr(so->output);
 
+	/* Freed once they complete */
+	wl_list_for_each_safe(rb, rbnext, &so->readback_list, link) {
+		rb->output = NULL;
+		wl_list_remove(&rb->link);
+		wl_list_init(&rb->link);
+	}
+
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
 		ss_shm_buffer_destroy(buffer);
 	wl_list_for_each_safe(buffer, bnext, &so->shm.free_buffers, free_link)
@@ -1047,8 +1090,9 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_remove(&so->output_destroyed.link);
 	wl_list_remove(&so->frame_listener.link);
 
-	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
+	if (so->cache_image)
+		pixman_image_unref(so->cache_image);
+	pixman_region32_fini(&so->pending_damage);
 
 	free(so);
 }
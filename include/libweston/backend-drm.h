@@ -95,6 +95,19 @@ weston_drm_output_get_api(struct weston_compositor *compositor)
 typedef int (*submit_frame_cb)(struct weston_output *output, int fd,
 			       int stride, void *buffer);
 
+/* Frames a virtual output hands to its owner before it starts replacing
+ * them, see set_frame_queue_depth() */
+#define WESTON_VIRTUAL_OUTPUT_FRAME_QUEUE_DEPTH 2
+
+struct weston_virtual_output_frame_counters {
+	/** Frames passed to the submit_frame_cb */
+	uint64_t submitted;
+	/** Frames superseded by a newer one before they could be submitted */
+	uint64_t replaced;
+	/** Repaints skipped because the output ran out of buffers */
+	uint64_t dropped;
+};
+
 struct weston_drm_virtual_output_api {
 	/** Create virtual output.
 	 * This is a low-level function, where the caller is expected to wrap
@@ -122,7 +135,7 @@ struct weston_drm_virtual_output_api {
 	 * The caller must call buffer_released() and finish_frame().
 	 *
 	 * The callback parameters are output, FD and stride (bytes) of dmabuf,
-	 * and buffer (drm_fb) pointer.
+	 * and an opaque buffer pointer to pass to buffer_released().
 	 * The callback returns 0 on success, -1 on failure.
 	 *
 	 * The submit_frame_cb callback hook is responsible for closing the fd
@@ -150,6 +163,34 @@ struct weston_drm_virtual_output_api {
 	void (*finish_frame)(struct weston_output *output,
 			     struct timespec *stamp,
 			     uint32_t presented_flags);
+
+	/** Set how many submitted buffers the owner may hold at once.
+	 *
+	 * Once that many are held, a newly drawn frame is kept back until
+	 * a buffer is released, and replaced if a newer frame gets drawn
+	 * meanwhile; the owner always receives the latest frame. Frames
+	 * kept back are completed by the output itself, so finish_frame()
+	 * calls for them are ignored.
+	 *
+	 * The output still needs two buffers of its own, and a gbm surface
+	 * usually has four; a deeper queue makes repaints drop instead.
+	 * Defaults to WESTON_VIRTUAL_OUTPUT_FRAME_QUEUE_DEPTH.
+	 */
+	void (*set_frame_queue_depth)(struct weston_output *output,
+				      unsigned int depth);
+
+	/** Get the frame statistics of the output since it was created */
+	void (*get_frame_counters)(struct weston_output *output,
+				   struct weston_virtual_output_frame_counters *counters);
+
+	/** Get what changed in a submitted frame since the frame submitted
+	 * before it, in buffer coordinates. The first frame after enabling
+	 * the output is entirely damaged.
+	 *
+	 * The region belongs to the buffer and is valid until
+	 * buffer_released().
+	 */
+	const pixman_region32_t *(*get_frame_damage)(void *buffer);
 };
 
 static inline const struct weston_drm_virtual_output_api *
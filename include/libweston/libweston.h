@@ -80,6 +80,7 @@ struct weston_pointer;
 struct linux_dmabuf_buffer;
 struct weston_recorder;
 struct weston_pointer_constraint;
+struct weston_pick_index;
 struct ro_anonymous_file;
 
 enum weston_keyboard_modifier {
@@ -228,6 +229,12 @@ struct weston_head {
 	enum weston_hdcp_protection current_protection;
 };
 
+/** Repaint costs kept per output for the adaptive repaint window
+ *
+ * \ingroup output
+ */
+#define WESTON_REPAINT_COST_SAMPLES 32
+
 /** Content producer for heads
  *
  * \rst
@@ -277,6 +284,32 @@ struct weston_output {
 	 *  next repaint should be run */
 	struct timespec next_repaint;
 
+	/** Repaint window bookkeeping, see weston_output_finish_frame() */
+	struct {
+		/** Set by weston_output_set_repaint_window() */
+		bool fixed;
+		int32_t fixed_msec;
+
+		/** CLOCK_MONOTONIC start and CPU end of the last repaint */
+		struct timespec begin;
+		struct timespec cpu_end;
+		/** Sync file of the renderer for the last repaint, or -1 */
+		int render_fence_fd;
+		/** The vblank the last repaint aimed for, or zero */
+		struct timespec target;
+
+		/** Recent repaint costs in microseconds, a ring */
+		uint32_t cost_usec[WESTON_REPAINT_COST_SAMPLES];
+		unsigned int num_costs;
+		unsigned int next_cost;
+
+		/** Added after a missed vblank, decays while on time */
+		int64_t penalty_nsec;
+		/** The window last used */
+		int64_t window_nsec;
+		unsigned int missed;
+	} repaint_window;
+
 	/** For cancelling the idle_repaint callback on output destruction. */
 	struct wl_event_source *idle_repaint_source;
 
@@ -307,6 +340,9 @@ struct weston_output {
 	enum weston_hdcp_protection current_protection;
 	bool allow_protection;
 
+	/** Build the renderer shaders for this output ahead of first use */
+	bool shader_prewarm;
+
 	int (*start_repaint_loop)(struct weston_output *output);
 	int (*repaint)(struct weston_output *output,
 			pixman_region32_t *damage,
@@ -884,13 +920,44 @@ struct weston_plane {
 	struct wl_list link;
 };
 
+/** Completion of weston_output_read_pixels_async()
+ *
+ * \param data The data given to weston_output_read_pixels_async().
+ * \param pixels The pixels, laid out the way weston_renderer::read_pixels
+ * writes them, or NULL if they could not be read. Only valid during the
+ * call.
+ */
+typedef void (*weston_read_pixels_done_func_t)(void *data,
+					       const void *pixels);
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+	/** Read pixels back without waiting for the renderer to finish
+	 *
+	 * Like read_pixels, but done gets the pixels once they are
+	 * available, at a later repaint of the output or when the output
+	 * is destroyed at the latest. Returns -1 without calling done on
+	 * failure. Optional, see weston_output_read_pixels_async().
+	 */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_read_pixels_done_func_t done,
+				 void *data);
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
+	/** Finish painting the outputs of a repaint sequence
+	 *
+	 * Called after weston_output::repaint of all the outputs repainted
+	 * together, before the backend flushes them. Renderers that paint
+	 * late, see weston_compositor::parallel_repaint, paint here.
+	 * Optional.
+	 */
+	void (*repaint_finish)(struct weston_compositor *compositor);
 	void (*flush_damage)(struct weston_surface *surface);
 	void (*attach)(struct weston_surface *es, struct weston_buffer *buffer);
 	void (*surface_set_color)(struct weston_surface *surface,
@@ -1057,6 +1124,16 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
+	/* view_list is rebuilt when these differ */
+	uint32_t view_list_generation;
+	uint32_t view_list_built_generation;
+	uint64_t view_list_rebuilds;
+	uint64_t view_list_rebuilds_skipped;
+	/* Grid over the view bounding boxes for picking, rebuilt when
+	 * pick_generation moved past pick_index_generation */
+	struct weston_pick_index *pick_index;
+	uint32_t pick_generation;
+	uint32_t pick_index_generation;
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -1078,6 +1155,19 @@ struct weston_compositor {
 	uint32_t capabilities; /* combination of enum weston_capability */
 
 	struct weston_renderer *renderer;
+	/* Threads the pixman renderer paints an output with, 0 or 1 for
+	 * the compositor thread alone; read on every repaint */
+	int pixman_threads;
+	/* Paint the outputs of a repaint sequence in parallel, once they
+	 * have all been prepared, if the renderer and backend can */
+	bool parallel_repaint;
+	/* Damage the gl renderer paints and hands to EGL is merged down to
+	 * at most this many rectangles, 0 for no limit; read on every
+	 * repaint */
+	int damage_rects_max;
+	/* And damage rectangles are merged whenever at most this many
+	 * percent of their bounding box are undamaged */
+	int damage_waste_max;
 
 	pixman_format_code_t read_format;
 
@@ -1100,6 +1190,15 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	/** Size the repaint window of outputs from their repaint costs,
+	 *  with repaint_msec as the initial value */
+	bool adaptive_repaint_window;
+	/** Send the frame callbacks of surfaces hidden behind opaque content
+	 *  at most this often, 0 to send them at the output rate */
+	int32_t occluded_frame_msec;
+	struct wl_event_source *occluded_frame_timer;
+	/* When occluded_frame_timer fires, zero when not armed */
+	struct timespec occluded_frame_deadline;
 
 	unsigned int activate_serial;
 
@@ -1435,6 +1534,14 @@ struct weston_surface {
 	struct wl_list frame_callback_list;
 	struct wl_list feedback_list;
 
+	/* No view of the surface is visible, as of the last repaint */
+	bool occluded;
+	/* Whether frame callbacks are held back while occluded, see
+	 * weston_compositor::occluded_frame_msec */
+	bool occluded_frame_throttle;
+	/* When frame callbacks were last sent while occluded */
+	struct timespec occluded_frame_time;
+
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_viewport buffer_viewport;
 	int32_t width_from_buffer; /* before applying viewport */
@@ -1766,6 +1873,10 @@ weston_surface_set_label_func(struct weston_surface *surface,
 			      int (*desc)(struct weston_surface *,
 					  char *, size_t));
 
+void
+weston_surface_set_occluded_frame_throttle(struct weston_surface *surface,
+					   bool throttle);
+
 void
 weston_surface_get_content_size(struct weston_surface *surface,
 				int *width, int *height);
@@ -1859,8 +1970,24 @@ typedef void (*weston_screenshooter_done_func_t)(void *data,
 int
 weston_screenshooter_shoot(struct weston_output *output, struct weston_buffer *buffer,
 			   weston_screenshooter_done_func_t done, void *data);
+int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done, void *data);
+enum weston_recorder_compression {
+	WESTON_RECORDER_COMPRESSION_NONE,
+	/** wcap v2, zstd compressed frames; needs a build with zstd */
+	WESTON_RECORDER_COMPRESSION_ZSTD,
+};
+
 struct weston_recorder *
 weston_recorder_start(struct weston_output *output, const char *filename);
+struct weston_recorder *
+weston_recorder_start_compressed(struct weston_output *output,
+				 const char *filename,
+				 enum weston_recorder_compression compression);
 void
 weston_recorder_stop(struct weston_recorder *recorder);
 
@@ -2031,6 +2158,10 @@ void
 weston_output_set_transform(struct weston_output *output,
 			    uint32_t transform);
 
+void
+weston_output_set_repaint_window(struct weston_output *output,
+				 int32_t msec);
+
 void
 weston_output_init(struct weston_output *output,
 		   struct weston_compositor *compositor,
@@ -2058,6 +2189,10 @@ void
 weston_output_allow_protection(struct weston_output *output,
 			       bool allow_protection);
 
+void
+weston_output_set_shader_prewarm(struct weston_output *output,
+				 bool shader_prewarm);
+
 int
 weston_compositor_enable_touch_calibrator(struct weston_compositor *compositor,
 				weston_touch_calibration_save_func save);
@@ -31,15 +31,19 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
 #include <drm_fourcc.h>
 
 #include "remoting-plugin.h"
+#include "remoting-worker.h"
 #include <libweston/backend-drm.h>
 #include <libweston/backend-headless.h>
 #include "shared/helpers.h"
@@ -51,6 +55,10 @@
 #include <sys/ioctl.h>
 #include <linux/dma-buf.h>
 
+/* Virtual outputs cycle through a small set of buffers; keep the mappings
+ * of as many as a gbm surface usually allocates. */
+#define MAPPED_FRAMES_MAX 4
+
 struct weston_remoting {
 	struct weston_compositor *compositor;
 	struct wl_list output_list;
@@ -58,8 +66,33 @@ struct weston_remoting {
 	const struct weston_drm_virtual_output_api *virtual_output_api;
 
 	struct wl_list resource_list;
-	int fd;
+	struct remoting_worker_pool *worker_pool;
+};
+
+enum remote_capture_type {
+	REMOTE_CAPTURE_NONE = 0,
+	REMOTE_CAPTURE_FULL,
+	REMOTE_CAPTURE_DAMAGE,
+	REMOTE_CAPTURE_DMABUF,
+};
+
+struct remote_capture {
+	enum remote_capture_type type;
+	struct wl_resource *resource;
+	/* NULL for REMOTE_CAPTURE_DMABUF */
 	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+};
+
+/* A read-only mapping of one of the buffers a virtual output renders to.
+ * Every frame comes with a newly exported fd, the dma-buf inode tells
+ * whether it is a buffer seen before. */
+struct mapped_frame {
+	struct wl_list link; /* remoted_output::mapped_frames, MRU first */
+	ino_t ino;
+	int fd;
+	void *data;
+	size_t size;
 };
 
 struct remoted_output {
@@ -75,15 +108,51 @@ struct remoted_output {
 	struct wl_event_source *finish_frame_timer;
 	struct wl_list link;
 	bool submitted_frame;
-	int fence_sync_fd;
-	struct wl_event_source *fence_sync_event_source;
+	struct remoting_queue *queue;
+	/* struct remoted_frame::link */
+	struct wl_list frames;
 
 	int retry_count;
+
+	uint32_t gbm_format;
+	struct remote_capture capture;
+
+	/* Output damage since the previous capture, in buffer coordinates */
+	pixman_region32_t damage;
+	struct wl_listener frame_listener;
+
+	/* Only used by the worker thread of the queue */
+	struct wl_list mapped_frames;
+	/* Kept away from the renderer while a client reads it as dma-buf */
+	void *held_buffer;
 };
 
-struct mem_free_cb_data {
+struct remoted_frame {
+	struct remoting_job job;
 	struct remoted_output *output;
+	struct wl_list link;
 	void *output_buffer;
+	int fd;
+	int stride;
+	int height;
+
+	/* Taken over from remoted_output::capture when queued */
+	struct remote_capture capture;
+	pixman_region32_t damage;
+
+	/* Copy destination, NULL unless copying */
+	struct wl_shm_pool *shm_pool;
+	void *shm_data;
+	int shm_stride;
+
+	/* For wl_shm_buffer_begin_access() on the worker; cleared when the
+	 * client destroys the buffer, under shm_mutex */
+	pthread_mutex_t shm_mutex;
+	struct wl_shm_buffer *shm_buffer;
+
+	/* Set by the worker, for the compositor thread */
+	bool copied;
+	int map_errno;
 };
 
 static int
@@ -98,6 +167,325 @@ remoting_output_buffer_release(struct remoted_output *output, void *buffer)
 	api->buffer_released(buffer);
 }
 
+static void
+remote_capture_finish(struct remote_capture *capture)
+{
+	if (capture->buffer)
+		wl_list_remove(&capture->buffer_destroy_listener.link);
+
+	capture->type = REMOTE_CAPTURE_NONE;
+	capture->resource = NULL;
+	capture->buffer = NULL;
+}
+
+static void
+remote_capture_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct remote_capture *capture =
+		container_of(listener, struct remote_capture,
+			     buffer_destroy_listener);
+
+	/* Nothing left to copy to */
+	lg_remote_send_done(capture->resource);
+	remote_capture_finish(capture);
+}
+
+static void
+mapped_frame_destroy(struct mapped_frame *frame)
+{
+	wl_list_remove(&frame->link);
+	munmap(frame->data, frame->size);
+	close(frame->fd);
+	free(frame);
+}
+
+static struct mapped_frame *
+remoted_output_map_frame(struct remoted_output *output, int fd, size_t size)
+{
+	struct mapped_frame *frame, *next;
+	struct stat st;
+	int count = 0;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	wl_list_for_each_safe(frame, next, &output->mapped_frames, link) {
+		if (frame->ino == st.st_ino && frame->size >= size) {
+			wl_list_remove(&frame->link);
+			wl_list_insert(&output->mapped_frames, &frame->link);
+			return frame;
+		}
+
+		if (frame->ino == st.st_ino || ++count >= MAPPED_FRAMES_MAX)
+			mapped_frame_destroy(frame);
+	}
+
+	frame = zalloc(sizeof *frame);
+	if (!frame)
+		return NULL;
+
+	frame->data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (frame->data == MAP_FAILED) {
+		free(frame);
+		return NULL;
+	}
+
+	/* The sync ioctls need an fd of our own */
+	frame->fd = dup(fd);
+	frame->ino = st.st_ino;
+	frame->size = size;
+	wl_list_insert(&output->mapped_frames, &frame->link);
+
+	return frame;
+}
+
+static void
+copy_frame_rect(uint8_t *dst, int dst_stride, const uint8_t *src,
+		int src_stride, const pixman_box32_t *rect)
+{
+	size_t len = (rect->x2 - rect->x1) * 4;
+	int y;
+
+	dst += rect->y1 * dst_stride + rect->x1 * 4;
+	src += rect->y1 * src_stride + rect->x1 * 4;
+
+	for (y = rect->y1; y < rect->y2; y++) {
+		memcpy(dst, src, len);
+		dst += dst_stride;
+		src += src_stride;
+	}
+}
+
+/* Runs on the worker thread */
+static void
+remoted_frame_copy(struct remoting_job *job)
+{
+	struct remoted_frame *rf = container_of(job, struct remoted_frame, job);
+	struct mapped_frame *frame;
+	struct dma_buf_sync sync;
+	pixman_box32_t *rects;
+	int i, nrects;
+
+	if (!rf->shm_data)
+		return;
+
+	frame = remoted_output_map_frame(rf->output, rf->fd,
+					 (size_t)rf->stride * rf->height);
+	if (!frame) {
+		rf->map_errno = errno;
+		return;
+	}
+
+	rects = pixman_region32_rectangles(&rf->damage, &nrects);
+
+	/* Only the buffer destroy listener waits on this, for one copy */
+	pthread_mutex_lock(&rf->shm_mutex);
+	if (!rf->shm_buffer) {
+		pthread_mutex_unlock(&rf->shm_mutex);
+		return;
+	}
+
+	/* The SIGBUS guard for pools the client shrinks is per thread */
+	wl_shm_buffer_begin_access(rf->shm_buffer);
+
+	sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+	ioctl(frame->fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+	for (i = 0; i < nrects; i++)
+		copy_frame_rect(rf->shm_data, rf->shm_stride,
+				frame->data, rf->stride, &rects[i]);
+
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+	ioctl(frame->fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+	wl_shm_buffer_end_access(rf->shm_buffer);
+	pthread_mutex_unlock(&rf->shm_mutex);
+
+	rf->copied = true;
+}
+
+static void
+remote_capture_send_damage(struct remote_capture *capture,
+			   pixman_region32_t *damage)
+{
+	pixman_box32_t *rects;
+	int i, nrects;
+
+	rects = pixman_region32_rectangles(damage, &nrects);
+	for (i = 0; i < nrects; i++)
+		lg_remote_send_damage(capture->resource,
+				      rects[i].x1, rects[i].y1,
+				      rects[i].x2 - rects[i].x1,
+				      rects[i].y2 - rects[i].y1);
+}
+
+static void
+remote_capture_buffer_gone(struct wl_listener *listener, void *data)
+{
+	struct remote_capture *capture =
+		container_of(listener, struct remote_capture,
+			     buffer_destroy_listener);
+	struct remoted_frame *rf =
+		container_of(capture, struct remoted_frame, capture);
+
+	/* The shm pool reference keeps the copy destination alive, but
+	 * the wl_shm_buffer goes now; waits for a copy in progress */
+	pthread_mutex_lock(&rf->shm_mutex);
+	rf->shm_buffer = NULL;
+	pthread_mutex_unlock(&rf->shm_mutex);
+
+	wl_list_remove(&capture->buffer_destroy_listener.link);
+	capture->buffer = NULL;
+}
+
+/* Runs on the compositor thread once the worker is done with the frame */
+static void
+remoted_frame_done(struct remoting_job *job)
+{
+	struct remoted_frame *rf = container_of(job, struct remoted_frame, job);
+	struct remoted_output *output = rf->output;
+	struct remote_capture *capture = &rf->capture;
+	struct weston_buffer *buffer = capture->buffer;
+	enum remote_capture_type type = capture->type;
+
+	if (rf->map_errno)
+		weston_log("lg-remoting: failed to map frame: %s\n",
+			   strerror(rf->map_errno));
+
+	switch (type) {
+	case REMOTE_CAPTURE_NONE:
+	case REMOTE_CAPTURE_FULL:
+		break;
+	case REMOTE_CAPTURE_DAMAGE:
+		/* Cancelled or failed copies write nothing; the areas are
+		 * still owed to the next capture. */
+		if (!rf->copied) {
+			pixman_region32_union(&output->damage,
+					      &output->damage, &rf->damage);
+			break;
+		}
+
+		remote_capture_send_damage(capture, &rf->damage);
+		break;
+	case REMOTE_CAPTURE_DMABUF:
+		if (job->cancelled)
+			break;
+
+		/* The fd is duplicated when the event is marshalled */
+		lg_remote_send_dmabuf(capture->resource, rf->fd,
+				      output->output->current_mode->width,
+				      rf->height, rf->stride,
+				      output->gbm_format);
+		remote_capture_send_damage(capture, &rf->damage);
+
+		/* Hold on to the buffer until the next frame is submitted,
+		 * so the client is not racing the renderer. */
+		output->held_buffer = rf->output_buffer;
+		rf->output_buffer = NULL;
+		break;
+	}
+
+	if (type != REMOTE_CAPTURE_NONE) {
+		lg_remote_send_done(capture->resource);
+		remote_capture_finish(capture);
+
+		/* Plain captures hand over the buffer for good, once
+		 * something was written to it */
+		if (type == REMOTE_CAPTURE_FULL && buffer && rf->copied)
+			wl_resource_destroy(buffer->resource);
+	}
+
+	if (rf->shm_pool)
+		wl_shm_pool_unref(rf->shm_pool);
+
+	output->submitted_frame = true;
+	close(rf->fd);
+
+	if (rf->output_buffer)
+		remoting_output_buffer_release(output, rf->output_buffer);
+
+	pixman_region32_fini(&rf->damage);
+	pthread_mutex_destroy(&rf->shm_mutex);
+	wl_list_remove(&rf->link);
+	free(rf);
+}
+
+/* Moves the pending capture of the output over to the frame, along with
+ * what it needs to be served off the compositor thread. */
+static void
+remoted_frame_take_capture(struct remoted_frame *rf)
+{
+	struct remoted_output *output = rf->output;
+	struct remote_capture *capture = &output->capture;
+	struct wl_shm_buffer *shm_buffer;
+	int width = output->output->current_mode->width;
+	int height = rf->height;
+
+	if (capture->type == REMOTE_CAPTURE_NONE)
+		return;
+
+	rf->capture.type = capture->type;
+	rf->capture.resource = capture->resource;
+
+	if (capture->type == REMOTE_CAPTURE_FULL)
+		pixman_region32_init_rect(&rf->damage, 0, 0, width, height);
+	else
+		pixman_region32_copy(&rf->damage, &output->damage);
+	pixman_region32_clear(&output->damage);
+
+	if (capture->buffer) {
+		rf->capture.buffer = capture->buffer;
+		rf->capture.buffer_destroy_listener.notify =
+			remote_capture_buffer_gone;
+		wl_signal_add(&capture->buffer->destroy_signal,
+			      &rf->capture.buffer_destroy_listener);
+
+		/* Formats here are 32 bpp, never copy past either buffer */
+		shm_buffer = capture->buffer->shm_buffer;
+		if (wl_shm_buffer_get_width(shm_buffer) < width)
+			width = wl_shm_buffer_get_width(shm_buffer);
+		if (wl_shm_buffer_get_height(shm_buffer) < height)
+			height = wl_shm_buffer_get_height(shm_buffer);
+		pixman_region32_intersect_rect(&rf->damage, &rf->damage,
+					       0, 0, width, height);
+
+		rf->shm_pool = wl_shm_buffer_ref_pool(shm_buffer);
+		rf->shm_buffer = shm_buffer;
+		rf->shm_data = wl_shm_buffer_get_data(shm_buffer);
+		rf->shm_stride = wl_shm_buffer_get_stride(shm_buffer);
+	}
+
+	remote_capture_finish(capture);
+}
+
+static void
+remoting_output_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct remoted_output *output =
+		container_of(listener, struct remoted_output, frame_listener);
+	struct weston_output *base = output->output;
+	pixman_region32_t *output_damage = data;
+	pixman_region32_t damage;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &base->region, output_damage);
+	pixman_region32_translate(&damage, -base->x, -base->y);
+	weston_transformed_region(base->width, base->height,
+				  base->transform, base->current_scale,
+				  &damage, &damage);
+	pixman_region32_union(&output->damage, &output->damage, &damage);
+	pixman_region32_fini(&damage);
+}
+
+static void
+remoting_output_damage_all(struct remoted_output *output)
+{
+	pixman_region32_fini(&output->damage);
+	pixman_region32_init_rect(&output->damage, 0, 0,
+				  output->output->current_mode->width,
+				  output->output->current_mode->height);
+}
+
 static void
 remoting_output_destroy(struct weston_output *output);
 
@@ -108,10 +496,11 @@ weston_remoting_destroy(struct wl_listener *l, void *data)
 		container_of(l, struct weston_remoting, destroy_listener);
 	struct remoted_output *output, *next;
 
-	remoting->buffer = NULL;
 	wl_list_for_each_safe(output, next, &remoting->output_list, link)
 		remoting_output_destroy(output->output);
 
+	remoting_worker_pool_destroy(remoting->worker_pool);
+
 	wl_list_remove(&remoting->destroy_listener.link);
 	free(remoting);
 }
@@ -178,95 +567,72 @@ lookup_remoted_output(struct weston_output *output)
 
 
 static int
-remoting_output_fence_sync_handler(int fd, uint32_t mask, void *data)
+remoting_output_frame(struct weston_output *output_base, int fd, int stride,
+		      void *output_buffer)
 {
-	struct mem_free_cb_data *cb_data = data;
-	struct remoted_output *output = cb_data->output;
-	struct weston_remoting *remoting = output->remoting;
-	struct wl_resource *resource;
-	void *frame;
-	int size = output->output->current_mode->width*output->output->current_mode->height*4;
-	struct dma_buf_sync sync;
-	uint8_t *d;
+	struct remoted_output *output = lookup_remoted_output(output_base);
+	const struct weston_drm_virtual_output_api *api;
+	struct remoted_frame *rf;
 
-	if(remoting->buffer) {
-		d = wl_shm_buffer_get_data(remoting->buffer->shm_buffer);
-		wl_shm_buffer_begin_access(remoting->buffer->shm_buffer);
+	if (!output || !output->queue)
+		return -1;
 
-		frame = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
-				remoting->fd, 0);
+	api = output->remoting->virtual_output_api;
 
-		if(frame) {
-			sync.flags = DMA_BUF_SYNC_START;
-			sync.flags |= DMA_BUF_SYNC_READ;
-			ioctl(remoting->fd, DMA_BUF_IOCTL_SYNC, &sync);
+	if (output->held_buffer) {
+		remoting_output_buffer_release(output, output->held_buffer);
+		output->held_buffer = NULL;
+	}
 
-			memcpy(d, frame, size);
+	/* The client is still being served older frames, drop this one */
+	if (remoting_queue_is_full(output->queue)) {
+		output->submitted_frame = true;
+		remoting_output_buffer_release(output, output_buffer);
+		close(fd);
+		return 0;
+	}
 
-			sync.flags = DMA_BUF_SYNC_END;
-			ioctl(remoting->fd, DMA_BUF_IOCTL_SYNC, &sync);
+	rf = zalloc(sizeof *rf);
+	if (!rf)
+		return -1;
 
-			munmap(frame, size);
-		}
-		wl_resource_for_each(resource, &remoting->resource_list) {
-			lg_remote_send_done(resource);
-		}
-		wl_shm_buffer_end_access(remoting->buffer->shm_buffer);
-		wl_resource_destroy(remoting->buffer->resource);
-		remoting->buffer = NULL;
-	}
+	rf->output = output;
+	rf->output_buffer = output_buffer;
+	rf->fd = fd;
+	rf->stride = stride;
+	rf->height = output_base->current_mode->height;
+	pthread_mutex_init(&rf->shm_mutex, NULL);
+	pixman_region32_init(&rf->damage);
+	remoted_frame_take_capture(rf);
 
-	output->submitted_frame = true;
-	wl_event_source_remove(output->fence_sync_event_source);
-	close(output->fence_sync_fd);
-	close(remoting->fd);
+	rf->job.fence_fd = api->get_fence_sync_fd(output->output);
+	rf->job.run = remoted_frame_copy;
+	rf->job.done = remoted_frame_done;
 
-	remoting_output_buffer_release(output, cb_data->output_buffer);
-	free(cb_data);
+	wl_list_insert(output->frames.prev, &rf->link);
+	remoting_queue_push(output->queue, &rf->job);
 
 	return 0;
 }
 
-static int
-remoting_output_frame(struct weston_output *output_base, int fd, int stride,
-		      void *output_buffer)
+/* Finishes the frames in flight and gives all buffers back */
+static void
+remoting_output_drain(struct remoted_output *output)
 {
-	struct remoted_output *output = lookup_remoted_output(output_base);
-	struct weston_remoting *remoting;
-	const struct weston_drm_virtual_output_api *api;
-	struct wl_event_loop *loop;
-	struct mem_free_cb_data *cb_data;
-
-	if (!output)
-		return -1;
-
-	remoting = output->remoting;
-	api = remoting->virtual_output_api;
-
-	cb_data = zalloc(sizeof *cb_data);
-	if (!cb_data)
-		return -1;
-
-	cb_data->output = output;
-	cb_data->output_buffer = output_buffer;
+	struct mapped_frame *frame, *next;
 
-	remoting->fd = fd;
-	output->fence_sync_fd = api->get_fence_sync_fd(output->output);
-	if (output->fence_sync_fd == -1) {
-		output->submitted_frame = true;
-		close(fd);
-		free(cb_data);
-		return 0;
+	if (output->queue) {
+		remoting_queue_destroy(output->queue);
+		output->queue = NULL;
 	}
 
+	if (output->held_buffer) {
+		remoting_output_buffer_release(output, output->held_buffer);
+		output->held_buffer = NULL;
+	}
 
-	loop = wl_display_get_event_loop(remoting->compositor->wl_display);
-	output->fence_sync_event_source =
-		wl_event_loop_add_fd(loop, output->fence_sync_fd,
-				     WL_EVENT_READABLE,
-				     remoting_output_fence_sync_handler,
-				     cb_data);
-	return 0;
+	wl_list_for_each_safe(frame, next, &output->mapped_frames, link)
+		mapped_frame_destroy(frame);
 }
 
 static void
@@ -279,6 +645,14 @@ remoting_output_destroy(struct weston_output *output)
 		return;
 	}
 
+	if (remoted_output->capture.type != REMOTE_CAPTURE_NONE) {
+		lg_remote_send_done(remoted_output->capture.resource);
+		remote_capture_finish(&remoted_output->capture);
+	}
+
+	remoting_output_drain(remoted_output);
+	pixman_region32_fini(&remoted_output->damage);
+
 	wl_list_for_each_safe(mode, next, &output->mode_list, link) {
 		wl_list_remove(&mode->link);
 		free(mode);
@@ -329,9 +703,21 @@ remoting_output_enable(struct weston_output *output)
 	if (ret < 0)
 		return ret;
 
+	remoted_output->queue =
+		remoting_queue_create(remoted_output->remoting->worker_pool,
+				      output->name);
+	if (!remoted_output->queue) {
+		remoted_output->saved_disable(output);
+		return -1;
+	}
+
 	remoted_output->saved_start_repaint_loop = output->start_repaint_loop;
 	output->start_repaint_loop = remoting_output_start_repaint_loop;
 
+	remoting_output_damage_all(remoted_output);
+	remoted_output->frame_listener.notify = remoting_output_frame_notify;
+	wl_signal_add(&output->frame_signal, &remoted_output->frame_listener);
+
 	loop = wl_display_get_event_loop(c->wl_display);
 	remoted_output->finish_frame_timer =
 		wl_event_loop_add_timer(loop,
@@ -351,6 +737,8 @@ remoting_output_disable(struct weston_output *output)
 	}
 
 	wl_event_source_remove(remoted_output->finish_frame_timer);
+	wl_list_remove(&remoted_output->frame_listener.link);
+	remoting_output_drain(remoted_output);
 
 	return remoted_output->saved_disable(output);
 }
@@ -393,6 +781,10 @@ remoting_output_create(struct weston_compositor *c, char *name)
 	output->saved_disable = output->output->disable;
 	output->output->disable = remoting_output_disable;
 	output->remoting = remoting;
+	output->gbm_format = DRM_FORMAT_XRGB8888;
+	pixman_region32_init(&output->damage);
+	wl_list_init(&output->frames);
+	wl_list_init(&output->mapped_frames);
 	wl_list_insert(remoting->output_list.prev, &output->link);
 
 	weston_head_init(head, connector_name);
@@ -466,6 +858,14 @@ static void
 remoting_output_set_gbm_format(struct weston_output *output,
 			       const char *gbm_format)
 {
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+	const struct weston_drm_virtual_output_api *api;
+
+	if (!remoted_output)
+		return;
+
+	api = remoted_output->remoting->virtual_output_api;
+	remoted_output->gbm_format = api->set_gbm_format(output, gbm_format);
 }
 
 static void
@@ -490,6 +890,27 @@ remoting_output_set_gst_pipeline(struct weston_output *output,
 {
 }
 
+static void
+remoting_output_set_frame_queue_depth(struct weston_output *output,
+				      unsigned int depth)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+	const struct weston_drm_virtual_output_api *api;
+
+	if (!remoted_output)
+		return;
+
+	api = remoted_output->remoting->virtual_output_api;
+	api->set_frame_queue_depth(output, depth);
+}
+
+/* Frames only go out on capture requests, there is no stream to keep alive */
+static void
+remoting_output_set_keepalive_interval(struct weston_output *output,
+				       unsigned int msec)
+{
+}
+
 static const struct weston_remoting_api remoting_api = {
 	remoting_output_create,
 	remoting_output_is_remoted,
@@ -499,40 +920,107 @@ static const struct weston_remoting_api remoting_api = {
 	remoting_output_set_host,
 	remoting_output_set_port,
 	remoting_output_set_gst_pipeline,
+	remoting_output_set_frame_queue_depth,
+	remoting_output_set_keepalive_interval,
 };
 
-static void remote_capture(struct wl_client *client,
-			struct wl_resource *resource,
-			struct wl_resource *output_resource,
-			struct wl_resource *buffer_resource)
+static void
+remote_capture_queue(struct wl_resource *resource,
+		     struct wl_resource *output_resource,
+		     struct wl_resource *buffer_resource,
+		     enum remote_capture_type type)
 {
-	struct weston_remoting *remoting;
-	struct weston_buffer *buffer =
-		weston_buffer_from_resource(buffer_resource);
 	struct weston_output *output =
 		weston_head_from_resource(output_resource)->output;
+	struct remoted_output *remoted_output;
+	struct weston_buffer *buffer = NULL;
 
-	if (buffer == NULL) {
-		wl_resource_post_no_memory(resource);
-		return;
+	if (buffer_resource) {
+		buffer = weston_buffer_from_resource(buffer_resource);
+		if (buffer == NULL) {
+			wl_resource_post_no_memory(resource);
+			return;
+		}
+
+		buffer->shm_buffer = wl_shm_buffer_get(buffer_resource);
+		if (!buffer->shm_buffer)
+			return;
 	}
 
-	buffer->shm_buffer = wl_shm_buffer_get(buffer_resource);
-	if (!buffer->shm_buffer) {
+	remoted_output = output ? lookup_remoted_output(output) : NULL;
+	if (!remoted_output) {
+		lg_remote_send_done(resource);
 		return;
 	}
 
-	remoting = wl_resource_get_user_data(resource);
-	remoting->buffer = buffer;
+	/* Only the latest request per output is served */
+	if (remoted_output->capture.type != REMOTE_CAPTURE_NONE) {
+		lg_remote_send_done(remoted_output->capture.resource);
+		remote_capture_finish(&remoted_output->capture);
+	}
+
+	remoted_output->capture.type = type;
+	remoted_output->capture.resource = resource;
+	remoted_output->capture.buffer = buffer;
+	if (buffer) {
+		remoted_output->capture.buffer_destroy_listener.notify =
+			remote_capture_buffer_destroy;
+		wl_signal_add(&buffer->destroy_signal,
+			      &remoted_output->capture.buffer_destroy_listener);
+	}
+
 	weston_output_damage(output);
 }
 
+static void remote_capture(struct wl_client *client,
+			struct wl_resource *resource,
+			struct wl_resource *output_resource,
+			struct wl_resource *buffer_resource)
+{
+	remote_capture_queue(resource, output_resource, buffer_resource,
+			     REMOTE_CAPTURE_FULL);
+}
+
+static void
+remote_capture_damage(struct wl_client *client,
+		      struct wl_resource *resource,
+		      struct wl_resource *output_resource,
+		      struct wl_resource *buffer_resource)
+{
+	remote_capture_queue(resource, output_resource, buffer_resource,
+			     REMOTE_CAPTURE_DAMAGE);
+}
+
+static void
+remote_capture_dmabuf(struct wl_client *client,
+		      struct wl_resource *resource,
+		      struct wl_resource *output_resource)
+{
+	remote_capture_queue(resource, output_resource, NULL,
+			     REMOTE_CAPTURE_DMABUF);
+}
+
 static const struct lg_remote_interface remote_implementation = {
 	remote_capture,
+	remote_capture_damage,
+	remote_capture_dmabuf,
 };
 
 static void unbind_resource(struct wl_resource *resource)
 {
+	struct weston_remoting *remoting = wl_resource_get_user_data(resource);
+	struct remoted_output *output;
+	struct remoted_frame *rf;
+
+	wl_list_for_each(output, &remoting->output_list, link) {
+		if (output->capture.resource == resource)
+			remote_capture_finish(&output->capture);
+
+		wl_list_for_each(rf, &output->frames, link)
+			if (rf->capture.resource == resource)
+				remote_capture_finish(&rf->capture);
+	}
+
 	wl_list_remove(wl_resource_get_link(resource));
 }
 
@@ -591,6 +1079,12 @@ weston_module_init(struct weston_compositor *compositor)
 	remoting->compositor = compositor;
 	wl_list_init(&remoting->output_list);
 
+	remoting->worker_pool =
+		remoting_worker_pool_create(compositor, REMOTING_WORKER_THREADS,
+					    "lg-remoting");
+	if (!remoting->worker_pool)
+		goto failed;
+
 	ret = weston_plugin_api_register(compositor, WESTON_REMOTING_API_NAME,
 					 &remoting_api, sizeof(remoting_api));
 
@@ -599,13 +1093,15 @@ weston_module_init(struct weston_compositor *compositor)
 		goto failed;
 	}
 
-	if (!wl_global_create(compositor->wl_display, &lg_remote_interface, 1,
+	if (!wl_global_create(compositor->wl_display, &lg_remote_interface, 2,
 			      remoting, bind_lg_remote))
 		goto failed;
 
 	return 0;
 
 failed:
+	if (remoting->worker_pool)
+		remoting_worker_pool_destroy(remoting->worker_pool);
 	wl_list_remove(&remoting->destroy_listener.link);
 	free(remoting);
 	return -1;
@@ -279,6 +279,21 @@ enum wdrm_crtc_property {
 	WDRM_CRTC__COUNT
 };
 
+/* Results of atomic TEST_ONLY commits remembered, see kms.c */
+#define DRM_TEST_CACHE_SIZE 16
+/* A failure can be transient, e.g. memory bandwidth, so test again after
+ * this many reuses, about a second at 60 Hz */
+#define DRM_TEST_CACHE_FAIL_REUSE 60
+
+struct drm_test_cache_entry {
+	/* Canonical description of the tested state, empty if unused */
+	struct wl_array key;
+	uint32_t hash;
+	int result;
+	uint32_t reused;
+	uint32_t last_used;
+};
+
 struct drm_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -337,6 +352,24 @@ struct drm_backend {
 
 	bool fb_modifiers;
 
+	/* struct drm_buffer_fb_cache::link */
+	struct wl_list buffer_fb_cache_list;
+	struct {
+		/* Client buffers imported and added as framebuffers */
+		uint64_t imports;
+		/* Reused from the cache */
+		uint64_t hits;
+		/* Known not to import, so not tried again */
+		uint64_t failed_hits;
+	} fb_cache_stats;
+
+	struct drm_test_cache_entry test_cache[DRM_TEST_CACHE_SIZE];
+	uint32_t test_cache_clock;
+	struct {
+		uint64_t hits;
+		uint64_t misses;
+	} test_cache_stats;
+
 	struct weston_log_scope *debug;
 };
 
@@ -369,8 +402,6 @@ struct drm_fb {
 	uint64_t modifier;
 	int width, height;
 	int fd;
-	struct weston_buffer_reference buffer_ref;
-	struct weston_buffer_release_reference buffer_release_ref;
 
 	/* Used by gbm fbs */
 	struct gbm_bo *bo;
@@ -440,6 +471,9 @@ struct drm_plane_state {
 	struct drm_output_state *output_state;
 
 	struct drm_fb *fb;
+	/* The client buffer fb comes from, kept busy while on the plane */
+	struct weston_buffer_reference buffer_ref;
+	struct weston_buffer_release_reference buffer_release_ref;
 
 	struct weston_view *ev; /**< maintained for drm_assign_planes only */
 
@@ -603,6 +637,21 @@ struct drm_output {
 	bool virtual;
 
 	submit_frame_cb virtual_submit_frame;
+	/* struct drm_virtual_frame::link, held by the submit_frame_cb owner */
+	struct wl_list virtual_frame_list;
+	unsigned int virtual_frames_in_flight;
+	unsigned int virtual_frame_queue_depth;
+	/* Latest frame, waiting for the owner to release a buffer */
+	struct drm_fb *virtual_pending_fb;
+	/* The owner calls finish_frame for the frame being repainted */
+	bool virtual_finish_owed;
+	/* Complete the frame from virtual_idle_source instead */
+	bool virtual_finish_pending;
+	bool virtual_repaint_pending;
+	struct wl_event_source *virtual_idle_source;
+	struct weston_virtual_output_frame_counters virtual_counters;
+	/* Repainted since the last frame submitted, in buffer coordinates */
+	pixman_region32_t virtual_damage;
 
 	/* HDR sesstion is active */
 	bool output_is_hdr;
@@ -727,6 +776,8 @@ init_kms_caps(struct drm_backend *b);
 
 int
 drm_pending_state_test(struct drm_pending_state *pending_state);
+void
+drm_test_cache_clear(struct drm_backend *b);
 int
 drm_pending_state_apply(struct drm_pending_state *pending_state);
 int
@@ -762,6 +813,8 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev);
 extern bool
 drm_can_scanout_dmabuf(struct weston_compositor *ec,
 		       struct linux_dmabuf_buffer *dmabuf);
+void
+drm_fb_cache_release(struct drm_backend *b);
 #else
 static inline struct drm_fb *
 drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
@@ -774,6 +827,10 @@ drm_can_scanout_dmabuf(struct weston_compositor *ec,
 {
 	return false;
 }
+static inline void
+drm_fb_cache_release(struct drm_backend *b)
+{
+}
 #endif
 
 struct drm_pending_state *
@@ -821,6 +878,9 @@ void
 drm_plane_state_free(struct drm_plane_state *state, bool force);
 void
 drm_plane_state_put_back(struct drm_plane_state *state);
+void
+drm_plane_state_set_view_fb(struct drm_plane_state *state,
+			    struct weston_view *ev, struct drm_fb *fb);
 bool
 drm_plane_state_coords_for_view(struct drm_plane_state *state,
 				struct weston_view *ev, uint64_t zpos);
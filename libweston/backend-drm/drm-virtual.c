@@ -30,6 +30,7 @@
 #include "config.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -104,31 +105,145 @@ drm_virtual_output_start_repaint_loop(struct weston_output *output_base)
 	return 0;
 }
 
+/* A buffer handed to the owner of a virtual output */
+struct drm_virtual_frame {
+	/* NULL once the output got disabled */
+	struct drm_output *output;
+	struct drm_fb *fb;
+	/* drm_output::virtual_frame_list */
+	struct wl_list link;
+	pixman_region32_t damage;
+};
+
 static int
 drm_virtual_output_submit_frame(struct drm_output *output,
-				void *_fb)
+				struct drm_fb *fb)
 {
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	struct drm_fb* fb = _fb;
+	struct drm_virtual_frame *frame;
 	int fd, ret;
 
 	assert(fb->num_planes == 1);
+
+	frame = zalloc(sizeof *frame);
+	if (!frame)
+		return -1;
+
 	ret = drmPrimeHandleToFD(b->drm.fd, fb->handles[0], DRM_CLOEXEC, &fd);
 	if (ret) {
 		weston_log("drmPrimeHandleFD failed, errno=%d\n", errno);
+		free(frame);
 		return -1;
 	}
 
-	drm_fb_ref(fb);
+	/* The owner may release the frame before the callback returns */
+	frame->output = output;
+	frame->fb = drm_fb_ref(fb);
+	pixman_region32_init(&frame->damage);
+	pixman_region32_copy(&frame->damage, &output->virtual_damage);
+	wl_list_insert(&output->virtual_frame_list, &frame->link);
+	output->virtual_frames_in_flight++;
+
 	ret = output->virtual_submit_frame(&output->base, fd, fb->strides[0],
-					   fb);
+					   frame);
 	if (ret < 0) {
-		drm_fb_unref(fb);
+		output->virtual_frames_in_flight--;
+		wl_list_remove(&frame->link);
+		drm_fb_unref(frame->fb);
+		pixman_region32_fini(&frame->damage);
+		free(frame);
 		close(fd);
+		return ret;
 	}
+
+	pixman_region32_clear(&output->virtual_damage);
+	output->virtual_counters.submitted++;
+
 	return ret;
 }
 
+static void
+drm_virtual_output_drop_pending_frame(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+
+	if (!output->virtual_pending_fb)
+		return;
+
+	drm_fb_unref(output->virtual_pending_fb);
+	output->virtual_pending_fb = NULL;
+	output->virtual_counters.replaced++;
+
+	drm_debug(b, "[virtual] %s: frame replaced before submission, "
+		  "%" PRIu64 " so far\n", output->base.name,
+		  output->virtual_counters.replaced);
+}
+
+static void
+drm_virtual_output_complete_frame(struct drm_output *output,
+				  struct timespec *stamp,
+				  uint32_t presented_flags)
+{
+	struct drm_plane_state *ps;
+
+	wl_list_for_each(ps, &output->state_cur->plane_list, link)
+		ps->complete = true;
+
+	drm_output_state_free(output->state_last);
+	output->state_last = NULL;
+
+	weston_output_finish_frame(&output->base, stamp, presented_flags);
+
+	/* We can't call this from frame_notify, because the output's
+	 * repaint needed flag is cleared just after that */
+	if (output->recorder)
+		weston_output_schedule_repaint(&output->base);
+}
+
+static void
+drm_virtual_output_idle(void *data)
+{
+	struct drm_output *output = data;
+	struct timespec now;
+	struct drm_fb *fb;
+
+	output->virtual_idle_source = NULL;
+
+	if (output->virtual_pending_fb &&
+	    output->virtual_frames_in_flight <
+	    output->virtual_frame_queue_depth) {
+		fb = output->virtual_pending_fb;
+		output->virtual_pending_fb = NULL;
+		drm_virtual_output_submit_frame(output, fb);
+		drm_fb_unref(fb);
+	}
+
+	if (output->virtual_finish_pending) {
+		output->virtual_finish_pending = false;
+		weston_compositor_read_presentation_clock(output->base.compositor,
+							  &now);
+		drm_virtual_output_complete_frame(output, &now, 0);
+	}
+
+	if (output->virtual_repaint_pending) {
+		output->virtual_repaint_pending = false;
+		weston_output_schedule_repaint(&output->base);
+	}
+}
+
+static void
+drm_virtual_output_schedule_idle(struct drm_output *output)
+{
+	struct wl_event_loop *loop;
+
+	if (output->virtual_idle_source)
+		return;
+
+	loop = wl_display_get_event_loop(output->base.compositor->wl_display);
+	output->virtual_idle_source =
+		wl_event_loop_add_idle(loop, drm_virtual_output_idle, output);
+}
+
 static int
 drm_virtual_output_repaint(struct weston_output *output_base,
 			   pixman_region32_t *damage,
@@ -137,18 +252,31 @@ drm_virtual_output_repaint(struct weston_output *output_base,
 	struct drm_pending_state *pending_state = repaint_data;
 	struct drm_output_state *state = NULL;
 	struct drm_output *output = to_drm_output(output_base);
+	struct drm_backend *b = to_drm_backend(output_base->compositor);
 	struct drm_plane *scanout_plane = output->scanout_plane;
 	struct drm_plane_state *scanout_state;
+	pixman_region32_t buffer_damage;
 
 	assert(output->virtual);
 
 	if (output->disable_pending || output->destroy_pending)
 		goto err;
 
-	/* Drop frame if there isn't free buffers */
+	/* The owner holds on to more buffers than the gbm surface has left
+	 * over; keep the repaint loop going and try again next refresh */
 	if (!gbm_surface_has_free_buffers(output->gbm_surface)) {
-		weston_log("%s: Drop frame!!\n", __func__);
-		return -1;
+		output->virtual_counters.dropped++;
+		drm_debug(b, "[virtual] %s: no free buffer, repaint dropped, "
+			  "%" PRIu64 " so far\n", output->base.name,
+			  output->virtual_counters.dropped);
+
+		state = drm_pending_state_get_output(pending_state, output);
+		drm_output_state_free(state);
+
+		output->virtual_finish_pending = true;
+		output->virtual_repaint_pending = true;
+		drm_virtual_output_schedule_idle(output);
+		return 0;
 	}
 
 	assert(!output->state_last);
@@ -167,8 +295,37 @@ drm_virtual_output_repaint(struct weston_output *output_base,
 	if (!scanout_state || !scanout_state->fb)
 		goto err;
 
-	if (drm_virtual_output_submit_frame(output, scanout_state->fb) < 0)
-		goto err;
+	/* Also what a replaced frame changed, until a frame goes out */
+	pixman_region32_init(&buffer_damage);
+	pixman_region32_copy(&buffer_damage, damage);
+	pixman_region32_translate(&buffer_damage,
+				  -output_base->x, -output_base->y);
+	weston_transformed_region(output_base->width, output_base->height,
+				  output_base->transform,
+				  output_base->current_scale,
+				  &buffer_damage, &buffer_damage);
+	pixman_region32_union(&output->virtual_damage,
+			      &output->virtual_damage, &buffer_damage);
+	pixman_region32_fini(&buffer_damage);
+
+	/* Whatever frame is still waiting is older than this one */
+	drm_virtual_output_drop_pending_frame(output);
+
+	if (output->virtual_frames_in_flight <
+	    output->virtual_frame_queue_depth) {
+		if (drm_virtual_output_submit_frame(output,
+						    scanout_state->fb) < 0)
+			goto err;
+
+		output->virtual_finish_owed = true;
+		return 0;
+	}
+
+	/* The owner is busy: keep the frame for when it releases a buffer,
+	 * and complete it ourselves so the repaint loop does not stall */
+	output->virtual_pending_fb = drm_fb_ref(scanout_state->fb);
+	output->virtual_finish_pending = true;
+	drm_virtual_output_schedule_idle(output);
 
 	return 0;
 
@@ -177,11 +334,46 @@ err:
 	return -1;
 }
 
+static void
+drm_virtual_output_release_frames(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_virtual_frame *frame, *next;
+
+	if (output->virtual_idle_source) {
+		wl_event_source_remove(output->virtual_idle_source);
+		output->virtual_idle_source = NULL;
+	}
+
+	drm_fb_unref(output->virtual_pending_fb);
+	output->virtual_pending_fb = NULL;
+
+	output->virtual_finish_owed = false;
+	output->virtual_finish_pending = false;
+	output->virtual_repaint_pending = false;
+
+	/* The owner still releases these, after the output is gone */
+	wl_list_for_each_safe(frame, next, &output->virtual_frame_list, link) {
+		wl_list_remove(&frame->link);
+		wl_list_init(&frame->link);
+		frame->output = NULL;
+	}
+	output->virtual_frames_in_flight = 0;
+
+	drm_debug(b, "[virtual] %s: %" PRIu64 " frames submitted, "
+		  "%" PRIu64 " replaced, %" PRIu64 " repaints dropped\n",
+		  output->base.name, output->virtual_counters.submitted,
+		  output->virtual_counters.replaced,
+		  output->virtual_counters.dropped);
+}
+
 static void
 drm_virtual_output_deinit(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
 
+	drm_virtual_output_release_frames(output);
+
 	drm_output_fini_egl(output);
 
 	drm_virtual_plane_destroy(output->scanout_plane);
@@ -200,6 +392,7 @@ drm_virtual_output_destroy(struct weston_output *base)
 	weston_output_release(&output->base);
 
 	drm_output_state_free(output->state_cur);
+	pixman_region32_fini(&output->virtual_damage);
 
 	free(output);
 }
@@ -242,6 +435,12 @@ drm_virtual_output_enable(struct weston_output *output_base)
 	output->base.gamma_size = 0;
 	output->base.set_gamma = NULL;
 
+	/* The owner has nothing of this output yet */
+	pixman_region32_fini(&output->virtual_damage);
+	pixman_region32_init_rect(&output->virtual_damage, 0, 0,
+				  output->base.current_mode->width,
+				  output->base.current_mode->height);
+
 	weston_compositor_stack_plane(b->compositor,
 				      &output->scanout_plane->base,
 				      &b->compositor->primary_plane);
@@ -275,6 +474,10 @@ drm_virtual_output_create(struct weston_compositor *c, char *name)
 
 	output->virtual = true;
 	output->gbm_bo_flags = GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING;
+	output->virtual_frame_queue_depth =
+		WESTON_VIRTUAL_OUTPUT_FRAME_QUEUE_DEPTH;
+	wl_list_init(&output->virtual_frame_list);
+	pixman_region32_init(&output->virtual_damage);
 
 	weston_output_init(&output->base, c, name);
 
@@ -319,11 +522,25 @@ drm_virtual_output_get_fence_fd(struct weston_output *output_base)
 }
 
 static void
-drm_virtual_output_buffer_released(void *_fb)
+drm_virtual_output_buffer_released(void *buffer)
 {
-	struct drm_fb* fb = _fb;
+	struct drm_virtual_frame *frame = buffer;
+	struct drm_output *output = frame->output;
+
+	wl_list_remove(&frame->link);
+	drm_fb_unref(frame->fb);
+	pixman_region32_fini(&frame->damage);
+	free(frame);
+
+	if (!output)
+		return;
 
-	drm_fb_unref(fb);
+	output->virtual_frames_in_flight--;
+
+	/* Not from here, the owner may be in the middle of its own
+	 * bookkeeping */
+	if (output->virtual_pending_fb)
+		drm_virtual_output_schedule_idle(output);
 }
 
 static void
@@ -332,20 +549,40 @@ drm_virtual_output_finish_frame(struct weston_output *output_base,
 				uint32_t presented_flags)
 {
 	struct drm_output *output = to_drm_output(output_base);
-	struct drm_plane_state *ps;
 
-	wl_list_for_each(ps, &output->state_cur->plane_list, link)
-		ps->complete = true;
+	/* Frames submitted late were already completed by the idle
+	 * handler */
+	if (!output->virtual_finish_owed)
+		return;
 
-	drm_output_state_free(output->state_last);
-	output->state_last = NULL;
+	output->virtual_finish_owed = false;
+	drm_virtual_output_complete_frame(output, stamp, presented_flags);
+}
 
-	weston_output_finish_frame(&output->base, stamp, presented_flags);
+static void
+drm_virtual_output_set_frame_queue_depth(struct weston_output *output_base,
+					 unsigned int depth)
+{
+	struct drm_output *output = to_drm_output(output_base);
 
-	/* We can't call this from frame_notify, because the output's
-	 * repaint needed flag is cleared just after that */
-	if (output->recorder)
-		weston_output_schedule_repaint(&output->base);
+	output->virtual_frame_queue_depth = MAX(depth, 1u);
+}
+
+static void
+drm_virtual_output_get_frame_counters(struct weston_output *output_base,
+				      struct weston_virtual_output_frame_counters *counters)
+{
+	struct drm_output *output = to_drm_output(output_base);
+
+	*counters = output->virtual_counters;
+}
+
+static const pixman_region32_t *
+drm_virtual_output_get_frame_damage(void *buffer)
+{
+	struct drm_virtual_frame *frame = buffer;
+
+	return &frame->damage;
 }
 
 static const struct weston_drm_virtual_output_api virt_api = {
@@ -354,7 +591,10 @@ static const struct weston_drm_virtual_output_api virt_api = {
 	drm_virtual_output_set_submit_frame_cb,
 	drm_virtual_output_get_fence_fd,
 	drm_virtual_output_buffer_released,
-	drm_virtual_output_finish_frame
+	drm_virtual_output_finish_frame,
+	drm_virtual_output_set_frame_queue_depth,
+	drm_virtual_output_get_frame_counters,
+	drm_virtual_output_get_frame_damage,
 };
 
 int drm_backend_init_virtual_output_api(struct weston_compositor *compositor)
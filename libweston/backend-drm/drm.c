@@ -2447,6 +2447,9 @@ drm_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(base, next, &ec->head_list, compositor_link)
 		drm_head_destroy(to_drm_head(base));
 
+	drm_fb_cache_release(b);
+	drm_test_cache_clear(b);
+
 #ifdef BUILD_DRM_GBM
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
@@ -2872,6 +2875,7 @@ drm_backend_create(struct weston_compositor *compositor,
 	b->state_invalid = true;
 	b->drm.fd = -1;
 	wl_array_init(&b->unused_crtcs);
+	wl_list_init(&b->buffer_fb_cache_list);
 
 	b->compositor = compositor;
 	b->use_pixman = config->use_pixman;
@@ -2940,6 +2944,8 @@ drm_backend_create(struct weston_compositor *compositor,
 	b->base.create_output = drm_output_create;
 	b->base.device_changed = drm_device_changed;
 	b->base.can_scanout_dmabuf = drm_can_scanout_dmabuf;
+	/* Frame buffers are only committed in drm_repaint_flush() */
+	b->base.deferred_paint = true;
 
 	weston_setup_vt_switch_bindings(compositor);
 
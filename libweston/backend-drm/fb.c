@@ -29,6 +29,7 @@
 
 #include "config.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 
 #include <xf86drm.h>
@@ -48,8 +49,6 @@ drm_fb_destroy(struct drm_fb *fb)
 {
 	if (fb->fb_id != 0)
 		drmModeRmFB(fb->fd, fb->fb_id);
-	weston_buffer_reference(&fb->buffer_ref, NULL);
-	weston_buffer_release_reference(&fb->buffer_release_ref, NULL);
 	free(fb);
 }
 
@@ -460,16 +459,6 @@ err_free:
 	return NULL;
 }
 
-static void
-drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer,
-		  struct weston_buffer_release *buffer_release)
-{
-	assert(fb->buffer_ref.buffer == NULL);
-	assert(fb->type == BUFFER_CLIENT || fb->type == BUFFER_DMABUF);
-	weston_buffer_reference(&fb->buffer_ref, buffer);
-	weston_buffer_release_reference(&fb->buffer_release_ref,
-					buffer_release);
-}
 #endif
 
 void
@@ -523,6 +512,108 @@ drm_can_scanout_dmabuf(struct weston_compositor *ec,
 	return ret;
 }
 
+/** Framebuffers of a client buffer, kept until the client destroys it
+ *
+ * Importing a buffer and adding it as a KMS framebuffer costs a few ioctls,
+ * and clients cycle through a handful of buffers. The fbs are indexed by
+ * whether the view is opaque, which changes the format. A buffer which
+ * failed to import is not tried again.
+ */
+struct drm_buffer_fb_cache {
+	struct drm_backend *backend;
+	struct wl_listener buffer_destroy_listener;
+	struct wl_list link; /* drm_backend::buffer_fb_cache_list */
+
+	struct drm_fb *fb[2];
+	bool failed[2];
+};
+
+static void
+drm_buffer_fb_cache_destroy(struct drm_buffer_fb_cache *cache)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(cache->fb); i++)
+		drm_fb_unref(cache->fb[i]);
+
+	wl_list_remove(&cache->buffer_destroy_listener.link);
+	wl_list_remove(&cache->link);
+	free(cache);
+}
+
+static void
+drm_buffer_fb_cache_handle_buffer_destroy(struct wl_listener *listener,
+					  void *data)
+{
+	struct drm_buffer_fb_cache *cache =
+		container_of(listener, struct drm_buffer_fb_cache,
+			     buffer_destroy_listener);
+
+	drm_buffer_fb_cache_destroy(cache);
+}
+
+static struct drm_buffer_fb_cache *
+drm_buffer_fb_cache_get(struct drm_backend *b, struct weston_buffer *buffer)
+{
+	struct drm_buffer_fb_cache *cache;
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 drm_buffer_fb_cache_handle_buffer_destroy);
+	if (listener)
+		return container_of(listener, struct drm_buffer_fb_cache,
+				    buffer_destroy_listener);
+
+	cache = zalloc(sizeof *cache);
+	if (!cache)
+		return NULL;
+
+	cache->backend = b;
+	cache->buffer_destroy_listener.notify =
+		drm_buffer_fb_cache_handle_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal,
+		      &cache->buffer_destroy_listener);
+	wl_list_insert(&b->buffer_fb_cache_list, &cache->link);
+
+	return cache;
+}
+
+/** Drop the fbs of all client buffers, before the GBM device goes away */
+void
+drm_fb_cache_release(struct drm_backend *b)
+{
+	struct drm_buffer_fb_cache *cache, *tmp;
+
+	wl_list_for_each_safe(cache, tmp, &b->buffer_fb_cache_list, link)
+		drm_buffer_fb_cache_destroy(cache);
+}
+
+static struct drm_fb *
+drm_fb_import_buffer(struct drm_backend *b, struct weston_buffer *buffer,
+		     bool is_opaque)
+{
+	struct linux_dmabuf_buffer *dmabuf;
+	struct gbm_bo *bo;
+	struct drm_fb *fb;
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (dmabuf)
+		return drm_fb_get_from_dmabuf(dmabuf, b, is_opaque);
+
+	bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
+			   buffer->resource, GBM_BO_USE_SCANOUT);
+	if (!bo)
+		return NULL;
+
+	fb = drm_fb_get_from_bo(bo, b, is_opaque, BUFFER_CLIENT);
+	if (!fb) {
+		gbm_bo_destroy(bo);
+		return NULL;
+	}
+
+	return fb;
+}
+
 struct drm_fb *
 drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 {
@@ -530,8 +621,9 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
 	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
 	bool is_opaque = weston_view_is_opaque(ev, &ev->transform.boundingbox);
-	struct linux_dmabuf_buffer *dmabuf;
+	struct drm_buffer_fb_cache *cache;
 	struct drm_fb *fb;
+	bool cached;
 
 	if (ev->alpha != 1.0f)
 		return NULL;
@@ -553,30 +645,37 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 	if (!b->gbm)
 		return NULL;
 
-	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
-	if (dmabuf) {
-		fb = drm_fb_get_from_dmabuf(dmabuf, b, is_opaque);
-		if (!fb)
-			return NULL;
-	} else {
-		struct gbm_bo *bo;
+	cache = drm_buffer_fb_cache_get(b, buffer);
+	if (!cache)
+		return NULL;
 
-		bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
-				   buffer->resource, GBM_BO_USE_SCANOUT);
-		if (!bo)
-			return NULL;
+	if (cache->failed[is_opaque]) {
+		b->fb_cache_stats.failed_hits++;
+		drm_debug(b, "\t\t\t[view] view %p: buffer failed to import "
+			     "before\n", ev);
+		return NULL;
+	}
 
-		fb = drm_fb_get_from_bo(bo, b, is_opaque, BUFFER_CLIENT);
+	fb = cache->fb[is_opaque];
+	cached = fb != NULL;
+	if (cached) {
+		b->fb_cache_stats.hits++;
+	} else {
+		b->fb_cache_stats.imports++;
+		fb = drm_fb_import_buffer(b, buffer, is_opaque);
 		if (!fb) {
-			gbm_bo_destroy(bo);
+			cache->failed[is_opaque] = true;
 			return NULL;
 		}
+		cache->fb[is_opaque] = fb;
 	}
 
-	drm_debug(b, "\t\t\t[view] view %p format: %s\n",
-		  ev, fb->format->drm_format_name);
-	drm_fb_set_buffer(fb, buffer,
-			  ev->surface->buffer_release_ref.buffer_release);
-	return fb;
+	drm_debug(b, "\t\t\t[view] view %p format: %s, fb %s "
+		     "(%" PRIu64 " imports, %" PRIu64 " reused)\n",
+		  ev, fb->format->drm_format_name,
+		  cached ? "cached" : "imported",
+		  b->fb_cache_stats.imports, b->fb_cache_stats.hits);
+
+	return drm_fb_ref(fb);
 }
 #endif
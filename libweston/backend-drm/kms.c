@@ -29,7 +29,9 @@
 
 #include "config.h"
 
+#include <inttypes.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -1291,6 +1293,7 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 	if (ret != 0) {
 		weston_log("atomic: couldn't commit new state: %s\n",
 			   strerror(errno));
+		drm_test_cache_clear(b);
 		goto out;
 	}
 
@@ -1298,6 +1301,9 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 			      link)
 		drm_output_assign_state(output_state, mode);
 
+	/* Tests passed against the state before may not anymore */
+	if (b->state_invalid)
+		drm_test_cache_clear(b);
 	b->state_invalid = false;
 
 	assert(wl_list_empty(&pending_state->output_list));
@@ -1308,6 +1314,189 @@ out:
 	return ret;
 }
 
+static bool
+test_key_add(struct wl_array *key, uint64_t value)
+{
+	uint64_t *p = wl_array_add(key, sizeof *p);
+
+	if (!p)
+		return false;
+
+	*p = value;
+	return true;
+}
+
+static bool
+test_key_add_output_state(struct wl_array *key,
+			  struct drm_output_state *output_state)
+{
+	struct drm_output *output = output_state->output;
+	struct drm_plane_state *ps;
+	struct drm_fb *fb;
+	bool ok = true;
+	int i;
+
+	ok &= test_key_add(key, output->crtc_id);
+	ok &= test_key_add(key, (uintptr_t) output->base.current_mode);
+	ok &= test_key_add(key, output_state->dpms);
+	ok &= test_key_add(key, output_state->protection);
+
+	wl_list_for_each(ps, &output_state->plane_list, link) {
+		fb = ps->fb;
+
+		ok &= test_key_add(key, ps->plane->plane_id);
+		ok &= test_key_add(key, fb ? fb->format->format : 0);
+		if (fb) {
+			ok &= test_key_add(key, fb->modifier);
+			ok &= test_key_add(key, fb->width);
+			ok &= test_key_add(key, fb->height);
+			ok &= test_key_add(key, fb->num_planes);
+			for (i = 0; i < fb->num_planes; i++) {
+				ok &= test_key_add(key, fb->strides[i]);
+				ok &= test_key_add(key, fb->offsets[i]);
+			}
+		}
+		ok &= test_key_add(key, (uint64_t) ps->src_x << 32 |
+					(uint32_t) ps->src_y);
+		ok &= test_key_add(key, (uint64_t) ps->src_w << 32 |
+					ps->src_h);
+		ok &= test_key_add(key, (uint64_t) ps->dest_x << 32 |
+					(uint32_t) ps->dest_y);
+		ok &= test_key_add(key, (uint64_t) ps->dest_w << 32 |
+					ps->dest_h);
+		ok &= test_key_add(key, ps->zpos);
+		ok &= test_key_add(key, ps->in_fence_fd >= 0);
+	}
+
+	return ok;
+}
+
+/**
+ * Describe what the kernel checks in a TEST_ONLY commit of a pending state:
+ * the CRTC configuration, and for every plane the fb layout and the
+ * coordinates. Which buffer an fb holds and the damage do not matter.
+ *
+ * Outputs without state in the pending state are checked by the kernel as
+ * they were last committed, since they share bandwidth, planes and clocks
+ * with the others, so their current state is part of the key too.
+ *
+ * Returns false if the state cannot be cached, because it involves a
+ * modeset or the key could not be allocated.
+ */
+static bool
+drm_pending_state_test_key(struct drm_pending_state *pending_state,
+			   struct wl_array *key)
+{
+	struct drm_backend *b = pending_state->backend;
+	struct drm_output_state *output_state;
+	struct drm_output *output;
+	struct drm_head *head;
+	bool ok = true;
+
+	if (b->state_invalid)
+		return false;
+
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		output = output_state->output;
+		if (output->virtual)
+			continue;
+
+		if (output_state->dpms != output->state_cur->dpms)
+			return false;
+
+		wl_list_for_each(head, &output->base.head_list,
+				 base.output_link)
+			if (head->color_state.changed)
+				return false;
+
+		ok &= test_key_add_output_state(key, output_state);
+	}
+
+	/* Zero is no KMS object ID, so this ends the outputs under test */
+	ok &= test_key_add(key, 0);
+
+	wl_list_for_each(output, &b->compositor->output_list, base.link) {
+		if (output->virtual || !output->state_cur ||
+		    drm_pending_state_get_output(pending_state, output))
+			continue;
+
+		ok &= test_key_add_output_state(key, output->state_cur);
+	}
+
+	return ok;
+}
+
+static uint32_t
+test_key_hash(struct wl_array *key)
+{
+	const uint8_t *p = key->data;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < key->size; i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static struct drm_test_cache_entry *
+drm_test_cache_lookup(struct drm_backend *b, struct wl_array *key,
+		      uint32_t hash)
+{
+	struct drm_test_cache_entry *entry;
+	int i;
+
+	for (i = 0; i < DRM_TEST_CACHE_SIZE; i++) {
+		entry = &b->test_cache[i];
+		if (entry->key.size == key->size && entry->hash == hash &&
+		    memcmp(entry->key.data, key->data, key->size) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Takes ownership of the key */
+static void
+drm_test_cache_insert(struct drm_backend *b, struct wl_array *key,
+		      uint32_t hash, int result)
+{
+	struct drm_test_cache_entry *entry = &b->test_cache[0];
+	int i;
+
+	/* Unused entries have last_used 0 */
+	for (i = 1; i < DRM_TEST_CACHE_SIZE; i++)
+		if (b->test_cache[i].last_used < entry->last_used)
+			entry = &b->test_cache[i];
+
+	wl_array_release(&entry->key);
+	entry->key = *key;
+	entry->hash = hash;
+	entry->result = result;
+	entry->reused = 0;
+	entry->last_used = ++b->test_cache_clock;
+}
+
+/**
+ * Forget all remembered TEST_ONLY results, when the kernel state they were
+ * tested against changed under us.
+ */
+void
+drm_test_cache_clear(struct drm_backend *b)
+{
+	int i;
+
+	for (i = 0; i < DRM_TEST_CACHE_SIZE; i++) {
+		wl_array_release(&b->test_cache[i].key);
+		wl_array_init(&b->test_cache[i].key);
+		b->test_cache[i].last_used = 0;
+	}
+	b->test_cache_clock = 0;
+}
+
 /**
  * Tests a pending state, to see if the kernel will accept the update as
  * constructed.
@@ -1330,10 +1519,49 @@ int
 drm_pending_state_test(struct drm_pending_state *pending_state)
 {
 	struct drm_backend *b = pending_state->backend;
+	struct drm_test_cache_entry *entry;
+	struct wl_array key;
+	uint32_t hash;
+	int ret;
 
-	if (b->atomic_modeset)
-		return drm_pending_state_apply_atomic(pending_state,
-						      DRM_STATE_TEST_ONLY);
+	if (b->atomic_modeset) {
+		wl_array_init(&key);
+		if (!drm_pending_state_test_key(pending_state, &key)) {
+			wl_array_release(&key);
+			return drm_pending_state_apply_atomic(pending_state,
+							      DRM_STATE_TEST_ONLY);
+		}
+
+		hash = test_key_hash(&key);
+		entry = drm_test_cache_lookup(b, &key, hash);
+		if (entry && (entry->result == 0 ||
+			      entry->reused < DRM_TEST_CACHE_FAIL_REUSE)) {
+			wl_array_release(&key);
+			entry->reused++;
+			entry->last_used = ++b->test_cache_clock;
+			b->test_cache_stats.hits++;
+			drm_debug(b, "\t\t[atomic] test result %s from cache "
+				     "(%" PRIu64 " hits, %" PRIu64 " tests)\n",
+				  entry->result == 0 ? "pass" : "fail",
+				  b->test_cache_stats.hits,
+				  b->test_cache_stats.misses);
+			return entry->result;
+		}
+
+		b->test_cache_stats.misses++;
+		ret = drm_pending_state_apply_atomic(pending_state,
+						     DRM_STATE_TEST_ONLY);
+		if (entry) {
+			wl_array_release(&key);
+			entry->result = ret;
+			entry->reused = 0;
+			entry->last_used = ++b->test_cache_clock;
+		} else {
+			drm_test_cache_insert(b, &key, hash, ret);
+		}
+
+		return ret;
+	}
 
 	/* We have no way to test state before application on the legacy
 	 * modesetting API, so just claim it succeeded. */
@@ -93,6 +93,9 @@ drm_plane_state_free(struct drm_plane_state *state, bool force)
 
 	if (force || state != state->plane->state_cur) {
 		drm_fb_unref(state->fb);
+		weston_buffer_reference(&state->buffer_ref, NULL);
+		weston_buffer_release_reference(&state->buffer_release_ref,
+						NULL);
 		free(state);
 	}
 }
@@ -130,6 +133,13 @@ drm_plane_state_duplicate(struct drm_output_state *state_output,
 	wl_list_insert(&state_output->plane_list, &dst->link);
 	if (src->fb)
 		dst->fb = drm_fb_ref(src->fb);
+
+	/* The copies above do not hold references */
+	memset(&dst->buffer_ref, 0, sizeof dst->buffer_ref);
+	memset(&dst->buffer_release_ref, 0, sizeof dst->buffer_release_ref);
+	weston_buffer_reference(&dst->buffer_ref, src->buffer_ref.buffer);
+	weston_buffer_release_reference(&dst->buffer_release_ref,
+					src->buffer_release_ref.buffer_release);
 	dst->output_state = state_output;
 	dst->complete = false;
 
@@ -169,6 +179,24 @@ drm_plane_state_put_back(struct drm_plane_state *state)
 	(void) drm_plane_state_alloc(state_output, plane);
 }
 
+/**
+ * Show the buffer of a view on a plane. The fb is referenced, and so is the
+ * client buffer, so that it is not released while the plane displays it.
+ */
+void
+drm_plane_state_set_view_fb(struct drm_plane_state *state,
+			    struct weston_view *ev, struct drm_fb *fb)
+{
+	struct weston_surface *surface = ev->surface;
+
+	assert(!state->fb);
+
+	state->fb = drm_fb_ref(fb);
+	weston_buffer_reference(&state->buffer_ref, surface->buffer_ref.buffer);
+	weston_buffer_release_reference(&state->buffer_release_ref,
+					surface->buffer_release_ref.buffer_release);
+}
+
 /**
  * Given a weston_view, fill the drm_plane_state's co-ordinates to display on
  * a given plane.
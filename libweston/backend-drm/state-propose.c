@@ -227,7 +227,7 @@ drm_output_prepare_overlay_view(struct drm_plane *plane,
 	/* We hold one reference for the lifetime of this function; from
 	 * calling drm_fb_get_from_view() in drm_output_prepare_plane_view(),
 	 * so, we take another reference here to live within the state. */
-	state->fb = drm_fb_ref(fb);
+	drm_plane_state_set_view_fb(state, ev, fb);
 
 	state->in_fence_fd = ev->surface->acquire_fence_fd;
 
@@ -452,7 +452,7 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 	assert(!state->fb);
 
 	/* take another reference here to live within the state */
-	state->fb = drm_fb_ref(fb);
+	drm_plane_state_set_view_fb(state, ev, fb);
 	state->ev = ev;
 	state->output = output;
 	if (!drm_plane_state_coords_for_view(state, ev, zpos)) {
@@ -10,6 +10,7 @@
 #include <drm_fourcc.h>
 
 #include <libweston/libweston.h>
+#include <libweston/weston-log.h>
 #include <libweston/backend.h>
 #include <libweston/backend-headless.h>
 
@@ -56,8 +57,13 @@ struct headless_backend {
 	struct udev *udev;
 	struct udev_input input;
 	struct wl_listener session_listener;
+
+	struct weston_log_scope *debug;
 };
 
+#define headless_debug(b, ...) \
+	weston_log_scope_printf((b)->debug, __VA_ARGS__)
+
 struct headless_head {
 	struct weston_head base;
 };
@@ -96,6 +102,19 @@ struct headless_output {
 	bool virtual;
 #ifdef BUILD_HEADLESS_VIRTUAL
 	submit_frame_cb virtual_submit_frame;
+	/* struct headless_virtual_frame::link, held by the callback owner */
+	struct wl_list virtual_frame_list;
+	unsigned int virtual_frames_in_flight;
+	unsigned int virtual_frame_queue_depth;
+	/* Latest frame, waiting for the owner to release a buffer */
+	struct headless_fb *virtual_pending_fb;
+	/* The owner calls finish_frame for the frame being repainted */
+	bool virtual_finish_owed;
+	/* Complete the frame from virtual_idle_source instead */
+	bool virtual_finish_pending;
+	bool virtual_repaint_pending;
+	struct wl_event_source *virtual_idle_source;
+	struct weston_virtual_output_frame_counters virtual_counters;
 #endif
 };
 
@@ -2,6 +2,7 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -19,59 +20,196 @@ headless_virtual_output_start_repaint_loop(struct weston_output *output_base)
 	return 0;
 }
 
+/* A buffer handed to the owner of a virtual output */
+struct headless_virtual_frame {
+	/* NULL once the output got disabled */
+	struct headless_output *output;
+	struct headless_fb *fb;
+	/* headless_output::virtual_frame_list */
+	struct wl_list link;
+};
+
 static int
 headless_virtual_output_submit_frame(struct headless_output *output,
-				     void *_fb)
+				     struct headless_fb *fb)
 {
 	struct headless_backend *b = to_headless_backend(output->base.compositor);
-	struct headless_fb* fb = _fb;
+	struct headless_virtual_frame *frame;
 	int fd, ret;
 
 	assert(fb->num_planes == 1);
+
+	frame = zalloc(sizeof *frame);
+	if (!frame)
+		return -1;
+
 	ret = drmPrimeHandleToFD(b->drm_fd, fb->handles[0], DRM_CLOEXEC | DRM_RDWR, &fd);
 	if (ret) {
 		weston_log("drmPrimeHandleFD failed, errno=%d\n", errno);
+		free(frame);
 		return -1;
 	}
 
-	headless_fb_ref(fb);
+	/* The owner may release the frame before the callback returns */
+	frame->output = output;
+	frame->fb = headless_fb_ref(fb);
+	wl_list_insert(&output->virtual_frame_list, &frame->link);
+	output->virtual_frames_in_flight++;
+
 	ret = output->virtual_submit_frame(&output->base, fd, fb->strides[0],
-					   fb);
+					   frame);
 	if (ret < 0) {
-		headless_fb_unref(fb);
+		output->virtual_frames_in_flight--;
+		wl_list_remove(&frame->link);
+		headless_fb_unref(frame->fb);
+		free(frame);
 		close(fd);
+		return ret;
 	}
 
+	output->virtual_counters.submitted++;
+
 	return ret;
 }
 
+static void
+headless_virtual_output_drop_pending_frame(struct headless_output *output)
+{
+	if (!output->virtual_pending_fb)
+		return;
+
+	headless_fb_unref(output->virtual_pending_fb);
+	output->virtual_pending_fb = NULL;
+	output->virtual_counters.replaced++;
+}
+
+static void
+headless_virtual_output_idle(void *data)
+{
+	struct headless_output *output = data;
+	struct timespec now;
+	struct headless_fb *fb;
+
+	output->virtual_idle_source = NULL;
+
+	if (output->virtual_pending_fb &&
+	    output->virtual_frames_in_flight <
+	    output->virtual_frame_queue_depth) {
+		fb = output->virtual_pending_fb;
+		output->virtual_pending_fb = NULL;
+		headless_virtual_output_submit_frame(output, fb);
+		headless_fb_unref(fb);
+	}
+
+	if (output->virtual_finish_pending) {
+		output->virtual_finish_pending = false;
+		weston_compositor_read_presentation_clock(output->base.compositor,
+							  &now);
+		weston_output_finish_frame(&output->base, &now, 0);
+	}
+
+	if (output->virtual_repaint_pending) {
+		output->virtual_repaint_pending = false;
+		weston_output_schedule_repaint(&output->base);
+	}
+}
+
+static void
+headless_virtual_output_schedule_idle(struct headless_output *output)
+{
+	struct wl_event_loop *loop;
+
+	if (output->virtual_idle_source)
+		return;
+
+	loop = wl_display_get_event_loop(output->base.compositor->wl_display);
+	output->virtual_idle_source =
+		wl_event_loop_add_idle(loop, headless_virtual_output_idle,
+				       output);
+}
+
 static int
 headless_virtual_output_repaint(struct weston_output *output_base,
 			   	pixman_region32_t *damage,
 			   	void *repaint_data)
 {
 	struct headless_output *output = to_headless_output(output_base);
+	struct headless_backend *b = to_headless_backend(output_base->compositor);
 
 	assert(output->virtual);
 
-	/* Drop frame if there isn't free buffers */
+	/* The owner holds on to more buffers than the gbm surface has left
+	 * over; keep the repaint loop going and try again next refresh */
 	if (!gbm_surface_has_free_buffers(output->gbm_surface)) {
-		weston_log("%s: Drop frame!!\n", __func__);
-		return -1;
+		output->virtual_counters.dropped++;
+		headless_debug(b, "[virtual] %s: no free buffer, repaint "
+			       "dropped, %" PRIu64 " so far\n",
+			       output->base.name,
+			       output->virtual_counters.dropped);
+
+		output->virtual_finish_pending = true;
+		output->virtual_repaint_pending = true;
+		headless_virtual_output_schedule_idle(output);
+		return 0;
 	}
 
 	headless_output_repaint_gbm(output, damage);
-	if (headless_virtual_output_submit_frame(output, output->curr_fb) < 0)
-		return -1;
+
+	/* Whatever frame is still waiting is older than this one */
+	headless_virtual_output_drop_pending_frame(output);
+
+	if (output->virtual_frames_in_flight <
+	    output->virtual_frame_queue_depth) {
+		if (headless_virtual_output_submit_frame(output,
+							 output->curr_fb) < 0)
+			return -1;
+
+		output->virtual_finish_owed = true;
+		return 0;
+	}
+
+	/* The owner is busy: keep the frame for when it releases a buffer,
+	 * and complete it ourselves so the repaint loop does not stall */
+	output->virtual_pending_fb = headless_fb_ref(output->curr_fb);
+	output->virtual_finish_pending = true;
+	headless_virtual_output_schedule_idle(output);
 
 	return 0;
 }
 
+static void
+headless_virtual_output_release_frames(struct headless_output *output)
+{
+	struct headless_virtual_frame *frame, *next;
+
+	if (output->virtual_idle_source) {
+		wl_event_source_remove(output->virtual_idle_source);
+		output->virtual_idle_source = NULL;
+	}
+
+	headless_fb_unref(output->virtual_pending_fb);
+	output->virtual_pending_fb = NULL;
+
+	output->virtual_finish_owed = false;
+	output->virtual_finish_pending = false;
+	output->virtual_repaint_pending = false;
+
+	/* The owner still releases these, after the output is gone */
+	wl_list_for_each_safe(frame, next, &output->virtual_frame_list, link) {
+		wl_list_remove(&frame->link);
+		wl_list_init(&frame->link);
+		frame->output = NULL;
+	}
+	output->virtual_frames_in_flight = 0;
+}
+
 static void
 headless_virtual_output_deinit(struct weston_output *base)
 {
 	struct headless_output *output = to_headless_output(base);
 
+	headless_virtual_output_release_frames(output);
+
 	headless_output_disable_gl_gbm(output);
 }
 
@@ -159,6 +297,9 @@ headless_virtual_output_create(struct weston_compositor *c, char *name)
 
 	output->virtual = true;
 	output->gbm_bo_flags = GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING;
+	output->virtual_frame_queue_depth =
+		WESTON_VIRTUAL_OUTPUT_FRAME_QUEUE_DEPTH;
+	wl_list_init(&output->virtual_frame_list);
 
 	weston_output_init(&output->base, c, name);
 
@@ -201,11 +342,24 @@ headless_virtual_output_get_fence_fd(struct weston_output *output_base)
 }
 
 static void
-headless_virtual_output_buffer_released(void *_fb)
+headless_virtual_output_buffer_released(void *buffer)
 {
-	struct headless_fb* fb = _fb;
+	struct headless_virtual_frame *frame = buffer;
+	struct headless_output *output = frame->output;
+
+	wl_list_remove(&frame->link);
+	headless_fb_unref(frame->fb);
+	free(frame);
+
+	if (!output)
+		return;
+
+	output->virtual_frames_in_flight--;
 
-	headless_fb_unref(fb);
+	/* Not from here, the owner may be in the middle of its own
+	 * bookkeeping */
+	if (output->virtual_pending_fb)
+		headless_virtual_output_schedule_idle(output);
 }
 
 static void
@@ -213,16 +367,44 @@ headless_virtual_output_finish_frame(struct weston_output *output_base,
 				     struct timespec *stamp,
 				     uint32_t presented_flags)
 {
+	struct headless_output *output = to_headless_output(output_base);
+
+	/* Frames submitted late were already completed by the idle
+	 * handler */
+	if (!output->virtual_finish_owed)
+		return;
+
+	output->virtual_finish_owed = false;
 	weston_output_finish_frame(output_base, stamp, presented_flags);
 }
 
+static void
+headless_virtual_output_set_frame_queue_depth(struct weston_output *output_base,
+					      unsigned int depth)
+{
+	struct headless_output *output = to_headless_output(output_base);
+
+	output->virtual_frame_queue_depth = MAX(depth, 1u);
+}
+
+static void
+headless_virtual_output_get_frame_counters(struct weston_output *output_base,
+					   struct weston_virtual_output_frame_counters *counters)
+{
+	struct headless_output *output = to_headless_output(output_base);
+
+	*counters = output->virtual_counters;
+}
+
 static const struct weston_drm_virtual_output_api virt_api = {
 	headless_virtual_output_create,
 	headless_virtual_output_set_gbm_format,
 	headless_virtual_output_set_submit_frame_cb,
 	headless_virtual_output_get_fence_fd,
 	headless_virtual_output_buffer_released,
-	headless_virtual_output_finish_frame
+	headless_virtual_output_finish_frame,
+	headless_virtual_output_set_frame_queue_depth,
+	headless_virtual_output_get_frame_counters,
 };
 
 int headless_backend_init_virtual_output_api(struct weston_compositor *compositor)
@@ -542,6 +542,7 @@ headless_destroy(struct weston_compositor *ec)
 	weston_launcher_destroy(ec->launcher);
         udev_unref(b->udev);
 
+	weston_log_scope_destroy(b->debug);
 	free(b);
 }
 
@@ -634,6 +635,10 @@ headless_backend_create(struct weston_compositor *compositor,
 	b->compositor = compositor;
 	compositor->backend = &b->base;
 
+	b->debug = weston_compositor_add_log_scope(compositor, "headless-backend",
+						   "Debug messages from headless backend\n",
+						   NULL, NULL, NULL);
+
 	if (weston_compositor_set_presentation_clock_software(compositor) < 0)
 		goto err_free;
 
@@ -656,6 +661,7 @@ headless_backend_create(struct weston_compositor *compositor,
 
 	b->base.destroy = headless_destroy;
 	b->base.create_output = headless_output_create;
+	b->base.deferred_paint = true;
 
 	if (config->use_pixman && config->use_gl) {
 		weston_log("Error: cannot use both Pixman *and* GL renderers.\n");
@@ -738,6 +744,7 @@ err_free:
 	if(b->drm_fd) {
 		close(b->drm_fd);
 	}
+	weston_log_scope_destroy(b->debug);
 	free(b);
 	return NULL;
 }
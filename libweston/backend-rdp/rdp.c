@@ -26,11 +26,15 @@
 #include "config.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <linux/input.h>
+#include <sys/eventfd.h>
 
 #if HAVE_FREERDP_VERSION_H
 #include <freerdp/version.h>
@@ -100,11 +104,18 @@
 #include "shared/timespec-util.h"
 #include <libweston/libweston.h>
 #include <libweston/backend-rdp.h>
+#include <libweston/weston-log.h>
 #include "pixman-renderer.h"
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
+#define RDP_ENCODER_MAX_THREADS 4
+/* The RemoteFX tile size, the unchanged tiles cache works on the same grid */
+#define RDP_TILE_SIZE 64
+/* About six frames; a peer whose acks stop coming for that long is not
+ * waited for anymore */
+#define RDP_FRAME_ACK_TIMEOUT_MS 100
 
 #if FREERDP_VERSION_MAJOR >= 2 && defined(PIXEL_FORMAT_BGRA32) && !defined(PIXEL_FORMAT_B8G8R8A8)
 	/* The RDP API is truly wonderful: the pixel format definition changed
@@ -118,6 +129,33 @@
 
 struct rdp_output;
 
+/** Encodes peer updates off the compositor thread
+ *
+ * An RFX or NSC context is stateful, so a peer has at most one job in
+ * flight and the peers of an output are encoded in parallel. The jobs only
+ * read the shadow surface, which the output does not repaint before all of
+ * them are done. FreeRDP peers are not thread safe, the encoded updates are
+ * sent from the compositor thread.
+ */
+struct rdp_encoder {
+	pthread_t threads[RDP_ENCODER_MAX_THREADS];
+	int num_threads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	bool stopping;
+
+	/* struct rdp_encode_job::link, protected by the mutex */
+	struct wl_list job_list;
+	struct wl_list done_list;
+
+	int done_fd;
+	struct wl_event_source *done_source;
+
+	struct weston_log_scope *log;
+};
+
 struct rdp_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -132,6 +170,9 @@ struct rdp_backend {
 	int tls_enabled;
 	int no_clients_resize;
 	int force_no_compression;
+	int max_unacked_frames;
+
+	struct rdp_encoder encoder;
 };
 
 enum peer_item_flags {
@@ -156,9 +197,42 @@ struct rdp_output {
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
 
+	/* Jobs queued by the last repaint, the frame finishes after them */
+	int encodes_pending;
+	/* A repaint awaits completion, and its refresh period is over */
+	bool repaint_awaiting;
+	bool frame_due;
+
 	struct wl_list peers;
 };
 
+enum rdp_encode_job_state {
+	RDP_ENCODE_JOB_IDLE = 0,
+	RDP_ENCODE_JOB_QUEUED,
+	RDP_ENCODE_JOB_RUNNING,
+	RDP_ENCODE_JOB_DONE,
+};
+
+struct rdp_encode_job {
+	freerdp_peer *peer;
+	/* NULL when not counted in encodes_pending */
+	struct rdp_output *output;
+	enum rdp_encode_job_state state;
+	struct wl_list link;
+
+	pixman_image_t *image;
+	pixman_region32_t damage;
+
+	SURFACE_BITS_COMMAND cmd;
+	bool has_cmd;
+
+	int tiles;
+	int tiles_skipped;
+	struct timespec queued;
+	struct timespec started;
+	struct timespec finished;
+};
+
 struct rdp_peer_context {
 	rdpContext _p;
 
@@ -169,6 +243,26 @@ struct rdp_peer_context {
 	RFX_RECT *rfx_rects;
 	NSC_CONTEXT *nsc_context;
 
+	struct rdp_encode_job job;
+
+	/* Damage not sent yet, while the peer is behind on frame acks */
+	pixman_region32_t pending_damage;
+	uint32_t frame_id;
+	uint32_t frame_acked;
+	/* Frames sent but not acked the peer may have, 0 for no limit */
+	uint32_t frame_window;
+	/* Only peers seen acking a frame are paced */
+	bool acks_frames;
+	/* When the oldest frame not acked was sent, roughly */
+	struct timespec ack_wait_start;
+	/* Acks timed out since the last one came, logged once */
+	bool ack_timed_out;
+
+	/* Hashes of the tiles the peer has, 0 for unknown */
+	uint64_t *tile_hashes;
+	int tiles_x;
+	int tiles_y;
+
 	struct rdp_peers_item item;
 };
 typedef struct rdp_peer_context RdpPeerContext;
@@ -192,14 +286,13 @@ to_rdp_backend(struct weston_compositor *base)
 }
 
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_encode_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer,
+		    SURFACE_BITS_COMMAND *cmd)
 {
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND cmd;
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
@@ -208,22 +301,21 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
+	memset(cmd, 0, sizeof(*cmd));
 #ifdef HAVE_SKIP_COMPRESSION
-	cmd.skipCompression = TRUE;
-#else
-	memset(&cmd, 0, sizeof(*cmd));
+	cmd->skipCompression = TRUE;
 #endif
 #ifdef HAVE_SURFCMD_CMDTYPE
-	cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
+	cmd->cmdType = CMDTYPE_STREAM_SURFACE_BITS;
 #endif
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
-	SURFACE_BPP(cmd) = 32;
-	SURFACE_CODECID(cmd) = peer->settings->RemoteFxCodecId;
-	SURFACE_WIDTH(cmd) = width;
-	SURFACE_HEIGHT(cmd) = height;
+	cmd->destLeft = damage->extents.x1;
+	cmd->destTop = damage->extents.y1;
+	cmd->destRight = damage->extents.x2;
+	cmd->destBottom = damage->extents.y2;
+	SURFACE_BPP((*cmd)) = 32;
+	SURFACE_CODECID((*cmd)) = peer->settings->RemoteFxCodecId;
+	SURFACE_WIDTH((*cmd)) = width;
+	SURFACE_HEIGHT((*cmd)) = height;
 
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
@@ -246,20 +338,17 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 			pixman_image_get_stride(image)
 	);
 
-	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(context->encode_stream);
-	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(context->encode_stream);
-
-	update->SurfaceBits(update->context, &cmd);
+	SURFACE_BITMAP_DATA_LEN((*cmd)) = Stream_GetPosition(context->encode_stream);
+	SURFACE_BITMAP_DATA((*cmd)) = Stream_Buffer(context->encode_stream);
 }
 
 
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_encode_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer,
+		    SURFACE_BITS_COMMAND *cmd)
 {
 	int width, height;
 	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND cmd;
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
@@ -268,22 +357,21 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd.skipCompression = TRUE;
-#else
 	memset(cmd, 0, sizeof(*cmd));
+#ifdef HAVE_SKIP_COMPRESSION
+	cmd->skipCompression = TRUE;
 #endif
 #ifdef HAVE_SURFCMD_CMDTYPE
-	cmd.cmdType = CMDTYPE_SET_SURFACE_BITS;
+	cmd->cmdType = CMDTYPE_SET_SURFACE_BITS;
 #endif
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
-	SURFACE_BPP(cmd) = 32;
-	SURFACE_CODECID(cmd) = peer->settings->NSCodecId;
-	SURFACE_WIDTH(cmd) = width;
-	SURFACE_HEIGHT(cmd) = height;
+	cmd->destLeft = damage->extents.x1;
+	cmd->destTop = damage->extents.y1;
+	cmd->destRight = damage->extents.x2;
+	cmd->destBottom = damage->extents.y2;
+	SURFACE_BPP((*cmd)) = 32;
+	SURFACE_CODECID((*cmd)) = peer->settings->NSCodecId;
+	SURFACE_WIDTH((*cmd)) = width;
+	SURFACE_HEIGHT((*cmd)) = height;
 
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
@@ -292,10 +380,503 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 			width, height,
 			pixman_image_get_stride(image));
 
-	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(context->encode_stream);
-	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(context->encode_stream);
+	SURFACE_BITMAP_DATA_LEN((*cmd)) = Stream_GetPosition(context->encode_stream);
+	SURFACE_BITMAP_DATA((*cmd)) = Stream_Buffer(context->encode_stream);
+}
+
+static uint64_t
+rdp_tile_hash(pixman_image_t *image, const pixman_box32_t *tile)
+{
+	int stride = pixman_image_get_stride(image) / sizeof(uint32_t);
+	const uint32_t *row = pixman_image_get_data(image) +
+			      tile->y1 * stride + tile->x1;
+	int width = tile->x2 - tile->x1;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	int x, y;
+
+	/* FNV-1a over whole pixels */
+	for (y = tile->y1; y < tile->y2; y++, row += stride) {
+		for (x = 0; x < width; x++)
+			hash = (hash ^ row[x]) * 0x100000001b3ull;
+	}
+
+	/* 0 stands for a tile the peer may not have */
+	return hash | 1;
+}
+
+static void
+rdp_peer_reset_tiles(RdpPeerContext *context, int width, int height)
+{
+	int tiles_x = (width + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	int tiles_y = (height + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+
+	if (context->tile_hashes &&
+	    context->tiles_x == tiles_x && context->tiles_y == tiles_y) {
+		memset(context->tile_hashes, 0,
+		       tiles_x * tiles_y * sizeof(uint64_t));
+		return;
+	}
+
+	free(context->tile_hashes);
+	context->tile_hashes = calloc(tiles_x * tiles_y, sizeof(uint64_t));
+	context->tiles_x = context->tile_hashes ? tiles_x : 0;
+	context->tiles_y = context->tile_hashes ? tiles_y : 0;
+}
+
+/* Collects the tiles touched by the damage whose content the peer does not
+ * have yet. Whole tiles are encoded, so that the RemoteFX tiles line up with
+ * the cache and a cached tile is always entirely on the peer. */
+static void
+rdp_peer_changed_tiles(RdpPeerContext *context, struct rdp_encode_job *job,
+		       pixman_region32_t *changed)
+{
+	int width = pixman_image_get_width(job->image);
+	int height = pixman_image_get_height(job->image);
+	bool cached = context->tiles_x == (width + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE &&
+		      context->tiles_y == (height + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	pixman_box32_t *extents, tile;
+	uint64_t hash, *slot;
+	int tx, ty;
+
+	pixman_region32_intersect_rect(&job->damage, &job->damage,
+				       0, 0, width, height);
+	extents = pixman_region32_extents(&job->damage);
+
+	for (ty = extents->y1 / RDP_TILE_SIZE;
+	     ty * RDP_TILE_SIZE < extents->y2; ty++) {
+		tile.y1 = ty * RDP_TILE_SIZE;
+		tile.y2 = MIN(tile.y1 + RDP_TILE_SIZE, height);
+
+		for (tx = extents->x1 / RDP_TILE_SIZE;
+		     tx * RDP_TILE_SIZE < extents->x2; tx++) {
+			tile.x1 = tx * RDP_TILE_SIZE;
+			tile.x2 = MIN(tile.x1 + RDP_TILE_SIZE, width);
+
+			if (pixman_region32_contains_rectangle(&job->damage, &tile) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			job->tiles++;
+			if (cached) {
+				hash = rdp_tile_hash(job->image, &tile);
+				slot = &context->tile_hashes[ty * context->tiles_x + tx];
+				if (*slot == hash) {
+					job->tiles_skipped++;
+					continue;
+				}
+				*slot = hash;
+			}
+
+			pixman_region32_union_rect(changed, changed,
+						   tile.x1, tile.y1,
+						   tile.x2 - tile.x1,
+						   tile.y2 - tile.y1);
+		}
+	}
+}
+
+static void
+rdp_encode_job_run(struct rdp_encode_job *job)
+{
+	freerdp_peer *peer = job->peer;
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	pixman_region32_t changed;
+
+	pixman_region32_init(&changed);
+	rdp_peer_changed_tiles(context, job, &changed);
+
+	job->has_cmd = pixman_region32_not_empty(&changed);
+	if (job->has_cmd) {
+		if (peer->settings->RemoteFxCodec)
+			rdp_peer_encode_rfx(&changed, job->image, peer, &job->cmd);
+		else
+			rdp_peer_encode_nsc(&changed, job->image, peer, &job->cmd);
+	}
+
+	pixman_region32_fini(&changed);
+}
+
+static void
+eventfd_signal(int fd)
+{
+	uint64_t one = 1;
+
+	while (write(fd, &one, sizeof one) < 0 && errno == EINTR)
+		continue;
+}
+
+static void *
+rdp_encoder_thread(void *data)
+{
+	struct rdp_encoder *encoder = data;
+	struct rdp_encode_job *job;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (true) {
+		while (!encoder->stopping && wl_list_empty(&encoder->job_list))
+			pthread_cond_wait(&encoder->job_cond, &encoder->mutex);
+		if (encoder->stopping)
+			break;
+
+		job = container_of(encoder->job_list.next,
+				   struct rdp_encode_job, link);
+		wl_list_remove(&job->link);
+		job->state = RDP_ENCODE_JOB_RUNNING;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &job->started);
+		rdp_encode_job_run(job);
+		clock_gettime(CLOCK_MONOTONIC, &job->finished);
+
+		pthread_mutex_lock(&encoder->mutex);
+		job->state = RDP_ENCODE_JOB_DONE;
+		wl_list_insert(encoder->done_list.prev, &job->link);
+		pthread_cond_broadcast(&encoder->done_cond);
+		eventfd_signal(encoder->done_fd);
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+static bool
+rdp_peer_window_full(RdpPeerContext *context)
+{
+	return context->acks_frames && context->frame_window > 0 &&
+	       context->frame_id - context->frame_acked >= context->frame_window;
+}
+
+static bool
+rdp_peer_can_send(RdpPeerContext *context)
+{
+	if (context->job.state != RDP_ENCODE_JOB_IDLE)
+		return false;
+
+	return !rdp_peer_window_full(context);
+}
+
+static void
+rdp_peer_frame_marker(freerdp_peer *peer, uint32_t action)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	SURFACE_FRAME_MARKER marker;
+
+	if (action == SURFACECMD_FRAMEACTION_BEGIN) {
+		context->frame_id++;
+		if (context->frame_id - context->frame_acked == 1)
+			clock_gettime(CLOCK_MONOTONIC, &context->ack_wait_start);
+	}
+
+	marker.frameAction = action;
+	marker.frameId = context->frame_id;
+	peer->update->SurfaceFrameMarker(peer->context, &marker);
+}
+
+/* Whether no peer could take a frame now. The output stops repainting
+ * until one of them acks, damage would only pile up. */
+static bool
+rdp_output_peers_saturated(struct rdp_output *output)
+{
+	struct rdp_peers_item *item;
+	RdpPeerContext *context;
+	bool saturated = false;
+
+	wl_list_for_each(item, &output->peers, link) {
+		if (!(item->flags & RDP_PEER_ACTIVATED) ||
+		    !(item->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		context = container_of(item, RdpPeerContext, item);
+		if (!rdp_peer_window_full(context))
+			return false;
 
-	update->SurfaceBits(update->context, &cmd);
+		saturated = true;
+	}
+
+	return saturated;
+}
+
+static void
+rdp_peer_flush_damage(RdpPeerContext *context, struct rdp_output *output);
+
+/* A lost ack, or a client that stopped acking, must not stall the output
+ * for good: such a peer counts as having acked everything */
+static void
+rdp_output_expire_acks(struct rdp_output *output)
+{
+	struct rdp_peers_item *item;
+	RdpPeerContext *context;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	wl_list_for_each(item, &output->peers, link) {
+		if (!(item->flags & RDP_PEER_ACTIVATED) ||
+		    !(item->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		context = container_of(item, RdpPeerContext, item);
+		if (!rdp_peer_window_full(context) ||
+		    timespec_sub_to_msec(&now, &context->ack_wait_start) <
+		    RDP_FRAME_ACK_TIMEOUT_MS)
+			continue;
+
+		if (!context->ack_timed_out)
+			weston_log("RDP peer did not ack %u frames in %d ms, "
+				   "not waiting for them\n",
+				   context->frame_id - context->frame_acked,
+				   RDP_FRAME_ACK_TIMEOUT_MS);
+		context->ack_timed_out = true;
+		context->frame_acked = context->frame_id;
+		rdp_peer_flush_damage(context, output);
+	}
+}
+
+static void
+rdp_output_try_finish_frame(struct rdp_output *output)
+{
+	struct timespec ts;
+
+	if (!output->frame_due)
+		return;
+
+	rdp_output_expire_acks(output);
+
+	/* What that sent may even have finished the frame already */
+	if (!output->frame_due || output->encodes_pending > 0)
+		return;
+
+	/* Check again later, for acks that do not come */
+	if (rdp_output_peers_saturated(output)) {
+		wl_event_source_timer_update(output->finish_frame_timer,
+					     RDP_FRAME_ACK_TIMEOUT_MS);
+		return;
+	}
+
+	output->frame_due = false;
+	output->repaint_awaiting = false;
+	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	weston_output_finish_frame(&output->base, &ts, 0);
+}
+
+/* Sends the update of a finished job, or drops it along with what the cache
+ * learnt from it. */
+static void
+rdp_encode_job_complete(struct rdp_encode_job *job, bool send)
+{
+	freerdp_peer *peer = job->peer;
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct weston_log_scope *log = context->rdpBackend->encoder.log;
+	rdpSettings *settings = peer->settings;
+	struct rdp_output *output = job->output;
+
+	job->state = RDP_ENCODE_JOB_IDLE;
+	job->output = NULL;
+	pixman_region32_fini(&job->damage);
+
+	if (!send) {
+		if (context->tile_hashes)
+			memset(context->tile_hashes, 0, context->tiles_x *
+			       context->tiles_y * sizeof(uint64_t));
+	} else {
+		if (job->has_cmd) {
+			rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_BEGIN);
+			peer->update->SurfaceBits(peer->update->context, &job->cmd);
+			rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_END);
+		}
+
+		if (weston_log_scope_is_enabled(log))
+			weston_log_scope_printf(log,
+				"%s: %d of %d tiles unchanged (%d%%), "
+				"encode %.3f ms, latency %.3f ms, "
+				"%u frames unacked\n",
+				settings->ClientHostname ?
+					settings->ClientHostname :
+					settings->ClientAddress,
+				job->tiles_skipped, job->tiles,
+				job->tiles ? job->tiles_skipped * 100 / job->tiles : 0,
+				timespec_sub_to_nsec(&job->finished,
+						     &job->started) / 1e6,
+				timespec_sub_to_nsec(&job->finished,
+						     &job->queued) / 1e6,
+				context->frame_id - context->frame_acked);
+	}
+
+	if (output) {
+		output->encodes_pending--;
+		rdp_output_try_finish_frame(output);
+	}
+}
+
+static int
+rdp_encoder_done_handler(int fd, uint32_t mask, void *data)
+{
+	struct rdp_encoder *encoder = data;
+	struct rdp_encode_job *job, *next;
+	struct wl_list done_list;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0)
+		return 0;
+
+	wl_list_init(&done_list);
+	pthread_mutex_lock(&encoder->mutex);
+	wl_list_insert_list(&done_list, &encoder->done_list);
+	wl_list_init(&encoder->done_list);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	wl_list_for_each_safe(job, next, &done_list, link)
+		rdp_encode_job_complete(job, true);
+
+	return 0;
+}
+
+/* Encodes the damage for a codec peer, on a worker thread when there is one */
+static void
+rdp_peer_queue_encode(pixman_region32_t *damage, freerdp_peer *peer,
+		      struct rdp_output *output, bool counted)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_encoder *encoder = &context->rdpBackend->encoder;
+	struct rdp_encode_job *job = &context->job;
+
+	assert(job->state == RDP_ENCODE_JOB_IDLE);
+
+	job->peer = peer;
+	job->output = counted ? output : NULL;
+	job->image = output->shadow_surface;
+	job->tiles = 0;
+	job->tiles_skipped = 0;
+	pixman_region32_init(&job->damage);
+	pixman_region32_copy(&job->damage, damage);
+	clock_gettime(CLOCK_MONOTONIC, &job->queued);
+
+	if (counted)
+		output->encodes_pending++;
+
+	if (encoder->num_threads == 0 || !counted) {
+		job->started = job->queued;
+		rdp_encode_job_run(job);
+		clock_gettime(CLOCK_MONOTONIC, &job->finished);
+		rdp_encode_job_complete(job, true);
+		return;
+	}
+
+	pthread_mutex_lock(&encoder->mutex);
+	job->state = RDP_ENCODE_JOB_QUEUED;
+	wl_list_insert(encoder->job_list.prev, &job->link);
+	pthread_cond_signal(&encoder->job_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static void
+rdp_peer_wait_encode(RdpPeerContext *context, bool send)
+{
+	struct rdp_encoder *encoder = &context->rdpBackend->encoder;
+	struct rdp_encode_job *job = &context->job;
+
+	if (job->state == RDP_ENCODE_JOB_IDLE)
+		return;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (job->state != RDP_ENCODE_JOB_DONE)
+		pthread_cond_wait(&encoder->done_cond, &encoder->mutex);
+	wl_list_remove(&job->link);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	rdp_encode_job_complete(job, send);
+}
+
+/* Before the shadow surface changes under the jobs */
+static void
+rdp_output_wait_encodes(struct rdp_output *output, bool send)
+{
+	struct rdp_peers_item *item;
+
+	wl_list_for_each(item, &output->peers, link)
+		rdp_peer_wait_encode(container_of(item, RdpPeerContext, item),
+				     send);
+}
+
+static void
+rdp_encoder_stop(struct rdp_encoder *encoder)
+{
+	int i;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->stopping = true;
+	pthread_cond_broadcast(&encoder->job_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->num_threads; i++)
+		pthread_join(encoder->threads[i], NULL);
+	encoder->num_threads = 0;
+}
+
+/* Without worker threads the updates are encoded on the compositor thread */
+static void
+rdp_encoder_init(struct rdp_encoder *encoder, struct weston_compositor *compositor)
+{
+	struct wl_event_loop *loop;
+	long num_threads;
+
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->job_cond, NULL);
+	pthread_cond_init(&encoder->done_cond, NULL);
+	wl_list_init(&encoder->job_list);
+	wl_list_init(&encoder->done_list);
+
+	encoder->log = weston_compositor_add_log_scope(compositor, "rdp-encode",
+						       "RDP peer updates: encoding time "
+						       "and unchanged tiles skipped\n",
+						       NULL, NULL, NULL);
+
+	encoder->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (encoder->done_fd < 0)
+		goto err;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	encoder->done_source = wl_event_loop_add_fd(loop, encoder->done_fd,
+						    WL_EVENT_READABLE,
+						    rdp_encoder_done_handler,
+						    encoder);
+	if (!encoder->done_source)
+		goto err_fd;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	num_threads = MAX(1, MIN(num_threads, RDP_ENCODER_MAX_THREADS));
+	while (encoder->num_threads < num_threads) {
+		if (pthread_create(&encoder->threads[encoder->num_threads], NULL,
+				   rdp_encoder_thread, encoder) != 0)
+			break;
+		encoder->num_threads++;
+	}
+
+	weston_log("RDP: encoding peer updates on %d threads\n",
+		   encoder->num_threads);
+	return;
+
+err_fd:
+	close(encoder->done_fd);
+	encoder->done_fd = -1;
+err:
+	weston_log("RDP: failed to set up encoder threads\n");
+}
+
+static void
+rdp_encoder_fini(struct rdp_encoder *encoder)
+{
+	rdp_encoder_stop(encoder);
+
+	if (encoder->done_source)
+		wl_event_source_remove(encoder->done_source);
+	if (encoder->done_fd >= 0)
+		close(encoder->done_fd);
+
+	weston_log_scope_destroy(encoder->log);
+	pthread_cond_destroy(&encoder->done_cond);
+	pthread_cond_destroy(&encoder->job_cond);
+	pthread_mutex_destroy(&encoder->mutex);
 }
 
 static void
@@ -317,7 +898,6 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 {
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND cmd;
-	SURFACE_FRAME_MARKER marker;
 	pixman_box32_t *rect, subrect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
@@ -326,9 +906,7 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	if (!nrects)
 		return;
 
-	marker.frameId++;
-	marker.frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, &marker);
+	rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_BEGIN);
 
 	memset(&cmd, 0, sizeof(cmd));
 #ifdef HAVE_SURFCMD_CMDTYPE
@@ -371,8 +949,28 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 
 	free(SURFACE_BITMAP_DATA(cmd));
 
-	marker.frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, &marker);
+	rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_END);
+}
+
+/* Sends the damage piled up for a peer, if it is not too many frames ahead
+ * of its acks */
+static void
+rdp_peer_flush_damage(RdpPeerContext *context, struct rdp_output *output)
+{
+	freerdp_peer *peer = context->item.peer;
+	rdpSettings *settings = peer->settings;
+
+	if (!pixman_region32_not_empty(&context->pending_damage) ||
+	    !rdp_peer_can_send(context))
+		return;
+
+	if (settings->RemoteFxCodec || settings->NSCodec)
+		rdp_peer_queue_encode(&context->pending_damage, peer, output, true);
+	else
+		rdp_peer_refresh_raw(&context->pending_damage,
+				     output->shadow_surface, peer);
+
+	pixman_region32_clear(&context->pending_damage);
 }
 
 static void
@@ -382,12 +980,17 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 	struct rdp_output *output = context->rdpBackend->output;
 	rdpSettings *settings = peer->settings;
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-	else
+	pixman_region32_subtract(&context->pending_damage,
+				 &context->pending_damage, region);
+
+	if (settings->RemoteFxCodec || settings->NSCodec) {
+		/* A refresh resends everything, cached or not */
+		rdp_peer_wait_encode(context, true);
+		rdp_peer_reset_tiles(context, output->base.width, output->base.height);
+		rdp_peer_queue_encode(region, peer, output, false);
+	} else {
 		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+	}
 }
 
 static int
@@ -408,23 +1011,32 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
 	struct rdp_peers_item *outputPeer;
+	RdpPeerContext *peerCtx;
+
+	/* Updates sent on a frame ack may still be reading the surface */
+	rdp_output_wait_encodes(output, true);
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
 	if (pixman_region32_not_empty(damage)) {
 		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
+			peerCtx = (RdpPeerContext *)outputPeer->peer->context;
+
+			if (!(outputPeer->flags & RDP_PEER_ACTIVATED) ||
+			    !(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
+				continue;
+
+			pixman_region32_union(&peerCtx->pending_damage,
+					      &peerCtx->pending_damage, damage);
+			rdp_peer_flush_damage(peerCtx, output);
 		}
 	}
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
+	output->repaint_awaiting = true;
 	wl_event_source_timer_update(output->finish_frame_timer, 16);
 	return 0;
 }
@@ -433,10 +1045,15 @@ static int
 finish_frame_handler(void *data)
 {
 	struct rdp_output *output = data;
-	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	/* The timer armed to recheck acks may outlive the frame it was for */
+	if (!output->repaint_awaiting)
+		return 1;
+
+	/* Held back while the surface is being encoded, since the next
+	 * repaint would draw over it, and while no peer can take a frame */
+	output->frame_due = true;
+	rdp_output_try_finish_frame(output);
 
 	return 1;
 }
@@ -492,6 +1109,8 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	output->current_mode = local_mode;
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
+	rdp_output_wait_encodes(rdpOutput, false);
+
 	pixman_renderer_output_destroy(output);
 	pixman_renderer_output_create(output, &options);
 
@@ -605,6 +1224,8 @@ rdp_output_disable(struct weston_output *base)
 	if (!output->base.enabled)
 		return 0;
 
+	rdp_output_wait_encodes(output, false);
+
 	pixman_image_unref(output->shadow_surface);
 	pixman_renderer_output_destroy(&output->base);
 
@@ -690,6 +1311,7 @@ rdp_destroy(struct weston_compositor *ec)
 			wl_event_source_remove(b->listener_events[i]);
 
 	weston_compositor_shutdown(ec);
+	rdp_encoder_fini(&b->encoder);
 
 	wl_list_for_each_safe(base, next, &ec->head_list, compositor_link)
 		rdp_head_destroy(to_rdp_head(base));
@@ -775,6 +1397,8 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	if (!context->encode_stream)
 		goto out_error_stream;
 
+	pixman_region32_init(&context->pending_damage);
+
 	FREERDP_CB_RETURN(TRUE);
 
 out_error_nsc:
@@ -791,7 +1415,13 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 	if (!context)
 		return;
 
+	rdp_peer_wait_encode(context, false);
+
 	wl_list_remove(&context->item.link);
+	/* The output may have been waiting for this peer's acks */
+	if (context->rdpBackend->output)
+		rdp_output_try_finish_frame(context->rdpBackend->output);
+
 	for (i = 0; i < MAX_FREERDP_FDS; i++) {
 		if (context->events[i])
 			wl_event_source_remove(context->events[i]);
@@ -808,6 +1438,8 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
 	free(context->rfx_rects);
+	free(context->tile_hashes);
+	pixman_region32_fini(&context->pending_damage);
 }
 
 
@@ -1034,6 +1666,23 @@ xf_peer_activate(freerdp_peer* client)
 	}
 
 	weston_output = &output->base;
+	rdp_peer_wait_encode(peerCtx, false);
+	rdp_peer_reset_tiles(peerCtx, weston_output->width, weston_output->height);
+
+	/* FrameAcknowledge is the most frames the peer takes unacked, 0 if
+	 * it does not ack frames at all. FreeRDP has it non-zero by default
+	 * even for clients that never ack, so pacing only starts with the
+	 * first ack. */
+	peerCtx->frame_window = 0;
+	if (b->max_unacked_frames > 0 && settings->FrameAcknowledge > 0)
+		peerCtx->frame_window = MIN((UINT32)b->max_unacked_frames,
+					    settings->FrameAcknowledge);
+	peerCtx->frame_acked = peerCtx->frame_id;
+	peerCtx->acks_frames = false;
+	peerCtx->ack_timed_out = false;
+	weston_log("RDP peer takes %u unacked frames at most%s\n",
+		   peerCtx->frame_window,
+		   peerCtx->frame_window ? ", once it acks one" : " (no limit)");
 	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
 	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
 
@@ -1266,11 +1915,51 @@ static FREERDP_CB_RET_TYPE
 xf_suppress_output(rdpContext *context, BYTE allow, const RECTANGLE_16 *area)
 {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
-
-	if (allow)
+	struct rdp_output *output = peerContext->rdpBackend->output;
+
+	if (allow) {
+		if (!(peerContext->item.flags & RDP_PEER_OUTPUT_ENABLED) && output) {
+			/* All the damage in between was missed */
+			pixman_region32_fini(&peerContext->pending_damage);
+			pixman_region32_init_rect(&peerContext->pending_damage, 0, 0,
+						  output->base.width,
+						  output->base.height);
+		}
 		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
-	else
+		if (output && (peerContext->item.flags & RDP_PEER_ACTIVATED))
+			rdp_peer_flush_damage(peerContext, output);
+	} else {
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
+		pixman_region32_clear(&peerContext->pending_damage);
+	}
+
+	if (output)
+		rdp_output_try_finish_frame(output);
+
+	FREERDP_CB_RETURN(TRUE);
+}
+
+static FREERDP_CB_RET_TYPE
+xf_surface_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	struct rdp_output *output = peerContext->rdpBackend->output;
+
+	/* Only acks of frames sent and not acked yet move the window */
+	if (frameId - peerContext->frame_acked >
+	    peerContext->frame_id - peerContext->frame_acked)
+		FREERDP_CB_RETURN(TRUE);
+
+	peerContext->frame_acked = frameId;
+	peerContext->acks_frames = true;
+	peerContext->ack_timed_out = false;
+	clock_gettime(CLOCK_MONOTONIC, &peerContext->ack_wait_start);
+
+	if (output && (peerContext->item.flags & RDP_PEER_ACTIVATED) &&
+	    (peerContext->item.flags & RDP_PEER_OUTPUT_ENABLED)) {
+		rdp_peer_flush_damage(peerContext, output);
+		rdp_output_try_finish_frame(output);
+	}
 
 	FREERDP_CB_RETURN(TRUE);
 }
@@ -1325,6 +2014,8 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = (pSuppressOutput)xf_suppress_output;
+	client->update->SurfaceFrameAcknowledge =
+		(pSurfaceFrameAcknowledge)xf_surface_frame_acknowledge;
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -1392,9 +2083,12 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	b->no_clients_resize = config->no_clients_resize;
 	b->force_no_compression = config->force_no_compression;
+	b->max_unacked_frames = config->max_unacked_frames;
 
 	compositor->backend = &b->base;
 
+	rdp_encoder_init(&b->encoder, compositor);
+
 	/* activate TLS only if certificate/key are available */
 	if (config->server_cert && config->server_key) {
 		weston_log("TLS support activated\n");
@@ -1458,6 +2152,7 @@ err_output:
 err_compositor:
 	weston_compositor_shutdown(compositor);
 err_free_strings:
+	rdp_encoder_fini(&b->encoder);
 	free(b->rdp_key);
 	free(b->server_cert);
 	free(b->server_key);
@@ -1476,6 +2171,7 @@ config_init_to_defaults(struct weston_rdp_backend_config *config)
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
 	config->force_no_compression = 0;
+	config->max_unacked_frames = 2;
 }
 
 WL_EXPORT int
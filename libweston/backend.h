@@ -107,6 +107,16 @@ struct weston_backend {
 	 */
 	bool (*can_scanout_dmabuf)(struct weston_compositor *compositor,
 				   struct linux_dmabuf_buffer *buffer);
+
+	/** Whether output repaints may be painted late
+	 *
+	 * Set by backends that do not read what the renderer painted into
+	 * an output before repaint_flush. The renderer may then paint all
+	 * the outputs of a repaint sequence at once, after their
+	 * weston_output::repaint returned; see
+	 * weston_compositor::parallel_repaint.
+	 */
+	bool deferred_paint;
 };
 
 /* weston_head */
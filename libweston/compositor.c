@@ -63,6 +63,7 @@
 #include "xdg-output-unstable-v1-server-protocol.h"
 #include "linux-explicit-synchronization-unstable-v1-server-protocol.h"
 #include "linux-explicit-synchronization.h"
+#include "linux-sync-file.h"
 #include "shared/fd-util.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
@@ -72,6 +73,7 @@
 #include <libweston/version.h>
 #include <libweston/plugin-registry.h>
 #include "pixel-formats.h"
+#include "pick-index.h"
 #include "backend.h"
 #include "libweston-internal.h"
 
@@ -85,6 +87,14 @@
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
 
+/* Repaints an output does before its costs size the repaint window */
+#define REPAINT_COST_MIN_SAMPLES 8
+/* The repaint cost used is the one this percentage of repaints stay under */
+#define REPAINT_COST_PERCENTILE 95
+/* Added to the repaint cost, for timer wake-up latency and the time the
+ * backend needs to get a finished frame to the display */
+#define REPAINT_WINDOW_MARGIN_NSEC 1500000
+
 static void
 weston_output_update_matrix(struct weston_output *output);
 
@@ -95,6 +105,14 @@ weston_output_transform_scale_init(struct weston_output *output,
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor);
 
+/* Layers, sub-surface order or mappedness changed */
+static inline void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_generation++;
+	compositor->pick_generation++;
+}
+
 static char *
 weston_output_create_heads_string(struct weston_output *output);
 
@@ -572,6 +590,8 @@ weston_surface_create(struct weston_compositor *compositor)
 	surface->current_protection = WESTON_HDCP_DISABLE;
 	surface->protection_mode = WESTON_SURFACE_PROTECTION_MODE_RELAXED;
 
+	surface->occluded_frame_throttle = true;
+
 	return surface;
 }
 
@@ -1574,6 +1594,9 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_assign_output(view);
 
+	/* The bounding box moved */
+	view->surface->compositor->pick_generation++;
+
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
@@ -2065,6 +2088,67 @@ weston_compositor_get_time(struct timespec *time)
 	clock_gettime(CLOCK_REALTIME, time);
 }
 
+struct pick_view_data {
+	wl_fixed_t x, y;
+	wl_fixed_t view_x, view_y;
+};
+
+static bool
+pick_view_accept(void *data, void *user_data)
+{
+	struct weston_view *view = data;
+	struct pick_view_data *pick = user_data;
+	int view_ix, view_iy;
+
+	/* The index only knows the extents */
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    wl_fixed_to_int(pick->x),
+					    wl_fixed_to_int(pick->y), NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, pick->x, pick->y,
+				      &pick->view_x, &pick->view_y);
+	view_ix = wl_fixed_to_int(pick->view_x);
+	view_iy = wl_fixed_to_int(pick->view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	return true;
+}
+
+/* Index the views in stacking order, top first like view_list */
+static bool
+weston_compositor_update_pick_index(struct weston_compositor *compositor)
+{
+	struct weston_pick_index *index = compositor->pick_index;
+	struct weston_view *view;
+
+	if (compositor->pick_index_generation == compositor->pick_generation)
+		return true;
+
+	weston_pick_index_clear(index);
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (!weston_pick_index_add(index,
+					   pixman_region32_extents(&view->transform.boundingbox),
+					   view))
+			return false;
+	}
+
+	if (!weston_pick_index_build(index))
+		return false;
+
+	compositor->pick_index_generation = compositor->pick_generation;
+
+	return true;
+}
+
 /** weston_compositor_pick_view
  * \ingroup compositor
  */
@@ -2073,32 +2157,28 @@ weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
+	struct pick_view_data pick = { .x = x, .y = y };
 	struct weston_view *view;
-	wl_fixed_t view_x, view_y;
-	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
-
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
-
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
-
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (weston_compositor_update_pick_index(compositor)) {
+		view = weston_pick_index_find(compositor->pick_index,
+					      wl_fixed_to_int(x),
+					      wl_fixed_to_int(y),
+					      pick_view_accept, &pick);
+	} else {
+		/* Out of memory, fall back to testing every view */
+		view = NULL;
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (pick_view_accept(view, &pick))
+				break;
+		}
+		if (&view->link == &compositor->view_list)
+			view = NULL;
+	}
 
-		*vx = view_x;
-		*vy = view_y;
+	if (view) {
+		*vx = pick.view_x;
+		*vy = pick.view_y;
 		return view;
 	}
 
@@ -2134,6 +2214,7 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	weston_compositor_view_list_dirty(view->surface->compositor);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -2164,6 +2245,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
+	weston_compositor_view_list_dirty(surface->compositor);
 }
 
 static void
@@ -2492,6 +2574,38 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+/* Whether opaque content above covers all of the view; needs the clips
+ * from output_accumulate_damage() */
+static bool
+weston_view_is_occluded(struct weston_view *view)
+{
+	pixman_region32_t visible;
+	bool occluded;
+
+	pixman_region32_init(&visible);
+	pixman_region32_subtract(&visible, &view->transform.boundingbox,
+				 &view->clip);
+	pixman_region32_subtract(&visible, &visible, &view->plane->clip);
+	occluded = !pixman_region32_not_empty(&visible);
+	pixman_region32_fini(&visible);
+
+	return occluded;
+}
+
+static void
+compositor_update_occlusion(struct weston_compositor *ec)
+{
+	struct weston_view *ev;
+
+	wl_list_for_each(ev, &ec->view_list, link)
+		ev->surface->occluded = true;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (ev->surface->occluded && !weston_view_is_occluded(ev))
+			ev->surface->occluded = false;
+	}
+}
+
 static void
 output_accumulate_damage(struct weston_output *output)
 {
@@ -2520,6 +2634,9 @@ output_accumulate_damage(struct weston_output *output)
 
 	pixman_region32_fini(&clip);
 
+	if (ec->occluded_frame_msec > 0)
+		compositor_update_occlusion(ec);
+
 	wl_list_for_each(ev, &ec->view_list, link)
 		ev->surface->touched = false;
 
@@ -2681,6 +2798,31 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Freeing the unused views dirtied the list again */
+	compositor->view_list_built_generation =
+		compositor->view_list_generation;
+	compositor->view_list_rebuilds++;
+	compositor->pick_generation++;
+}
+
+/* Rebuild the view list if the scene graph changed since it was last built,
+ * otherwise only bring the view transforms up to date. */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	if (compositor->view_list_built_generation !=
+	    compositor->view_list_generation) {
+		weston_compositor_build_view_list(compositor);
+		return;
+	}
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		weston_view_update_transform(view);
+
+	compositor->view_list_rebuilds_skipped++;
 }
 
 static void
@@ -2708,12 +2850,114 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+static int
+occluded_frame_timer_handler(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_view *ev;
+
+	compositor->occluded_frame_deadline = (struct timespec) { 0 };
+
+	/* The held back frame callbacks go out with the next repaint */
+	wl_list_for_each(ev, &compositor->view_list, link) {
+		if (ev->surface->occluded && ev->surface->output &&
+		    !wl_list_empty(&ev->surface->frame_callback_list))
+			weston_output_schedule_repaint(ev->surface->output);
+	}
+
+	return 0;
+}
+
+static void
+occluded_frame_timer_arm(struct weston_compositor *compositor,
+			 const struct timespec *deadline,
+			 const struct timespec *now)
+{
+	int64_t msec;
+
+	if (!timespec_is_zero(&compositor->occluded_frame_deadline) &&
+	    timespec_sub_to_nsec(&compositor->occluded_frame_deadline,
+				 deadline) <= 0)
+		return;
+
+	/* Round up, firing early would only arm the timer again */
+	msec = (timespec_sub_to_nsec(deadline, now) + 999999) / 1000000;
+	compositor->occluded_frame_deadline = *deadline;
+	wl_event_source_timer_update(compositor->occluded_frame_timer,
+				     MAX(msec, 1));
+}
+
+/** Whether to hold back the frame callbacks of a surface in this repaint
+ *
+ * Frame callbacks of surfaces with nothing visible go out once per
+ * weston_compositor::occluded_frame_msec only, so that the hidden clients
+ * do not keep drawing at the output rate. A timer schedules the repaint
+ * that sends them, as hidden surfaces do not cause repaints themselves.
+ */
+static bool
+weston_surface_frame_is_throttled(struct weston_surface *surface)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct timespec now, deadline;
+
+	if (ec->occluded_frame_msec <= 0 ||
+	    !surface->occluded_frame_throttle || !surface->occluded ||
+	    wl_list_empty(&surface->frame_callback_list))
+		return false;
+
+	weston_compositor_read_presentation_clock(ec, &now);
+	timespec_add_msec(&deadline, &surface->occluded_frame_time,
+			  ec->occluded_frame_msec);
+	if (timespec_sub_to_nsec(&now, &deadline) >= 0) {
+		surface->occluded_frame_time = now;
+		return false;
+	}
+
+	occluded_frame_timer_arm(ec, &deadline, &now);
+
+	return true;
+}
+
+/** Whether the renderer paints outputs after their repaint returned
+ *
+ * With weston_compositor::parallel_repaint, and a renderer and backend
+ * that can, weston_output::repaint only prepares the paint. The renderer
+ * paints all the outputs repainted together in
+ * weston_renderer::repaint_finish, on several threads, and the scene graph
+ * must not change in between.
+ *
+ * \ingroup compositor
+ * \internal
+ */
+WL_EXPORT bool
+weston_compositor_repaint_is_deferred(struct weston_compositor *compositor)
+{
+	return compositor->parallel_repaint &&
+	       compositor->backend->deferred_paint &&
+	       compositor->renderer->repaint_finish;
+}
+
+static void
+weston_output_repaint_posted(struct weston_output *output)
+{
+	struct weston_animation *animation, *next;
+
+	clock_gettime(CLOCK_MONOTONIC, &output->repaint_window.cpu_end);
+
+	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
+		animation->frame_counter++;
+		animation->frame(animation, output, &output->frame_time);
+	}
+
+	TL_POINT(output->compositor, "core_repaint_posted",
+		 TLP_OUTPUT(output), TLP_END);
+}
+
 static int
 weston_output_repaint(struct weston_output *output, void *repaint_data)
 {
 	struct weston_compositor *ec = output->compositor;
 	struct weston_view *ev;
-	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
@@ -2725,9 +2969,11 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		return 0;
 
 	TL_POINT(ec, "core_repaint_begin", TLP_OUTPUT(output), TLP_END);
+	clock_gettime(CLOCK_MONOTONIC, &output->repaint_window.begin);
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	/* Rebuild the surface list if needed and update surface transforms
+	 * up front. */
+	weston_compositor_update_view_list(ec);
 
 	/* Find the highest protection desired for an output */
 	wl_list_for_each(ev, &ec->view_list, link) {
@@ -2755,21 +3001,29 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		}
 	}
 
+	output_accumulate_damage(output);
+
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
 		/* Note: This operation is safe to do multiple times on the
 		 * same surface.
 		 */
-		if (ev->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &ev->surface->frame_callback_list);
-			wl_list_init(&ev->surface->frame_callback_list);
+		if (ev->surface->output != output)
+			continue;
 
-			weston_output_take_feedback_list(output, ev->surface);
+		/* What the surface shows now will not be seen */
+		if (weston_surface_frame_is_throttled(ev->surface)) {
+			weston_presentation_feedback_discard_list(
+				&ev->surface->feedback_list);
+			continue;
 		}
-	}
 
-	output_accumulate_damage(output);
+		wl_list_insert_list(&frame_callback_list,
+				    &ev->surface->frame_callback_list);
+		wl_list_init(&ev->surface->frame_callback_list);
+
+		weston_output_take_feedback_list(output, ev->surface);
+	}
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -2797,12 +3051,10 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		wl_resource_destroy(cb->resource);
 	}
 
-	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
-		animation->frame_counter++;
-		animation->frame(animation, output, &output->frame_time);
-	}
-
-	TL_POINT(ec, "core_repaint_posted", TLP_OUTPUT(output), TLP_END);
+	/* Animations change the scene graph, which must hold still until
+	 * the renderer has painted all the outputs */
+	if (!weston_compositor_repaint_is_deferred(ec))
+		weston_output_repaint_posted(output);
 
 	return r;
 }
@@ -2842,6 +3094,14 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 	if (!output->repaint_needed)
 		goto err;
 
+	/* Only a repaint started on time can tell whether the window was
+	 * long enough. */
+	if (timespec_sub_to_nsec(now, &output->next_repaint) <
+	    REPAINT_WINDOW_MARGIN_NSEC)
+		timespec_add_nsec(&output->repaint_window.target,
+				  &output->next_repaint,
+				  output->repaint_window.window_nsec);
+
 	/* If repaint fails, we aren't going to get weston_output_finish_frame
 	 * to trigger a new repaint, so drop it from repaint and hope
 	 * something schedules a successful repaint later. As repainting may
@@ -2849,8 +3109,11 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 	 * output. */
 	ret = weston_output_repaint(output, repaint_data);
 	weston_compositor_read_presentation_clock(compositor, now);
-	if (ret != 0)
+	if (ret != 0) {
+		output->repaint_window.begin = (struct timespec) { 0 };
+		output->repaint_window.target = (struct timespec) { 0 };
 		goto err;
+	}
 
 	output->repainted = true;
 	return ret;
@@ -2919,6 +3182,15 @@ output_repaint_timer_handler(void *data)
 			break;
 	}
 
+	if (compositor->renderer->repaint_finish)
+		compositor->renderer->repaint_finish(compositor);
+
+	if (weston_compositor_repaint_is_deferred(compositor)) {
+		wl_list_for_each(output, &compositor->output_list, link)
+			if (output->repainted)
+				weston_output_repaint_posted(output);
+	}
+
 	if (ret == 0) {
 		if (compositor->backend->repaint_flush)
 			ret = compositor->backend->repaint_flush(compositor,
@@ -2977,6 +3249,151 @@ convert_presentation_time_now(struct weston_compositor *compositor,
 	return target_stamp;
 }
 
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/** The repaint cost REPAINT_COST_PERCENTILE percent of recent repaints
+ * stayed under */
+static int64_t
+weston_output_repaint_cost_nsec(struct weston_output *output)
+{
+	uint32_t sorted[WESTON_REPAINT_COST_SAMPLES];
+	unsigned int n = output->repaint_window.num_costs;
+
+	if (n == 0)
+		return 0;
+
+	memcpy(sorted, output->repaint_window.cost_usec, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_uint32);
+
+	return (int64_t) sorted[(n * REPAINT_COST_PERCENTILE + 99) / 100 - 1] *
+	       1000;
+}
+
+/** Account the repaint that was just presented
+ *
+ * The cost of a repaint runs from weston_output_repaint() until both the
+ * CPU and the renderer, if it set a fence, were done with it.
+ */
+static void
+weston_output_update_repaint_cost(struct weston_output *output,
+				  const struct timespec *stamp,
+				  int32_t refresh_nsec)
+{
+	struct timespec end = output->repaint_window.cpu_end;
+	struct timespec render_end;
+	int fd = output->repaint_window.render_fence_fd;
+	unsigned int next = output->repaint_window.next_cost;
+	int64_t cost, late;
+
+	if (fd >= 0) {
+		/* The timestamp is zero if the fence did not signal yet */
+		if (weston_linux_sync_file_read_timestamp(fd,
+							  &render_end) == 0 &&
+		    timespec_sub_to_nsec(&render_end, &end) > 0)
+			end = render_end;
+		close(fd);
+		output->repaint_window.render_fence_fd = -1;
+	}
+
+	if (!timespec_is_zero(&output->repaint_window.begin)) {
+		cost = timespec_sub_to_nsec(&end, &output->repaint_window.begin);
+		output->repaint_window.cost_usec[next] =
+			MIN(MAX(cost, 0) / 1000, UINT32_MAX);
+		output->repaint_window.next_cost =
+			(next + 1) % WESTON_REPAINT_COST_SAMPLES;
+		if (output->repaint_window.num_costs <
+		    WESTON_REPAINT_COST_SAMPLES)
+			output->repaint_window.num_costs++;
+		output->repaint_window.begin = (struct timespec) { 0 };
+	}
+
+	if (stamp && !timespec_is_zero(&output->repaint_window.target)) {
+		late = timespec_sub_to_nsec(stamp,
+					    &output->repaint_window.target);
+		if (late > refresh_nsec / 2) {
+			output->repaint_window.missed++;
+			output->repaint_window.penalty_nsec =
+				MIN(output->repaint_window.penalty_nsec +
+				    REPAINT_WINDOW_MARGIN_NSEC, refresh_nsec);
+		} else {
+			output->repaint_window.penalty_nsec -=
+				output->repaint_window.penalty_nsec / 16;
+		}
+	}
+	output->repaint_window.target = (struct timespec) { 0 };
+}
+
+/** How long before the vblank the next repaint of an output should start
+ *
+ * Without a fixed window for the output or adaptive repaint windows, this
+ * is weston_compositor::repaint_msec. Otherwise it is a high percentile of
+ * the recent repaint costs, plus a safety margin that grows while vblanks
+ * are missed.
+ */
+static int64_t
+weston_output_get_repaint_window(struct weston_output *output,
+				 int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int64_t window;
+
+	if (output->repaint_window.fixed)
+		return (int64_t) output->repaint_window.fixed_msec * 1000000;
+
+	if (!compositor->adaptive_repaint_window ||
+	    output->repaint_window.num_costs < REPAINT_COST_MIN_SAMPLES)
+		return (int64_t) compositor->repaint_msec * 1000000;
+
+	window = weston_output_repaint_cost_nsec(output) +
+		 REPAINT_WINDOW_MARGIN_NSEC +
+		 output->repaint_window.penalty_nsec;
+
+	/* Repainting right after the previous vblank is as early as it gets */
+	return MIN(window, refresh_nsec);
+}
+
+/** Whether the renderer should report when it finished repainting
+ *
+ * \sa weston_output_set_render_fence
+ * \ingroup output
+ * \internal
+ */
+WL_EXPORT bool
+weston_output_wants_render_fence(struct weston_output *output)
+{
+	return output->compositor->adaptive_repaint_window &&
+	       !output->repaint_window.fixed;
+}
+
+/** Hand the sync file of the repaint in flight to the core
+ *
+ * \param output The output being repainted.
+ * \param fd A sync file signalled when the renderer is done with the
+ * repaint; the output takes ownership.
+ *
+ * Called by renderers that finish asynchronously, from their
+ * repaint_output hook. The signal time counts towards the repaint cost of
+ * the output.
+ *
+ * \ingroup output
+ * \internal
+ */
+WL_EXPORT void
+weston_output_set_render_fence(struct weston_output *output, int fd)
+{
+	if (output->repaint_window.render_fence_fd >= 0)
+		close(output->repaint_window.render_fence_fd);
+
+	output->repaint_window.render_fence_fd = fd;
+}
+
 /**
  * \ingroup output
  */
@@ -2989,12 +3406,16 @@ weston_output_finish_frame(struct weston_output *output,
 	int32_t refresh_nsec;
 	struct timespec now;
 	struct timespec vblank_monotonic;
+	struct timespec deadline_monotonic;
 	int64_t msec_rel;
 
 	assert(output->repaint_status == REPAINT_AWAITING_COMPLETION);
 
 	weston_compositor_read_presentation_clock(compositor, &now);
 
+	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	weston_output_update_repaint_cost(output, stamp, refresh_nsec);
+
 	/* If we haven't been supplied any timestamp at all, we don't have a
 	 * timebase to work against, so any delay just wastes time. Push a
 	 * repaint as soon as possible so we can get on with it. */
@@ -3009,7 +3430,6 @@ weston_output_finish_frame(struct weston_output *output,
 	TL_POINT(compositor, "core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(&vblank_monotonic), TLP_END);
 
-	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
 						  output->msc,
@@ -3017,9 +3437,10 @@ weston_output_finish_frame(struct weston_output *output,
 
 	output->frame_time = *stamp;
 
-	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	output->repaint_window.window_nsec =
+		weston_output_get_repaint_window(output, refresh_nsec);
+	timespec_add_nsec(&output->next_repaint, stamp,
+			  refresh_nsec - output->repaint_window.window_nsec);
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -3034,7 +3455,7 @@ weston_output_finish_frame(struct weston_output *output,
 	}
 
 	/* Called from restart_repaint_loop and restart happens already after
-	 * the deadline given by repaint_msec? In that case we delay until
+	 * the deadline given by the repaint window? In that case we delay until
 	 * the deadline of the next frame, to give clients a more predictable
 	 * timing of the repaint cycle to lock on. */
 	if (presented_flags == WP_PRESENTATION_FEEDBACK_INVALID &&
@@ -3046,6 +3467,16 @@ weston_output_finish_frame(struct weston_output *output,
 		}
 	}
 
+	if (weston_log_scope_is_enabled(compositor->timeline)) {
+		deadline_monotonic =
+			convert_presentation_time_now(compositor,
+						      &output->next_repaint,
+						      &now, CLOCK_MONOTONIC);
+		TL_POINT(compositor, "core_repaint_window",
+			 TLP_OUTPUT(output), TLP_DEADLINE(&deadline_monotonic),
+			 TLP_END);
+	}
+
 out:
 	output->repaint_status = REPAINT_SCHEDULED;
 	output_repaint_timer_arm(compositor);
@@ -3071,11 +3502,17 @@ weston_layer_entry_insert(struct weston_layer_entry *list,
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+
+	if (entry->layer)
+		weston_compositor_view_list_dirty(entry->layer->compositor);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		weston_compositor_view_list_dirty(entry->layer->compositor);
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -3113,6 +3550,7 @@ weston_layer_set_position(struct weston_layer *layer,
 	struct weston_layer *below;
 
 	wl_list_remove(&layer->link);
+	weston_compositor_view_list_dirty(layer->compositor);
 
 	/* layer_list is ordered from top to bottom, the last layer being the
 	 * background with the smallest position value */
@@ -3137,6 +3575,7 @@ weston_layer_unset_position(struct weston_layer *layer)
 {
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
+	weston_compositor_view_list_dirty(layer->compositor);
 }
 
 WL_EXPORT void
@@ -3381,6 +3820,9 @@ weston_surface_commit_subsurface_order(struct weston_surface *surface)
 
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
+		if (sub->reordered)
+			weston_compositor_view_list_dirty(surface->compositor);
+
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 
@@ -4160,6 +4602,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		weston_compositor_view_list_dirty(surface->compositor);
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -4236,6 +4679,26 @@ weston_surface_set_label_func(struct weston_surface *surface,
 						     surface);
 }
 
+/** Choose whether to hold back frame callbacks while hidden
+ *
+ * \param surface The surface.
+ * \param throttle False to send the frame callbacks of the surface at the
+ * output rate even when no part of it is visible.
+ *
+ * With weston_compositor::occluded_frame_msec set, the frame callbacks of
+ * surfaces entirely hidden behind opaque content are sent at that interval
+ * only. Shells can opt out surfaces that must keep running at full rate.
+ * Surfaces throttle by default.
+ *
+ * \ingroup surface
+ */
+WL_EXPORT void
+weston_surface_set_occluded_frame_throttle(struct weston_surface *surface,
+					   bool throttle)
+{
+	surface->occluded_frame_throttle = throttle;
+}
+
 /** Get the size of surface contents
  *
  * \param surface The surface to query.
@@ -4501,6 +4964,7 @@ weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
+	weston_compositor_view_list_dirty(sub->parent->compositor);
 	sub->parent = NULL;
 }
 
@@ -4564,6 +5028,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	weston_compositor_view_list_dirty(parent->compositor);
 }
 
 static void
@@ -6229,6 +6694,25 @@ weston_output_set_transform(struct weston_output *output,
 	}
 }
 
+/** Sets a fixed repaint window for an output
+ *
+ * \param output The weston_output object to set the repaint window of.
+ * \param msec   How long before the vblank to start repainting, in
+ *                milliseconds.
+ *
+ * Overrides weston_compositor::repaint_msec for this output, which then
+ * also does not size its repaint window from its repaint costs.
+ *
+ * \ingroup output
+ */
+WL_EXPORT void
+weston_output_set_repaint_window(struct weston_output *output,
+				 int32_t msec)
+{
+	output->repaint_window.fixed = true;
+	output->repaint_window.fixed_msec = msec;
+}
+
 /** Initializes a weston_output object with enough data so
  ** an output can be configured.
  *
@@ -6258,6 +6742,7 @@ weston_output_init(struct weston_output *output,
 	output->enabled = false;
 	output->desired_protection = WESTON_HDCP_DISABLE;
 	output->allow_protection = true;
+	output->shader_prewarm = false;
 
 	wl_list_init(&output->head_list);
 
@@ -6268,6 +6753,8 @@ weston_output_init(struct weston_output *output,
 	/* Can't use -1 on uint32_t and 0 is valid enum value */
 	output->transform = UINT32_MAX;
 
+	output->repaint_window.render_fence_fd = -1;
+
 	pixman_region32_init(&output->region);
 	wl_list_init(&output->mode_list);
 }
@@ -6578,6 +7065,9 @@ weston_output_release(struct weston_output *output)
 	if (output->enabled)
 		weston_compositor_remove_output(output);
 
+	if (output->repaint_window.render_fence_fd >= 0)
+		close(output->repaint_window.render_fence_fd);
+
 	pixman_region32_fini(&output->region);
 	wl_list_remove(&output->link);
 
@@ -6727,6 +7217,23 @@ weston_output_allow_protection(struct weston_output *output,
 	output->allow_protection = allow_protection;
 }
 
+/** Enable/Disable shader pre-warming for an output
+ *
+ * When enabled, a renderer that compiles shaders at runtime builds all the
+ * shader variants that can be needed for this output's target color space
+ * and transfer function in the background, instead of on first use in the
+ * middle of a repaint. Must be called before the output is enabled.
+ *
+ * \param output The weston_output to configure.
+ * \param shader_prewarm The bool value which is to be set.
+ */
+WL_EXPORT void
+weston_output_set_shader_prewarm(struct weston_output *output,
+				 bool shader_prewarm)
+{
+	output->shader_prewarm = shader_prewarm;
+}
+
 static void
 xdg_output_unlist(struct wl_resource *resource)
 {
@@ -7253,6 +7760,13 @@ weston_compositor_print_scene_graph(struct weston_compositor *ec)
 	fprintf(fp, "Weston scene graph at %ld.%09ld:\n\n",
 		now.tv_sec, now.tv_nsec);
 
+	fprintf(fp, "View list: generation %u, %" PRIu64 " rebuilds, "
+		"%" PRIu64 " repaints without rebuild%s\n\n",
+		ec->view_list_generation, ec->view_list_rebuilds,
+		ec->view_list_rebuilds_skipped,
+		ec->view_list_built_generation != ec->view_list_generation ?
+			", rebuild pending" : "");
+
 	wl_list_for_each(output, &ec->output_list, link) {
 		struct weston_head *head;
 		int head_idx = 0;
@@ -7276,6 +7790,14 @@ weston_compositor_print_scene_graph(struct weston_compositor *ec)
 			fprintf(fp, "\tnext repaint: %ld.%09ld\n",
 				output->next_repaint.tv_sec,
 				output->next_repaint.tv_nsec);
+		fprintf(fp, "\trepaint window: %.3f ms (%s), repaint cost "
+			"%.3f ms at %d%%, %u vblanks missed\n",
+			output->repaint_window.window_nsec / 1e6,
+			output->repaint_window.fixed ? "fixed" :
+			ec->adaptive_repaint_window ? "adaptive" : "default",
+			weston_output_repaint_cost_nsec(output) / 1e6,
+			REPAINT_COST_PERCENTILE,
+			output->repaint_window.missed);
 
 		wl_list_for_each(head, &output->head_list, output_link) {
 			fprintf(fp, "\tHead %d (%s): %sconnected\n",
@@ -7414,6 +7936,11 @@ weston_compositor_create(struct wl_display *display,
 	if (weston_input_init(ec) != 0)
 		goto fail;
 
+	ec->pick_index = zalloc(sizeof *ec->pick_index);
+	if (!ec->pick_index)
+		goto fail;
+	weston_pick_index_init(ec->pick_index);
+
 	wl_list_init(&ec->view_list);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
@@ -7442,6 +7969,9 @@ weston_compositor_create(struct wl_display *display,
 	ec->repaint_timer =
 		wl_event_loop_add_timer(loop, output_repaint_timer_handler,
 					ec);
+	ec->occluded_frame_timer =
+		wl_event_loop_add_timer(loop, occluded_frame_timer_handler,
+					ec);
 
 	weston_layer_init(&ec->fade_layer, ec);
 	weston_layer_init(&ec->cursor_layer, ec);
@@ -7465,6 +7995,7 @@ weston_compositor_create(struct wl_display *display,
 	return ec;
 
 fail:
+	free(ec->pick_index);
 	free(ec);
 	return NULL;
 }
@@ -7478,6 +8009,7 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	struct weston_output *output, *next;
 
 	wl_event_source_remove(ec->idle_source);
+	wl_event_source_remove(ec->occluded_frame_timer);
 
 	/* Destroy all outputs associated with this compositor */
 	wl_list_for_each_safe(output, next, &ec->output_list, link)
@@ -7832,6 +8364,9 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 	weston_log_scope_destroy(compositor->timeline);
 	compositor->timeline = NULL;
 
+	weston_pick_index_release(compositor->pick_index);
+	free(compositor->pick_index);
+
 	free(compositor);
 }
 
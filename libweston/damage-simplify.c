@@ -0,0 +1,213 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "damage-simplify.h"
+#include "shared/helpers.h"
+
+/* Overlapping merged boxes get cut into bands again by pixman, so the
+ * result can have more rectangles than boxes; merge again, this often */
+#define SIMPLIFY_PASSES_MAX 3
+
+struct simplify_box {
+	pixman_box32_t box;
+	/* Damaged pixels in box, -1 once merged into another box. Overlaps
+	 * between merged boxes are counted twice, so this is an estimate. */
+	int64_t damaged;
+	/* The box merging with which wastes the least, -1 for none */
+	int best;
+	int64_t best_waste;
+};
+
+static int64_t
+box_area(const pixman_box32_t *box)
+{
+	return (int64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+static pixman_box32_t
+box_union(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	pixman_box32_t box = {
+		.x1 = MIN(a->x1, b->x1),
+		.y1 = MIN(a->y1, b->y1),
+		.x2 = MAX(a->x2, b->x2),
+		.y2 = MAX(a->y2, b->y2),
+	};
+
+	return box;
+}
+
+/* Undamaged pixels in the bounding box of a and b */
+static int64_t
+merge_waste(const struct simplify_box *a, const struct simplify_box *b)
+{
+	pixman_box32_t box = box_union(&a->box, &b->box);
+
+	return MAX(box_area(&box) - a->damaged - b->damaged, 0);
+}
+
+static void
+find_best(struct simplify_box *boxes, int num_boxes, int i)
+{
+	int64_t waste;
+	int j;
+
+	boxes[i].best = -1;
+	boxes[i].best_waste = INT64_MAX;
+
+	for (j = 0; j < num_boxes; j++) {
+		if (j == i || boxes[j].damaged < 0)
+			continue;
+
+		waste = merge_waste(&boxes[i], &boxes[j]);
+		if (waste < boxes[i].best_waste) {
+			boxes[i].best = j;
+			boxes[i].best_waste = waste;
+		}
+	}
+}
+
+/* Greedily merge the pair of boxes wasting the least, while over the
+ * rectangle budget or under the waste threshold */
+static void
+simplify_pass(pixman_region32_t *region,
+	      const struct weston_damage_simplify *params)
+{
+	struct simplify_box *boxes;
+	pixman_box32_t *rects, *result, merged;
+	int num_boxes, live, i, j, k;
+
+	rects = pixman_region32_rectangles(region, &num_boxes);
+	if (num_boxes < 2)
+		return;
+
+	boxes = calloc(num_boxes, sizeof *boxes);
+	result = calloc(num_boxes, sizeof *result);
+	if (!boxes || !result) {
+		free(boxes);
+		free(result);
+		pixman_region32_reset(region, pixman_region32_extents(region));
+		return;
+	}
+
+	for (i = 0; i < num_boxes; i++) {
+		boxes[i].box = rects[i];
+		boxes[i].damaged = box_area(&rects[i]);
+	}
+	for (i = 0; i < num_boxes; i++)
+		find_best(boxes, num_boxes, i);
+
+	live = num_boxes;
+	while (live > 1) {
+		i = -1;
+		for (k = 0; k < num_boxes; k++) {
+			if (boxes[k].damaged < 0 || boxes[k].best < 0)
+				continue;
+			if (i < 0 || boxes[k].best_waste < boxes[i].best_waste)
+				i = k;
+		}
+		j = boxes[i].best;
+		merged = box_union(&boxes[i].box, &boxes[j].box);
+
+		if ((params->max_rects <= 0 || live <= params->max_rects) &&
+		    boxes[i].best_waste * 100 >
+		    (int64_t)params->max_waste_percent * box_area(&merged))
+			break;
+
+		boxes[i].box = merged;
+		boxes[i].damaged += boxes[j].damaged;
+		boxes[j].damaged = -1;
+		live--;
+
+		find_best(boxes, num_boxes, i);
+		for (k = 0; k < num_boxes; k++) {
+			int64_t waste;
+
+			if (k == i || boxes[k].damaged < 0)
+				continue;
+
+			if (boxes[k].best == i || boxes[k].best == j) {
+				find_best(boxes, num_boxes, k);
+				continue;
+			}
+
+			waste = merge_waste(&boxes[k], &boxes[i]);
+			if (waste < boxes[k].best_waste) {
+				boxes[k].best = i;
+				boxes[k].best_waste = waste;
+			}
+		}
+	}
+
+	k = 0;
+	for (i = 0; i < num_boxes; i++)
+		if (boxes[i].damaged >= 0)
+			result[k++] = boxes[i].box;
+
+	pixman_region32_fini(region);
+	pixman_region32_init_rects(region, result, k);
+
+	free(result);
+	free(boxes);
+}
+
+/** Merge the rectangles of a damage region
+ *
+ * \param dst The simplified region, may be src.
+ * \param src The damage.
+ * \param params How far to simplify.
+ * \return The number of rectangles of dst.
+ *
+ * The result covers all of src, and maybe some more.
+ */
+int
+weston_damage_simplify(pixman_region32_t *dst, pixman_region32_t *src,
+		       const struct weston_damage_simplify *params)
+{
+	int pass;
+
+	if (dst != src)
+		pixman_region32_copy(dst, src);
+
+	if (params->max_rects <= 0 && params->max_waste_percent <= 0)
+		return pixman_region32_n_rects(dst);
+
+	for (pass = 0; pass < SIMPLIFY_PASSES_MAX; pass++) {
+		simplify_pass(dst, params);
+
+		if (params->max_rects <= 0 ||
+		    pixman_region32_n_rects(dst) <= params->max_rects)
+			return pixman_region32_n_rects(dst);
+	}
+
+	pixman_region32_reset(dst, pixman_region32_extents(dst));
+
+	return pixman_region32_n_rects(dst);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_DAMAGE_SIMPLIFY_H
+#define WESTON_DAMAGE_SIMPLIFY_H
+
+#include <pixman.h>
+
+/** How far to simplify a damage region
+ *
+ * Every rectangle of damage costs a renderer some fixed work, in draw
+ * calls, clipping and the damage lists handed to EGL. Merging nearby
+ * rectangles into their bounding box repaints some undamaged pixels, but
+ * saves that work.
+ */
+struct weston_damage_simplify {
+	/** Rectangles the result may have at most, 0 for no limit */
+	int max_rects;
+	/** Merge two boxes whenever at most this many percent of their
+	 * bounding box are undamaged, 0 to merge only to meet max_rects.
+	 * With both 0 the region is left as it is. */
+	int max_waste_percent;
+};
+
+int
+weston_damage_simplify(pixman_region32_t *dst, pixman_region32_t *src,
+		       const struct weston_damage_simplify *params);
+
+#endif /* WESTON_DAMAGE_SIMPLIFY_H */
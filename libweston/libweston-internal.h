@@ -148,6 +148,9 @@ weston_compositor_shutdown(struct weston_compositor *ec);
 void
 weston_compositor_xkb_destroy(struct weston_compositor *ec);
 
+bool
+weston_compositor_repaint_is_deferred(struct weston_compositor *compositor);
+
 int
 weston_input_init(struct weston_compositor *compositor);
 
@@ -159,6 +162,12 @@ weston_output_disable_planes_incr(struct weston_output *output);
 void
 weston_output_disable_planes_decr(struct weston_output *output);
 
+bool
+weston_output_wants_render_fence(struct weston_output *output);
+
+void
+weston_output_set_render_fence(struct weston_output *output, int fd);
+
 /* weston_plane */
 
 void
@@ -0,0 +1,239 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pick-index.h"
+#include "shared/helpers.h"
+
+/* Cells are at least this many pixels wide... */
+#define PICK_CELL_SIZE_MIN 64
+/* ...and there are at most this many in each direction */
+#define PICK_GRID_SIZE_MAX 64
+
+void
+weston_pick_index_init(struct weston_pick_index *index)
+{
+	memset(index, 0, sizeof *index);
+	wl_array_init(&index->entries);
+	wl_array_init(&index->cell_start);
+	wl_array_init(&index->cell_entries);
+}
+
+void
+weston_pick_index_release(struct weston_pick_index *index)
+{
+	wl_array_release(&index->entries);
+	wl_array_release(&index->cell_start);
+	wl_array_release(&index->cell_entries);
+}
+
+/** Remove all entries, keeping the allocations around */
+void
+weston_pick_index_clear(struct weston_pick_index *index)
+{
+	index->entries.size = 0;
+	index->cell_start.size = 0;
+	index->cell_entries.size = 0;
+	index->columns = 0;
+	index->rows = 0;
+}
+
+/** Add a box below the ones added so far
+ *
+ * Call weston_pick_index_build() once all are added.
+ */
+bool
+weston_pick_index_add(struct weston_pick_index *index,
+		      const pixman_box32_t *box, void *data)
+{
+	struct weston_pick_entry *entry;
+
+	/* Nothing can be picked there */
+	if (box->x1 >= box->x2 || box->y1 >= box->y2)
+		return true;
+
+	entry = wl_array_add(&index->entries, sizeof *entry);
+	if (!entry)
+		return false;
+
+	entry->box = *box;
+	entry->data = data;
+
+	return true;
+}
+
+static int
+div_round_up(int64_t a, int b)
+{
+	return (a + b - 1) / b;
+}
+
+static void
+pick_index_cell_range(struct weston_pick_index *index,
+		      const pixman_box32_t *box,
+		      int *col1, int *row1, int *col2, int *row2)
+{
+	int64_t x1 = (int64_t)box->x1 - index->extents.x1;
+	int64_t y1 = (int64_t)box->y1 - index->extents.y1;
+	int64_t x2 = (int64_t)box->x2 - index->extents.x1;
+	int64_t y2 = (int64_t)box->y2 - index->extents.y1;
+
+	*col1 = x1 / index->cell_size;
+	*row1 = y1 / index->cell_size;
+	*col2 = MIN(div_round_up(x2, index->cell_size), index->columns);
+	*row2 = MIN(div_round_up(y2, index->cell_size), index->rows);
+}
+
+/** Sort the entries into the grid cells they overlap */
+bool
+weston_pick_index_build(struct weston_pick_index *index)
+{
+	struct weston_pick_entry *entries = index->entries.data;
+	size_t count = index->entries.size / sizeof *entries;
+	int64_t width, height;
+	uint32_t *start, *cell_entries, total = 0;
+	int col1, row1, col2, row2, col, row;
+	int num_cells, i;
+	size_t e;
+
+	index->cell_start.size = 0;
+	index->cell_entries.size = 0;
+	index->columns = 0;
+	index->rows = 0;
+
+	if (count == 0)
+		return true;
+
+	index->extents = entries[0].box;
+	for (e = 1; e < count; e++) {
+		index->extents.x1 = MIN(index->extents.x1, entries[e].box.x1);
+		index->extents.y1 = MIN(index->extents.y1, entries[e].box.y1);
+		index->extents.x2 = MAX(index->extents.x2, entries[e].box.x2);
+		index->extents.y2 = MAX(index->extents.y2, entries[e].box.y2);
+	}
+
+	width = (int64_t)index->extents.x2 - index->extents.x1;
+	height = (int64_t)index->extents.y2 - index->extents.y1;
+	index->cell_size = MAX(PICK_CELL_SIZE_MIN,
+			       div_round_up(MAX(width, height),
+					    PICK_GRID_SIZE_MAX));
+	index->columns = div_round_up(width, index->cell_size);
+	index->rows = div_round_up(height, index->cell_size);
+	num_cells = index->columns * index->rows;
+
+	start = wl_array_add(&index->cell_start,
+			     (num_cells + 1) * sizeof *start);
+	if (!start)
+		goto err;
+	memset(start, 0, (num_cells + 1) * sizeof *start);
+
+	/* Count the entries of every cell... */
+	for (e = 0; e < count; e++) {
+		pick_index_cell_range(index, &entries[e].box,
+				      &col1, &row1, &col2, &row2);
+		for (row = row1; row < row2; row++)
+			for (col = col1; col < col2; col++)
+				start[row * index->columns + col + 1]++;
+	}
+
+	for (i = 1; i <= num_cells; i++) {
+		total += start[i];
+		start[i] = total;
+	}
+
+	cell_entries = wl_array_add(&index->cell_entries,
+				    total * sizeof *cell_entries);
+	if (!cell_entries && total > 0)
+		goto err;
+
+	/* ...then fill them in, using start[cell] as the write position;
+	 * once done, it has moved to where start[cell + 1] was */
+	for (e = 0; e < count; e++) {
+		pick_index_cell_range(index, &entries[e].box,
+				      &col1, &row1, &col2, &row2);
+		for (row = row1; row < row2; row++)
+			for (col = col1; col < col2; col++)
+				cell_entries[start[row * index->columns + col]++] = e;
+	}
+
+	memmove(start + 1, start, num_cells * sizeof *start);
+	start[0] = 0;
+
+	return true;
+
+err:
+	index->cell_start.size = 0;
+	index->columns = 0;
+	index->rows = 0;
+	return false;
+}
+
+/** Find the topmost entry containing a point
+ *
+ * \param accept Called for every entry whose box contains the point, top to
+ * bottom, until it returns true. May be NULL to take the first such entry.
+ * \return The data of the entry found, or NULL.
+ */
+void *
+weston_pick_index_find(struct weston_pick_index *index, int x, int y,
+		       weston_pick_accept_func_t accept, void *user_data)
+{
+	struct weston_pick_entry *entries = index->entries.data;
+	uint32_t *start = index->cell_start.data;
+	uint32_t *cell_entries = index->cell_entries.data;
+	struct weston_pick_entry *entry;
+	int64_t gx, gy;
+	uint32_t i;
+	int cell;
+
+	gx = (int64_t)x - index->extents.x1;
+	gy = (int64_t)y - index->extents.y1;
+	if (index->columns == 0 || gx < 0 || gy < 0)
+		return NULL;
+
+	gx /= index->cell_size;
+	gy /= index->cell_size;
+	if (gx >= index->columns || gy >= index->rows)
+		return NULL;
+
+	cell = gy * index->columns + gx;
+	for (i = start[cell]; i < start[cell + 1]; i++) {
+		entry = &entries[cell_entries[i]];
+
+		if (x < entry->box.x1 || x >= entry->box.x2 ||
+		    y < entry->box.y1 || y >= entry->box.y2)
+			continue;
+
+		if (!accept || accept(entry->data, user_data))
+			return entry->data;
+	}
+
+	return NULL;
+}
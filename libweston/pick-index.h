@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_PICK_INDEX_H
+#define WESTON_PICK_INDEX_H
+
+#include <stdbool.h>
+#include <pixman.h>
+#include <wayland-util.h>
+
+/** Uniform grid over a stack of boxes
+ *
+ * Finds the topmost box containing a point without testing every box.
+ * Boxes are added top to bottom, and every cell of the grid lists the boxes
+ * overlapping it in that order.
+ */
+struct weston_pick_index {
+	/* struct weston_pick_entry, top to bottom */
+	struct wl_array entries;
+	/* uint32_t per cell, plus one: start of the cell in cell_entries */
+	struct wl_array cell_start;
+	/* uint32_t index into entries, ascending within a cell */
+	struct wl_array cell_entries;
+
+	pixman_box32_t extents;
+	int cell_size;
+	int columns;
+	int rows;
+};
+
+struct weston_pick_entry {
+	pixman_box32_t box;
+	void *data;
+};
+
+/* Final say on an entry whose box contains the point */
+typedef bool (*weston_pick_accept_func_t)(void *data, void *user_data);
+
+void
+weston_pick_index_init(struct weston_pick_index *index);
+
+void
+weston_pick_index_release(struct weston_pick_index *index);
+
+void
+weston_pick_index_clear(struct weston_pick_index *index);
+
+bool
+weston_pick_index_add(struct weston_pick_index *index,
+		      const pixman_box32_t *box, void *data);
+
+bool
+weston_pick_index_build(struct weston_pick_index *index);
+
+void *
+weston_pick_index_find(struct weston_pick_index *index, int x, int y,
+		       weston_pick_accept_func_t accept, void *user_data);
+
+#endif /* WESTON_PICK_INDEX_H */
@@ -28,8 +28,10 @@
 #include "config.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "pixman-renderer.h"
@@ -37,17 +39,40 @@
 
 #include <linux/input.h>
 
+/* Bands are handed out on demand, a few per thread even out the load when
+ * the damage is uneven */
+#define PIXMAN_BANDS_PER_THREAD 4
+/* Thinner bands cost more in per-view region work than they save */
+#define PIXMAN_BAND_HEIGHT_MIN 32
+#define PIXMAN_THREADS_MAX 32
+
+static const pixman_color_t repaint_debug_color = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
+};
+
 struct pixman_output_state {
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
 	pixman_region32_t *hw_extra_damage;
+
+	struct weston_output *output;
+	/* Repaint left to pixman_renderer_repaint_finish(), see
+	 * weston_compositor::parallel_repaint */
+	bool deferred;
+	struct wl_list deferred_link; /* pixman_renderer::deferred_list */
+	/* Global coordinates */
+	pixman_region32_t deferred_damage;
+	pixman_region32_t deferred_hw_damage;
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	/* Set when image is a solid fill of color */
+	bool is_solid;
+	pixman_color_t color;
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_release_reference buffer_release_ref;
 
@@ -56,6 +81,55 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+struct pixman_renderer;
+
+/** One output repaint, split into bands of rows
+ *
+ * Several frames are painted at once when the outputs of a repaint are
+ * painted in parallel.
+ */
+struct pixman_frame {
+	struct weston_output *output;
+	/* Global coordinates */
+	pixman_region32_t *damage;
+	/* Global coordinates, NULL without a shadow image */
+	pixman_region32_t *hw_damage;
+
+	/* Output coordinates */
+	pixman_region32_t bands[PIXMAN_THREADS_MAX * PIXMAN_BANDS_PER_THREAD];
+	int num_bands;
+	/* Next band to paint, taken atomically */
+	int next_band;
+	/* Set by the threads painting, see pixman_paint::overdraw */
+	int overdraw;
+};
+
+struct pixman_worker {
+	struct pixman_renderer *renderer;
+	pthread_t thread;
+	int index;
+	/* Last frame_seq the worker has seen */
+	uint32_t frame_seq;
+};
+
+/** Where a thread paints
+ *
+ * Painting sets the transform, filter and clip of the images it uses, so
+ * the threads painting bands of a frame each have their own pixman images,
+ * sharing the pixels.
+ */
+struct pixman_paint {
+	pixman_image_t *target;
+	/* Destination of copy_to_hw_buffer() */
+	pixman_image_t *hw_target;
+	pixman_image_t *debug_color;
+	/* Output coordinates, NULL to paint the whole damage */
+	pixman_region32_t *band;
+	/* Most passes a clipped source took. Only the compositor thread
+	 * may log, so the warning waits for the paint to end. */
+	int overdraw;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -64,6 +138,27 @@ struct pixman_renderer {
 	struct weston_binding *debug_binding;
 
 	struct wl_signal destroy_signal;
+
+	/* Outputs whose paint waits for repaint_finish */
+	struct wl_list deferred_list; /* pixman_output_state::deferred_link */
+
+	/* Protects the fields below, and the frames while workers paint */
+	pthread_mutex_t worker_mutex;
+	pthread_cond_t worker_start_cond;
+	pthread_cond_t worker_done_cond;
+	struct pixman_frame *frames;
+	int num_frames;
+	uint32_t frame_seq;
+	/* Workers painting bands of the current frames */
+	int active_workers;
+	/* Active workers not done with the current frames */
+	int busy_workers;
+	bool workers_stopping;
+	bool worker_create_failed;
+	bool overdraw_warned;
+
+	int num_workers;
+	struct pixman_worker workers[PIXMAN_THREADS_MAX - 1];
 };
 
 static inline struct pixman_output_state *
@@ -242,7 +337,8 @@ composite_whole(pixman_op_t op,
 				 dest_width, dest_height);
 }
 
-static void
+/* Returns how many passes the source took */
+static int
 composite_clipped(pixman_image_t *src,
 		  pixman_image_t *mask,
 		  pixman_image_t *dest,
@@ -311,14 +407,27 @@ composite_clipped(pixman_image_t *src,
 		pixman_image_unref(boximg);
 	}
 
-	if (n_box > 1) {
-		static bool warned = false;
+	return n_box;
+}
 
-		if (!warned)
-			weston_log("Pixman-renderer warning: %dx overdraw\n",
-				   n_box);
-		warned = true;
-	}
+/* A private copy of a bits image, sharing the pixels */
+static pixman_image_t *
+bits_image_copy(pixman_image_t *image)
+{
+	return pixman_image_create_bits_no_clear(pixman_image_get_format(image),
+						 pixman_image_get_width(image),
+						 pixman_image_get_height(image),
+						 pixman_image_get_data(image),
+						 pixman_image_get_stride(image));
+}
+
+static pixman_image_t *
+image_copy(struct pixman_surface_state *ps)
+{
+	if (ps->is_solid)
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return bits_image_copy(ps->image);
 }
 
 /** Paint an intersected region
@@ -332,25 +441,42 @@ composite_clipped(pixman_image_t *src,
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_paint *paint,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
 {
-	struct pixman_renderer *pr =
-		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
-	pixman_image_t *target_image;
+	pixman_image_t *target_image = paint->target;
+	pixman_image_t *source_image;
+	bool source_owned = true;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
 
-	if (po->shadow_image)
-		target_image = po->shadow_image;
-	else
-		target_image = po->hw_buffer;
+	if (paint->band) {
+		pixman_region32_intersect(repaint_output, repaint_output,
+					  paint->band);
+		if (!pixman_region32_not_empty(repaint_output))
+			return;
+
+		/* composite_whole() changes the source image. Other bands
+		 * use ps->image at the same time and pixman reference
+		 * counts are not atomic, so it is not referenced here; it
+		 * outlives the paint anyway. */
+		if (!source_clip) {
+			source_image = image_copy(ps);
+		} else {
+			source_image = ps->image;
+			source_owned = false;
+		}
+		if (!source_image)
+			return;
+	} else {
+		source_image = pixman_image_ref(ps->image);
+	}
 
  	/* Clip rendering to the damaged output region */
 	pixman_image_set_clip_region32(target_image, repaint_output);
@@ -373,21 +499,28 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	}
 
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, target_image,
-				  &transform, filter, source_clip);
+		paint->overdraw = MAX(paint->overdraw,
+				      composite_clipped(source_image,
+							mask_image,
+							target_image,
+							&transform, filter,
+							source_clip));
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
+		composite_whole(pixman_op, source_image, mask_image,
 				target_image, &transform, filter);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
 
+	if (source_owned)
+		pixman_image_unref(source_image);
+
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (paint->debug_color)
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 paint->debug_color, /* src */
 					 NULL /* mask */,
 					 target_image, /* dest */
 					 0, 0, /* src_x, src_y */
@@ -401,6 +534,7 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_paint *paint,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -428,8 +562,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, paint, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -439,7 +573,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, paint, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -450,6 +584,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_paint *paint,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -475,7 +610,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, paint, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -485,6 +620,7 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
+	  struct pixman_paint *paint,
 	  pixman_region32_t *damage) /* in global coordinates */
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
@@ -511,7 +647,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, paint, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -520,25 +656,27 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, paint, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output, struct pixman_paint *paint,
+		 pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			draw_view(view, output, paint, damage);
 }
 
 static void
-copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
+copy_to_hw_buffer(struct weston_output *output, struct pixman_paint *paint,
+		  pixman_region32_t *region)
 {
 	struct pixman_output_state *po = get_output_state(output);
 	pixman_region32_t output_region;
@@ -547,27 +685,442 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 	pixman_region32_copy(&output_region, region);
 
 	region_global_to_output(output, &output_region);
+	if (paint->band)
+		pixman_region32_intersect(&output_region, &output_region,
+					  paint->band);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
+	pixman_image_set_clip_region32 (paint->hw_target, &output_region);
 	pixman_region32_fini(&output_region);
 
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 po->shadow_image, /* src */
+				 paint->target, /* src */
 				 NULL /* mask */,
-				 po->hw_buffer, /* dest */
+				 paint->hw_target, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
 				 pixman_image_get_width (po->hw_buffer), /* width */
 				 pixman_image_get_height (po->hw_buffer) /* height */);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
+	pixman_image_set_clip_region32 (paint->hw_target, NULL);
+}
+
+static bool
+pixman_paint_init_band(struct pixman_paint *paint,
+		       struct pixman_renderer *pr,
+		       struct pixman_output_state *po)
+{
+	memset(paint, 0, sizeof *paint);
+
+	paint->hw_target = bits_image_copy(po->hw_buffer);
+	if (!paint->hw_target)
+		return false;
+
+	if (po->shadow_image) {
+		paint->target = bits_image_copy(po->shadow_image);
+		if (!paint->target) {
+			pixman_image_unref(paint->hw_target);
+			return false;
+		}
+	} else {
+		paint->target = pixman_image_ref(paint->hw_target);
+	}
+
+	if (pr->repaint_debug)
+		paint->debug_color =
+			pixman_image_create_solid_fill(&repaint_debug_color);
+
+	return true;
+}
+
+static void
+pixman_paint_fini(struct pixman_paint *paint)
+{
+	pixman_image_unref(paint->target);
+	pixman_image_unref(paint->hw_target);
+	if (paint->debug_color)
+		pixman_image_unref(paint->debug_color);
+}
+
+/* Called on the compositor thread and on the workers */
+static void
+pixman_frame_paint_bands(struct pixman_renderer *pr,
+			 struct pixman_frame *frame)
+{
+	struct pixman_output_state *po = get_output_state(frame->output);
+	struct pixman_paint paint;
+	int band;
+
+	/* Other threads took all the bands already */
+	if (__atomic_load_n(&frame->next_band, __ATOMIC_RELAXED) >=
+	    frame->num_bands)
+		return;
+
+	if (!pixman_paint_init_band(&paint, pr, po)) {
+		/* Leave the bands to the other threads */
+		return;
+	}
+
+	while ((band = __atomic_fetch_add(&frame->next_band, 1,
+					  __ATOMIC_RELAXED)) <
+	       frame->num_bands) {
+		paint.band = &frame->bands[band];
+		repaint_surfaces(frame->output, &paint, frame->damage);
+		if (frame->hw_damage)
+			copy_to_hw_buffer(frame->output, &paint,
+					  frame->hw_damage);
+	}
+
+	/* Any of the threads' values will do for the warning */
+	if (paint.overdraw > 1)
+		__atomic_store_n(&frame->overdraw, paint.overdraw,
+				 __ATOMIC_RELAXED);
+
+	pixman_paint_fini(&paint);
+}
+
+/* Paint bands of frames[first] first, then of the frames after it, so that
+ * threads starting on different frames only meet towards the end */
+static void
+pixman_frames_paint_bands(struct pixman_renderer *pr,
+			  struct pixman_frame *frames, int num_frames,
+			  int first)
+{
+	int i;
+
+	for (i = 0; i < num_frames; i++)
+		pixman_frame_paint_bands(pr,
+					 &frames[(first + i) % num_frames]);
+}
+
+static void *
+pixman_worker_thread(void *data)
+{
+	struct pixman_worker *worker = data;
+	struct pixman_renderer *pr = worker->renderer;
+	struct pixman_frame *frames;
+	int num_frames;
+
+	pthread_mutex_lock(&pr->worker_mutex);
+	while (true) {
+		while (!pr->workers_stopping &&
+		       worker->frame_seq == pr->frame_seq)
+			pthread_cond_wait(&pr->worker_start_cond,
+					  &pr->worker_mutex);
+
+		if (pr->workers_stopping)
+			break;
+
+		worker->frame_seq = pr->frame_seq;
+		if (worker->index >= pr->active_workers)
+			continue;
+
+		frames = pr->frames;
+		num_frames = pr->num_frames;
+		pthread_mutex_unlock(&pr->worker_mutex);
+
+		pixman_frames_paint_bands(pr, frames, num_frames,
+					  (worker->index + 1) % num_frames);
+
+		pthread_mutex_lock(&pr->worker_mutex);
+		if (--pr->busy_workers == 0)
+			pthread_cond_signal(&pr->worker_done_cond);
+	}
+	pthread_mutex_unlock(&pr->worker_mutex);
+
+	return NULL;
+}
+
+/* Start workers up to the number of threads asked for, returns how many
+ * there are */
+static int
+pixman_renderer_ensure_workers(struct pixman_renderer *pr, int threads)
+{
+	struct pixman_worker *worker;
+	int wanted = MIN(threads, PIXMAN_THREADS_MAX) - 1;
+
+	while (pr->num_workers < wanted && !pr->worker_create_failed) {
+		worker = &pr->workers[pr->num_workers];
+		worker->renderer = pr;
+		worker->index = pr->num_workers;
+		/* Only the compositor thread changes frame_seq */
+		worker->frame_seq = pr->frame_seq;
+
+		if (pthread_create(&worker->thread, NULL,
+				   pixman_worker_thread, worker) != 0) {
+			weston_log("Pixman-renderer: failed to start a paint "
+				   "thread, using %d threads\n",
+				   pr->num_workers + 1);
+			pr->worker_create_failed = true;
+			break;
+		}
+
+		pr->num_workers++;
+	}
+
+	return MIN(wanted, pr->num_workers);
+}
+
+static void
+pixman_renderer_stop_workers(struct pixman_renderer *pr)
+{
+	int i;
+
+	pthread_mutex_lock(&pr->worker_mutex);
+	pr->workers_stopping = true;
+	pthread_cond_broadcast(&pr->worker_start_cond);
+	pthread_mutex_unlock(&pr->worker_mutex);
+
+	for (i = 0; i < pr->num_workers; i++)
+		pthread_join(pr->workers[i].thread, NULL);
+	pr->num_workers = 0;
+}
+
+/** Split the repaint of an output into bands of rows
+ *
+ * The bands span the whole width of the output, so pixman walks the same
+ * spans of every row as in a single pass, and the result is identical.
+ *
+ * \return false if the damage is too small for min_bands bands.
+ */
+static bool
+pixman_frame_init(struct pixman_frame *frame, struct weston_output *output,
+		  int max_bands, int min_bands, pixman_region32_t *damage,
+		  pixman_region32_t *hw_damage, bool use_shadow)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t output_region;
+	pixman_box32_t extents;
+	int width = pixman_image_get_width(po->hw_buffer);
+	int height, y1, y2, i;
+
+	pixman_region32_init(&output_region);
+	pixman_region32_copy(&output_region, hw_damage);
+	region_global_to_output(output, &output_region);
+	extents = *pixman_region32_extents(&output_region);
+	pixman_region32_fini(&output_region);
+
+	height = extents.y2 - extents.y1;
+	frame->num_bands = MIN(max_bands, height / PIXMAN_BAND_HEIGHT_MIN);
+	if (frame->num_bands < min_bands)
+		return false;
+
+	frame->output = output;
+	frame->damage = use_shadow ? damage : hw_damage;
+	frame->hw_damage = use_shadow ? hw_damage : NULL;
+	frame->next_band = 0;
+	frame->overdraw = 0;
+
+	for (i = 0; i < frame->num_bands; i++) {
+		y1 = extents.y1 + height * i / frame->num_bands;
+		y2 = extents.y1 + height * (i + 1) / frame->num_bands;
+		pixman_region32_init_rect(&frame->bands[i], 0, y1,
+					  width, y2 - y1);
+	}
+
+	return true;
+}
+
+static void
+pixman_frame_fini(struct pixman_frame *frame)
+{
+	int i;
+
+	for (i = 0; i < frame->num_bands; i++)
+		pixman_region32_fini(&frame->bands[i]);
+}
+
+/* On the compositor thread, after painting */
+static void
+pixman_renderer_warn_overdraw(struct pixman_renderer *pr, int overdraw)
+{
+	if (overdraw <= 1 || pr->overdraw_warned)
+		return;
+
+	weston_log("Pixman-renderer warning: %dx overdraw\n", overdraw);
+	pr->overdraw_warned = true;
+}
+
+/* The workers must not create surface states */
+static void
+pixman_renderer_ensure_surface_states(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			get_surface_state(view->surface);
+}
+
+/* Paint the bands of frames on the compositor thread and the workers */
+static void
+pixman_renderer_paint_frames(struct pixman_renderer *pr,
+			     struct pixman_frame *frames, int num_frames,
+			     int workers)
+{
+	pthread_mutex_lock(&pr->worker_mutex);
+	pr->frames = frames;
+	pr->num_frames = num_frames;
+	pr->active_workers = workers;
+	pr->busy_workers = workers;
+	pr->frame_seq++;
+	pthread_cond_broadcast(&pr->worker_start_cond);
+	pthread_mutex_unlock(&pr->worker_mutex);
+
+	pixman_frames_paint_bands(pr, frames, num_frames, 0);
+
+	pthread_mutex_lock(&pr->worker_mutex);
+	while (pr->busy_workers > 0)
+		pthread_cond_wait(&pr->worker_done_cond, &pr->worker_mutex);
+	pr->frames = NULL;
+	pr->num_frames = 0;
+	pthread_mutex_unlock(&pr->worker_mutex);
+}
+
+/* Paint the bands of one frame on the compositor thread and the workers */
+static bool
+repaint_output_threaded(struct weston_output *output,
+			pixman_region32_t *damage,
+			pixman_region32_t *hw_damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_renderer *pr = get_renderer(compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_frame frame;
+	int workers;
+
+	if (compositor->pixman_threads < 2)
+		return false;
+
+	workers = pixman_renderer_ensure_workers(pr,
+						 compositor->pixman_threads);
+	if (workers < 1)
+		return false;
+
+	if (!pixman_frame_init(&frame, output,
+			       (workers + 1) * PIXMAN_BANDS_PER_THREAD, 2,
+			       damage, hw_damage, po->shadow_image != NULL))
+		return false;
+
+	pixman_renderer_ensure_surface_states(compositor);
+	pixman_renderer_paint_frames(pr, &frame, 1, workers);
+	pixman_renderer_warn_overdraw(pr, frame.overdraw);
+	pixman_frame_fini(&frame);
+
+	return true;
+}
+
+static void
+repaint_output(struct weston_output *output, pixman_region32_t *damage,
+	       pixman_region32_t *hw_damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_paint paint;
+
+	if (repaint_output_threaded(output, damage, hw_damage))
+		return;
+
+	paint.target = po->shadow_image ? po->shadow_image : po->hw_buffer;
+	paint.hw_target = po->hw_buffer;
+	paint.debug_color = pr->repaint_debug ? pr->debug_color : NULL;
+	paint.band = NULL;
+	paint.overdraw = 0;
+
+	if (po->shadow_image) {
+		repaint_surfaces(output, &paint, damage);
+		copy_to_hw_buffer(output, &paint, hw_damage);
+	} else {
+		repaint_surfaces(output, &paint, hw_damage);
+	}
+
+	pixman_renderer_warn_overdraw(pr, paint.overdraw);
+}
+
+/* Paint the deferred outputs together, each in as many bands as the
+ * threads can share between them */
+static bool
+repaint_outputs_parallel(struct pixman_renderer *pr,
+			 struct weston_compositor *compositor,
+			 int num_outputs)
+{
+	struct pixman_output_state *po;
+	struct pixman_frame *frames;
+	int threads, workers, max_bands;
+	int num_frames = 0;
+	int i;
+
+	threads = MAX(compositor->pixman_threads, num_outputs);
+	workers = pixman_renderer_ensure_workers(pr, threads);
+	if (workers < 1)
+		return false;
+
+	frames = calloc(num_outputs, sizeof *frames);
+	if (!frames)
+		return false;
+
+	max_bands = MAX(1, (workers + 1) * PIXMAN_BANDS_PER_THREAD /
+			   num_outputs);
+
+	wl_list_for_each(po, &pr->deferred_list, deferred_link) {
+		if (pixman_frame_init(&frames[num_frames], po->output,
+				      max_bands, 1, &po->deferred_damage,
+				      &po->deferred_hw_damage,
+				      po->shadow_image != NULL))
+			num_frames++;
+		else
+			repaint_output(po->output, &po->deferred_damage,
+				       &po->deferred_hw_damage);
+	}
+
+	if (num_frames > 0) {
+		pixman_renderer_ensure_surface_states(compositor);
+		pixman_renderer_paint_frames(pr, frames, num_frames, workers);
+	}
+
+	for (i = 0; i < num_frames; i++) {
+		pixman_renderer_warn_overdraw(pr, frames[i].overdraw);
+		pixman_frame_fini(&frames[i]);
+	}
+	free(frames);
+
+	return true;
+}
+
+static void
+pixman_renderer_repaint_finish(struct weston_compositor *compositor)
+{
+	struct pixman_renderer *pr = get_renderer(compositor);
+	struct pixman_output_state *po, *tmp;
+	int num_outputs;
+
+	num_outputs = wl_list_length(&pr->deferred_list);
+	if (num_outputs == 0)
+		return;
+
+	if (num_outputs == 1 ||
+	    !repaint_outputs_parallel(pr, compositor, num_outputs)) {
+		wl_list_for_each(po, &pr->deferred_list, deferred_link)
+			repaint_output(po->output, &po->deferred_damage,
+				       &po->deferred_hw_damage);
+	}
+
+	wl_list_for_each_safe(po, tmp, &pr->deferred_list, deferred_link) {
+		wl_list_remove(&po->deferred_link);
+		po->deferred = false;
+
+		wl_signal_emit(&po->output->frame_signal, &po->deferred_damage);
+
+		pixman_region32_clear(&po->deferred_damage);
+		pixman_region32_clear(&po->deferred_hw_damage);
+	}
 }
 
 static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			       pixman_region32_t *output_damage)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
 	pixman_region32_t hw_damage;
 
@@ -585,12 +1138,23 @@ pixman_renderer_repaint_output(struct weston_output *output,
 		pixman_region32_copy(&hw_damage, output_damage);
 	}
 
-	if (po->shadow_image) {
-		repaint_surfaces(output, output_damage);
-		copy_to_hw_buffer(output, &hw_damage);
-	} else {
-		repaint_surfaces(output, &hw_damage);
+	/* Painted along with the other outputs of this repaint, before the
+	 * backend flushes them */
+	if (weston_compositor_repaint_is_deferred(output->compositor)) {
+		pixman_region32_union(&po->deferred_damage,
+				      &po->deferred_damage, output_damage);
+		pixman_region32_union(&po->deferred_hw_damage,
+				      &po->deferred_hw_damage, &hw_damage);
+		if (!po->deferred) {
+			wl_list_insert(pr->deferred_list.prev,
+				       &po->deferred_link);
+			po->deferred = true;
+		}
+		pixman_region32_fini(&hw_damage);
+		return;
 	}
+
+	repaint_output(output, output_damage, &hw_damage);
 	pixman_region32_fini(&hw_damage);
 
 	wl_signal_emit(&output->frame_signal, output_damage);
@@ -640,6 +1204,7 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	ps->is_solid = false;
 
 	if (!buffer)
 		return;
@@ -780,6 +1345,8 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	}
 
 	ps->image = pixman_image_create_solid_fill(&color);
+	ps->is_solid = true;
+	ps->color = color;
 }
 
 static void
@@ -787,6 +1354,11 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 {
 	struct pixman_renderer *pr = get_renderer(ec);
 
+	pixman_renderer_stop_workers(pr);
+	pthread_cond_destroy(&pr->worker_done_cond);
+	pthread_cond_destroy(&pr->worker_start_cond);
+	pthread_mutex_destroy(&pr->worker_mutex);
+
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
 	free(pr);
@@ -851,11 +1423,8 @@ debug_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color =
+			pixman_image_create_solid_fill(&repaint_debug_color);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -875,6 +1444,7 @@ pixman_renderer_init(struct weston_compositor *ec)
 	renderer->debug_color = NULL;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
 	renderer->base.repaint_output = pixman_renderer_repaint_output;
+	renderer->base.repaint_finish = pixman_renderer_repaint_finish;
 	renderer->base.flush_damage = pixman_renderer_flush_damage;
 	renderer->base.attach = pixman_renderer_attach;
 	renderer->base.surface_set_color = pixman_renderer_surface_set_color;
@@ -896,6 +1466,11 @@ pixman_renderer_init(struct weston_compositor *ec)
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
 
 	wl_signal_init(&renderer->destroy_signal);
+	wl_list_init(&renderer->deferred_list);
+
+	pthread_mutex_init(&renderer->worker_mutex, NULL);
+	pthread_cond_init(&renderer->worker_start_cond, NULL);
+	pthread_cond_init(&renderer->worker_done_cond, NULL);
 
 	return 0;
 }
@@ -959,6 +1534,10 @@ pixman_renderer_output_create(struct weston_output *output,
 		}
 	}
 
+	po->output = output;
+	pixman_region32_init(&po->deferred_damage);
+	pixman_region32_init(&po->deferred_hw_damage);
+
 	output->renderer_state = po;
 
 	return 0;
@@ -969,6 +1548,11 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
+	if (po->deferred)
+		wl_list_remove(&po->deferred_link);
+	pixman_region32_fini(&po->deferred_damage);
+	pixman_region32_fini(&po->deferred_hw_damage);
+
 	if (po->shadow_image)
 		pixman_image_unref(po->shadow_image);
 
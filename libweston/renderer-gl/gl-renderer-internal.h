@@ -28,7 +28,16 @@
 
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
+#include <GLES3/gl3.h>
 #include "shared/weston-egl-ext.h"  /* for PFN* stuff */
+#include "gl-renderer-private.h"
+
+/** A colorspace conversion matrix, memoized by gl_renderer_get_csc() */
+struct gl_csc_cache_entry {
+	bool valid;
+	float luminance_scale;
+	GLfloat matrix[9]; /* column-major 3x3 */
+};
 
 struct gl_renderer {
 	struct weston_renderer base;
@@ -49,6 +58,31 @@ struct gl_renderer {
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
 
+	/** Indexed triangles waiting to be drawn with the current state
+	 *
+	 * The indices refer to vertices[batch_first, batch_last), relative
+	 * to batch_first. See gl_renderer_flush_batch().
+	 */
+	struct wl_array indices;
+	struct wl_array fan_debug_indices;
+	unsigned int batch_first;
+	unsigned int batch_last;
+
+	/** Streaming buffer objects the batches are uploaded to */
+	GLuint vertex_buffer;
+	GLsizeiptr vertex_buffer_size;
+	GLuint index_buffer;
+	GLsizeiptr index_buffer_size;
+
+	/** Texture and blend state of the batch, -1 when unknown */
+	struct {
+		GLenum target;
+		GLuint textures[3];
+		int num_textures;
+		GLint filter;
+		int blend;
+	} batch_state;
+
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
 	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
@@ -101,12 +135,40 @@ struct gl_renderer {
 	bool has_wait_sync;
 	PFNEGLWAITSYNCKHRPROC wait_sync;
 
+	/** GLES 3 pixel pack buffers and syncs, for read_pixels_async */
+	bool has_pack_buffer;
+	PFNGLMAPBUFFERRANGEPROC map_buffer_range;
+	PFNGLUNMAPBUFFERPROC unmap_buffer;
+	PFNGLFENCESYNCPROC fence_sync;
+	PFNGLCLIENTWAITSYNCPROC client_wait_sync;
+	PFNGLDELETESYNCPROC delete_sync;
+
 	/** struct gl_shader::link
 	 *
 	 * List constains cached shaders built from struct gl_shader_requirements
 	 */
 	struct wl_list shader_list;
 
+	/** struct gl_shader::table_link
+	 *
+	 * Hash table over shader_list, indexed with gl_shader_table_index()
+	 * of the packed shader requirements.
+	 */
+	struct wl_list shader_table[GL_SHADER_TABLE_SIZE];
+
+	/** CSC matrices indexed by [source][destination] colorspace */
+	struct gl_csc_cache_entry csc_cache[WESTON_CS_UNDEFINED][WESTON_CS_UNDEFINED];
+
+	/** Uniform updates issued and skipped in the current repaint */
+	uint32_t uniforms_issued;
+	uint32_t uniforms_skipped;
+	/** Draw calls issued in the current repaint */
+	uint32_t draw_calls;
+
+	/** struct gl_shader_requirements waiting to be pre-warmed */
+	struct wl_array prewarm_queue;
+	struct wl_event_source *prewarm_source;
+
 	struct gl_shader_generator *sg;
 };
 
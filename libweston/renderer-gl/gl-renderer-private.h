@@ -77,8 +77,39 @@ struct gl_shader_requirements
 	enum gl_shader_tone_map_variant tone_mapping;
 };
 
+/* Number of bits used to index gl_renderer::shader_table */
+#define GL_SHADER_TABLE_BITS 6
+#define GL_SHADER_TABLE_SIZE (1 << GL_SHADER_TABLE_BITS)
+
+enum gl_shader_uniform {
+	GL_SHADER_UNIFORM_PROJ = 1 << 0,
+	GL_SHADER_UNIFORM_COLOR = 1 << 1,
+	GL_SHADER_UNIFORM_ALPHA = 1 << 2,
+	GL_SHADER_UNIFORM_TEX0 = 1 << 3,
+	GL_SHADER_UNIFORM_TEX1 = 1 << 4,
+	GL_SHADER_UNIFORM_TEX2 = 1 << 5,
+	GL_SHADER_UNIFORM_DISPLAY_MAX_LUMINANCE = 1 << 6,
+	GL_SHADER_UNIFORM_CONTENT_MAX_LUMINANCE = 1 << 7,
+	GL_SHADER_UNIFORM_CONTENT_MIN_LUMINANCE = 1 << 8,
+};
+
+/** Shadow copy of the uniform values last uploaded to a program */
+struct gl_shader_uniform_state {
+	uint32_t valid; /* mask of enum gl_shader_uniform */
+	GLfloat proj[16];
+	GLfloat color[4];
+	GLfloat alpha;
+	GLint tex[3];
+	GLfloat display_max_luminance;
+	GLfloat content_max_luminance;
+	GLfloat content_min_luminance;
+	/* gl_renderer::csc_cache entry, NULL if none uploaded yet */
+	const GLfloat *csc;
+};
+
 struct gl_shader {
 	struct gl_shader_requirements key;
+	uint32_t packed_key; /* gl_shader_requirements_pack(&key) */
 	GLuint program;
 	GLuint vertex_shader, fragment_shader;
 	GLint proj_uniform;
@@ -89,7 +120,11 @@ struct gl_shader {
 	GLint display_max_luminance;
 	GLint content_max_luminance;
 	GLint content_min_luminance;
+
+	struct gl_shader_uniform_state uniforms;
+
 	struct wl_list link; /* gl_renderer::shader_list */
+	struct wl_list table_link; /* gl_renderer::shader_table */
 };
 
 struct gl_shader_generator;
@@ -97,6 +132,16 @@ struct gl_shader_generator;
 void
 gl_shader_requirements_init(struct gl_shader_requirements *requirements);
 
+uint32_t
+gl_shader_requirements_pack(const struct gl_shader_requirements *requirements);
+
+static inline uint32_t
+gl_shader_table_index(uint32_t packed_key)
+{
+	/* Fibonacci hashing spreads the densely packed keys over the table */
+	return (packed_key * 2654435761u) >> (32 - GL_SHADER_TABLE_BITS);
+}
+
 void
 gl_shader_destroy(struct gl_shader *shader);
 
@@ -110,4 +155,7 @@ gl_shader_generator_create(struct weston_compositor *compositor);
 void
 gl_shader_generator_destroy(struct gl_shader_generator *sg);
 
+struct weston_log_scope *
+gl_shader_generator_get_debug_scope(struct gl_shader_generator *sg);
+
 #endif
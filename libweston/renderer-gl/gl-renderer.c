@@ -47,6 +47,7 @@
 #include "gl-renderer.h"
 #include "gl-renderer-internal.h"
 #include "vertex-clipping.h"
+#include "damage-simplify.h"
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 #include "linux-explicit-synchronization.h"
@@ -104,6 +105,26 @@ struct gl_output_state {
 	enum weston_colorspace_enums target_colorspace;
 	struct weston_hdr_metadata *target_hdr_metadata;
 	bool hdr_state_changed;
+
+	/* struct gl_readback::link, oldest first */
+	struct wl_list readback_list;
+	/* struct gl_readback::link, finished, to reuse the buffers of */
+	struct wl_list readback_pool;
+	struct wl_event_source *readback_timer;
+};
+
+/* Read-backs in flight per output, and buffers kept for reuse */
+#define GL_READBACK_MAX 3
+
+/** A read_pixels_async() into a pixel pack buffer */
+struct gl_readback {
+	struct wl_list link;
+	GLuint pbo;
+	GLsizeiptr size;
+	GLsync sync;
+	uint32_t width, height;
+	weston_read_pixels_done_func_t done;
+	void *data;
 };
 
 enum buffer_type {
@@ -229,6 +250,9 @@ static void
 use_gl_program(struct gl_renderer *gr,
 	       const struct gl_shader_requirements *requirements);
 
+static void
+gl_renderer_flush_batch(struct gl_renderer *gr);
+
 static inline const char *
 dump_format(uint32_t format, char out[4])
 {
@@ -623,32 +647,121 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	return nvtx;
 }
 
+/** Update the shadow copy of a uniform value
+ *
+ * \return true if the value differs from what was last uploaded to the
+ * program, and the caller must issue the glUniform call.
+ */
+static bool
+shader_uniform_changed(struct gl_renderer *gr, struct gl_shader *shader,
+		       GLint location, enum gl_shader_uniform uniform,
+		       void *shadow, const void *value, size_t size)
+{
+	/* Not in the program, so there is nothing to skip */
+	if (location < 0)
+		return false;
+
+	if ((shader->uniforms.valid & uniform) &&
+	    memcmp(shadow, value, size) == 0) {
+		gr->uniforms_skipped++;
+		return false;
+	}
+
+	gl_renderer_flush_batch(gr);
+
+	memcpy(shadow, value, size);
+	shader->uniforms.valid |= uniform;
+	gr->uniforms_issued++;
+
+	return true;
+}
+
 static void
-triangle_fan_debug(struct weston_view *view, int first, int count)
+shader_set_proj(struct gl_renderer *gr, struct gl_shader *shader,
+		const GLfloat *proj)
 {
-	struct weston_compositor *compositor = view->surface->compositor;
-	struct gl_renderer *gr = get_renderer(compositor);
-	int i;
-	GLushort *buffer;
-	GLushort *index;
-	int nelems;
-	static int color_idx = 0;
-	struct gl_shader *prev_shader = NULL;
-	struct gl_shader_requirements shader_requirements;
+	if (shader_uniform_changed(gr, shader, shader->proj_uniform,
+				   GL_SHADER_UNIFORM_PROJ,
+				   shader->uniforms.proj, proj,
+				   sizeof shader->uniforms.proj))
+		glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, proj);
+}
 
-	prev_shader = gr->current_shader;
+static void
+shader_set_color(struct gl_renderer *gr, struct gl_shader *shader,
+		 const GLfloat *color)
+{
+	if (shader_uniform_changed(gr, shader, shader->color_uniform,
+				   GL_SHADER_UNIFORM_COLOR,
+				   shader->uniforms.color, color,
+				   sizeof shader->uniforms.color))
+		glUniform4fv(shader->color_uniform, 1, color);
+}
 
-	static const GLfloat color[][4] = {
-			{ 1.0, 0.0, 0.0, 1.0 },
-			{ 0.0, 1.0, 0.0, 1.0 },
-			{ 0.0, 0.0, 1.0, 1.0 },
-			{ 1.0, 1.0, 1.0, 1.0 },
-	};
+static void
+shader_set_alpha(struct gl_renderer *gr, struct gl_shader *shader,
+		 GLfloat alpha)
+{
+	if (shader_uniform_changed(gr, shader, shader->alpha_uniform,
+				   GL_SHADER_UNIFORM_ALPHA,
+				   &shader->uniforms.alpha, &alpha,
+				   sizeof alpha))
+		glUniform1f(shader->alpha_uniform, alpha);
+}
+
+static void
+shader_set_textures(struct gl_renderer *gr, struct gl_shader *shader,
+		    int num_textures)
+{
+	GLint unit;
+
+	for (unit = 0; unit < num_textures; unit++)
+		if (shader_uniform_changed(gr, shader,
+					   shader->tex_uniforms[unit],
+					   GL_SHADER_UNIFORM_TEX0 << unit,
+					   &shader->uniforms.tex[unit], &unit,
+					   sizeof unit))
+			glUniform1i(shader->tex_uniforms[unit], unit);
+}
+
+static void
+shader_set_luminance(struct gl_renderer *gr, struct gl_shader *shader,
+		     GLint location, enum gl_shader_uniform uniform,
+		     GLfloat *shadow, GLfloat value)
+{
+	if (shader_uniform_changed(gr, shader, location, uniform,
+				   shadow, &value, sizeof value))
+		glUniform1f(location, value);
+}
+
+/* Batches are drawn with GLushort indices, the only index type core
+ * GLES2 supports. */
+#define BATCH_MAX_VERTICES (UINT16_MAX + 1)
+
+static void
+upload_stream(GLenum target, GLsizeiptr *capacity,
+	      const void *data, GLsizeiptr size)
+{
+	if (size > *capacity) {
+		while (*capacity < size)
+			*capacity = *capacity ? *capacity * 2 : 4096;
+	}
+
+	/* Orphan the previous storage, so that the driver does not have
+	 * to wait for draws still reading from it. */
+	glBufferData(target, *capacity, NULL, GL_STREAM_DRAW);
+	glBufferSubData(target, 0, size, data);
+}
 
-	nelems = (count - 1 + count - 2) * 2;
+static void
+triangle_fan_debug(struct gl_renderer *gr, unsigned int first,
+		   unsigned int count)
+{
+	GLushort *index;
+	unsigned int i;
 
-	buffer = malloc(sizeof(GLushort) * nelems);
-	index = buffer;
+	index = wl_array_add(&gr->fan_debug_indices,
+			     (count - 1 + count - 2) * 2 * sizeof *index);
 
 	for (i = 1; i < count; i++) {
 		*index++ = first;
@@ -659,17 +772,94 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 		*index++ = first + i - 1;
 		*index++ = first + i;
 	}
+}
+
+static void
+triangle_fan_debug_draw(struct gl_renderer *gr)
+{
+	static int color_idx = 0;
+	struct gl_shader *prev_shader = gr->current_shader;
+	struct gl_shader_requirements shader_requirements;
+	GLsizei nelems = gr->fan_debug_indices.size / sizeof(GLushort);
+
+	static const GLfloat color[][4] = {
+			{ 1.0, 0.0, 0.0, 1.0 },
+			{ 0.0, 1.0, 0.0, 1.0 },
+			{ 0.0, 0.0, 1.0, 1.0 },
+			{ 1.0, 1.0, 1.0, 1.0 },
+	};
 
 	gl_shader_requirements_init(&shader_requirements);
 	shader_requirements.variant = SHADER_VARIANT_SOLID;
 	use_gl_program(gr, &shader_requirements);
-	glUniform4fv(gr->current_shader->color_uniform, 1,
-			color[color_idx++ % ARRAY_LENGTH(color)]);
-	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
+	shader_set_color(gr, gr->current_shader,
+			 color[color_idx++ % ARRAY_LENGTH(color)]);
+
+	upload_stream(GL_ELEMENT_ARRAY_BUFFER, &gr->index_buffer_size,
+		      gr->fan_debug_indices.data, gr->fan_debug_indices.size);
+	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, NULL);
+	gr->draw_calls++;
+	gr->fan_debug_indices.size = 0;
 
 	gr->current_shader = prev_shader;
 	glUseProgram(gr->current_shader->program);
-	free(buffer);
+}
+
+/** Draw the geometry batched so far
+ *
+ * This must be called before changing any GL state the pending batch
+ * depends on: the program and its uniforms, the bound textures and the
+ * blend mode.
+ */
+static void
+gl_renderer_flush_batch(struct gl_renderer *gr)
+{
+	const GLsizei stride = 4 * sizeof(GLfloat);
+	GLsizei nelems = gr->indices.size / sizeof(GLushort);
+	GLfloat *v = gr->vertices.data;
+
+	if (nelems == 0)
+		return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, gr->vertex_buffer);
+	upload_stream(GL_ARRAY_BUFFER, &gr->vertex_buffer_size,
+		      &v[gr->batch_first * 4],
+		      (gr->batch_last - gr->batch_first) * stride);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gr->index_buffer);
+	upload_stream(GL_ELEMENT_ARRAY_BUFFER, &gr->index_buffer_size,
+		      gr->indices.data, gr->indices.size);
+
+	/* position: */
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void *) 0);
+	glEnableVertexAttribArray(0);
+
+	/* texcoord: */
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+			      (void *) (2 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(1);
+
+	/* The fan debug draw switches programs, which would flush again. */
+	gr->indices.size = 0;
+
+	glDrawElements(GL_TRIANGLES, nelems, GL_UNSIGNED_SHORT, NULL);
+	gr->draw_calls++;
+
+	if (gr->fan_debug_indices.size > 0)
+		triangle_fan_debug_draw(gr);
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	/* Other users of vertex attributes pass client memory. */
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	gr->batch_first = gr->batch_last;
+	if (gr->batch_last * stride == gr->vertices.size) {
+		gr->vertices.size = 0;
+		gr->batch_first = 0;
+		gr->batch_last = 0;
+	}
 }
 
 static void
@@ -678,9 +868,12 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v;
+	const size_t stride = 4 * sizeof(GLfloat);
 	unsigned int *vtxcnt;
-	int i, first, nfans;
+	unsigned int first, base, nvtx;
+	GLushort *index;
+	int i, nfans;
+	unsigned int k;
 
 	/* The final region to be painted is the intersection of
 	 * 'region' and 'surf_region'. However, 'region' is in the global
@@ -689,32 +882,45 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	 * rectangles from both regions, compute the intersection
 	 * polygon for each pair, and store it as a triangle fan if
 	 * it has a non-zero area (at least 3 vertices, actually).
+	 *
+	 * The fans are appended after the vertices of the views batched
+	 * before, and turned into indexed triangles here so that views
+	 * sharing the same state are drawn with a single call.
 	 */
+	first = gr->vertices.size / stride;
 	nfans = texture_region(ev, region, surf_region);
-
-	v = gr->vertices.data;
 	vtxcnt = gr->vtxcnt.data;
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glEnableVertexAttribArray(0);
-
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(1);
+	/* texture_region() reserves space for the worst case */
+	for (i = 0, nvtx = 0; i < nfans; i++)
+		nvtx += vtxcnt[i];
+	gr->vertices.size = (first + nvtx) * stride;
+
+	for (i = 0; i < nfans; i++) {
+		if (first + vtxcnt[i] - gr->batch_first > BATCH_MAX_VERTICES)
+			gl_renderer_flush_batch(gr);
+
+		base = first - gr->batch_first;
+		index = wl_array_add(&gr->indices,
+				     (vtxcnt[i] - 2) * 3 * sizeof *index);
+		for (k = 1; k + 1 < vtxcnt[i]; k++) {
+			*index++ = base;
+			*index++ = base + k;
+			*index++ = base + k + 1;
+		}
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
 		if (gr->fan_debug)
-			triangle_fan_debug(ev, first, vtxcnt[i]);
+			triangle_fan_debug(gr, base, vtxcnt[i]);
+
 		first += vtxcnt[i];
+		gr->batch_last = first;
 	}
 
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
-
-	gr->vertices.size = 0;
 	gr->vtxcnt.size = 0;
+
+	/* Give every region its own fan debug color */
+	if (gr->fan_debug)
+		gl_renderer_flush_batch(gr);
 }
 
 static int
@@ -740,57 +946,123 @@ use_output(struct weston_output *output)
 	return 0;
 }
 
+static struct gl_shader *
+gl_renderer_get_shader(struct gl_renderer *gr,
+		       const struct gl_shader_requirements *requirements,
+		       uint32_t packed_key)
+{
+	struct gl_shader *iterator, *shader;
+	struct wl_list *bucket;
+	struct gl_shader_requirements reqs;
+
+	bucket = &gr->shader_table[gl_shader_table_index(packed_key)];
+	wl_list_for_each(iterator, bucket, table_link)
+		if (iterator->packed_key == packed_key)
+			return iterator;
+
+	memcpy(&reqs, requirements, sizeof(struct gl_shader_requirements));
+	shader = gl_shader_create(gr->sg, &reqs);
+	if (!shader) {
+		weston_log("warning: failed to generate gl program\n");
+		return NULL;
+	}
+
+	wl_list_insert(&gr->shader_list, &shader->link);
+	wl_list_insert(bucket, &shader->table_link);
+
+	return shader;
+}
+
 static void
 use_gl_program(struct gl_renderer *gr,
 	       const struct gl_shader_requirements *requirements)
 {
-	struct gl_shader *iterator, *shader = NULL;
+	struct gl_shader *shader;
 	struct gl_shader_requirements reqs;
+	uint32_t packed_key;
 
 	memcpy(&reqs, requirements, sizeof(struct gl_shader_requirements));
 	if (gr->fragment_shader_debug)
 		reqs.debug = true;
 
-	wl_list_for_each(iterator, &gr->shader_list, link)
-		if (!memcmp(&reqs, &iterator->key,
-			    sizeof(struct gl_shader_requirements))) {
-			shader = iterator;
-			break;
-		}
-
-	if (!shader) {
-		shader = gl_shader_create(gr->sg, &reqs);
-		if (!shader) {
-			weston_log("warning: failed to generate gl program\n");
-			return;
-		}
-
-		wl_list_insert(&gr->shader_list, &shader->link);
-	}
+	packed_key = gl_shader_requirements_pack(&reqs);
+	if (gr->current_shader && gr->current_shader->packed_key == packed_key)
+		return;
 
-	if (gr->current_shader == shader)
+	shader = gl_renderer_get_shader(gr, &reqs, packed_key);
+	if (!shader)
 		return;
 
+	gl_renderer_flush_batch(gr);
 	glUseProgram(shader->program);
 	gr->current_shader = shader;
 }
 
+/** Get the 3x3 matrix converting from src to dst colorspace
+ *
+ * The colorspace definitions are constant, so the result only depends on
+ * the arguments and is computed once per combination.
+ *
+ * \return The matrix, or NULL if either colorspace is unknown.
+ */
+static const GLfloat *
+gl_renderer_get_csc(struct gl_renderer *gr, uint32_t src, uint32_t dst,
+		    float luminance_scale)
+{
+	struct gl_csc_cache_entry *entry;
+	const struct weston_colorspace *src_cs, *dst_cs;
+	struct weston_matrix csc_matrix;
+	struct gl_shader *shader;
+	float *d;
+	int i;
+
+	if (src >= WESTON_CS_UNDEFINED || dst >= WESTON_CS_UNDEFINED)
+		return NULL;
+
+	entry = &gr->csc_cache[src][dst];
+	if (entry->valid) {
+		if (entry->luminance_scale == luminance_scale)
+			return entry->matrix;
+
+		/* The entry is overwritten in place, make sure no shader
+		 * thinks it still holds the old contents. */
+		wl_list_for_each(shader, &gr->shader_list, link)
+			if (shader->uniforms.csc == entry->matrix)
+				shader->uniforms.csc = NULL;
+	}
+
+	src_cs = weston_colorspace_lookup(src);
+	dst_cs = weston_colorspace_lookup(dst);
+
+	weston_matrix_init(&csc_matrix);
+	weston_csc_matrix(&csc_matrix, dst_cs, src_cs, luminance_scale);
+
+	/* Drop the last row and column of the 4x4 matrix */
+	d = csc_matrix.d;
+	for (i = 0; i < 3; i++) {
+		memcpy(entry->matrix + 3 * i, d, 3 * sizeof(float));
+		d += 4;
+	}
+
+	entry->luminance_scale = luminance_scale;
+	entry->valid = true;
+
+	return entry->matrix;
+}
+
 static void
 shader_uniforms(struct gl_shader *shader,
 		struct weston_view *view,
 		struct weston_output *output)
 {
-	int i;
+	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_surface_state *gs = get_surface_state(view->surface);
 	struct gl_output_state *go = get_output_state(output);
 	struct weston_surface *surface = view->surface;
 	struct weston_hdr_metadata *src_md = surface->hdr_metadata;
 	struct weston_hdr_metadata *dst_md = go->target_hdr_metadata;
 	struct weston_hdr_metadata_static *static_metadata;
-	const struct weston_colorspace *src_cs, *dst_cs;
-	struct weston_matrix csc_matrix;
-	float csc[9] = {0};
-	float *dst;
+	const GLfloat *csc;
 	uint32_t display_max_luminance;
 	uint32_t content_max_luminance;
 	uint32_t content_min_luminance;
@@ -798,26 +1070,26 @@ shader_uniforms(struct gl_shader *shader,
 	// shader key contains the set of requirements used to build the shader
 	struct gl_shader_requirements *requirements = &shader->key;
 
-	glUniformMatrix4fv(shader->proj_uniform,
-			   1, GL_FALSE, go->output_matrix.d);
-	glUniform4fv(shader->color_uniform, 1, gs->color);
-	glUniform1f(shader->alpha_uniform, view->alpha);
-
-	for (i = 0; i < gs->num_textures; i++)
-		glUniform1i(shader->tex_uniforms[i], i);
+	shader_set_proj(gr, shader, go->output_matrix.d);
+	shader_set_color(gr, shader, gs->color);
+	shader_set_alpha(gr, shader, view->alpha);
+	shader_set_textures(gr, shader, gs->num_textures);
 
 	if (requirements->csc_matrix) {
-		weston_matrix_init(&csc_matrix);
-		src_cs = weston_colorspace_lookup(surface->colorspace);
-		dst_cs = weston_colorspace_lookup(go->target_colorspace);
-
-		weston_csc_matrix(&csc_matrix, dst_cs, src_cs, 1.0);
-		dst = csc_matrix.d;
-		for (i = 0; i < 3; i++) {
-			memcpy(csc + 3 * i, dst, 3 * sizeof(float));
-			dst += 4;
+		csc = gl_renderer_get_csc(gr, surface->colorspace,
+					  go->target_colorspace, 1.0);
+
+		/* Cached matrices are not modified while a shader refers
+		 * to them, so the same pointer means the same value. */
+		if (csc && csc != shader->uniforms.csc) {
+			gl_renderer_flush_batch(gr);
+			glUniformMatrix3fv(shader->csc_uniform, 1, GL_FALSE,
+					   csc);
+			shader->uniforms.csc = csc;
+			gr->uniforms_issued++;
+		} else if (csc) {
+			gr->uniforms_skipped++;
 		}
-		glUniformMatrix3fv(shader->csc_uniform, 1, GL_FALSE, csc);
 	}
 
 	switch(requirements->tone_mapping) {
@@ -825,19 +1097,32 @@ shader_uniforms(struct gl_shader *shader,
 		static_metadata = &src_md->metadata.static_metadata;
 		content_max_luminance = static_metadata->max_luminance;
 		content_min_luminance = static_metadata->min_luminance;
-		glUniform1f(shader->content_max_luminance,
-			    content_max_luminance);
-		glUniform1f(shader->content_min_luminance,
-			    content_min_luminance);
+		shader_set_luminance(gr, shader,
+				     shader->content_max_luminance,
+				     GL_SHADER_UNIFORM_CONTENT_MAX_LUMINANCE,
+				     &shader->uniforms.content_max_luminance,
+				     content_max_luminance);
+		shader_set_luminance(gr, shader,
+				     shader->content_min_luminance,
+				     GL_SHADER_UNIFORM_CONTENT_MIN_LUMINANCE,
+				     &shader->uniforms.content_min_luminance,
+				     content_min_luminance);
 		/* fallthrough */
 	case SHADER_TONE_MAP_SDR_TO_HDR:
 		static_metadata = &dst_md->metadata.static_metadata;
 		display_max_luminance = static_metadata->max_luminance;
-		glUniform1f(shader->display_max_luminance,
-			    display_max_luminance);
+		shader_set_luminance(gr, shader,
+				     shader->display_max_luminance,
+				     GL_SHADER_UNIFORM_DISPLAY_MAX_LUMINANCE,
+				     &shader->uniforms.display_max_luminance,
+				     display_max_luminance);
 		break;
 	default:
-		glUniform1f(shader->display_max_luminance, 1.0);
+		shader_set_luminance(gr, shader,
+				     shader->display_max_luminance,
+				     GL_SHADER_UNIFORM_DISPLAY_MAX_LUMINANCE,
+				     &shader->uniforms.display_max_luminance,
+				     1.0);
 		break;
 	}
 }
@@ -958,6 +1243,31 @@ setup_censor_overrides(struct weston_output *output,
 	return replaced_variant;
 }
 
+static enum gl_shader_gamma_variant
+gamma_from_hdr_metadata(const struct weston_hdr_metadata *dst_md)
+{
+	if (dst_md) {
+		switch (dst_md->metadata.static_metadata.eotf) {
+		case WESTON_EOTF_ST2084:
+			return SHADER_GAMMA_PQ;
+		case WESTON_EOTF_HLG:
+			return SHADER_GAMMA_HLG;
+		}
+	}
+
+	return SHADER_GAMMA_SRGB;
+}
+
+static enum gl_shader_tone_map_variant
+tone_map_variant(bool src_hdr, bool dst_hdr)
+{
+	if (dst_hdr)
+		return src_hdr ? SHADER_TONE_MAP_HDR_TO_HDR :
+				 SHADER_TONE_MAP_SDR_TO_HDR;
+
+	return src_hdr ? SHADER_TONE_MAP_HDR_TO_SDR : SHADER_TONE_MAP_NONE;
+}
+
 static void
 compute_hdr_requirements_from_view(struct weston_view *ev,
 				   struct weston_output *output)
@@ -968,9 +1278,8 @@ compute_hdr_requirements_from_view(struct weston_view *ev,
 	struct weston_hdr_metadata *src_md = surface->hdr_metadata;
 	struct weston_hdr_metadata *dst_md = go->target_hdr_metadata;
 	uint32_t target_colorspace = go->target_colorspace;
-	bool needs_csc = false, needs_tm = false;
+	bool needs_csc = false;
 	uint32_t degamma = 0, gamma = 0;
-	enum gl_shader_tone_map_variant tone_map_type = SHADER_TONE_MAP_NONE;
 
 	/* Start by assuming that we don't need color space conversion */
 	/* and tone mapping. This resets the csc and tone mapping requirements */
@@ -979,7 +1288,6 @@ compute_hdr_requirements_from_view(struct weston_view *ev,
 	gs->shader_requirements.tone_mapping = SHADER_TONE_MAP_NONE;
 
 	needs_csc = surface->colorspace != target_colorspace;
-	needs_tm = src_md || dst_md;
 
 	if (needs_csc)
 		gs->shader_requirements.csc_matrix = true;
@@ -1000,38 +1308,67 @@ compute_hdr_requirements_from_view(struct weston_view *ev,
 
 	gs->shader_requirements.degamma = degamma;
 
-	if (needs_tm) {
-		if (dst_md) {
-			if (src_md)
-				tone_map_type = SHADER_TONE_MAP_HDR_TO_HDR;
-			else
-				tone_map_type = SHADER_TONE_MAP_SDR_TO_HDR;
-		} else {
-			if (src_md)
-				tone_map_type = SHADER_TONE_MAP_HDR_TO_SDR;
-			else
-				tone_map_type = SHADER_TONE_MAP_NONE;
-		}
-	}
+	gs->shader_requirements.tone_mapping =
+		tone_map_variant(src_md != NULL, dst_md != NULL);
 
-	gs->shader_requirements.tone_mapping = tone_map_type;
-
-	gamma = SHADER_GAMMA_SRGB;
-	if (dst_md) {
-		switch (dst_md->metadata.static_metadata.eotf) {
-		case WESTON_EOTF_ST2084:
-			gamma = SHADER_GAMMA_PQ;
-			break;
-		case WESTON_EOTF_HLG:
-			gamma = SHADER_GAMMA_HLG;
-			break;
-		}
-	}
+	gamma = gamma_from_hdr_metadata(dst_md);
 
 	gs->shader_requirements.nl_variant = gamma;
 	gs->shader_requirements.gamma = gamma;
 }
 
+static void
+batch_set_blend(struct gl_renderer *gr, bool blend)
+{
+	if (gr->batch_state.blend == blend)
+		return;
+
+	gl_renderer_flush_batch(gr);
+
+	if (blend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
+
+	gr->batch_state.blend = blend;
+}
+
+static void
+batch_bind_textures(struct gl_renderer *gr, struct gl_surface_state *gs,
+		    GLint filter)
+{
+	int i;
+
+	if (gr->batch_state.num_textures == gs->num_textures &&
+	    gr->batch_state.target == gs->target &&
+	    gr->batch_state.filter == filter &&
+	    memcmp(gr->batch_state.textures, gs->textures,
+		   gs->num_textures * sizeof gs->textures[0]) == 0)
+		return;
+
+	gl_renderer_flush_batch(gr);
+
+	for (i = 0; i < gs->num_textures; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(gs->target, gs->textures[i]);
+		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
+		gr->batch_state.textures[i] = gs->textures[i];
+	}
+
+	gr->batch_state.num_textures = gs->num_textures;
+	gr->batch_state.target = gs->target;
+	gr->batch_state.filter = filter;
+}
+
+static void
+batch_state_reset(struct gl_renderer *gr)
+{
+	gr->batch_state.num_textures = -1;
+	gr->batch_state.filter = -1;
+	gr->batch_state.blend = -1;
+}
+
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
 	  pixman_region32_t *damage) /* in global coordinates */
@@ -1093,12 +1430,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	else
 		filter = GL_NEAREST;
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
-	}
+	batch_bind_textures(gr, gs, filter);
 
 	/* blended region is whole surface minus opaque region: */
 	pixman_region32_init_rect(&surface_blend, 0, 0,
@@ -1132,10 +1464,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 			shader_uniforms(gr->current_shader, ev, output);
 		}
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
-		else
-			glDisable(GL_BLEND);
+		batch_set_blend(gr, ev->alpha < 1.0);
 
 		repaint_region(ev, &repaint, &surface_opaque);
 		gs->used_in_output_repaint = true;
@@ -1143,7 +1472,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 
 	if (pixman_region32_not_empty(&surface_blend)) {
 		use_gl_program(gr, &gs->shader_requirements);
-		glEnable(GL_BLEND);
+		batch_set_blend(gr, true);
 		repaint_region(ev, &repaint, &surface_blend);
 		gs->used_in_output_repaint = true;
 	}
@@ -1162,11 +1491,18 @@ static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
 	struct weston_view *view;
 
+	/* Textures may have been re-created and other paths change the
+	 * blend mode between repaints. */
+	batch_state_reset(gr);
+
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
 			draw_view(view, output, damage);
+
+	gl_renderer_flush_batch(gr);
 }
 
 static int
@@ -1315,6 +1651,178 @@ output_has_borders(struct weston_output *output)
 	       go->borders[GL_RENDERER_BORDER_LEFT].data;
 }
 
+static void
+border_shader_requirements(struct gl_shader_requirements *requirements,
+			   uint32_t target_colorspace,
+			   const struct weston_hdr_metadata *dst_md)
+{
+	gl_shader_requirements_init(requirements);
+	requirements->variant = SHADER_VARIANT_RGBA;
+
+	// assuming that the borders are always BT709
+	if (target_colorspace != WESTON_CS_BT709)
+		requirements->csc_matrix = true;
+	else
+		requirements->csc_matrix = false;
+
+	requirements->degamma = SHADER_DEGAMMA_SRGB;
+	requirements->gamma = gamma_from_hdr_metadata(dst_md);
+
+	if (dst_md)
+		requirements->tone_mapping = SHADER_TONE_MAP_SDR_TO_HDR;
+}
+
+/* Pause between two pre-warmed shaders, so that client requests and
+ * repaints can be handled in between. */
+#define SHADER_PREWARM_INTERVAL_MS 1
+
+static int
+shader_prewarm_handler(void *data)
+{
+	struct gl_renderer *gr = data;
+	struct gl_shader_requirements reqs;
+
+	if (gr->prewarm_queue.size == 0)
+		return 0;
+
+	memcpy(&reqs, gr->prewarm_queue.data, sizeof reqs);
+	gr->prewarm_queue.size -= sizeof reqs;
+	memmove(gr->prewarm_queue.data,
+		(char *)gr->prewarm_queue.data + sizeof reqs,
+		gr->prewarm_queue.size);
+
+	/* Outputs may have been destroyed since the shaders were queued,
+	 * taking the current EGL surface with them. */
+	if (eglGetCurrentContext() != gr->egl_context &&
+	    !eglMakeCurrent(gr->egl_display, gr->dummy_surface,
+			    gr->dummy_surface, gr->egl_context)) {
+		weston_log("Failed to make EGL context current for "
+			   "shader pre-warming.\n");
+		gr->prewarm_queue.size = 0;
+		return 0;
+	}
+
+	if (gr->fragment_shader_debug)
+		reqs.debug = true;
+
+	gl_renderer_get_shader(gr, &reqs, gl_shader_requirements_pack(&reqs));
+
+	if (gr->prewarm_queue.size > 0)
+		wl_event_source_timer_update(gr->prewarm_source,
+					     SHADER_PREWARM_INTERVAL_MS);
+
+	return 0;
+}
+
+static void
+shader_prewarm_queue(struct gl_renderer *gr,
+		     const struct gl_shader_requirements *requirements)
+{
+	struct gl_shader_requirements *queued;
+	struct gl_shader *shader;
+	struct wl_list *bucket;
+	uint32_t packed_key;
+
+	packed_key = gl_shader_requirements_pack(requirements);
+	bucket = &gr->shader_table[gl_shader_table_index(packed_key)];
+	wl_list_for_each(shader, bucket, table_link)
+		if (shader->packed_key == packed_key)
+			return;
+
+	wl_array_for_each(queued, &gr->prewarm_queue)
+		if (gl_shader_requirements_pack(queued) == packed_key)
+			return;
+
+	queued = wl_array_add(&gr->prewarm_queue, sizeof *queued);
+	if (queued)
+		memcpy(queued, requirements, sizeof *queued);
+}
+
+/** Queue every shader the output can need for its current target
+ *
+ * Mirrors compute_hdr_requirements_from_view() and draw_output_borders():
+ * the output target fixes the gamma and whether tone mapping is towards
+ * SDR or HDR, while surfaces may use any texture variant, colorspace and
+ * transfer function.
+ */
+static void
+gl_renderer_output_prewarm_shaders(struct weston_output *output)
+{
+	static const enum gl_shader_texture_variant variants[] = {
+		SHADER_VARIANT_RGBA,
+		SHADER_VARIANT_RGBX,
+		SHADER_VARIANT_SOLID,
+		SHADER_VARIANT_Y_UV,
+		SHADER_VARIANT_Y_U_V,
+		SHADER_VARIANT_Y_XUXV,
+		SHADER_VARIANT_Y_XYUV,
+		SHADER_VARIANT_EXTERNAL,
+	};
+	static const enum gl_shader_degamma_variant hdr_degammas[] = {
+		SHADER_DEGAMMA_PQ,
+		SHADER_DEGAMMA_HLG,
+		SHADER_DEGAMMA_SRGB,
+	};
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	const struct weston_hdr_metadata *dst_md = go->target_hdr_metadata;
+	struct gl_shader_requirements reqs;
+	struct wl_event_loop *loop;
+	unsigned v, d;
+	int csc;
+
+	if (!output->shader_prewarm)
+		return;
+
+	for (v = 0; v < ARRAY_LENGTH(variants); v++) {
+		if (variants[v] == SHADER_VARIANT_EXTERNAL &&
+		    !gr->has_egl_image_external)
+			continue;
+
+		for (csc = 0; csc <= 1; csc++) {
+			gl_shader_requirements_init(&reqs);
+			reqs.variant = variants[v];
+			reqs.csc_matrix = csc;
+			reqs.gamma = gamma_from_hdr_metadata(dst_md);
+			reqs.nl_variant = reqs.gamma;
+
+			/* SDR surface, without HDR metadata */
+			reqs.degamma = SHADER_DEGAMMA_SRGB;
+			reqs.tone_mapping = tone_map_variant(false,
+							     dst_md != NULL);
+			shader_prewarm_queue(gr, &reqs);
+
+			/* HDR surface, with any transfer function */
+			reqs.tone_mapping = tone_map_variant(true,
+							     dst_md != NULL);
+			for (d = 0; d < ARRAY_LENGTH(hdr_degammas); d++) {
+				reqs.degamma = hdr_degammas[d];
+				shader_prewarm_queue(gr, &reqs);
+			}
+		}
+	}
+
+	border_shader_requirements(&reqs, go->target_colorspace, dst_md);
+	shader_prewarm_queue(gr, &reqs);
+
+	if (gr->prewarm_queue.size == 0)
+		return;
+
+	if (!gr->prewarm_source) {
+		loop = wl_display_get_event_loop(output->compositor->wl_display);
+		gr->prewarm_source =
+			wl_event_loop_add_timer(loop, shader_prewarm_handler,
+						gr);
+		if (!gr->prewarm_source) {
+			gr->prewarm_queue.size = 0;
+			return;
+		}
+	}
+
+	wl_event_source_timer_update(gr->prewarm_source,
+				     SHADER_PREWARM_INTERVAL_MS);
+}
+
 static void
 draw_output_borders(struct weston_output *output,
 		    enum gl_border_status border_status)
@@ -1327,7 +1835,6 @@ draw_output_borders(struct weston_output *output,
 	struct weston_matrix matrix;
 	int full_width, full_height;
 	struct gl_shader_requirements shader_requirements;
-	int gamma = 0;
 
 	if (border_status == BORDER_STATUS_CLEAN)
 		return; /* Clean. Nothing to do. */
@@ -1341,33 +1848,8 @@ draw_output_borders(struct weston_output *output,
 	full_height = output->current_mode->height + top->height + bottom->height;
 
 	glDisable(GL_BLEND);
-	gl_shader_requirements_init(&shader_requirements);
-	shader_requirements.variant = SHADER_VARIANT_RGBA;
-
-	// assuming that the borders are always BT709
-	if (target_colorspace != WESTON_CS_BT709)
-		shader_requirements.csc_matrix = true;
-	else
-		shader_requirements.csc_matrix = false;
-
-	shader_requirements.degamma = SHADER_DEGAMMA_SRGB;
-
-	gamma = SHADER_GAMMA_SRGB;
-	if (dst_md) {
-		switch (dst_md->metadata.static_metadata.eotf) {
-		case WESTON_EOTF_ST2084:
-			gamma = SHADER_GAMMA_PQ;
-			break;
-		case WESTON_EOTF_HLG:
-			gamma = SHADER_GAMMA_HLG;
-			break;
-		}
-	}
-	shader_requirements.gamma = gamma;
-
-	if (dst_md)
-		shader_requirements.tone_mapping = SHADER_TONE_MAP_SDR_TO_HDR;
-
+	border_shader_requirements(&shader_requirements, target_colorspace,
+				   dst_md);
 	use_gl_program(gr, &shader_requirements);
 
 	glViewport(0, 0, full_width, full_height);
@@ -1375,12 +1857,14 @@ draw_output_borders(struct weston_output *output,
 	weston_matrix_init(&matrix);
 	weston_matrix_translate(&matrix, -full_width/2.0, -full_height/2.0, 0);
 	weston_matrix_scale(&matrix, 2.0/full_width, -2.0/full_height, 1);
-	glUniformMatrix4fv(gr->current_shader->proj_uniform, 1,
-			   GL_FALSE, matrix.d);
-
-	glUniform1i(gr->current_shader->tex_uniforms[0], 0);
-	glUniform1f(gr->current_shader->alpha_uniform, 1);
-	glUniform1f(gr->current_shader->display_max_luminance, 1.0);
+	shader_set_proj(gr, gr->current_shader, matrix.d);
+	shader_set_textures(gr, gr->current_shader, 1);
+	shader_set_alpha(gr, gr->current_shader, 1.0);
+	shader_set_luminance(gr, gr->current_shader,
+			     gr->current_shader->display_max_luminance,
+			     GL_SHADER_UNIFORM_DISPLAY_MAX_LUMINANCE,
+			     &gr->current_shader->uniforms.display_max_luminance,
+			     1.0);
 
 	glActiveTexture(GL_TEXTURE0);
 
@@ -1566,6 +2050,220 @@ pixman_region_to_egl_y_invert(struct weston_output *output,
 	pixman_region32_fini(&transformed);
 }
 
+/* GL format to read pixels in, 0 if they cannot be */
+static GLenum
+gl_format_from_read_format(pixman_format_code_t format)
+{
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		return GL_BGRA_EXT;
+	case PIXMAN_a8b8g8r8:
+		return GL_RGBA;
+	default:
+		return 0;
+	}
+}
+
+static void
+gl_readback_destroy(struct gl_readback *rb)
+{
+	wl_list_remove(&rb->link);
+	glDeleteBuffers(1, &rb->pbo);
+	free(rb);
+}
+
+/* Hands the pixels of a read-back to its owner, once the GPU has written
+ * them if wait is false. The context must be current. */
+static bool
+gl_readback_finish(struct gl_renderer *gr, struct gl_output_state *go,
+		   struct gl_readback *rb, bool wait)
+{
+	GLenum status;
+	void *pixels;
+
+	if (!wait) {
+		status = gr->client_wait_sync(rb->sync, 0, 0);
+		if (status != GL_ALREADY_SIGNALED &&
+		    status != GL_CONDITION_SATISFIED)
+			return false;
+	}
+
+	gr->delete_sync(rb->sync);
+	rb->sync = NULL;
+	/* On no list while done runs, so it cannot reuse the buffer */
+	wl_list_remove(&rb->link);
+	wl_list_init(&rb->link);
+
+	/* Mapping waits for the GPU, if it still has to */
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	pixels = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0,
+				      rb->width * rb->height * 4,
+				      GL_MAP_READ_BIT);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	/* done may start another read-back */
+	rb->done(rb->data, pixels);
+
+	if (pixels) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+		gr->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	if (wl_list_length(&go->readback_pool) >= GL_READBACK_MAX)
+		gl_readback_destroy(rb);
+	else
+		wl_list_insert(go->readback_pool.prev, &rb->link);
+
+	return true;
+}
+
+/* Finishes the read-backs the GPU is done with, or all of them */
+static void
+gl_output_finish_readbacks(struct weston_output *output, bool wait)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_readback *rb;
+
+	/* In order, and done may add more to the list */
+	while (!wl_list_empty(&go->readback_list)) {
+		rb = container_of(go->readback_list.next,
+				  struct gl_readback, link);
+		if (!gl_readback_finish(gr, go, rb, wait))
+			break;
+	}
+}
+
+static void
+gl_output_arm_readback_timer(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	int msec = 16;
+
+	/* A frame, in case no repaint picks the read-backs up before */
+	if (output->current_mode && output->current_mode->refresh > 0)
+		msec = MAX(1000000 / output->current_mode->refresh, 1);
+
+	wl_event_source_timer_update(go->readback_timer, msec);
+}
+
+static int
+gl_output_readback_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+	struct gl_output_state *go = get_output_state(output);
+
+	if (use_output(output) < 0)
+		return 0;
+
+	gl_output_finish_readbacks(output, false);
+	if (!wl_list_empty(&go->readback_list))
+		gl_output_arm_readback_timer(output);
+
+	return 0;
+}
+
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_done_func_t done, void *data)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct wl_event_loop *loop;
+	struct gl_readback *rb, *tmp;
+	GLsizeiptr size = (GLsizeiptr)width * height * 4;
+	GLenum gl_format;
+
+	gl_format = gl_format_from_read_format(format);
+	if (gl_format == 0 || size == 0)
+		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	if (!go->readback_timer) {
+		loop = wl_display_get_event_loop(output->compositor->wl_display);
+		go->readback_timer =
+			wl_event_loop_add_timer(loop,
+						gl_output_readback_timer_handler,
+						output);
+		if (!go->readback_timer)
+			return -1;
+	}
+
+	/* Bound the memory held by read-backs nobody picks up */
+	if (wl_list_length(&go->readback_list) >= GL_READBACK_MAX) {
+		rb = container_of(go->readback_list.next,
+				  struct gl_readback, link);
+		gl_readback_finish(gr, go, rb, true);
+	}
+
+	rb = NULL;
+	wl_list_for_each(tmp, &go->readback_pool, link) {
+		if (tmp->size >= size) {
+			rb = tmp;
+			break;
+		}
+	}
+	if (rb) {
+		wl_list_remove(&rb->link);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	} else {
+		rb = zalloc(sizeof *rb);
+		if (!rb)
+			return -1;
+		glGenBuffers(1, &rb->pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		rb->size = size;
+	}
+
+	rb->width = width;
+	rb->height = height;
+	rb->done = done;
+	rb->data = data;
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	/* Flushed, so that the fence signals without anyone waiting */
+	rb->sync = gr->fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+
+	wl_list_insert(go->readback_list.prev, &rb->link);
+	gl_output_arm_readback_timer(output);
+
+	return 0;
+}
+
+/* Merges damage down the way weston_compositor::damage_rects_max and
+ * damage_waste_max ask for, dst may be src */
+static void
+simplify_damage(struct weston_output *output, pixman_region32_t *dst,
+		pixman_region32_t *src, const char *tp_name)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_damage_simplify params = {
+		.max_rects = compositor->damage_rects_max,
+		.max_waste_percent = compositor->damage_waste_max,
+	};
+	struct weston_timeline_damage_rects rects;
+
+	rects.before = pixman_region32_n_rects(src);
+	rects.after = weston_damage_simplify(dst, src, &params);
+
+	TL_POINT(compositor, tp_name, TLP_OUTPUT(output),
+		 TLP_DAMAGE_RECTS(&rects), TLP_END);
+}
+
 /* NOTE: We now allow falling back to ARGB gl visuals when XRGB is
  * unavailable, so we're assuming the background has no transparency
  * and that everything with a blend, like drop shadows, will have something
@@ -1591,10 +2289,19 @@ gl_renderer_repaint_output(struct weston_output *output,
 	struct weston_view *view;
 	pixman_region32_t full_damage;
 	pixman_region32_t *repaint_damage;
+	struct weston_log_scope *debug;
+	int fd;
 
 	if (use_output(output) < 0)
 		return;
 
+	/* Read-backs of the previous frames are likely done by now */
+	gl_output_finish_readbacks(output, false);
+
+	gr->uniforms_issued = 0;
+	gr->uniforms_skipped = 0;
+	gr->draw_calls = 0;
+
 	pixman_region32_init_rect(&full_damage, 0, 0,
 				  output->current_mode->width,
 				  output->current_mode->height);
@@ -1667,6 +2374,11 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_union(&total_damage, &previous_damage, output_damage);
 	border_status |= go->border_status;
 
+	/* Fewer, larger rectangles are cheaper to clip the views against
+	 * and to hand to EGL than many tiny ones */
+	simplify_damage(output, &total_damage, &total_damage,
+			"renderer_damage_simplified");
+
 	if (gr->has_egl_partial_update && !gr->fan_debug) {
 		int n_egl_rects;
 		EGLint *egl_rects;
@@ -1695,19 +2407,34 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	draw_output_borders(output, border_status);
 
+	debug = gl_shader_generator_get_debug_scope(gr->sg);
+	if (weston_log_scope_is_enabled(debug))
+		weston_log_scope_printf(debug,
+					"output '%s': %u draw calls, "
+					"%u uniform updates issued, "
+					"%u skipped\n", output->name,
+					gr->draw_calls, gr->uniforms_issued,
+					gr->uniforms_skipped);
+
 	wl_signal_emit(&output->frame_signal, output_damage);
 
 	go->end_render_sync = create_render_sync(gr);
 
 	if (gr->swap_buffers_with_damage && !gr->fan_debug) {
+		pixman_region32_t swap_damage;
 		int n_egl_rects;
 		EGLint *egl_rects;
 
 		/* For swap_buffers_with_damage, we need to pass the region
 		 * which has changed since the previous SwapBuffers on this
-		 * surface - this is output_damage. */
-		pixman_region_to_egl_y_invert(output, output_damage,
+		 * surface - this is output_damage. Reporting more than that
+		 * is harmless, the buffer is up to date everywhere. */
+		pixman_region32_init(&swap_damage);
+		simplify_damage(output, &swap_damage, output_damage,
+				"renderer_swap_damage_simplified");
+		pixman_region_to_egl_y_invert(output, &swap_damage,
 					      &egl_rects, &n_egl_rects);
+		pixman_region32_fini(&swap_damage);
 		ret = gr->swap_buffers_with_damage(gr->egl_display,
 						   go->egl_surface,
 						   egl_rects, n_egl_rects);
@@ -1733,6 +2460,15 @@ gl_renderer_repaint_output(struct weston_output *output,
 	timeline_submit_render_sync(gr, compositor, output, go->end_render_sync,
 				    TIMELINE_RENDER_POINT_TYPE_END);
 
+	/* Rendering ends when the GPU is done, for the repaint window */
+	if (go->end_render_sync != EGL_NO_SYNC_KHR &&
+	    weston_output_wants_render_fence(output)) {
+		fd = gr->dup_native_fence_fd(gr->egl_display,
+					     go->end_render_sync);
+		if (fd != EGL_NO_NATIVE_FENCE_FD_ANDROID)
+			weston_output_set_render_fence(output, fd);
+	}
+
 	update_buffer_release_fences(compositor, output);
 
 	go->hdr_state_changed = false;
@@ -1751,16 +2487,9 @@ gl_renderer_read_pixels(struct weston_output *output,
 	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
 	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
 
-	switch (format) {
-	case PIXMAN_a8r8g8b8:
-		gl_format = GL_BGRA_EXT;
-		break;
-	case PIXMAN_a8b8g8r8:
-		gl_format = GL_RGBA;
-		break;
-	default:
+	gl_format = gl_format_from_read_format(format);
+	if (gl_format == 0)
 		return -1;
-	}
 
 	if (use_output(output) < 0)
 		return -1;
@@ -3008,12 +3737,11 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	else
 		proj = projmat_yinvert;
 
-	glUniformMatrix4fv(gr->current_shader->proj_uniform, 1, GL_FALSE, proj);
-	glUniform1f(gr->current_shader->alpha_uniform, 1.0f);
+	shader_set_proj(gr, gr->current_shader, proj);
+	shader_set_alpha(gr, gr->current_shader, 1.0f);
+	shader_set_textures(gr, gr->current_shader, gs->num_textures);
 
 	for (i = 0; i < gs->num_textures; i++) {
-		glUniform1i(gr->current_shader->tex_uniforms[i], i);
-
 		glActiveTexture(GL_TEXTURE0 + i);
 		glBindTexture(gs->target, gs->textures[i]);
 		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -3271,6 +3999,8 @@ gl_renderer_output_create(struct weston_output *output,
 		pixman_region32_init(&go->buffer_damage[i]);
 
 	wl_list_init(&go->timeline_render_point_list);
+	wl_list_init(&go->readback_list);
+	wl_list_init(&go->readback_pool);
 
 	go->begin_render_sync = EGL_NO_SYNC_KHR;
 	go->end_render_sync = EGL_NO_SYNC_KHR;
@@ -3283,6 +4013,8 @@ gl_renderer_output_create(struct weston_output *output,
 	go->target_hdr_metadata = NULL;
 	go->hdr_state_changed = false;
 
+	gl_renderer_output_prewarm_shaders(output);
+
 	return 0;
 }
 
@@ -3357,11 +4089,24 @@ gl_renderer_output_destroy(struct weston_output *output)
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_output_state *go = get_output_state(output);
 	struct timeline_render_point *trp, *tmp;
+	struct gl_readback *rb, *rb_tmp;
 	int i;
 
 	for (i = 0; i < 2; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
+	/* Whoever waits for read-backs gets them still */
+	if (!wl_list_empty(&go->readback_list) && use_output(output) == 0)
+		gl_output_finish_readbacks(output, true);
+	wl_list_for_each_safe(rb, rb_tmp, &go->readback_list, link) {
+		rb->done(rb->data, NULL);
+		gl_readback_destroy(rb);
+	}
+	wl_list_for_each_safe(rb, rb_tmp, &go->readback_pool, link)
+		gl_readback_destroy(rb);
+	if (go->readback_timer)
+		wl_event_source_remove(go->readback_timer);
+
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
 		       EGL_NO_CONTEXT);
@@ -3413,10 +4158,17 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
+	if (gr->prewarm_source)
+		wl_event_source_remove(gr->prewarm_source);
+	wl_array_release(&gr->prewarm_queue);
+
 	wl_list_for_each_safe(shader, next_shader, &gr->shader_list, link) {
 		gl_shader_destroy(shader);
 	}
 
+	glDeleteBuffers(1, &gr->vertex_buffer);
+	glDeleteBuffers(1, &gr->index_buffer);
+
 	/* Work around crash in egl_dri2.c's dri2_make_current() - when does this apply? */
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
@@ -3440,6 +4192,8 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->indices);
+	wl_array_release(&gr->fan_debug_indices);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
@@ -3507,6 +4261,8 @@ gl_renderer_set_output_colorspace(struct weston_output *output,
 
 	go->target_colorspace = colorspace;
 	go->hdr_state_changed = true;
+
+	gl_renderer_output_prewarm_shaders(output);
 }
 
 static void
@@ -3524,6 +4280,8 @@ gl_renderer_set_output_hdr_metadata(struct weston_output *output,
 
 	go->target_hdr_metadata = hdr_metadata;
 	go->hdr_state_changed = true;
+
+	gl_renderer_output_prewarm_shaders(output);
 }
 
 static int
@@ -3531,6 +4289,7 @@ gl_renderer_display_create(struct weston_compositor *ec,
 			   const struct gl_renderer_display_options *options)
 {
 	struct gl_renderer *gr;
+	int i;
 
 	gr = zalloc(sizeof *gr);
 	if (gr == NULL)
@@ -3544,6 +4303,9 @@ gl_renderer_display_create(struct weston_compositor *ec,
 		goto fail;
 
 	wl_list_init(&gr->shader_list);
+	for (i = 0; i < GL_SHADER_TABLE_SIZE; i++)
+		wl_list_init(&gr->shader_table[i]);
+	wl_array_init(&gr->prewarm_queue);
 
 	gr->base.read_pixels = gl_renderer_read_pixels;
 	gr->base.repaint_output = gl_renderer_repaint_output;
@@ -3800,11 +4562,29 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = true;
 
+	if (gr->gl_version >= GR_GL_VERSION(3, 0)) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+		gr->fence_sync = (void *) eglGetProcAddress("glFenceSync");
+		gr->client_wait_sync =
+			(void *) eglGetProcAddress("glClientWaitSync");
+		gr->delete_sync = (void *) eglGetProcAddress("glDeleteSync");
+		gr->has_pack_buffer = gr->map_buffer_range &&
+				      gr->unmap_buffer && gr->fence_sync &&
+				      gr->client_wait_sync && gr->delete_sync;
+	}
+	if (gr->has_pack_buffer)
+		gr->base.read_pixels_async = gl_renderer_read_pixels_async;
+
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
 	glActiveTexture(GL_TEXTURE0);
 
+	glGenBuffers(1, &gr->vertex_buffer);
+	glGenBuffers(1, &gr->index_buffer);
+
 	gr->fragment_binding =
 		weston_compositor_add_debug_binding(ec, KEY_S,
 						    fragment_debug_binding,
@@ -3823,6 +4603,8 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    gr->has_pack_buffer ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
@@ -24,18 +24,53 @@
  * SOFTWARE.
  */
 
+#include "config.h"
+
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
+#include <EGL/egl.h>
 
 #include <libweston/libweston.h>
 #include "gl-renderer-private.h"
 #include "shared/helpers.h"
+#include "shared/platform.h"
 #include "libweston/weston-log.h"
 
+/* Bump whenever the layout of struct gl_shader_cache_header changes */
+#define GL_SHADER_CACHE_VERSION 1
+#define GL_SHADER_CACHE_MAGIC 0x43485357 /* "WSHC" */
+
+/** On-disk header preceding every cached program binary */
+struct gl_shader_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	/* hash of the GL driver identification strings */
+	uint64_t driver_hash;
+	/* hash of the GLSL sources the binary was linked from */
+	uint64_t source_hash;
+	uint32_t binary_format;
+	uint32_t binary_length;
+};
+
 struct gl_shader_generator {
 	struct weston_log_scope *debug;
+
+	/* Program binary cache, cache_dir is NULL when disabled */
+	char *cache_dir;
+	uint64_t driver_hash;
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
 };
 
 static const char vertex_shader[] =
@@ -644,6 +679,29 @@ gl_shader_requirements_init(struct gl_shader_requirements *requirements)
 	memset(requirements, 0, sizeof(struct gl_shader_requirements));
 }
 
+/** Pack shader requirements into a single integer key
+ *
+ * Every field of struct gl_shader_requirements gets its own bit range, so
+ * two requirement sets are equal if and only if their packed keys are.
+ */
+uint32_t
+gl_shader_requirements_pack(const struct gl_shader_requirements *requirements)
+{
+	assert(requirements->variant <= 0xf);
+	assert(requirements->degamma <= 0x3);
+	assert(requirements->nl_variant <= 0x3);
+	assert(requirements->gamma <= 0x3);
+	assert(requirements->tone_mapping <= 0x3);
+
+	return (uint32_t)requirements->variant |
+	       (uint32_t)requirements->debug << 4 |
+	       (uint32_t)requirements->csc_matrix << 5 |
+	       (uint32_t)requirements->degamma << 6 |
+	       (uint32_t)requirements->nl_variant << 8 |
+	       (uint32_t)requirements->gamma << 10 |
+	       (uint32_t)requirements->tone_mapping << 12;
+}
+
 void
 gl_shader_destroy(struct gl_shader *shader)
 {
@@ -655,9 +713,209 @@ gl_shader_destroy(struct gl_shader *shader)
 	shader->fragment_shader = 0;
 	shader->program = 0;
 	wl_list_remove(&shader->link);
+	wl_list_remove(&shader->table_link);
 	free(shader);
 }
 
+/* 64-bit FNV-1a */
+static uint64_t
+hash_string(uint64_t hash, const char *str)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)str; *p; p++) {
+		hash ^= *p;
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ull
+
+static uint64_t
+hash_shader_sources(const char *vertex_source,
+		    struct gl_shader_source *fragment_source)
+{
+	uint64_t hash = HASH_INIT;
+	uint32_t i;
+
+	hash = hash_string(hash, vertex_source);
+	for (i = 0; i < fragment_source->len; i++)
+		hash = hash_string(hash, fragment_source->parts[i]);
+
+	return hash;
+}
+
+static char *
+shader_cache_path(struct gl_shader_generator *sg, uint32_t packed_key)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%016" PRIx64 "-%04" PRIx32 ".bin",
+		     sg->cache_dir, sg->driver_hash, packed_key) < 0)
+		return NULL;
+
+	return path;
+}
+
+static bool
+read_all(int fd, void *data, size_t len)
+{
+	uint8_t *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		p += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static bool
+write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return false;
+		p += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+/** Try to create shader->program from the program binary cache
+ *
+ * \return true if a valid binary was found and linked successfully.
+ */
+static bool
+shader_cache_load(struct gl_shader_generator *sg, struct gl_shader *shader,
+		  uint64_t source_hash)
+{
+	struct gl_shader_cache_header header;
+	void *binary = NULL;
+	char *path;
+	GLint status = GL_FALSE;
+	int fd;
+
+	path = shader_cache_path(sg, shader->packed_key);
+	if (!path)
+		return false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return false;
+
+	if (!read_all(fd, &header, sizeof header) ||
+	    header.magic != GL_SHADER_CACHE_MAGIC ||
+	    header.version != GL_SHADER_CACHE_VERSION ||
+	    header.driver_hash != sg->driver_hash ||
+	    header.source_hash != source_hash ||
+	    header.binary_length == 0)
+		goto out;
+
+	binary = malloc(header.binary_length);
+	if (!binary || !read_all(fd, binary, header.binary_length))
+		goto out;
+
+	shader->program = glCreateProgram();
+	sg->program_binary(shader->program, header.binary_format,
+			   binary, header.binary_length);
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+	if (!status) {
+		/* The driver rejected the binary, e.g. after an update
+		 * which did not change the version strings. */
+		glDeleteProgram(shader->program);
+		shader->program = 0;
+	}
+
+out:
+	free(binary);
+	close(fd);
+
+	return status == GL_TRUE;
+}
+
+static void
+shader_cache_store(struct gl_shader_generator *sg, struct gl_shader *shader,
+		   uint64_t source_hash)
+{
+	struct gl_shader_cache_header header = {
+		.magic = GL_SHADER_CACHE_MAGIC,
+		.version = GL_SHADER_CACHE_VERSION,
+		.driver_hash = sg->driver_hash,
+		.source_hash = source_hash,
+	};
+	GLint length = 0;
+	GLenum format;
+	void *binary;
+	char *path, *tmp_path = NULL;
+	int fd = -1;
+
+	glGetProgramiv(shader->program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	sg->get_program_binary(shader->program, length, &length,
+			       &format, binary);
+	if (length <= 0)
+		goto out;
+
+	header.binary_format = format;
+	header.binary_length = length;
+
+	path = shader_cache_path(sg, shader->packed_key);
+	if (!path)
+		goto out;
+
+	/* Write to a temporary file first and rename it over the final
+	 * name, so that a concurrent or crashed writer never leaves a
+	 * truncated binary behind. */
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0) {
+		tmp_path = NULL;
+		goto out_path;
+	}
+
+	fd = mkostemp(tmp_path, O_CLOEXEC);
+	if (fd < 0)
+		goto out_path;
+
+	if (!write_all(fd, &header, sizeof header) ||
+	    !write_all(fd, binary, length) ||
+	    rename(tmp_path, path) < 0) {
+		weston_log_scope_printf(sg->debug,
+					"failed to write shader cache %s: %s\n",
+					path, strerror(errno));
+		unlink(tmp_path);
+	}
+
+	close(fd);
+
+out_path:
+	free(tmp_path);
+	free(path);
+out:
+	free(binary);
+}
+
 static int
 compile_shader(GLenum type, int count, const char **sources)
 {
@@ -687,6 +945,7 @@ gl_shader_create(struct gl_shader_generator *sg,
 	GLint status;
 	const char *vertex_source[1];
 	struct gl_shader_source fragment_source;
+	uint64_t source_hash = 0;
 
 	shader = zalloc(sizeof *shader);
 	if (!shader) {
@@ -696,12 +955,38 @@ gl_shader_create(struct gl_shader_generator *sg,
 
 	memcpy(&shader->key, requirements,
 	       sizeof(struct gl_shader_requirements));
+	shader->packed_key = gl_shader_requirements_pack(requirements);
+	wl_list_init(&shader->link);
+	wl_list_init(&shader->table_link);
 
 	vertex_source[0] = vertex_shader;
 
 	fragment_source.len = 0;
 	generate_fragment_shader(sg, &fragment_source, requirements);
 
+	if (sg->cache_dir) {
+		source_hash = hash_shader_sources(vertex_shader,
+						  &fragment_source);
+
+		if (shader_cache_load(sg, shader, source_hash)) {
+			sg->cache_hits++;
+			weston_log_scope_printf(sg->debug,
+						"program binary cache hit for "
+						"key 0x%04x (%u hits, %u misses)\n",
+						shader->packed_key,
+						sg->cache_hits,
+						sg->cache_misses);
+			goto uniforms;
+		}
+
+		sg->cache_misses++;
+		weston_log_scope_printf(sg->debug,
+					"program binary cache miss for "
+					"key 0x%04x (%u hits, %u misses)\n",
+					shader->packed_key,
+					sg->cache_hits, sg->cache_misses);
+	}
+
 	shader->vertex_shader = compile_shader(GL_VERTEX_SHADER, 1,
 					       vertex_source);
 
@@ -724,6 +1009,10 @@ gl_shader_create(struct gl_shader_generator *sg,
 		return NULL;
 	}
 
+	if (sg->cache_dir)
+		shader_cache_store(sg, shader, source_hash);
+
+uniforms:
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
 	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
@@ -741,22 +1030,161 @@ gl_shader_create(struct gl_shader_generator *sg,
 	return shader;
 }
 
+static int
+mkdir_parents(char *path)
+{
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+/** Pick the program binary cache directory
+ *
+ * WESTON_GL_SHADER_CACHE_DIR overrides the default location of
+ * $XDG_CACHE_HOME/weston/gl-shaders (or ~/.cache/weston/gl-shaders).
+ * Setting it to the empty string disables the cache.
+ */
+static char *
+shader_cache_dir(void)
+{
+	const char *env;
+	char *dir;
+
+	env = getenv("WESTON_GL_SHADER_CACHE_DIR");
+	if (env) {
+		if (env[0] == '\0')
+			return NULL;
+		return strdup(env);
+	}
+
+	env = getenv("XDG_CACHE_HOME");
+	if (env && env[0] == '/') {
+		if (asprintf(&dir, "%s/weston/gl-shaders", env) < 0)
+			return NULL;
+		return dir;
+	}
+
+	env = getenv("HOME");
+	if (env && env[0] == '/') {
+		if (asprintf(&dir, "%s/.cache/weston/gl-shaders", env) < 0)
+			return NULL;
+		return dir;
+	}
+
+	return NULL;
+}
+
+static uint64_t
+hash_driver(void)
+{
+	static const GLenum names[] = {
+		GL_VENDOR,
+		GL_RENDERER,
+		GL_VERSION,
+		GL_SHADING_LANGUAGE_VERSION,
+	};
+	uint64_t hash = HASH_INIT;
+	const char *str;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(names); i++) {
+		str = (const char *)glGetString(names[i]);
+		hash = hash_string(hash, str ? str : "");
+	}
+
+	return hash;
+}
+
+/* Requires the GL context to be current */
+static void
+shader_cache_init(struct gl_shader_generator *sg)
+{
+	const char *extensions;
+	GLint num_formats = 0;
+
+	extensions = (const char *)glGetString(GL_EXTENSIONS);
+	if (!extensions ||
+	    !weston_check_egl_extension(extensions,
+					"GL_OES_get_program_binary"))
+		return;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &num_formats);
+	if (num_formats <= 0)
+		return;
+
+	sg->get_program_binary =
+		(void *) eglGetProcAddress("glGetProgramBinaryOES");
+	sg->program_binary =
+		(void *) eglGetProcAddress("glProgramBinaryOES");
+	if (!sg->get_program_binary || !sg->program_binary)
+		return;
+
+	sg->cache_dir = shader_cache_dir();
+	if (!sg->cache_dir)
+		return;
+
+	if (mkdir_parents(sg->cache_dir) < 0) {
+		weston_log("GL program binary cache disabled, "
+			   "cannot create %s: %s\n",
+			   sg->cache_dir, strerror(errno));
+		free(sg->cache_dir);
+		sg->cache_dir = NULL;
+		return;
+	}
+
+	sg->driver_hash = hash_driver();
+	weston_log("GL program binary cache: %s\n", sg->cache_dir);
+}
+
 struct gl_shader_generator *
 gl_shader_generator_create(struct weston_compositor *compositor)
 {
 	struct gl_shader_generator *sg = zalloc(sizeof *sg);
 
-	if (sg)
-		sg->debug = weston_compositor_add_log_scope(compositor, "gl-shader-generator",
-							    "Debug messages from GL renderer",
-							    NULL, NULL, NULL);
+	if (!sg)
+		return NULL;
+
+	sg->debug = weston_compositor_add_log_scope(compositor, "gl-shader-generator",
+						    "Debug messages from GL renderer",
+						    NULL, NULL, NULL);
+	shader_cache_init(sg);
+
 	return sg;
 }
 
 void
 gl_shader_generator_destroy(struct gl_shader_generator *sg)
 {
+	if (!sg)
+		return;
+
+	if (sg->cache_dir)
+		weston_log_scope_printf(sg->debug,
+					"program binary cache: %u hits, "
+					"%u misses\n",
+					sg->cache_hits, sg->cache_misses);
+
 	weston_log_scope_destroy(sg->debug);
 	sg->debug = NULL;
+	free(sg->cache_dir);
 	free(sg);
 }
+
+/** The GL renderer debug scope, NULL without a generator */
+struct weston_log_scope *
+gl_shader_generator_get_debug_scope(struct gl_shader_generator *sg)
+{
+	return sg ? sg->debug : NULL;
+}
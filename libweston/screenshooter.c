@@ -34,6 +34,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include <libweston/libweston.h>
 #include "shared/helpers.h"
@@ -46,11 +52,57 @@
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
 	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
 	struct weston_output *output;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
 
+/** Read pixels back, without waiting for the renderer if it can help it
+ *
+ * \param output The output to read from.
+ * \param format The pixel format, see weston_renderer::read_pixels.
+ * \param x Left edge, in output framebuffer coordinates.
+ * \param y Edge, in output framebuffer coordinates; the bottom one with
+ * WESTON_CAP_CAPTURE_YFLIP.
+ * \param width Width of the area.
+ * \param height Height of the area.
+ * \param done Called with the pixels, maybe before this returns.
+ * \param data Passed to done.
+ * \return 0 on success, -1 without calling done on failure.
+ *
+ * Renderers that can read back asynchronously hand the pixels over at a
+ * later repaint, so the compositor does not wait for the GPU to drain in
+ * between. With the others, this reads the pixels right away.
+ */
+WL_EXPORT int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done, void *data)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+	void *pixels;
+	int ret;
+
+	if (renderer->read_pixels_async)
+		return renderer->read_pixels_async(output, format, x, y,
+						   width, height, done, data);
+
+	pixels = malloc(width * height * (PIXMAN_FORMAT_BPP(format) / 8));
+	if (pixels == NULL)
+		return -1;
+
+	ret = renderer->read_pixels(output, format, pixels,
+				    x, y, width, height);
+	if (ret == 0)
+		done(data, pixels);
+	free(pixels);
+
+	return ret;
+}
+
 static void
 copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
 {
@@ -115,36 +167,49 @@ copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
 }
 
 static void
-screenshooter_frame_notify(struct wl_listener *listener, void *data)
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l)
+{
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	free(l);
+}
+
+static void
+screenshooter_buffer_destroy(struct wl_listener *listener, void *data)
 {
 	struct screenshooter_frame_listener *l =
-		container_of(listener,
-			     struct screenshooter_frame_listener, listener);
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
+
+	l->buffer = NULL;
+}
+
+static void
+screenshooter_read_done(void *data, const void *read_pixels)
+{
+	struct screenshooter_frame_listener *l = data;
 	struct weston_output *output = l->output;
 	struct weston_compositor *compositor = output->compositor;
+	uint8_t *pixels = (uint8_t *) read_pixels;
 	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	uint8_t *d, *s;
 
-	weston_output_disable_planes_decr(output);
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	if (l->buffer == NULL) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
 
 	if (pixels == NULL) {
 		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+		screenshooter_frame_listener_destroy(l);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
-
 	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
 
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+	s = pixels + stride * (output->current_mode->height - 1);
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
@@ -170,8 +235,32 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
 	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
-	free(l);
+	screenshooter_frame_listener_destroy(l);
+}
+
+static void
+screenshooter_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener,
+			     struct screenshooter_frame_listener, listener);
+	struct weston_output *output = l->output;
+	struct weston_compositor *compositor = output->compositor;
+	int ret;
+
+	weston_output_disable_planes_decr(output);
+	wl_list_remove(&listener->link);
+
+	/* The pixels arrive a frame later, not to stall the GPU */
+	ret = weston_output_read_pixels_async(output, compositor->read_format,
+					      0, 0,
+					      output->current_mode->width,
+					      output->current_mode->height,
+					      screenshooter_read_done, l);
+	if (ret < 0) {
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		screenshooter_frame_listener_destroy(l);
+	}
 }
 
 WL_EXPORT int
@@ -190,8 +279,12 @@ weston_screenshooter_shoot(struct weston_output *output,
 	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
 
+	/* The pixels are copied over as read, rows as long as the output */
 	if (buffer->width < output->current_mode->width ||
-	    buffer->height < output->current_mode->height) {
+	    buffer->height < output->current_mode->height ||
+	    wl_shm_buffer_get_stride(buffer->shm_buffer) !=
+	    output->current_mode->width *
+	    (PIXMAN_FORMAT_BPP(output->compositor->read_format) / 8)) {
 		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
 		return -1;
 	}
@@ -203,6 +296,8 @@ weston_screenshooter_shoot(struct weston_output *output,
 	}
 
 	l->buffer = buffer;
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
 	l->output = output;
 	l->done = done;
 	l->data = data;
@@ -214,14 +309,65 @@ weston_screenshooter_shoot(struct weston_output *output,
 	return 0;
 }
 
+/* Frames being read back or waiting for the encoder at most; frames
+ * beyond that are skipped, their damage goes into the next one */
+#define RECORDER_QUEUE_DEPTH 4
+
+/* Fast, recordings compress well anyway */
+#define RECORDER_ZSTD_LEVEL 1
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
 	int fd;
 	struct wl_listener frame_listener;
-	int count, destroying;
+	int destroying;
+	/* Frames read back but not queued yet, compositor thread only */
+	int pending;
+	int width;
+	bool stopped;
+	/* Damage of skipped frames, for the next one */
+	pixman_region32_t skipped_damage;
+	int skipped;
+	struct timespec start;
+
+	uint32_t compression;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	/* Signalled when a frame is queued or the thread should quit */
+	pthread_cond_t cond;
+	/* struct weston_recorder_frame::link, oldest first */
+	struct wl_list queue;
+	int queued;
+	bool quit;
+	/* Frames the encoder dropped, and why, for the compositor thread
+	 * to log */
+	int failed;
+	const char *error;
+	bool error_logged;
+
+	/* Only used by the encoder thread, once started */
+	uint32_t *frame, *rect, *delta;
+	void *compressed;
+	size_t compressed_size;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+	uint64_t total;
+	int count;
+	int64_t encode_nsec;
+};
+
+/** A frame on its way to the file */
+struct weston_recorder_frame {
+	struct weston_recorder *recorder;
+	struct wl_list link;
+	uint32_t msecs;
+	/* In output framebuffer coordinates */
+	pixman_region32_t damage;
+	/* What was read back, the extents of damage */
+	pixman_box32_t area;
+	/* The damaged pixels, rectangle by rectangle, rows bottom up */
+	uint32_t *pixels;
 };
 
 static uint32_t *
@@ -243,127 +389,351 @@ output_run(uint32_t *p, uint32_t delta, int run)
 	return p;
 }
 
-static uint32_t
+/* The bytes of next minus those of prev, each modulo 256, without the
+ * borrows crossing bytes. Branchless, so the loop using it vectorizes. */
+static inline uint32_t
 component_delta(uint32_t next, uint32_t prev)
 {
-	unsigned char dr, dg, db;
+	uint32_t delta;
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+	delta = ((next | 0x80808080) - (prev & 0x7f7f7f7f)) ^
+		((next ^ ~prev) & 0x80808080);
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+	return delta & 0x00ffffff;
 }
 
+/* Deltas of a row against the previous frame, which gets updated */
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
+delta_row(uint32_t *restrict delta, const uint32_t *restrict next,
+	  uint32_t *restrict prev, int width)
+{
+	int k;
 
-static void
-weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+	for (k = 0; k < width; k++) {
+		delta[k] = component_delta(next[k], prev[k]);
+		prev[k] = next[k];
+	}
+}
+
+/* Run-length encodes the rectangles of a frame into recorder->rect,
+ * returns the number of words */
+static size_t
+weston_recorder_encode(struct weston_recorder *recorder,
+		       struct weston_recorder_frame *frame)
 {
-	struct weston_recorder *recorder =
-		container_of(listener, struct weston_recorder, frame_listener);
-	struct weston_output *output = recorder->output;
-	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = timespec_to_msec(&output->frame_time);
 	pixman_box32_t *r;
-	pixman_region32_t damage, transformed_damage;
+	const uint32_t *s = frame->pixels;
+	uint32_t *p = recorder->rect, *d, *delta = recorder->delta;
+	uint32_t prev;
 	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
-
-	pixman_region32_init(&damage);
-	pixman_region32_init(&transformed_damage);
-	pixman_region32_intersect(&damage, &output->region, data);
-	pixman_region32_translate(&damage, -output->x, -output->y);
-	weston_transformed_region(output->width, output->height,
-				 output->transform, output->current_scale,
-				 &damage, &transformed_damage);
-	pixman_region32_fini(&damage);
 
-	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
-	}
-
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	stride = recorder->width;
+	r = pixman_region32_rectangles(&frame->damage, &n);
 
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
-		else
-			y_orig = r[i].y1;
-
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
 		run = prev = 0; /* quiet gcc */
 		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
+			d = recorder->frame + stride * (r[i].y2 - j - 1) +
+			    r[i].x1;
+			delta_row(delta, s, d, width);
+			s += width;
 
 			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
+				if (run == 0 || delta[k] == prev) {
 					run++;
 				} else {
 					p = output_run(p, prev, run);
 					run = 1;
 				}
-				prev = delta;
+				prev = delta[k];
 			}
 		}
 
 		p = output_run(p, prev, run);
+	}
+
+	return p - recorder->rect;
+}
+
+/* Returns NULL, or why the frame was dropped */
+static const char *
+weston_recorder_write_frame(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame)
+{
+	pixman_box32_t *r;
+	struct wcap_frame_header header;
+	struct iovec v[5];
+	size_t words;
+	ssize_t ret;
+	int n, iovcnt = 0;
 
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+	words = weston_recorder_encode(recorder, frame);
+	r = pixman_region32_rectangles(&frame->damage, &n);
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
+	header.msecs = frame->msecs;
+	header.nrects = n;
+	v[iovcnt].iov_base = &header;
+	v[iovcnt++].iov_len = sizeof header;
+	v[iovcnt].iov_base = r;
+	v[iovcnt++].iov_len = n * sizeof *r;
+
+	switch (recorder->compression) {
+#ifdef HAVE_ZSTD
+	case WCAP_COMPRESSION_ZSTD: {
+		static const uint32_t padding;
+		struct wcap_block_header block;
+		size_t size;
+
+		size = ZSTD_compressCCtx(recorder->zstd, recorder->compressed,
+					 recorder->compressed_size,
+					 recorder->rect, words * 4,
+					 RECORDER_ZSTD_LEVEL);
+		if (ZSTD_isError(size))
+			return ZSTD_getErrorName(size);
+
+		block.size = words * 4;
+		block.compressed_size = size;
+		v[iovcnt].iov_base = &block;
+		v[iovcnt++].iov_len = sizeof block;
+		v[iovcnt].iov_base = recorder->compressed;
+		v[iovcnt++].iov_len = size;
+		v[iovcnt].iov_base = (void *) &padding;
+		v[iovcnt++].iov_len = -size & 3;
+		break;
+	}
 #endif
+	default:
+		v[iovcnt].iov_base = recorder->rect;
+		v[iovcnt++].iov_len = words * 4;
+		break;
 	}
 
-	pixman_region32_fini(&transformed_damage);
+	ret = writev(recorder->fd, v, iovcnt);
+	if (ret > 0)
+		recorder->total += ret;
 	recorder->count++;
 
+	return NULL;
+}
+
+static void *
+weston_recorder_thread(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+	struct timespec begin, end;
+	const char *error;
+
+	pthread_mutex_lock(&recorder->mutex);
+	for (;;) {
+		while (wl_list_empty(&recorder->queue) && !recorder->quit)
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+		if (wl_list_empty(&recorder->queue))
+			break;
+
+		frame = container_of(recorder->queue.next,
+				     struct weston_recorder_frame, link);
+		wl_list_remove(&frame->link);
+		pthread_mutex_unlock(&recorder->mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		error = weston_recorder_write_frame(recorder, frame);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		recorder->encode_nsec += timespec_sub_to_nsec(&end, &begin);
+
+		pixman_region32_fini(&frame->damage);
+		free(frame->pixels);
+		free(frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->queued--;
+		if (error) {
+			recorder->failed++;
+			if (!recorder->error)
+				recorder->error = error;
+		}
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
+}
+
+static bool
+weston_recorder_queue_full(struct weston_recorder *recorder)
+{
+	bool full;
+
+	pthread_mutex_lock(&recorder->mutex);
+	full = recorder->pending + recorder->queued >= RECORDER_QUEUE_DEPTH;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return full;
+}
+
+static void
+weston_recorder_frame_free(struct weston_recorder_frame *frame)
+{
+	pixman_region32_fini(&frame->damage);
+	free(frame->pixels);
+	free(frame);
+}
+
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static void
+weston_recorder_close(struct weston_recorder *recorder);
+
+/* Copies the damaged pixels out, in the order the encoder takes them */
+static uint32_t *
+weston_recorder_copy_damage(struct weston_recorder_frame *frame,
+			    const uint32_t *src, bool yflip)
+{
+	pixman_box32_t *r, *area = &frame->area;
+	uint32_t *pixels, *d;
+	int i, j, n, width, area_width, row, y;
+	size_t size = 0;
+
+	r = pixman_region32_rectangles(&frame->damage, &n);
+	for (i = 0; i < n; i++)
+		size += (size_t)(r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	pixels = malloc(size * 4);
+	if (pixels == NULL)
+		return NULL;
+
+	area_width = area->x2 - area->x1;
+	d = pixels;
+	for (i = 0; i < n; i++) {
+		width = r[i].x2 - r[i].x1;
+		for (j = 0; j < r[i].y2 - r[i].y1; j++) {
+			y = r[i].y2 - j - 1;
+			/* Rows were read bottom up with y-flip */
+			if (yflip)
+				row = area->y2 - y - 1;
+			else
+				row = y - area->y1;
+			memcpy(d, src + area_width * row + r[i].x1 - area->x1,
+			       width * 4);
+			d += width;
+		}
+	}
+
+	return pixels;
+}
+
+static void
+weston_recorder_read_done(void *data, const void *pixels)
+{
+	struct weston_recorder_frame *frame = data;
+	struct weston_recorder *recorder = frame->recorder;
+	struct weston_compositor *compositor = recorder->output->compositor;
+	const char *error = NULL;
+
+	if (pixels)
+		frame->pixels = weston_recorder_copy_damage(frame, pixels,
+			compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+
+	recorder->pending--;
+
+	pthread_mutex_lock(&recorder->mutex);
+	if (frame->pixels) {
+		/* Encoded and written by the thread, not to stall repaints */
+		wl_list_insert(recorder->queue.prev, &frame->link);
+		recorder->queued++;
+		pthread_cond_signal(&recorder->cond);
+	}
+	if (recorder->error && !recorder->error_logged) {
+		error = recorder->error;
+		recorder->error_logged = true;
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	/* The encoder thread does not log */
+	if (error)
+		weston_log("recorder: compression failed: %s\n", error);
+
+	if (!frame->pixels) {
+		weston_log("recorder: failed to read frame, dropped\n");
+		weston_recorder_frame_free(frame);
+	}
+
+	if (recorder->stopped && recorder->pending == 0)
+		weston_recorder_close(recorder);
+}
+
+static void
+weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct weston_recorder *recorder =
+		container_of(listener, struct weston_recorder, frame_listener);
+	struct weston_output *output = recorder->output;
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_recorder_frame *frame;
+	pixman_region32_t damage;
+	pixman_box32_t *area;
+	int y_orig;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &output->region, data);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+
+	if (weston_recorder_queue_full(recorder)) {
+		pixman_region32_union(&recorder->skipped_damage,
+				      &recorder->skipped_damage, &damage);
+		pixman_region32_fini(&damage);
+		recorder->skipped++;
+		goto out;
+	}
+
+	frame = zalloc(sizeof *frame);
+	if (frame == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		pixman_region32_fini(&damage);
+		goto out;
+	}
+
+	frame->recorder = recorder;
+	frame->msecs = timespec_to_msec(&output->frame_time);
+
+	pixman_region32_union(&damage, &damage, &recorder->skipped_damage);
+	pixman_region32_clear(&recorder->skipped_damage);
+	pixman_region32_init(&frame->damage);
+	weston_transformed_region(output->width, output->height,
+				 output->transform, output->current_scale,
+				 &damage, &frame->damage);
+	pixman_region32_fini(&damage);
+
+	if (!pixman_region32_not_empty(&frame->damage)) {
+		weston_recorder_frame_free(frame);
+		goto out;
+	}
+
+	/* One read-back of the extents costs less than one per rectangle */
+	area = pixman_region32_extents(&frame->damage);
+	frame->area = *area;
+	if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
+		y_orig = output->current_mode->height - area->y2;
+	else
+		y_orig = area->y1;
+
+	/* Queued once the pixels arrive, in order */
+	recorder->pending++;
+	if (weston_output_read_pixels_async(output, compositor->read_format,
+					    area->x1, y_orig,
+					    area->x2 - area->x1,
+					    area->y2 - area->y1,
+					    weston_recorder_read_done,
+					    frame) < 0) {
+		recorder->pending--;
+		weston_log("recorder: failed to read frame, dropped\n");
+		weston_recorder_frame_free(frame);
+	}
+
+out:
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
 }
@@ -374,22 +744,30 @@ weston_recorder_free(struct weston_recorder *recorder)
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(recorder->zstd);
+#endif
+	pixman_region32_fini(&recorder->skipped_damage);
+	pthread_cond_destroy(&recorder->cond);
+	pthread_mutex_destroy(&recorder->mutex);
+	free(recorder->compressed);
+	free(recorder->delta);
 	free(recorder->rect);
 	free(recorder->frame);
 	free(recorder);
 }
 
 static struct weston_recorder *
-weston_recorder_create(struct weston_output *output, const char *filename)
+weston_recorder_create(struct weston_output *output, const char *filename,
+		       enum weston_recorder_compression compression)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
 	int stride, size;
-	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	struct wcap_header header;
+	struct wcap_header_v2 header_v2;
+	struct iovec v[2];
+	int iovcnt = 1;
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -397,23 +775,46 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return NULL;
 	}
 
+	pixman_region32_init(&recorder->skipped_damage);
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+	wl_list_init(&recorder->queue);
+	recorder->fd = -1;
+
 	stride = output->current_mode->width;
 	size = stride * 4 * output->current_mode->height;
+	recorder->width = stride;
 	recorder->frame = zalloc(size);
+	/* Run-length encoding takes a word per pixel at most */
 	recorder->rect = malloc(size);
+	recorder->delta = malloc(stride * 4);
 	recorder->output = output;
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if ((recorder->frame == NULL) || (recorder->rect == NULL) ||
+	    (recorder->delta == NULL)) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
+	switch (compression) {
+	case WESTON_RECORDER_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+		recorder->compression = WCAP_COMPRESSION_ZSTD;
+		recorder->zstd = ZSTD_createCCtx();
+		recorder->compressed_size = ZSTD_compressBound(size);
+		recorder->compressed = malloc(recorder->compressed_size);
+		if (recorder->zstd == NULL || recorder->compressed == NULL) {
 			weston_log("%s: out of memory\n", __func__);
 			goto err_recorder;
 		}
+		break;
+#else
+		weston_log("recorder: built without zstd, not compressing\n");
+		/* fallthrough */
+#endif
+	case WESTON_RECORDER_COMPRESSION_NONE:
+		recorder->compression = WCAP_COMPRESSION_NONE;
+		break;
 	}
 
 	header.magic = WCAP_HEADER_MAGIC;
@@ -442,7 +843,26 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 
 	header.width = output->current_mode->width;
 	header.height = output->current_mode->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	/* Uncompressed recordings stay readable by older decoders */
+	if (recorder->compression != WCAP_COMPRESSION_NONE) {
+		header.magic = WCAP_HEADER_MAGIC_V2;
+		header_v2.compression = recorder->compression;
+		v[1].iov_base = &header_v2;
+		v[1].iov_len = sizeof header_v2;
+		iovcnt = 2;
+	}
+	recorder->total += writev(recorder->fd, v, iovcnt);
+
+	if (pthread_create(&recorder->thread, NULL,
+			   weston_recorder_thread, recorder) != 0) {
+		weston_log("%s: failed to start the encoder thread\n",
+			   __func__);
+		goto err_recorder;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &recorder->start);
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
@@ -452,21 +872,59 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	return recorder;
 
 err_recorder:
+	if (recorder->fd >= 0)
+		close(recorder->fd);
 	weston_recorder_free(recorder);
 	return NULL;
 }
 
+/* Waits for the thread to write the queued frames out */
+static void
+weston_recorder_close(struct weston_recorder *recorder)
+{
+	struct timespec now;
+	double sec;
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = true;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->thread, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sec = timespec_sub_to_nsec(&now, &recorder->start) / 1e9;
+
+	weston_log("recorder: %d frames, %d skipped, in %.1f s: %.1f frames/s, "
+		   "%.1f MiB written at %.1f MiB/s, %.2f ms encoding per "
+		   "frame\n", recorder->count, recorder->skipped, sec,
+		   recorder->count / sec, recorder->total / (1024.0 * 1024.0),
+		   recorder->total / (1024.0 * 1024.0) / sec,
+		   recorder->count ?
+		   recorder->encode_nsec / 1e6 / recorder->count : 0.0);
+	if (recorder->failed > 0)
+		weston_log("recorder: %d frames dropped, compression failed: "
+			   "%s\n", recorder->failed, recorder->error);
+
+	close(recorder->fd);
+	weston_recorder_free(recorder);
+}
+
+/* Stops recording, the file is closed once the last frame is written */
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
 	weston_output_disable_planes_decr(recorder->output);
-	weston_recorder_free(recorder);
+	recorder->stopped = true;
+
+	if (recorder->pending == 0)
+		weston_recorder_close(recorder);
 }
 
 WL_EXPORT struct weston_recorder *
-weston_recorder_start(struct weston_output *output, const char *filename)
+weston_recorder_start_compressed(struct weston_output *output,
+				 const char *filename,
+				 enum weston_recorder_compression compression)
 {
 	struct wl_listener *listener;
 
@@ -480,14 +938,20 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 
 	weston_log("starting recorder for output %s, file %s\n",
 		   output->name, filename);
-	return weston_recorder_create(output, filename);
+	return weston_recorder_create(output, filename, compression);
+}
+
+WL_EXPORT struct weston_recorder *
+weston_recorder_start(struct weston_output *output, const char *filename)
+{
+	return weston_recorder_start_compressed(output, filename,
+						WESTON_RECORDER_COMPRESSION_NONE);
 }
 
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder\n");
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
@@ -341,6 +341,28 @@ emit_gpu_timestamp(struct timeline_emit_context *ctx, void *obj)
 	return 1;
 }
 
+static int
+emit_deadline_timestamp(struct timeline_emit_context *ctx, void *obj)
+{
+	struct timespec *ts = obj;
+
+	fprintf(ctx->cur, "\"deadline\":[%" PRId64 ", %ld]",
+		(int64_t)ts->tv_sec, ts->tv_nsec);
+
+	return 1;
+}
+
+static int
+emit_damage_rects(struct timeline_emit_context *ctx, void *obj)
+{
+	struct weston_timeline_damage_rects *rects = obj;
+
+	fprintf(ctx->cur, "\"damage_rects\":[%d, %d]",
+		rects->before, rects->after);
+
+	return 1;
+}
+
 static struct weston_timeline_subscription_object *
 weston_timeline_get_subscription_object(struct weston_log_subscription *sub,
 		void *object)
@@ -388,6 +410,8 @@ static const type_func type_dispatch[] = {
 	[TLT_SURFACE] = emit_weston_surface,
 	[TLT_VBLANK] = emit_vblank_timestamp,
 	[TLT_GPU] = emit_gpu_timestamp,
+	[TLT_DEADLINE] = emit_deadline_timestamp,
+	[TLT_DAMAGE_RECTS] = emit_damage_rects,
 };
 
 /** Disseminates the message to all subscriptions of the scope \c
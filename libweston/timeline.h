@@ -39,6 +39,14 @@ enum timeline_type {
 	TLT_SURFACE,
 	TLT_VBLANK,
 	TLT_GPU,
+	TLT_DEADLINE,
+	TLT_DAMAGE_RECTS,
+};
+
+/** Rectangle counts of a damage region before and after simplifying */
+struct weston_timeline_damage_rects {
+	int before;
+	int after;
 };
 
 /** Timeline subscription created for each subscription
@@ -83,6 +91,8 @@ struct weston_timeline_subscription_object {
 #define TLP_SURFACE(s) TLT_SURFACE, TYPEVERIFY(struct weston_surface *, (s))
 #define TLP_VBLANK(t) TLT_VBLANK, TYPEVERIFY(const struct timespec *, (t))
 #define TLP_GPU(t) TLT_GPU, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_DEADLINE(t) TLT_DEADLINE, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_DAMAGE_RECTS(r) TLT_DAMAGE_RECTS, TYPEVERIFY(const struct weston_timeline_damage_rects *, (r))
 
 /** This macro is used to add timeline points.
  *
@@ -84,6 +84,10 @@ struct pipewire_output {
 	struct spa_hook stream_listener;
 
 	struct spa_video_info_raw video_format;
+	int stride;
+
+	/* struct pipewire_buffer::link */
+	struct wl_list buffer_list;
 
 	struct wl_event_source *finish_frame_timer;
 	struct wl_list link;
@@ -91,6 +95,13 @@ struct pipewire_output {
 	enum dpms_enum dpms;
 };
 
+/* What a buffer of the stream lacks of the latest frame */
+struct pipewire_buffer {
+	struct pw_buffer *buffer;
+	pixman_region32_t damage;
+	struct wl_list link;
+};
+
 struct pipewire_frame_data {
 	struct pipewire_output *output;
 	int fd;
@@ -178,19 +189,54 @@ lookup_pipewire_output(struct weston_output *base_output)
 	return NULL;
 }
 
+static void
+pipewire_output_copy_damage(struct pipewire_output *output,
+			    struct pipewire_buffer *pw_buf,
+			    const uint8_t *src, int src_stride)
+{
+	struct spa_buffer *spa_buffer = pw_buf->buffer->buffer;
+	uint8_t *dst = spa_buffer->datas[0].data;
+	int dst_stride = output->stride;
+	const int bpp = 4;
+	pixman_box32_t *rects;
+	int n_rects, i, y;
+
+	pixman_region32_intersect_rect(&pw_buf->damage, &pw_buf->damage, 0, 0,
+				       output->output->current_mode->width,
+				       output->output->current_mode->height);
+
+	rects = pixman_region32_rectangles(&pw_buf->damage, &n_rects);
+	for (i = 0; i < n_rects; i++) {
+		for (y = rects[i].y1; y < rects[i].y2; y++)
+			memcpy(dst + y * dst_stride + rects[i].x1 * bpp,
+			       src + y * src_stride + rects[i].x1 * bpp,
+			       (rects[i].x2 - rects[i].x1) * bpp);
+	}
+
+	pixman_region32_clear(&pw_buf->damage);
+}
+
 static void
 pipewire_output_handle_frame(struct pipewire_output *output, int fd,
 			     int stride, struct drm_fb *drm_buffer)
 {
 	const struct weston_drm_virtual_output_api *api =
 		output->pipewire->virtual_output_api;
-	size_t size = output->output->height * stride;
+	size_t size = output->output->current_mode->height * stride;
 	struct pw_type *t = output->pipewire->t;
+	pixman_region32_t *damage;
+	struct pipewire_buffer *pw_buf;
 	struct pw_buffer *buffer;
 	struct spa_buffer *spa_buffer;
 	struct spa_meta_header *h;
 	void *ptr;
 
+	/* Even for a frame that does not go out, the buffers have to carry
+	 * its damage */
+	damage = (pixman_region32_t *)api->get_frame_damage(drm_buffer);
+	wl_list_for_each(pw_buf, &output->buffer_list, link)
+		pixman_region32_union(&pw_buf->damage, &pw_buf->damage, damage);
+
 	if (pw_stream_get_state(output->stream, NULL) !=
 	    PW_STREAM_STATE_STREAMING)
 		goto out;
@@ -202,6 +248,19 @@ pipewire_output_handle_frame(struct pipewire_output *output, int fd,
 	}
 
 	spa_buffer = buffer->buffer;
+	pw_buf = buffer->user_data;
+
+	ptr = MAP_FAILED;
+	if (pw_buf)
+		ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		weston_log("Failed to map the frame of pipewire output %s\n",
+			   output->output->name);
+		/* Hand the buffer back empty */
+		spa_buffer->datas[0].chunk->size = 0;
+		pw_stream_queue_buffer(output->stream, buffer);
+		goto out;
+	}
 
 	if ((h = spa_buffer_find_meta(spa_buffer, t->meta.Header))) {
 		h->pts = -1;
@@ -210,13 +269,16 @@ pipewire_output_handle_frame(struct pipewire_output *output, int fd,
 		h->dts_offset = 0;
 	}
 
-	ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
-	memcpy(spa_buffer->datas[0].data, ptr, size);
+	pipewire_output_debug(output, "copy %d damage rects",
+			      pixman_region32_n_rects(&pw_buf->damage));
+	pipewire_output_copy_damage(output, pw_buf, ptr, stride);
 	munmap(ptr, size);
 
+
 	spa_buffer->datas[0].chunk->offset = 0;
-	spa_buffer->datas[0].chunk->stride = stride;
-	spa_buffer->datas[0].chunk->size = spa_buffer->datas[0].maxsize;
+	spa_buffer->datas[0].chunk->stride = output->stride;
+	spa_buffer->datas[0].chunk->size =
+		output->output->current_mode->height * output->stride;
 
 	pipewire_output_debug(output, "push frame");
 	pw_stream_queue_buffer(output->stream, buffer);
@@ -491,6 +553,7 @@ pipewire_output_stream_format_changed(void *data, const struct spa_pod *format)
 	struct spa_pod_builder builder =
 		SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 	const struct spa_pod *params[2];
+	int n_params = 0;
 	struct pw_type *t = pipewire->t;
 	int32_t width, height, stride, size;
 	const int bpp = 4;
@@ -508,10 +571,11 @@ pipewire_output_stream_format_changed(void *data, const struct spa_pod *format)
 	height = output->video_format.size.height;
 	stride = SPA_ROUND_UP_N(width * bpp, 4);
 	size = height * stride;
+	output->stride = stride;
 
 	pipewire_output_debug(output, "format = %dx%d", width, height);
 
-	params[0] = spa_pod_builder_object(&builder,
+	params[n_params++] = spa_pod_builder_object(&builder,
 		t->param.idBuffers, t->param_buffers.Buffers,
 		":", t->param_buffers.size,
 		"i", size,
@@ -522,18 +586,53 @@ pipewire_output_stream_format_changed(void *data, const struct spa_pod *format)
 		":", t->param_buffers.align,
 		"i", 16);
 
-	params[1] = spa_pod_builder_object(&builder,
+	params[n_params++] = spa_pod_builder_object(&builder,
 		t->param.idMeta, t->param_meta.Meta,
 		":", t->param_meta.type, "I", t->meta.Header,
 		":", t->param_meta.size, "i", sizeof(struct spa_meta_header));
 
-	pw_stream_finish_format(output->stream, 0, params, 2);
+	pw_stream_finish_format(output->stream, 0, params, n_params);
+}
+
+static void
+pipewire_output_stream_add_buffer(void *data, struct pw_buffer *buffer)
+{
+	struct pipewire_output *output = data;
+	struct pipewire_buffer *pw_buf;
+
+	pw_buf = zalloc(sizeof *pw_buf);
+	if (!pw_buf)
+		return;
+
+	/* Nothing of the output in there yet */
+	pw_buf->buffer = buffer;
+	pixman_region32_init_rect(&pw_buf->damage, 0, 0,
+				  output->output->current_mode->width,
+				  output->output->current_mode->height);
+	wl_list_insert(&output->buffer_list, &pw_buf->link);
+	buffer->user_data = pw_buf;
+}
+
+static void
+pipewire_output_stream_remove_buffer(void *data, struct pw_buffer *buffer)
+{
+	struct pipewire_buffer *pw_buf = buffer->user_data;
+
+	if (!pw_buf)
+		return;
+
+	buffer->user_data = NULL;
+	wl_list_remove(&pw_buf->link);
+	pixman_region32_fini(&pw_buf->damage);
+	free(pw_buf);
 }
 
 static const struct pw_stream_events stream_events = {
 	PW_VERSION_STREAM_EVENTS,
 	.state_changed = pipewire_output_stream_state_changed,
 	.format_changed = pipewire_output_stream_format_changed,
+	.add_buffer = pipewire_output_stream_add_buffer,
+	.remove_buffer = pipewire_output_stream_remove_buffer,
 };
 
 static struct weston_output *
@@ -557,6 +656,8 @@ pipewire_output_create(struct weston_compositor *c, char *name)
 	if (!output)
 		return NULL;
 
+	wl_list_init(&output->buffer_list);
+
 	head = zalloc(sizeof *head);
 	if (!head)
 		goto err;
@@ -662,6 +763,20 @@ pipewire_output_set_seat(struct weston_output *output, const char *seat)
 {
 }
 
+static void
+pipewire_output_set_frame_queue_depth(struct weston_output *base_output,
+				      unsigned int depth)
+{
+	struct pipewire_output *output = lookup_pipewire_output(base_output);
+	const struct weston_drm_virtual_output_api *api;
+
+	if (!output)
+		return;
+
+	api = output->pipewire->virtual_output_api;
+	api->set_frame_queue_depth(base_output, depth);
+}
+
 static void
 weston_pipewire_destroy(struct wl_listener *l, void *data)
 {
@@ -800,6 +915,7 @@ static const struct weston_pipewire_api pipewire_api = {
 	pipewire_output_is_pipewire,
 	pipewire_output_set_mode,
 	pipewire_output_set_seat,
+	pipewire_output_set_frame_queue_depth,
 };
 
 WL_EXPORT int
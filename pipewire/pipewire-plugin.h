@@ -47,6 +47,11 @@ struct weston_pipewire_api {
 
 	/** Set seat */
 	void (*set_seat)(struct weston_output *output, const char *seat);
+
+	/** Set how many frames the output may have in flight, newer frames
+	 * replace older ones beyond that */
+	void (*set_frame_queue_depth)(struct weston_output *output,
+				      unsigned int depth);
 };
 
 static inline const struct weston_pipewire_api *
@@ -44,6 +44,7 @@
 #include <drm_fourcc.h>
 
 #include "remoting-plugin.h"
+#include "remoting-worker.h"
 #include <libweston/backend-drm.h>
 #include <libweston/backend-headless.h>
 #include "shared/helpers.h"
@@ -53,6 +54,10 @@
 
 #define MAX_RETRY_COUNT	3
 
+/* Beyond this many damage rectangles a frame carries their extents as its
+ * only region of interest */
+#define REMOTING_DAMAGE_RECTS_MAX	16
+
 struct weston_remoting {
 	struct weston_compositor *compositor;
 	struct wl_list output_list;
@@ -60,6 +65,7 @@ struct weston_remoting {
 	const struct weston_drm_virtual_output_api *virtual_output_api;
 
 	GstAllocator *allocator;
+	struct remoting_worker_pool *worker_pool;
 };
 
 struct remoted_gstpipe {
@@ -111,8 +117,13 @@ struct remoted_output {
 	struct wl_event_source *finish_frame_timer;
 	struct wl_list link;
 	bool submitted_frame;
-	int fence_sync_fd;
-	struct wl_event_source *fence_sync_event_source;
+	struct remoting_queue *queue;
+
+	/* What changed since the last frame pushed to gstreamer */
+	pixman_region32_t damage;
+	uint32_t keepalive_msec;
+	struct wl_event_source *keepalive_timer;
+	bool keepalive_due;
 
 	GstElement *pipeline;
 	GstAppSrc *appsrc;
@@ -129,7 +140,9 @@ struct mem_free_cb_data {
 };
 
 struct gst_frame_buffer_data {
+	struct remoting_job job;
 	struct remoted_output *output;
+	GstAppSrc *appsrc;
 	GstBuffer *buffer;
 };
 
@@ -299,7 +312,11 @@ remoting_gst_restart(void *data)
 	if (remoting_gst_pipeline_init(output) < 0) {
 		weston_log("gst: Could not restart pipeline!!\n");
 		remoting_output_disable(output->output);
+		return;
 	}
+
+	/* The new pipeline has no picture yet */
+	weston_output_damage(output->output);
 }
 
 static void
@@ -441,6 +458,8 @@ weston_remoting_destroy(struct wl_listener *l, void *data)
 	wl_list_for_each_safe(output, next, &remoting->output_list, link)
 		remoting_output_destroy(output->output);
 
+	remoting_worker_pool_destroy(remoting->worker_pool);
+
 	/* Finalize gstreamer */
 	remoting_gst_deinit(remoting);
 
@@ -523,8 +542,8 @@ lookup_remoted_output(struct weston_output *output)
 }
 
 static void
-remoting_output_gst_push_buffer(struct remoted_output *output,
-				GstBuffer *buffer)
+remoting_output_gst_stamp_buffer(struct remoted_output *output,
+				 GstBuffer *buffer)
 {
 	struct timespec current_frame_ts;
 	GstClockTime ts, current_frame_time;
@@ -541,26 +560,93 @@ remoting_output_gst_push_buffer(struct remoted_output *output,
 	else
 		GST_BUFFER_PTS(buffer) = GST_CLOCK_TIME_NONE;
 	GST_BUFFER_DURATION(buffer) = GST_CLOCK_TIME_NONE;
+}
+
+/* Tells the encoder where the frame changed, encoders that know region of
+ * interest meta can spend their bits there */
+static void
+remoting_output_gst_add_damage(struct remoted_output *output,
+			       GstBuffer *buffer)
+{
+	pixman_box32_t *rects;
+	int n_rects, i;
+
+	rects = pixman_region32_rectangles(&output->damage, &n_rects);
+	if (n_rects > REMOTING_DAMAGE_RECTS_MAX) {
+		rects = pixman_region32_extents(&output->damage);
+		n_rects = 1;
+	}
+
+	for (i = 0; i < n_rects; i++)
+		gst_buffer_add_video_region_of_interest_meta(buffer, "damage",
+							     rects[i].x1,
+							     rects[i].y1,
+							     rects[i].x2 - rects[i].x1,
+							     rects[i].y2 - rects[i].y1);
 
-	gst_app_src_push_buffer(output->appsrc, buffer);
-	output->submitted_frame = true;
+	pixman_region32_clear(&output->damage);
 }
 
 static int
-remoting_output_fence_sync_handler(int fd, uint32_t mask, void *data)
+remoting_output_keepalive_handler(void *data)
 {
-	struct gst_frame_buffer_data *frame_data = data;
-	struct remoted_output *output = frame_data->output;
-
-	remoting_output_gst_push_buffer(output, frame_data->buffer);
+	struct remoted_output *output = data;
 
-	wl_event_source_remove(output->fence_sync_event_source);
-	close(output->fence_sync_fd);
-	free(frame_data);
+	/* Have the next repaint sent even when it changes nothing */
+	output->keepalive_due = true;
+	weston_output_schedule_repaint(output->output);
 
 	return 0;
 }
 
+/* Whether a frame is worth pushing, collecting its damage if it is */
+static bool
+remoting_output_frame_changed(struct remoted_output *output,
+			      void *output_buffer)
+{
+	const struct weston_drm_virtual_output_api *api
+		= output->remoting->virtual_output_api;
+	struct weston_mode *mode = output->output->current_mode;
+
+	if (!api->get_frame_damage) {
+		pixman_region32_union_rect(&output->damage, &output->damage,
+					   0, 0, mode->width, mode->height);
+		return true;
+	}
+
+	pixman_region32_union(&output->damage, &output->damage,
+			      api->get_frame_damage(output_buffer));
+
+	return output->keepalive_msec == 0 || output->keepalive_due ||
+	       pixman_region32_not_empty(&output->damage);
+}
+
+/* Runs on the worker thread once rendering is complete */
+static void
+remoting_output_gst_push_buffer(struct remoting_job *job)
+{
+	struct gst_frame_buffer_data *frame_data =
+		container_of(job, struct gst_frame_buffer_data, job);
+
+	gst_app_src_push_buffer(frame_data->appsrc, frame_data->buffer);
+	frame_data->buffer = NULL;
+}
+
+static void
+remoting_output_gst_push_done(struct remoting_job *job)
+{
+	struct gst_frame_buffer_data *frame_data =
+		container_of(job, struct gst_frame_buffer_data, job);
+
+	/* Dropping the buffer releases the output buffer */
+	if (frame_data->buffer)
+		gst_buffer_unref(frame_data->buffer);
+
+	frame_data->output->submitted_frame = true;
+	gst_object_unref(frame_data->appsrc);
+	free(frame_data);
+}
+
 static int
 remoting_output_frame(struct weston_output *output_base, int fd, int stride,
 		      void *output_buffer)
@@ -570,20 +656,33 @@ remoting_output_frame(struct weston_output *output_base, int fd, int stride,
 	struct weston_mode *mode;
 	const struct weston_drm_virtual_output_api *api
 		= output->remoting->virtual_output_api;
-	struct wl_event_loop *loop;
 	GstBuffer *buf;
 	GstMemory *mem;
 	gsize offset = 0;
 	struct mem_free_cb_data *cb_data;
 	struct gst_frame_buffer_data *frame_data;
 
-	if (!output)
+	if (!output || !output->queue)
 		return -1;
 
+	/* Nothing changed, the encoder already has this picture */
+	if (!remoting_output_frame_changed(output, output_buffer)) {
+		close(fd);
+		api->buffer_released(output_buffer);
+		output->submitted_frame = true;
+		return 0;
+	}
+
 	cb_data = zalloc(sizeof *cb_data);
 	if (!cb_data)
 		return -1;
 
+	frame_data = zalloc(sizeof *frame_data);
+	if (!frame_data) {
+		free(cb_data);
+		return -1;
+	}
+
 	mode = output->output->current_mode;
 	buf = gst_buffer_new();
 	mem = gst_dmabuf_allocator_alloc(remoting->allocator, fd,
@@ -604,28 +703,31 @@ remoting_output_frame(struct weston_output *output_base, int fd, int stride,
 				 (GstMiniObjectNotify)remoting_gst_mem_free_cb,
 				 cb_data);
 
-	output->fence_sync_fd = api->get_fence_sync_fd(output->output);
-	/* Push buffer to gstreamer immediately on get_fence_sync_fd failure */
-	if (output->fence_sync_fd == -1) {
-		remoting_output_gst_push_buffer(output, buf);
+	/* The encoder is falling behind, drop the frame; its damage goes
+	 * with the next one */
+	if (remoting_queue_is_full(output->queue)) {
+		gst_buffer_unref(buf);
+		free(frame_data);
+		output->submitted_frame = true;
 		return 0;
 	}
 
-	frame_data = zalloc(sizeof *frame_data);
-	if (!frame_data) {
-		close(output->fence_sync_fd);
-		remoting_output_gst_push_buffer(output, buf);
-		return 0;
-	}
+	remoting_output_gst_stamp_buffer(output, buf);
+	remoting_output_gst_add_damage(output, buf);
+
+	output->keepalive_due = false;
+	if (output->keepalive_msec > 0)
+		wl_event_source_timer_update(output->keepalive_timer,
+					     output->keepalive_msec);
 
 	frame_data->output = output;
+	frame_data->appsrc = gst_object_ref(output->appsrc);
 	frame_data->buffer = buf;
-	loop = wl_display_get_event_loop(remoting->compositor->wl_display);
-	output->fence_sync_event_source =
-		wl_event_loop_add_fd(loop, output->fence_sync_fd,
-				     WL_EVENT_READABLE,
-				     remoting_output_fence_sync_handler,
-				     frame_data);
+	/* Pushed as soon as possible when there is no fence */
+	frame_data->job.fence_fd = api->get_fence_sync_fd(output->output);
+	frame_data->job.run = remoting_output_gst_push_buffer;
+	frame_data->job.done = remoting_output_gst_push_done;
+	remoting_queue_push(output->queue, &frame_data->job);
 
 	return 0;
 }
@@ -641,9 +743,13 @@ remoting_output_destroy(struct weston_output *output)
 		free(mode);
 	}
 
+	if (remoted_output->queue)
+		remoting_queue_destroy(remoted_output->queue);
+
 	remoted_output->saved_destroy(output);
 
 	remoting_gst_pipeline_deinit(remoted_output);
+	pixman_region32_fini(&remoted_output->damage);
 	remoting_gstpipe_release(&remoted_output->gstpipe);
 
 	if (remoted_output->host)
@@ -710,11 +816,26 @@ remoting_output_enable(struct weston_output *output)
 		return ret;
 	}
 
+	remoted_output->queue =
+		remoting_queue_create(remoted_output->remoting->worker_pool,
+				      output->name);
+	if (!remoted_output->queue) {
+		remoting_gst_pipeline_deinit(remoted_output);
+		remoted_output->saved_disable(output);
+		return -1;
+	}
+
 	loop = wl_display_get_event_loop(c->wl_display);
 	remoted_output->finish_frame_timer =
 		wl_event_loop_add_timer(loop,
 					remoting_output_finish_frame_handler,
 					remoted_output);
+	remoted_output->keepalive_timer =
+		wl_event_loop_add_timer(loop,
+					remoting_output_keepalive_handler,
+					remoted_output);
+	remoted_output->keepalive_due = false;
+	pixman_region32_clear(&remoted_output->damage);
 
 	remoted_output->dpms = WESTON_DPMS_ON;
 	return 0;
@@ -726,6 +847,11 @@ remoting_output_disable(struct weston_output *output)
 	struct remoted_output *remoted_output = lookup_remoted_output(output);
 
 	wl_event_source_remove(remoted_output->finish_frame_timer);
+	wl_event_source_remove(remoted_output->keepalive_timer);
+	if (remoted_output->queue) {
+		remoting_queue_destroy(remoted_output->queue);
+		remoted_output->queue = NULL;
+	}
 	remoting_gst_pipeline_deinit(remoted_output);
 
 	return remoted_output->saved_disable(output);
@@ -774,6 +900,8 @@ remoting_output_create(struct weston_compositor *c, char *name)
 	output->saved_disable = output->output->disable;
 	output->output->disable = remoting_output_disable;
 	output->remoting = remoting;
+	output->keepalive_msec = WESTON_REMOTING_KEEPALIVE_INTERVAL;
+	pixman_region32_init(&output->damage);
 	wl_list_insert(remoting->output_list.prev, &output->link);
 
 	weston_head_init(head, connector_name);
@@ -907,6 +1035,32 @@ remoting_output_set_gst_pipeline(struct weston_output *output,
 	remoted_output->gst_pipeline = strdup(gst_pipeline);
 }
 
+static void
+remoting_output_set_frame_queue_depth(struct weston_output *output,
+				      unsigned int depth)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+	const struct weston_drm_virtual_output_api *api;
+
+	if (!remoted_output)
+		return;
+
+	api = remoted_output->remoting->virtual_output_api;
+	api->set_frame_queue_depth(output, depth);
+}
+
+static void
+remoting_output_set_keepalive_interval(struct weston_output *output,
+				       unsigned int msec)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+
+	if (!remoted_output)
+		return;
+
+	remoted_output->keepalive_msec = msec;
+}
+
 static const struct weston_remoting_api remoting_api = {
 	remoting_output_create,
 	remoting_output_is_remoted,
@@ -916,6 +1070,8 @@ static const struct weston_remoting_api remoting_api = {
 	remoting_output_set_host,
 	remoting_output_set_port,
 	remoting_output_set_gst_pipeline,
+	remoting_output_set_frame_queue_depth,
+	remoting_output_set_keepalive_interval,
 };
 
 WL_EXPORT int
@@ -966,6 +1122,14 @@ weston_module_init(struct weston_compositor *compositor)
 		goto failed;
 	}
 
+	remoting->worker_pool =
+		remoting_worker_pool_create(compositor, REMOTING_WORKER_THREADS,
+					    "remoting");
+	if (!remoting->worker_pool) {
+		remoting_gst_deinit(remoting);
+		goto failed;
+	}
+
 	return 0;
 
 failed:
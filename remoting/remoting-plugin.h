@@ -33,6 +33,10 @@
 
 #define WESTON_REMOTING_API_NAME	"weston_remoting_api_v1"
 
+/* How long a remoted output may go without sending a frame while nothing
+ * changes on it, see set_keepalive_interval() */
+#define WESTON_REMOTING_KEEPALIVE_INTERVAL 1000
+
 struct weston_remoting_api {
 	/** Create remoted outputs
 	 *
@@ -63,6 +67,21 @@ struct weston_remoting_api {
 	/** Set the pipeline for gstreamer */
 	void (*set_gst_pipeline)(struct weston_output *output,
 				 char *gst_pipeline);
+
+	/** Set how many frames the output may have in flight, newer frames
+	 * replace older ones beyond that */
+	void (*set_frame_queue_depth)(struct weston_output *output,
+				      unsigned int depth);
+
+	/** Set how long, in milliseconds, the stream may go without a frame
+	 * when nothing changes on the output
+	 *
+	 * Repaints that change nothing are not sent until then, and the last
+	 * frame is sent again when the interval runs out. 0 sends every
+	 * repaint. Defaults to WESTON_REMOTING_KEEPALIVE_INTERVAL.
+	 */
+	void (*set_keepalive_interval)(struct weston_output *output,
+				       unsigned int msec);
 };
 
 static inline const struct weston_remoting_api *
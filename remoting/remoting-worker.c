@@ -0,0 +1,434 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <libweston/libweston.h>
+#include <libweston/weston-log.h>
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "remoting-worker.h"
+
+/* Rather run a job on a stuck fence than stall the other outputs */
+#define FENCE_TIMEOUT_MS 1000
+
+struct remoting_worker {
+	struct remoting_worker_pool *pool;
+	pthread_t thread;
+	int wake_fd;
+
+	/* Protects queue_list and remoting_queue::busy, never held while a
+	 * job waits for its fence or runs */
+	pthread_mutex_t mutex;
+	/* Signalled when a job finished running */
+	pthread_cond_t idle_cond;
+
+	/* struct remoting_queue::link */
+	struct wl_list queue_list;
+	int num_queues;
+};
+
+struct remoting_worker_pool {
+	struct weston_log_scope *log;
+
+	int done_fd;
+	struct wl_event_source *done_source;
+
+	bool stopping;
+
+	/* struct remoting_queue::pool_link, compositor thread only */
+	struct wl_list queue_list;
+
+	int num_workers;
+	struct remoting_worker workers[];
+};
+
+/** Single producer, single consumer ring of jobs
+ *
+ * The compositor thread pushes jobs at head, the worker owning the queue
+ * runs them up to run, and the compositor thread retires them up to tail.
+ * Every index has a single writer, so no locking is needed.
+ */
+struct remoting_queue {
+	struct remoting_worker *worker;
+	struct wl_list link;
+	struct wl_list pool_link;
+	char *name;
+
+	struct remoting_job *jobs[REMOTING_QUEUE_DEPTH];
+	unsigned int head;
+	unsigned int run;
+	unsigned int tail;
+
+	/* The worker is running a job of this queue */
+	bool busy;
+};
+
+static void
+eventfd_signal(int fd)
+{
+	uint64_t one = 1;
+
+	while (write(fd, &one, sizeof one) < 0 && errno == EINTR)
+		continue;
+}
+
+static bool
+remoting_queue_run_one(struct remoting_queue *queue)
+{
+	unsigned int run = queue->run;
+	struct remoting_job *job;
+	struct pollfd pfd;
+
+	if (run == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+		return false;
+
+	job = queue->jobs[run % REMOTING_QUEUE_DEPTH];
+
+	if (job->fence_fd >= 0) {
+		pfd.fd = job->fence_fd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, FENCE_TIMEOUT_MS) < 0 && errno == EINTR)
+			continue;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &job->started);
+	job->run(job);
+	clock_gettime(CLOCK_MONOTONIC, &job->finished);
+
+	__atomic_store_n(&queue->run, run + 1, __ATOMIC_RELEASE);
+	eventfd_signal(queue->worker->pool->done_fd);
+
+	return true;
+}
+
+/* Takes the next queue with a job to run, round robin, with the worker
+ * mutex held */
+static struct remoting_queue *
+remoting_worker_next_queue(struct remoting_worker *worker)
+{
+	struct remoting_queue *queue;
+
+	wl_list_for_each(queue, &worker->queue_list, link) {
+		if (queue->run ==
+		    __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+			continue;
+
+		wl_list_remove(&queue->link);
+		wl_list_insert(worker->queue_list.prev, &queue->link);
+		queue->busy = true;
+
+		return queue;
+	}
+
+	return NULL;
+}
+
+static void *
+worker_thread_function(void *data)
+{
+	struct remoting_worker *worker = data;
+	struct remoting_worker_pool *pool = worker->pool;
+	struct remoting_queue *queue;
+	uint64_t count;
+
+	while (true) {
+		if (read(worker->wake_fd, &count, sizeof count) < 0 &&
+		    errno != EINTR)
+			break;
+
+		if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE))
+			break;
+
+		pthread_mutex_lock(&worker->mutex);
+		while ((queue = remoting_worker_next_queue(worker))) {
+			/* A queue being destroyed waits for busy to clear */
+			pthread_mutex_unlock(&worker->mutex);
+			remoting_queue_run_one(queue);
+			pthread_mutex_lock(&worker->mutex);
+
+			queue->busy = false;
+			pthread_cond_broadcast(&worker->idle_cond);
+		}
+		pthread_mutex_unlock(&worker->mutex);
+	}
+
+	return NULL;
+}
+
+static void
+remoting_queue_retire(struct remoting_queue *queue, unsigned int end,
+		      bool cancelled)
+{
+	struct weston_log_scope *log = queue->worker->pool->log;
+	struct remoting_job *job;
+
+	while (queue->tail != end) {
+		job = queue->jobs[queue->tail % REMOTING_QUEUE_DEPTH];
+
+		if (!cancelled && weston_log_scope_is_enabled(log))
+			weston_log_scope_printf(log,
+				"%s: depth %u, fence wait %" PRId64 " us, "
+				"run %" PRId64 " us, latency %" PRId64 " us\n",
+				queue->name, queue->head - queue->tail,
+				timespec_sub_to_nsec(&job->started,
+						     &job->queued) / 1000,
+				timespec_sub_to_nsec(&job->finished,
+						     &job->started) / 1000,
+				timespec_sub_to_nsec(&job->finished,
+						     &job->queued) / 1000);
+
+		queue->tail++;
+
+		if (job->fence_fd >= 0)
+			close(job->fence_fd);
+		job->cancelled = cancelled;
+		job->done(job);
+	}
+}
+
+static int
+remoting_worker_pool_done_handler(int fd, uint32_t mask, void *data)
+{
+	struct remoting_worker_pool *pool = data;
+	struct remoting_queue *queue, *next;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0)
+		return 0;
+
+	wl_list_for_each_safe(queue, next, &pool->queue_list, pool_link)
+		remoting_queue_retire(queue,
+				      __atomic_load_n(&queue->run,
+						      __ATOMIC_ACQUIRE),
+				      false);
+
+	return 0;
+}
+
+static void
+remoting_worker_pool_stop(struct remoting_worker_pool *pool)
+{
+	int i;
+
+	__atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+
+	for (i = 0; i < pool->num_workers; i++)
+		eventfd_signal(pool->workers[i].wake_fd);
+
+	for (i = 0; i < pool->num_workers; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		close(pool->workers[i].wake_fd);
+		pthread_cond_destroy(&pool->workers[i].idle_cond);
+		pthread_mutex_destroy(&pool->workers[i].mutex);
+	}
+}
+
+struct remoting_worker_pool *
+remoting_worker_pool_create(struct weston_compositor *compositor,
+			    int num_threads, const char *log_scope_name)
+{
+	struct remoting_worker_pool *pool;
+	struct remoting_worker *worker;
+	struct wl_event_loop *loop;
+
+	pool = zalloc(sizeof *pool + num_threads * sizeof pool->workers[0]);
+	if (!pool)
+		return NULL;
+
+	pool->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (pool->done_fd < 0)
+		goto err_free;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	pool->done_source =
+		wl_event_loop_add_fd(loop, pool->done_fd, WL_EVENT_READABLE,
+				     remoting_worker_pool_done_handler, pool);
+	if (!pool->done_source)
+		goto err_fd;
+
+	wl_list_init(&pool->queue_list);
+
+	while (pool->num_workers < num_threads) {
+		worker = &pool->workers[pool->num_workers];
+		worker->pool = pool;
+		wl_list_init(&worker->queue_list);
+
+		worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (worker->wake_fd < 0)
+			goto err_workers;
+
+		pthread_mutex_init(&worker->mutex, NULL);
+		pthread_cond_init(&worker->idle_cond, NULL);
+
+		if (pthread_create(&worker->thread, NULL,
+				   worker_thread_function, worker) != 0) {
+			pthread_cond_destroy(&worker->idle_cond);
+			pthread_mutex_destroy(&worker->mutex);
+			close(worker->wake_fd);
+			goto err_workers;
+		}
+
+		pool->num_workers++;
+	}
+
+	pool->log = weston_compositor_add_log_scope(compositor, log_scope_name,
+						    "Remoted frames: queue depth "
+						    "and copy latency\n",
+						    NULL, NULL, NULL);
+
+	return pool;
+
+err_workers:
+	weston_log("remoting: failed to start worker thread\n");
+	remoting_worker_pool_stop(pool);
+	wl_event_source_remove(pool->done_source);
+err_fd:
+	close(pool->done_fd);
+err_free:
+	free(pool);
+	return NULL;
+}
+
+void
+remoting_worker_pool_destroy(struct remoting_worker_pool *pool)
+{
+	struct remoting_queue *queue, *next;
+
+	wl_list_for_each_safe(queue, next, &pool->queue_list, pool_link)
+		remoting_queue_destroy(queue);
+
+	remoting_worker_pool_stop(pool);
+
+	wl_event_source_remove(pool->done_source);
+	close(pool->done_fd);
+
+	weston_log_scope_destroy(pool->log);
+	free(pool);
+}
+
+struct remoting_queue *
+remoting_queue_create(struct remoting_worker_pool *pool, const char *name)
+{
+	struct remoting_queue *queue;
+	struct remoting_worker *worker = &pool->workers[0];
+	int i;
+
+	queue = zalloc(sizeof *queue);
+	if (!queue)
+		return NULL;
+
+	queue->name = strdup(name);
+	if (!queue->name) {
+		free(queue);
+		return NULL;
+	}
+
+	for (i = 1; i < pool->num_workers; i++)
+		if (pool->workers[i].num_queues < worker->num_queues)
+			worker = &pool->workers[i];
+
+	queue->worker = worker;
+	worker->num_queues++;
+	wl_list_insert(&pool->queue_list, &queue->pool_link);
+
+	pthread_mutex_lock(&worker->mutex);
+	wl_list_insert(&worker->queue_list, &queue->link);
+	pthread_mutex_unlock(&worker->mutex);
+
+	return queue;
+}
+
+/** Destroy a queue
+ *
+ * Jobs the worker already ran are retired normally, the others get
+ * done() with cancelled set.
+ */
+void
+remoting_queue_destroy(struct remoting_queue *queue)
+{
+	struct remoting_worker *worker = queue->worker;
+
+	/* Waits only for a job of this queue in progress */
+	pthread_mutex_lock(&worker->mutex);
+	wl_list_remove(&queue->link);
+	while (queue->busy)
+		pthread_cond_wait(&worker->idle_cond, &worker->mutex);
+	pthread_mutex_unlock(&worker->mutex);
+
+	queue->worker->num_queues--;
+	wl_list_remove(&queue->pool_link);
+
+	remoting_queue_retire(queue, queue->run, false);
+	remoting_queue_retire(queue, queue->head, true);
+
+	free(queue->name);
+	free(queue);
+}
+
+bool
+remoting_queue_is_full(struct remoting_queue *queue)
+{
+	return queue->head - queue->tail >= REMOTING_QUEUE_DEPTH;
+}
+
+/** Queue a job for the worker thread
+ *
+ * Must be called from the compositor thread.
+ *
+ * \return false if the queue is full, and the job was not queued.
+ */
+bool
+remoting_queue_push(struct remoting_queue *queue, struct remoting_job *job)
+{
+	struct weston_log_scope *log = queue->worker->pool->log;
+
+	if (remoting_queue_is_full(queue)) {
+		if (weston_log_scope_is_enabled(log))
+			weston_log_scope_printf(log,
+				"%s: queue full, dropping frame\n",
+				queue->name);
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &job->queued);
+	job->cancelled = false;
+
+	queue->jobs[queue->head % REMOTING_QUEUE_DEPTH] = job;
+	__atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+	eventfd_signal(queue->worker->wake_fd);
+
+	return true;
+}
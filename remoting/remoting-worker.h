@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef REMOTING_WORKER_H
+#define REMOTING_WORKER_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include <libweston/libweston.h>
+
+/* Frames a remoted output can have in flight, must be a power of two */
+#define REMOTING_QUEUE_DEPTH 4
+
+/* Copies are memory bound, more threads than this do not help */
+#define REMOTING_WORKER_THREADS 2
+
+struct remoting_worker_pool;
+struct remoting_queue;
+
+/** A frame handed to a worker thread
+ *
+ * Embed this in a frame specific struct and push it to the queue of the
+ * output. The worker waits for fence_fd to signal, then calls run(); the
+ * compositor thread gets done() once run() has returned.
+ */
+struct remoting_job {
+	/* Sync file of the rendering, or -1; closed by the queue */
+	int fence_fd;
+
+	/* Called on the worker thread; must not touch compositor state */
+	void (*run)(struct remoting_job *job);
+	/* Called on the compositor thread, also for cancelled jobs */
+	void (*done)(struct remoting_job *job);
+
+	/* Set when the queue was destroyed before run() got called */
+	bool cancelled;
+
+	/* For the log scope */
+	struct timespec queued;
+	struct timespec started;
+	struct timespec finished;
+};
+
+struct remoting_worker_pool *
+remoting_worker_pool_create(struct weston_compositor *compositor,
+			    int num_threads, const char *log_scope_name);
+
+void
+remoting_worker_pool_destroy(struct remoting_worker_pool *pool);
+
+struct remoting_queue *
+remoting_queue_create(struct remoting_worker_pool *pool, const char *name);
+
+void
+remoting_queue_destroy(struct remoting_queue *queue);
+
+bool
+remoting_queue_is_full(struct remoting_queue *queue);
+
+bool
+remoting_queue_push(struct remoting_queue *queue, struct remoting_job *job);
+
+#endif /* REMOTING_WORKER_H */
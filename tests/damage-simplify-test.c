@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "damage-simplify.h"
+
+/* Text being typed: three lines of 8x16 glyph cells, a pixel apart */
+static void
+damage_text(pixman_region32_t *damage)
+{
+	int line, col;
+
+	for (line = 0; line < 3; line++)
+		for (col = 0; col < 80; col++)
+			pixman_region32_union_rect(damage, damage,
+						   10 + col * 9, 40 + line * 20,
+						   8, 16);
+}
+
+/* Every other 64x64 tile, merging any two wastes at least a third */
+static void
+damage_checkerboard(pixman_region32_t *damage)
+{
+	int x, y;
+
+	for (y = 0; y < 16; y++)
+		for (x = 0; x < 16; x++)
+			if ((x + y) % 2 == 0)
+				pixman_region32_union_rect(damage, damage,
+							   x * 64, y * 64,
+							   64, 64);
+}
+
+/* One field of interlaced video: every other row of a 640x480 area */
+static void
+damage_field(pixman_region32_t *damage)
+{
+	int y;
+
+	for (y = 0; y < 480; y += 2)
+		pixman_region32_union_rect(damage, damage, 0, y, 640, 1);
+}
+
+/* A clock and tray icons in the corners of a 1080p output */
+static void
+damage_corners(pixman_region32_t *damage)
+{
+	pixman_region32_union_rect(damage, damage, 0, 0, 24, 24);
+	pixman_region32_union_rect(damage, damage, 1896, 0, 24, 24);
+	pixman_region32_union_rect(damage, damage, 0, 1056, 24, 24);
+	pixman_region32_union_rect(damage, damage, 1896, 1056, 24, 24);
+}
+
+struct damage_simplify_test_data {
+	const char *name;
+	void (*build)(pixman_region32_t *damage);
+	struct weston_damage_simplify params;
+	/* Whether the result must have fewer rectangles than the damage */
+	bool merges;
+};
+
+static const struct damage_simplify_test_data test_data[] = {
+	{ "text", damage_text, { 0, 25 }, true },
+	{ "text", damage_text, { 8, 0 }, true },
+	{ "checkerboard", damage_checkerboard, { 0, 25 }, false },
+	{ "checkerboard", damage_checkerboard, { 16, 0 }, true },
+	{ "field", damage_field, { 0, 50 }, true },
+	{ "corners", damage_corners, { 0, 25 }, false },
+	{ "corners", damage_corners, { 1, 0 }, true },
+};
+
+static bool
+region_contains(pixman_region32_t *outer, pixman_region32_t *inner)
+{
+	pixman_region32_t rest;
+	bool ret;
+
+	pixman_region32_init(&rest);
+	pixman_region32_subtract(&rest, inner, outer);
+	ret = !pixman_region32_not_empty(&rest);
+	pixman_region32_fini(&rest);
+
+	return ret;
+}
+
+static int64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	int64_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (int64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+TEST_P(damage_simplify_covers_damage, test_data)
+{
+	const struct damage_simplify_test_data *tdata = data;
+	pixman_region32_t damage, simple;
+	int before, n;
+
+	pixman_region32_init(&damage);
+	tdata->build(&damage);
+	before = pixman_region32_n_rects(&damage);
+
+	pixman_region32_init(&simple);
+	n = weston_damage_simplify(&simple, &damage, &tdata->params);
+
+	testlog("%s, at most %d rects and %d %% waste: %d rects down to %d, "
+		"%.1f %% more pixels\n", tdata->name,
+		tdata->params.max_rects, tdata->params.max_waste_percent,
+		before, n,
+		100.0 * (region_area(&simple) - region_area(&damage)) /
+		region_area(&damage));
+
+	assert(n == pixman_region32_n_rects(&simple));
+	assert(region_contains(&simple, &damage));
+	if (tdata->params.max_rects > 0)
+		assert(n <= tdata->params.max_rects);
+	if (tdata->merges)
+		assert(n < before);
+	else
+		assert(pixman_region32_equal(&simple, &damage));
+
+	/* In place gives the same */
+	weston_damage_simplify(&damage, &damage, &tdata->params);
+	assert(pixman_region32_equal(&damage, &simple));
+
+	pixman_region32_fini(&simple);
+	pixman_region32_fini(&damage);
+}
+
+TEST(damage_simplify_untouched)
+{
+	static const struct weston_damage_simplify params = { 0, 0 };
+	pixman_region32_t damage, simple;
+
+	pixman_region32_init_rect(&damage, 0, 0, 10, 10);
+	pixman_region32_union_rect(&damage, &damage, 100, 100, 10, 10);
+	pixman_region32_init(&simple);
+
+	assert(weston_damage_simplify(&simple, &damage, &params) == 2);
+	assert(pixman_region32_equal(&simple, &damage));
+
+	pixman_region32_fini(&simple);
+	pixman_region32_fini(&damage);
+}
+
+TEST(damage_simplify_merges_close_boxes)
+{
+	static const struct weston_damage_simplify params = { 0, 25 };
+	pixman_region32_t damage, simple;
+	pixman_box32_t *extents;
+
+	/* Two glyphs a pixel apart merge, a far away one does not */
+	pixman_region32_init_rect(&damage, 0, 0, 8, 16);
+	pixman_region32_union_rect(&damage, &damage, 9, 2, 8, 14);
+	pixman_region32_union_rect(&damage, &damage, 1000, 1000, 8, 16);
+	assert(pixman_region32_n_rects(&damage) > 2);
+	pixman_region32_init(&simple);
+
+	assert(weston_damage_simplify(&simple, &damage, &params) == 2);
+	assert(region_contains(&simple, &damage));
+	extents = pixman_region32_rectangles(&simple, NULL);
+	assert(extents[0].x1 == 0 && extents[0].y1 == 0);
+	assert(extents[0].x2 == 17 && extents[0].y2 == 16);
+
+	pixman_region32_fini(&simple);
+	pixman_region32_fini(&damage);
+}
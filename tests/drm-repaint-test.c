@@ -0,0 +1,108 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#include "shared/timespec-util.h"
+#include "weston-test-client-helper.h"
+#include "weston-test-fixture-compositor.h"
+
+#define NUM_FRAMES 120
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.shell = SHELL_TEST_DESKTOP;
+	setup.backend = WESTON_BACKEND_DRM;
+	setup.renderer = RENDERER_PIXMAN;
+
+	return weston_test_harness_execute_as_client(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+/*
+ * Commit a stream of full surface updates and report how long each took
+ * to come back as a frame callback. Meant to be run against the fake KMS
+ * device, where vblanks are regular and the numbers comparable.
+ */
+TEST(drm_repaint_latency)
+{
+	struct client *client;
+	struct buffer *buffers[2];
+	struct wl_surface *surface;
+	struct timespec start, commit, done;
+	pixman_color_t colors[2];
+	int64_t latency, min = INT64_MAX, max = 0, total = 0;
+	int64_t elapsed;
+	int i, frame;
+
+	color_rgb888(&colors[0], 255, 0, 0);
+	color_rgb888(&colors[1], 0, 0, 255);
+
+	client = create_client_and_test_surface(0, 0, 200, 200);
+	assert(client);
+	surface = client->surface->wl_surface;
+
+	for (i = 0; i < 2; i++) {
+		buffers[i] = create_shm_buffer_a8r8g8b8(client, 200, 200);
+		fill_image_with_color(buffers[i]->image, &colors[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < NUM_FRAMES; i++) {
+		wl_surface_attach(surface, buffers[i % 2]->proxy, 0, 0);
+		wl_surface_damage(surface, 0, 0, 200, 200);
+		frame_callback_set(surface, &frame);
+
+		clock_gettime(CLOCK_MONOTONIC, &commit);
+		wl_surface_commit(surface);
+		frame_callback_wait(client, &frame);
+		clock_gettime(CLOCK_MONOTONIC, &done);
+
+		latency = timespec_sub_to_nsec(&done, &commit);
+		min = MIN(min, latency);
+		max = MAX(max, latency);
+		total += latency;
+	}
+
+	elapsed = timespec_sub_to_nsec(&done, &start);
+
+	testlog("%d frames in %.1f ms, %.1f fps\n", NUM_FRAMES,
+		elapsed / 1e6, NUM_FRAMES * 1e9 / elapsed);
+	testlog("commit to frame callback: min %.3f ms, avg %.3f ms, "
+		"max %.3f ms\n", min / 1e6, total / 1e6 / NUM_FRAMES,
+		max / 1e6);
+
+	for (i = 0; i < 2; i++)
+		buffer_destroy(buffers[i]);
+	client_destroy(client);
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "weston-test-client-helper.h"
+#include "weston-test-fixture-compositor.h"
+#include "fake-kms.h"
+
+#define NUM_FRAMES 60
+/* Matches FAKE_KMS_MODE in tests/meson.build */
+#define OUTPUT_WIDTH 640
+
+static fake_kms_get_stats_func_t get_stats;
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	/* Only the fake device can tell how many tests reach the kernel */
+	get_stats = (fake_kms_get_stats_func_t)
+		dlsym(RTLD_DEFAULT, FAKE_KMS_GET_STATS);
+	if (!get_stats)
+		return RESULT_SKIP;
+
+	compositor_setup_defaults(&setup);
+	setup.shell = SHELL_TEST_DESKTOP;
+	setup.backend = WESTON_BACKEND_DRM;
+	setup.renderer = RENDERER_PIXMAN;
+
+	return weston_test_harness_execute_as_client(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+/*
+ * With Pixman, every repaint after the first proposes a mixed-mode state,
+ * the renderer's last buffer on the primary plane, and tests it once. The
+ * device flips once per repainted output, so its TEST_ONLY commits against
+ * its flips give the share of tests the DRM backend answered from its
+ * cache.
+ */
+static void
+report_phase(const char *name, const struct fake_kms_stats *before,
+	     const struct fake_kms_stats *after,
+	     unsigned int *repaints, unsigned int *misses)
+{
+	*repaints = after->flips - before->flips;
+	*misses = after->tests - before->tests;
+
+	testlog("%s: %u output repaints, %u TEST_ONLY commits, "
+		"hit rate %.1f %%\n", name, *repaints, *misses,
+		*repaints ? 100.0 * (*repaints - *misses) / *repaints : 0.0);
+}
+
+static void
+commit_frames(struct client *client, int count)
+{
+	struct surface *surface = client->surface;
+	int i, frame;
+
+	for (i = 0; i < count; i++) {
+		wl_surface_attach(surface->wl_surface,
+				  surface->buffer->proxy, 0, 0);
+		wl_surface_damage(surface->wl_surface, 0, 0,
+				  surface->width, surface->height);
+		frame_callback_set(surface->wl_surface, &frame);
+		wl_surface_commit(surface->wl_surface);
+		frame_callback_wait(client, &frame);
+	}
+}
+
+TEST(drm_test_cache_hit_rate)
+{
+	struct client *client;
+	struct fake_kms_stats start, single, both;
+	unsigned int repaints, misses;
+	pixman_color_t red;
+
+	color_rgb888(&red, 255, 0, 0);
+
+	client = create_client_and_test_surface(0, 0, 200, 200);
+	assert(client);
+	fill_image_with_color(client->surface->buffer->image, &red);
+
+	/* Counted from when the device was opened, so the misses that
+	 * first filled the cache are in */
+	memset(&start, 0, sizeof start);
+
+	/* The same layout on one output: one miss, then hits */
+	commit_frames(client, NUM_FRAMES);
+	get_stats(&single);
+	report_phase("one output", &start, &single, &repaints, &misses);
+	assert(repaints >= NUM_FRAMES);
+	assert(misses >= 1);
+	assert(misses <= 4);
+
+	/* Straddling both outputs: the other output's state is part of
+	 * the key, so the new combinations miss before they hit */
+	move_client(client, OUTPUT_WIDTH - 100, 0);
+	commit_frames(client, NUM_FRAMES);
+	get_stats(&both);
+	report_phase("two outputs", &single, &both, &repaints, &misses);
+	assert(repaints >= NUM_FRAMES);
+	assert(misses <= 4);
+
+	report_phase("total", &start, &both, &repaints, &misses);
+	assert(both.tests_failed == 0);
+
+	client_destroy(client);
+}
@@ -0,0 +1,2797 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * A fake KMS device, to run the DRM-backend tests without hardware.
+ *
+ * Preloaded into a test program, this library answers the libdrm calls
+ * made on the device node FAKE_KMS_DEVNODE, and hands out a made up udev
+ * device for the sysname FAKE_KMS_SYSNAME. Everything else is passed on
+ * to the real libraries.
+ *
+ * The device has a number of CRTCs, each with one connector, a primary
+ * and a cursor plane. Atomic commits, TEST_ONLY ones included, are checked
+ * against roughly the rules drivers apply, and page flips complete on the
+ * first vblank of a timeline derived from the mode. Only dumb buffers are
+ * supported, so the backend has to use the Pixman renderer, and client
+ * buffers never reach a plane; there are no overlays to offer them.
+ *
+ * The configuration is read from the environment when the device is
+ * first opened; see the test suite documentation.
+ */
+
+#include "config.h"
+
+/* The libc entry points below are interposed under both of their names,
+ * so the headers must not redirect or wrap them. */
+#undef _FILE_OFFSET_BITS
+#undef _FORTIFY_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+
+#include <libudev.h>
+#include <wayland-util.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include <libweston/zalloc.h>
+#include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+#include "fake-kms.h"
+
+#define FAKE_KMS_SYSNAME "fake-card0"
+#define FAKE_KMS_DEVNODE "/dev/dri/" FAKE_KMS_SYSNAME
+
+#define FAKE_MAX_CRTCS 4
+#define FAKE_MAX_PLANES (FAKE_MAX_CRTCS * 2)
+#define FAKE_MAX_OBJECTS (FAKE_MAX_CRTCS * 2 + FAKE_MAX_PLANES)
+#define FAKE_MAX_OBJECT_PROPS 16
+#define FAKE_MAX_PROPS FAKE_PROP__COUNT
+#define FAKE_MAX_FORMATS 8
+
+#define FAKE_CURSOR_SIZE 64
+#define FAKE_GAMMA_SIZE 256
+#define FAKE_FB_SIZE_MAX 8192
+
+#define NSEC_PER_SEC 1000000000ull
+
+enum fake_prop_kind {
+	FAKE_PROP_PLANE_TYPE = 0,
+	FAKE_PROP_PLANE_FB_ID,
+	FAKE_PROP_PLANE_CRTC_ID,
+	FAKE_PROP_PLANE_SRC_X,
+	FAKE_PROP_PLANE_SRC_Y,
+	FAKE_PROP_PLANE_SRC_W,
+	FAKE_PROP_PLANE_SRC_H,
+	FAKE_PROP_PLANE_CRTC_X,
+	FAKE_PROP_PLANE_CRTC_Y,
+	FAKE_PROP_PLANE_CRTC_W,
+	FAKE_PROP_PLANE_CRTC_H,
+	FAKE_PROP_PLANE_IN_FORMATS,
+	FAKE_PROP_CONNECTOR_CRTC_ID,
+	FAKE_PROP_CONNECTOR_DPMS,
+	FAKE_PROP_CRTC_MODE_ID,
+	FAKE_PROP_CRTC_ACTIVE,
+	FAKE_PROP__COUNT
+};
+
+struct fake_prop {
+	uint32_t id;
+	enum fake_prop_kind kind;
+	const char *name;
+	uint32_t flags;
+	/* Range properties */
+	uint64_t min, max;
+	/* Object properties */
+	uint32_t object_type;
+	const struct drm_mode_property_enum *enums;
+	int count_enums;
+};
+
+struct fake_object {
+	uint32_t id;
+	uint32_t type;
+	int num_props;
+	struct fake_prop *props[FAKE_MAX_OBJECT_PROPS];
+	uint64_t values[FAKE_MAX_OBJECT_PROPS];
+};
+
+struct fake_plane;
+
+struct fake_crtc {
+	struct fake_object base;
+	int index;
+	struct fake_plane *primary;
+
+	/* As of the last commit */
+	bool enabled;
+	bool active;
+	drmModeModeInfo mode;
+
+	/* Vblank n happens at epoch + n * period */
+	uint64_t epoch_ns;
+	uint64_t period_ns;
+	bool flip_pending;
+};
+
+struct fake_connector {
+	struct fake_object base;
+	uint32_t encoder_id;
+	int type_id;
+	drmModeModeInfo mode;
+	/* As of the last commit */
+	uint32_t crtc_id;
+};
+
+struct fake_encoder {
+	uint32_t id;
+	uint32_t possible_crtcs;
+};
+
+struct fake_plane {
+	struct fake_object base;
+	uint64_t type;
+	uint32_t possible_crtcs;
+	uint32_t formats[FAKE_MAX_FORMATS];
+	int count_formats;
+};
+
+struct fake_fb {
+	uint32_t id;
+	uint32_t width, height;
+	uint32_t format;
+	uint64_t modifier;
+	struct fake_fb *next;
+};
+
+struct fake_blob {
+	uint32_t id;
+	uint32_t length;
+	void *data;
+	/* Destroyed by the user while still in use */
+	bool orphaned;
+	struct fake_blob *next;
+};
+
+struct fake_dumb {
+	uint32_t handle;
+	int fd;
+	uint64_t size;
+	uint64_t offset;
+	struct fake_dumb *next;
+};
+
+struct fake_event {
+	uint32_t crtc_id;
+	uint64_t deadline_ns;
+	uint32_t sequence;
+	void *user_data;
+	struct fake_event *next;
+};
+
+struct fake_config {
+	int num_crtcs;
+	int width, height, refresh;
+	int check_cost_us;
+	const char *stats;
+	bool debug;
+};
+
+/* An atomic request; opaque to libdrm users. */
+struct _drmModeAtomicReq {
+	uint32_t cursor;
+	uint32_t size;
+	struct {
+		uint32_t object_id;
+		uint32_t property_id;
+		uint64_t value;
+	} *items;
+};
+
+struct fake_device {
+	bool initialized;
+	/* The timerfd handed out as device fd, -1 when closed */
+	int fd;
+	struct fake_config config;
+
+	uint32_t next_id;
+	uint32_t next_handle;
+	bool atomic;
+
+	struct fake_prop props[FAKE_MAX_PROPS];
+	int num_props;
+
+	struct fake_object *objects[FAKE_MAX_OBJECTS];
+	int num_objects;
+
+	struct fake_crtc crtcs[FAKE_MAX_CRTCS];
+	struct fake_connector connectors[FAKE_MAX_CRTCS];
+	struct fake_encoder encoders[FAKE_MAX_CRTCS];
+	int num_crtcs;
+
+	struct fake_plane planes[FAKE_MAX_PLANES];
+	int num_planes;
+
+	struct fake_fb *fbs;
+	struct fake_blob *blobs;
+	struct fake_dumb *dumbs;
+	/* Sorted by deadline */
+	struct fake_event *events;
+
+	/* Also read by test threads, see fake_kms_get_stats() */
+	struct fake_kms_stats stats;
+	unsigned int legacy_calls;
+	uint64_t flip_wait_ns;
+};
+
+static struct fake_device dev = {
+	.fd = -1,
+};
+
+/* Stand-in for the udev device of the fake node */
+static struct {
+	int unused;
+} fake_udev_device;
+
+#define FAKE_UDEV_DEVICE ((struct udev_device *) &fake_udev_device)
+
+#define STATS_INC(field) \
+	__atomic_fetch_add(&dev.stats.field, 1, __ATOMIC_RELAXED)
+
+static const struct drm_mode_property_enum plane_type_enums[] = {
+	{ DRM_PLANE_TYPE_PRIMARY, "Primary" },
+	{ DRM_PLANE_TYPE_CURSOR, "Cursor" },
+};
+
+static const struct drm_mode_property_enum dpms_enums[] = {
+	{ DRM_MODE_DPMS_ON, "On" },
+	{ DRM_MODE_DPMS_STANDBY, "Standby" },
+	{ DRM_MODE_DPMS_SUSPEND, "Suspend" },
+	{ DRM_MODE_DPMS_OFF, "Off" },
+};
+
+static const uint32_t primary_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_RGB565,
+};
+
+static void *
+real_symbol(const char *name)
+{
+	void *sym = dlsym(RTLD_NEXT, name);
+
+	if (!sym) {
+		fprintf(stderr, "fake-kms: no real %s\n", name);
+		abort();
+	}
+
+	return sym;
+}
+
+#define REAL(fn) ({ \
+	static __typeof__(&fn) real_##fn; \
+	if (!real_##fn) \
+		real_##fn = real_symbol(#fn); \
+	real_##fn; \
+})
+
+static bool
+is_fake_fd(int fd)
+{
+	return fd >= 0 && fd == __atomic_load_n(&dev.fd, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void
+sleep_until_ns(uint64_t deadline)
+{
+	struct timespec ts = {
+		.tv_sec = deadline / NSEC_PER_SEC,
+		.tv_nsec = deadline % NSEC_PER_SEC,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		continue;
+}
+
+static int
+fake_error(int err)
+{
+	errno = err;
+	return -err;
+}
+
+static int
+fake_reject(int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (dev.config.debug) {
+		fprintf(stderr, "fake-kms: ");
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fprintf(stderr, "\n");
+	}
+
+	return fake_error(err);
+}
+
+/* Configuration */
+
+static int
+env_int(const char *name, int def, int min, int max)
+{
+	const char *str = getenv(name);
+	char *end;
+	long val;
+
+	if (!str || !*str)
+		return def;
+
+	errno = 0;
+	val = strtol(str, &end, 0);
+	if (errno || *end || val < min || val > max) {
+		fprintf(stderr, "fake-kms: ignoring bad %s=%s\n", name, str);
+		return def;
+	}
+
+	return val;
+}
+
+static void
+fake_config_init(struct fake_config *config)
+{
+	const char *str;
+
+	config->num_crtcs = env_int("FAKE_KMS_CRTCS", 1, 1, FAKE_MAX_CRTCS);
+	config->check_cost_us = env_int("FAKE_KMS_CHECK_COST_US", 0,
+					0, 1000000);
+	config->debug = env_int("FAKE_KMS_DEBUG", 0, 0, 1);
+	config->stats = getenv("FAKE_KMS_STATS");
+
+	config->width = 1920;
+	config->height = 1080;
+	config->refresh = 60;
+	str = getenv("FAKE_KMS_MODE");
+	if (str && (sscanf(str, "%dx%d@%d", &config->width, &config->height,
+			   &config->refresh) < 2 ||
+		    config->width <= 0 || config->width > FAKE_FB_SIZE_MAX ||
+		    config->height <= 0 || config->height > FAKE_FB_SIZE_MAX ||
+		    config->refresh <= 0)) {
+		fprintf(stderr, "fake-kms: ignoring bad FAKE_KMS_MODE=%s\n",
+			str);
+		config->width = 1920;
+		config->height = 1080;
+		config->refresh = 60;
+	}
+}
+
+/* Mode objects */
+
+static void
+fake_mode_init(drmModeModeInfo *mode, int width, int height, int refresh)
+{
+	memset(mode, 0, sizeof *mode);
+
+	/* Reduced blanking, the timings only matter for the refresh rate */
+	mode->hdisplay = width;
+	mode->hsync_start = width + 48;
+	mode->hsync_end = width + 80;
+	mode->htotal = width + 160;
+	mode->vdisplay = height;
+	mode->vsync_start = height + 3;
+	mode->vsync_end = height + 8;
+	mode->vtotal = height + 40;
+	mode->clock = (uint64_t) mode->htotal * mode->vtotal * refresh / 1000;
+	mode->vrefresh = refresh;
+	mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_NVSYNC;
+	mode->type = DRM_MODE_TYPE_PREFERRED | DRM_MODE_TYPE_DRIVER;
+	snprintf(mode->name, sizeof mode->name, "%dx%d", width, height);
+}
+
+static uint64_t
+fake_mode_period_ns(const drmModeModeInfo *mode)
+{
+	if (mode->clock == 0)
+		return NSEC_PER_SEC / 60;
+
+	return (uint64_t) mode->htotal * mode->vtotal * 1000000 / mode->clock;
+}
+
+static struct fake_prop *
+fake_prop_create(enum fake_prop_kind kind, const char *name, uint32_t flags)
+{
+	struct fake_prop *prop = &dev.props[dev.num_props++];
+
+	prop->id = dev.next_id++;
+	prop->kind = kind;
+	prop->name = name;
+	prop->flags = flags;
+
+	return prop;
+}
+
+static struct fake_prop *
+fake_prop_create_range(enum fake_prop_kind kind, const char *name,
+		       uint32_t flags, uint64_t min, uint64_t max)
+{
+	struct fake_prop *prop = fake_prop_create(kind, name,
+						  flags | DRM_MODE_PROP_RANGE);
+
+	prop->min = min;
+	prop->max = max;
+
+	return prop;
+}
+
+static struct fake_prop *
+fake_prop_create_object(enum fake_prop_kind kind, const char *name,
+			uint32_t object_type)
+{
+	struct fake_prop *prop = fake_prop_create(kind, name,
+						  DRM_MODE_PROP_OBJECT);
+
+	prop->object_type = object_type;
+
+	return prop;
+}
+
+static struct fake_prop *
+fake_prop_create_enum(enum fake_prop_kind kind, const char *name,
+		      uint32_t flags,
+		      const struct drm_mode_property_enum *enums,
+		      int count_enums)
+{
+	struct fake_prop *prop = fake_prop_create(kind, name,
+						  flags | DRM_MODE_PROP_ENUM);
+
+	prop->enums = enums;
+	prop->count_enums = count_enums;
+
+	return prop;
+}
+
+static struct fake_prop *
+fake_prop_find(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < dev.num_props; i++)
+		if (dev.props[i].id == id)
+			return &dev.props[i];
+
+	return NULL;
+}
+
+static void
+fake_object_init(struct fake_object *obj, uint32_t type)
+{
+	obj->id = dev.next_id++;
+	obj->type = type;
+	dev.objects[dev.num_objects++] = obj;
+}
+
+static void
+fake_object_attach(struct fake_object *obj, struct fake_prop *prop,
+		   uint64_t value)
+{
+	obj->props[obj->num_props] = prop;
+	obj->values[obj->num_props] = value;
+	obj->num_props++;
+}
+
+static int
+fake_object_prop_index(struct fake_object *obj, uint32_t prop_id)
+{
+	int i;
+
+	for (i = 0; i < obj->num_props; i++)
+		if (obj->props[i]->id == prop_id)
+			return i;
+
+	return -1;
+}
+
+static uint64_t *
+fake_object_value(struct fake_object *obj, enum fake_prop_kind kind)
+{
+	int i;
+
+	for (i = 0; i < obj->num_props; i++)
+		if (obj->props[i]->kind == kind)
+			return &obj->values[i];
+
+	return NULL;
+}
+
+static uint64_t
+fake_object_get(struct fake_object *obj, enum fake_prop_kind kind)
+{
+	uint64_t *value = fake_object_value(obj, kind);
+
+	return value ? *value : 0;
+}
+
+static void
+fake_object_set(struct fake_object *obj, enum fake_prop_kind kind,
+		uint64_t value)
+{
+	uint64_t *ptr = fake_object_value(obj, kind);
+
+	if (ptr)
+		*ptr = value;
+}
+
+static struct fake_object *
+fake_object_find(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < dev.num_objects; i++)
+		if (dev.objects[i]->id == id)
+			return dev.objects[i];
+
+	return NULL;
+}
+
+static struct fake_crtc *
+fake_crtc_find(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < dev.num_crtcs; i++)
+		if (dev.crtcs[i].base.id == id)
+			return &dev.crtcs[i];
+
+	return NULL;
+}
+
+static struct fake_connector *
+fake_connector_find(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < dev.num_crtcs; i++)
+		if (dev.connectors[i].base.id == id)
+			return &dev.connectors[i];
+
+	return NULL;
+}
+
+static struct fake_plane *
+fake_plane_find(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < dev.num_planes; i++)
+		if (dev.planes[i].base.id == id)
+			return &dev.planes[i];
+
+	return NULL;
+}
+
+static struct fake_fb *
+fake_fb_find(uint32_t id)
+{
+	struct fake_fb *fb;
+
+	for (fb = dev.fbs; fb; fb = fb->next)
+		if (fb->id == id)
+			return fb;
+
+	return NULL;
+}
+
+static struct fake_blob *
+fake_blob_find(uint32_t id)
+{
+	struct fake_blob *blob;
+
+	for (blob = dev.blobs; blob; blob = blob->next)
+		if (blob->id == id)
+			return blob;
+
+	return NULL;
+}
+
+static bool
+fake_blob_in_use(struct fake_blob *blob)
+{
+	struct fake_object *obj;
+	int i, j;
+
+	for (i = 0; i < dev.num_objects; i++) {
+		obj = dev.objects[i];
+		for (j = 0; j < obj->num_props; j++)
+			if ((obj->props[j]->flags & DRM_MODE_PROP_BLOB) &&
+			    obj->values[j] == blob->id)
+				return true;
+	}
+
+	return false;
+}
+
+/** Free the blobs the user destroyed, once no property points at them */
+static void
+fake_blobs_collect(void)
+{
+	struct fake_blob *blob, **pos;
+
+	for (pos = &dev.blobs; (blob = *pos);) {
+		if (!blob->orphaned || fake_blob_in_use(blob)) {
+			pos = &blob->next;
+			continue;
+		}
+
+		*pos = blob->next;
+		free(blob->data);
+		free(blob);
+	}
+}
+
+static struct fake_dumb *
+fake_dumb_find(uint32_t handle)
+{
+	struct fake_dumb *dumb;
+
+	for (dumb = dev.dumbs; dumb; dumb = dumb->next)
+		if (dumb->handle == handle)
+			return dumb;
+
+	return NULL;
+}
+
+static struct fake_blob *
+fake_blob_create(const void *data, uint32_t length)
+{
+	struct fake_blob *blob;
+
+	blob = zalloc(sizeof *blob);
+	if (!blob)
+		return NULL;
+
+	blob->data = malloc(length);
+	if (!blob->data) {
+		free(blob);
+		return NULL;
+	}
+
+	blob->id = dev.next_id++;
+	blob->length = length;
+	memcpy(blob->data, data, length);
+	blob->next = dev.blobs;
+	dev.blobs = blob;
+
+	return blob;
+}
+
+/** Build the IN_FORMATS blob of a plane: every format, linear only */
+static uint32_t
+fake_plane_in_formats(struct fake_plane *plane)
+{
+	struct drm_format_modifier_blob *header;
+	struct drm_format_modifier *mods;
+	struct fake_blob *blob;
+	size_t formats_offset, modifiers_offset, size;
+
+	formats_offset = sizeof *header;
+	modifiers_offset = formats_offset +
+			   plane->count_formats * sizeof(uint32_t);
+	modifiers_offset = (modifiers_offset + 7) & ~(size_t) 7;
+	size = modifiers_offset + sizeof *mods;
+
+	header = zalloc(size);
+	if (!header)
+		return 0;
+
+	header->version = 1;
+	header->count_formats = plane->count_formats;
+	header->formats_offset = formats_offset;
+	header->count_modifiers = 1;
+	header->modifiers_offset = modifiers_offset;
+	memcpy((char *) header + formats_offset, plane->formats,
+	       plane->count_formats * sizeof(uint32_t));
+
+	mods = (struct drm_format_modifier *) ((char *) header +
+					       modifiers_offset);
+	mods->formats = (1ull << plane->count_formats) - 1;
+	mods->offset = 0;
+	mods->modifier = DRM_FORMAT_MOD_LINEAR;
+
+	blob = fake_blob_create(header, size);
+	free(header);
+
+	return blob ? blob->id : 0;
+}
+
+static struct fake_plane *
+fake_plane_create(struct fake_prop **shared, uint64_t type, int crtc_index)
+{
+	struct fake_plane *plane = &dev.planes[dev.num_planes++];
+	int k;
+
+	fake_object_init(&plane->base, DRM_MODE_OBJECT_PLANE);
+	plane->type = type;
+	plane->possible_crtcs = 1 << crtc_index;
+
+	switch (type) {
+	case DRM_PLANE_TYPE_PRIMARY:
+		plane->count_formats = ARRAY_LENGTH(primary_formats);
+		memcpy(plane->formats, primary_formats, sizeof primary_formats);
+		break;
+	case DRM_PLANE_TYPE_CURSOR:
+		plane->formats[0] = DRM_FORMAT_ARGB8888;
+		plane->count_formats = 1;
+		break;
+	}
+
+	fake_object_attach(&plane->base, shared[FAKE_PROP_PLANE_TYPE], type);
+	for (k = FAKE_PROP_PLANE_FB_ID; k <= FAKE_PROP_PLANE_CRTC_H; k++)
+		fake_object_attach(&plane->base, shared[k], 0);
+	fake_object_attach(&plane->base, shared[FAKE_PROP_PLANE_IN_FORMATS],
+			   fake_plane_in_formats(plane));
+
+	return plane;
+}
+
+static void
+fake_device_init(void)
+{
+	struct fake_config *config = &dev.config;
+	struct fake_prop *shared[FAKE_PROP__COUNT] = { NULL };
+	struct fake_crtc *crtc;
+	struct fake_connector *conn;
+	int i;
+
+	fake_config_init(config);
+
+	dev.next_id = 1;
+	dev.next_handle = 1;
+
+	shared[FAKE_PROP_PLANE_TYPE] =
+		fake_prop_create_enum(FAKE_PROP_PLANE_TYPE, "type",
+				      DRM_MODE_PROP_IMMUTABLE,
+				      plane_type_enums,
+				      ARRAY_LENGTH(plane_type_enums));
+	shared[FAKE_PROP_PLANE_FB_ID] =
+		fake_prop_create_object(FAKE_PROP_PLANE_FB_ID, "FB_ID",
+					DRM_MODE_OBJECT_FB);
+	shared[FAKE_PROP_PLANE_CRTC_ID] =
+		fake_prop_create_object(FAKE_PROP_PLANE_CRTC_ID, "CRTC_ID",
+					DRM_MODE_OBJECT_CRTC);
+	shared[FAKE_PROP_PLANE_SRC_X] =
+		fake_prop_create_range(FAKE_PROP_PLANE_SRC_X, "SRC_X", 0,
+				       0, UINT32_MAX);
+	shared[FAKE_PROP_PLANE_SRC_Y] =
+		fake_prop_create_range(FAKE_PROP_PLANE_SRC_Y, "SRC_Y", 0,
+				       0, UINT32_MAX);
+	shared[FAKE_PROP_PLANE_SRC_W] =
+		fake_prop_create_range(FAKE_PROP_PLANE_SRC_W, "SRC_W", 0,
+				       0, UINT32_MAX);
+	shared[FAKE_PROP_PLANE_SRC_H] =
+		fake_prop_create_range(FAKE_PROP_PLANE_SRC_H, "SRC_H", 0,
+				       0, UINT32_MAX);
+	/* Signed ranges, values are sign extended to 64 bits */
+	shared[FAKE_PROP_PLANE_CRTC_X] =
+		fake_prop_create_range(FAKE_PROP_PLANE_CRTC_X, "CRTC_X",
+				       DRM_MODE_PROP_SIGNED_RANGE,
+				       (uint64_t) INT32_MIN, INT32_MAX);
+	shared[FAKE_PROP_PLANE_CRTC_Y] =
+		fake_prop_create_range(FAKE_PROP_PLANE_CRTC_Y, "CRTC_Y",
+				       DRM_MODE_PROP_SIGNED_RANGE,
+				       (uint64_t) INT32_MIN, INT32_MAX);
+	shared[FAKE_PROP_PLANE_CRTC_W] =
+		fake_prop_create_range(FAKE_PROP_PLANE_CRTC_W, "CRTC_W", 0,
+				       0, INT32_MAX);
+	shared[FAKE_PROP_PLANE_CRTC_H] =
+		fake_prop_create_range(FAKE_PROP_PLANE_CRTC_H, "CRTC_H", 0,
+				       0, INT32_MAX);
+	shared[FAKE_PROP_PLANE_IN_FORMATS] =
+		fake_prop_create(FAKE_PROP_PLANE_IN_FORMATS, "IN_FORMATS",
+				 DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE);
+	shared[FAKE_PROP_CONNECTOR_CRTC_ID] =
+		fake_prop_create_object(FAKE_PROP_CONNECTOR_CRTC_ID, "CRTC_ID",
+					DRM_MODE_OBJECT_CRTC);
+	shared[FAKE_PROP_CONNECTOR_DPMS] =
+		fake_prop_create_enum(FAKE_PROP_CONNECTOR_DPMS, "DPMS", 0,
+				      dpms_enums, ARRAY_LENGTH(dpms_enums));
+	shared[FAKE_PROP_CRTC_MODE_ID] =
+		fake_prop_create(FAKE_PROP_CRTC_MODE_ID, "MODE_ID",
+				 DRM_MODE_PROP_BLOB);
+	shared[FAKE_PROP_CRTC_ACTIVE] =
+		fake_prop_create_range(FAKE_PROP_CRTC_ACTIVE, "ACTIVE", 0,
+				       0, 1);
+
+	dev.num_crtcs = config->num_crtcs;
+	for (i = 0; i < dev.num_crtcs; i++) {
+		crtc = &dev.crtcs[i];
+		fake_object_init(&crtc->base, DRM_MODE_OBJECT_CRTC);
+		crtc->index = i;
+		fake_object_attach(&crtc->base,
+				   shared[FAKE_PROP_CRTC_MODE_ID], 0);
+		fake_object_attach(&crtc->base,
+				   shared[FAKE_PROP_CRTC_ACTIVE], 0);
+	}
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		dev.encoders[i].id = dev.next_id++;
+		dev.encoders[i].possible_crtcs = (1 << dev.num_crtcs) - 1;
+
+		conn = &dev.connectors[i];
+		fake_object_init(&conn->base, DRM_MODE_OBJECT_CONNECTOR);
+		conn->encoder_id = dev.encoders[i].id;
+		conn->type_id = i + 1;
+		fake_mode_init(&conn->mode, config->width, config->height,
+			       config->refresh);
+		fake_object_attach(&conn->base,
+				   shared[FAKE_PROP_CONNECTOR_CRTC_ID], 0);
+		fake_object_attach(&conn->base,
+				   shared[FAKE_PROP_CONNECTOR_DPMS],
+				   DRM_MODE_DPMS_ON);
+	}
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		crtc = &dev.crtcs[i];
+		crtc->primary = fake_plane_create(shared,
+						  DRM_PLANE_TYPE_PRIMARY, i);
+		fake_plane_create(shared, DRM_PLANE_TYPE_CURSOR, i);
+	}
+
+	dev.initialized = true;
+}
+
+/* Vblank timeline and events */
+
+static uint32_t
+fake_crtc_vblank(struct fake_crtc *crtc, uint64_t now, uint64_t *time)
+{
+	uint64_t seq = (now - crtc->epoch_ns) / crtc->period_ns;
+
+	if (time)
+		*time = crtc->epoch_ns + seq * crtc->period_ns;
+
+	return seq;
+}
+
+static void
+fake_event_arm(void)
+{
+	struct itimerspec its = { 0 };
+
+	if (dev.events) {
+		its.it_value.tv_sec = dev.events->deadline_ns / NSEC_PER_SEC;
+		its.it_value.tv_nsec = dev.events->deadline_ns % NSEC_PER_SEC;
+		/* Zero would disarm */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	timerfd_settime(dev.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/** Queue a flip event for the first vblank after now */
+static int
+fake_event_queue(struct fake_crtc *crtc, uint64_t now, void *user_data)
+{
+	struct fake_event *event, **pos;
+	uint64_t vblank;
+
+	event = zalloc(sizeof *event);
+	if (!event)
+		return -ENOMEM;
+
+	event->crtc_id = crtc->base.id;
+	event->user_data = user_data;
+	if (crtc->active) {
+		event->sequence = fake_crtc_vblank(crtc, now, &vblank) + 1;
+		event->deadline_ns = vblank + crtc->period_ns;
+	} else {
+		/* Switched off, completes right away */
+		event->deadline_ns = now;
+	}
+
+	dev.flip_wait_ns += event->deadline_ns - now;
+	STATS_INC(flips);
+	crtc->flip_pending = true;
+
+	for (pos = &dev.events; *pos; pos = &(*pos)->next)
+		if ((*pos)->deadline_ns > event->deadline_ns)
+			break;
+	event->next = *pos;
+	*pos = event;
+
+	fake_event_arm();
+
+	return 0;
+}
+
+static void
+fake_events_clear(void)
+{
+	struct fake_event *event, *next;
+	int i;
+
+	for (event = dev.events; event; event = next) {
+		next = event->next;
+		free(event);
+	}
+	dev.events = NULL;
+
+	for (i = 0; i < dev.num_crtcs; i++)
+		dev.crtcs[i].flip_pending = false;
+}
+
+/* Atomic state checks */
+
+static int
+fake_check_plane(struct fake_plane *plane)
+{
+	struct fake_object *obj = &plane->base;
+	uint32_t fb_id = fake_object_get(obj, FAKE_PROP_PLANE_FB_ID);
+	uint32_t crtc_id = fake_object_get(obj, FAKE_PROP_PLANE_CRTC_ID);
+	uint32_t src_x = fake_object_get(obj, FAKE_PROP_PLANE_SRC_X);
+	uint32_t src_y = fake_object_get(obj, FAKE_PROP_PLANE_SRC_Y);
+	uint32_t src_w = fake_object_get(obj, FAKE_PROP_PLANE_SRC_W);
+	uint32_t src_h = fake_object_get(obj, FAKE_PROP_PLANE_SRC_H);
+	int32_t crtc_x = fake_object_get(obj, FAKE_PROP_PLANE_CRTC_X);
+	int32_t crtc_y = fake_object_get(obj, FAKE_PROP_PLANE_CRTC_Y);
+	uint32_t crtc_w = fake_object_get(obj, FAKE_PROP_PLANE_CRTC_W);
+	uint32_t crtc_h = fake_object_get(obj, FAKE_PROP_PLANE_CRTC_H);
+	const drmModeModeInfo *mode;
+	struct fake_crtc *crtc;
+	struct fake_blob *blob;
+	struct fake_fb *fb;
+	int i;
+
+	if (!fb_id && !crtc_id)
+		return 0;
+
+	if (!fb_id || !crtc_id)
+		return fake_reject(EINVAL, "plane %u: FB_ID %u with CRTC_ID %u",
+				   obj->id, fb_id, crtc_id);
+
+	crtc = fake_crtc_find(crtc_id);
+	if (!crtc || !(plane->possible_crtcs & (1 << crtc->index)))
+		return fake_reject(EINVAL, "plane %u: can't use CRTC %u",
+				   obj->id, crtc_id);
+
+	blob = fake_blob_find(fake_object_get(&crtc->base,
+					      FAKE_PROP_CRTC_MODE_ID));
+	if (!blob)
+		return fake_reject(EINVAL, "plane %u: CRTC %u is disabled",
+				   obj->id, crtc_id);
+	mode = blob->data;
+
+	fb = fake_fb_find(fb_id);
+	if (!fb)
+		return fake_reject(ENOENT, "plane %u: no FB %u",
+				   obj->id, fb_id);
+
+	for (i = 0; i < plane->count_formats; i++)
+		if (plane->formats[i] == fb->format)
+			break;
+	if (i == plane->count_formats)
+		return fake_reject(EINVAL, "plane %u: format 0x%08x of FB %u "
+				   "not supported", obj->id, fb->format, fb_id);
+
+	if (fb->modifier != DRM_FORMAT_MOD_LINEAR)
+		return fake_reject(EINVAL, "plane %u: modifier 0x%016" PRIx64
+				   " of FB %u not supported",
+				   obj->id, fb->modifier, fb_id);
+
+	if (src_w == 0 || src_h == 0 || crtc_w == 0 || crtc_h == 0 ||
+	    (uint64_t) src_x + src_w > (uint64_t) fb->width << 16 ||
+	    (uint64_t) src_y + src_h > (uint64_t) fb->height << 16)
+		return fake_reject(ENOSPC, "plane %u: bad source rectangle "
+				   "for FB %u", obj->id, fb_id);
+
+	if (src_w != crtc_w << 16 || src_h != crtc_h << 16)
+		return fake_reject(EINVAL, "plane %u: can't scale", obj->id);
+
+	if (plane->type == DRM_PLANE_TYPE_PRIMARY &&
+	    (crtc_x != 0 || crtc_y != 0 ||
+	     crtc_w != mode->hdisplay || crtc_h != mode->vdisplay))
+		return fake_reject(EINVAL, "plane %u: primary plane "
+				   "must cover the CRTC", obj->id);
+
+	return 0;
+}
+
+static bool
+fake_crtc_needs_modeset(struct fake_crtc *crtc)
+{
+	uint32_t mode_id = fake_object_get(&crtc->base, FAKE_PROP_CRTC_MODE_ID);
+	bool active = fake_object_get(&crtc->base, FAKE_PROP_CRTC_ACTIVE);
+	struct fake_blob *blob = fake_blob_find(mode_id);
+	uint32_t crtc_id;
+	int i;
+
+	if (active != crtc->active || !!blob != crtc->enabled)
+		return true;
+
+	if (blob && memcmp(blob->data, &crtc->mode, sizeof crtc->mode))
+		return true;
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		crtc_id = fake_object_get(&dev.connectors[i].base,
+					  FAKE_PROP_CONNECTOR_CRTC_ID);
+		if ((crtc_id == crtc->base.id) !=
+		    (dev.connectors[i].crtc_id == crtc->base.id))
+			return true;
+	}
+
+	return false;
+}
+
+static int
+fake_check_crtc(struct fake_crtc *crtc, uint32_t flags, bool affected)
+{
+	struct fake_object *obj = &crtc->base;
+	uint32_t mode_id = fake_object_get(obj, FAKE_PROP_CRTC_MODE_ID);
+	bool active = fake_object_get(obj, FAKE_PROP_CRTC_ACTIVE);
+	struct fake_blob *blob = NULL;
+	bool has_connectors = false;
+	int i;
+
+	if (mode_id) {
+		blob = fake_blob_find(mode_id);
+		if (!blob || blob->length != sizeof(drmModeModeInfo))
+			return fake_reject(EINVAL, "CRTC %u: bad MODE_ID %u",
+					   obj->id, mode_id);
+	}
+
+	if (active && !blob)
+		return fake_reject(EINVAL, "CRTC %u: active without a mode",
+				   obj->id);
+
+	for (i = 0; i < dev.num_crtcs; i++)
+		if (fake_object_get(&dev.connectors[i].base,
+				    FAKE_PROP_CONNECTOR_CRTC_ID) == obj->id)
+			has_connectors = true;
+
+	if (!!blob != has_connectors)
+		return fake_reject(EINVAL, "CRTC %u: %s", obj->id,
+				   blob ? "enabled without connectors" :
+					  "connectors without a mode");
+
+	if (!(flags & DRM_MODE_ATOMIC_ALLOW_MODESET) &&
+	    fake_crtc_needs_modeset(crtc))
+		return fake_reject(EINVAL, "CRTC %u: modeset not allowed",
+				   obj->id);
+
+	if (!affected)
+		return 0;
+
+	if ((flags & DRM_MODE_PAGE_FLIP_EVENT) && !active && !crtc->active)
+		return fake_reject(EINVAL, "CRTC %u: no event for off to off",
+				   obj->id);
+
+	if ((flags & DRM_MODE_ATOMIC_NONBLOCK) && crtc->flip_pending)
+		return fake_reject(EBUSY, "CRTC %u: flip pending", obj->id);
+
+	return 0;
+}
+
+static int
+fake_check_state(uint32_t flags, const bool *affected)
+{
+	struct fake_connector *conn;
+	struct fake_crtc *crtc;
+	uint32_t crtc_id;
+	int ret;
+	int i;
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		conn = &dev.connectors[i];
+		crtc_id = fake_object_get(&conn->base,
+					  FAKE_PROP_CONNECTOR_CRTC_ID);
+		if (!crtc_id)
+			continue;
+
+		crtc = fake_crtc_find(crtc_id);
+		if (!crtc || !(dev.encoders[i].possible_crtcs &
+			       (1 << crtc->index)))
+			return fake_reject(EINVAL, "connector %u: can't use "
+					   "CRTC %u", conn->base.id, crtc_id);
+	}
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		ret = fake_check_crtc(&dev.crtcs[i], flags, affected[i]);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < dev.num_planes; i++) {
+		ret = fake_check_plane(&dev.planes[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+fake_check_value(struct fake_prop *prop, uint64_t value)
+{
+	int i;
+
+	if (prop->flags & DRM_MODE_PROP_IMMUTABLE)
+		return fake_reject(EINVAL, "property %s is immutable",
+				   prop->name);
+
+	if (prop->flags & DRM_MODE_PROP_SIGNED_RANGE) {
+		if ((int64_t) value < (int64_t) prop->min ||
+		    (int64_t) value > (int64_t) prop->max)
+			return fake_reject(EINVAL, "%s out of range",
+					   prop->name);
+	} else if (prop->flags & DRM_MODE_PROP_RANGE) {
+		if (value < prop->min || value > prop->max)
+			return fake_reject(EINVAL, "%s out of range",
+					   prop->name);
+	} else if (prop->flags & DRM_MODE_PROP_ENUM) {
+		for (i = 0; i < prop->count_enums; i++)
+			if (prop->enums[i].value == value)
+				break;
+		if (i == prop->count_enums)
+			return fake_reject(EINVAL, "%s: no enum value %" PRIu64,
+					   prop->name, value);
+	}
+
+	return 0;
+}
+
+/** Make the checked state current */
+static int
+fake_apply_state(uint32_t flags, const bool *affected, void *user_data)
+{
+	struct fake_crtc *crtc;
+	struct fake_blob *blob;
+	uint64_t now = now_ns();
+	uint64_t vblank, wait = 0;
+	bool modeset;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		crtc = &dev.crtcs[i];
+		modeset = fake_crtc_needs_modeset(crtc);
+		blob = fake_blob_find(fake_object_get(&crtc->base,
+						      FAKE_PROP_CRTC_MODE_ID));
+
+		crtc->enabled = !!blob;
+		if (blob)
+			memcpy(&crtc->mode, blob->data, sizeof crtc->mode);
+
+		if (fake_object_get(&crtc->base, FAKE_PROP_CRTC_ACTIVE)) {
+			if (!crtc->active || modeset) {
+				crtc->epoch_ns = now;
+				crtc->period_ns =
+					fake_mode_period_ns(&crtc->mode);
+				STATS_INC(modesets);
+			}
+			crtc->active = true;
+		} else {
+			crtc->active = false;
+		}
+
+		if (!affected[i])
+			continue;
+
+		if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+			ret = fake_event_queue(crtc, now, user_data);
+			if (ret)
+				break;
+		} else if (!(flags & DRM_MODE_ATOMIC_NONBLOCK) &&
+			   crtc->active) {
+			/* Blocking commits return after the next vblank */
+			fake_crtc_vblank(crtc, now, &vblank);
+			wait = MAX(wait, vblank + crtc->period_ns);
+		}
+	}
+
+	for (i = 0; i < dev.num_crtcs; i++)
+		dev.connectors[i].crtc_id =
+			fake_object_get(&dev.connectors[i].base,
+					FAKE_PROP_CONNECTOR_CRTC_ID);
+
+	if (wait)
+		sleep_until_ns(wait);
+
+	return ret;
+}
+
+static void
+fake_spend_check_cost(void)
+{
+	if (dev.config.check_cost_us > 0)
+		sleep_until_ns(now_ns() + dev.config.check_cost_us * 1000ull);
+}
+
+static int
+fake_atomic_commit(drmModeAtomicReq *req, uint32_t flags, void *user_data)
+{
+	static const uint32_t valid_flags = DRM_MODE_PAGE_FLIP_EVENT |
+					    DRM_MODE_ATOMIC_TEST_ONLY |
+					    DRM_MODE_ATOMIC_NONBLOCK |
+					    DRM_MODE_ATOMIC_ALLOW_MODESET;
+	uint64_t saved[FAKE_MAX_OBJECTS][FAKE_MAX_OBJECT_PROPS];
+	bool affected[FAKE_MAX_CRTCS] = { false };
+	bool test_only = flags & DRM_MODE_ATOMIC_TEST_ONLY;
+	struct fake_object *obj;
+	struct fake_crtc *crtc;
+	uint32_t i;
+	int idx, ret;
+
+	if (test_only)
+		STATS_INC(tests);
+	else
+		STATS_INC(commits);
+
+	fake_spend_check_cost();
+
+	if (!dev.atomic) {
+		ret = fake_reject(EINVAL, "atomic cap not set");
+		goto out;
+	}
+
+	if ((flags & ~valid_flags) ||
+	    (test_only && (flags & DRM_MODE_PAGE_FLIP_EVENT))) {
+		ret = fake_reject(EINVAL, "bad commit flags 0x%x", flags);
+		goto out;
+	}
+
+	for (idx = 0; idx < dev.num_objects; idx++)
+		memcpy(saved[idx], dev.objects[idx]->values,
+		       sizeof saved[idx]);
+
+	ret = 0;
+	for (i = 0; i < req->cursor && ret == 0; i++) {
+		obj = fake_object_find(req->items[i].object_id);
+		if (!obj) {
+			ret = fake_reject(ENOENT, "no object %u",
+					  req->items[i].object_id);
+			break;
+		}
+
+		idx = fake_object_prop_index(obj, req->items[i].property_id);
+		if (idx < 0) {
+			ret = fake_reject(EINVAL, "object %u has no "
+					  "property %u", obj->id,
+					  req->items[i].property_id);
+			break;
+		}
+
+		/* Setting a property to its value is always fine */
+		if (obj->values[idx] != req->items[i].value)
+			ret = fake_check_value(obj->props[idx],
+					       req->items[i].value);
+		obj->values[idx] = req->items[i].value;
+
+		/* Both the CRTC left and the one joined are in the commit */
+		switch (obj->type) {
+		case DRM_MODE_OBJECT_CRTC:
+			crtc = fake_crtc_find(obj->id);
+			affected[crtc->index] = true;
+			break;
+		case DRM_MODE_OBJECT_PLANE:
+		case DRM_MODE_OBJECT_CONNECTOR:
+			if (obj->props[idx]->kind !=
+			    FAKE_PROP_PLANE_CRTC_ID &&
+			    obj->props[idx]->kind !=
+			    FAKE_PROP_CONNECTOR_CRTC_ID)
+				break;
+			crtc = fake_crtc_find(req->items[i].value);
+			if (crtc)
+				affected[crtc->index] = true;
+			break;
+		}
+	}
+
+	/* The CRTCs planes and connectors in the commit were on before */
+	for (idx = 0; idx < dev.num_objects && ret == 0; idx++) {
+		obj = dev.objects[idx];
+		if (obj->type == DRM_MODE_OBJECT_CRTC ||
+		    !memcmp(saved[idx], obj->values, sizeof saved[idx]))
+			continue;
+
+		for (i = 0; i < (uint32_t) obj->num_props; i++) {
+			if (obj->props[i]->kind != FAKE_PROP_PLANE_CRTC_ID &&
+			    obj->props[i]->kind != FAKE_PROP_CONNECTOR_CRTC_ID)
+				continue;
+			crtc = fake_crtc_find(saved[idx][i]);
+			if (crtc)
+				affected[crtc->index] = true;
+			crtc = fake_crtc_find(obj->values[i]);
+			if (crtc)
+				affected[crtc->index] = true;
+		}
+	}
+
+	if (ret == 0)
+		ret = fake_check_state(flags, affected);
+
+	if (ret == 0 && !test_only)
+		ret = fake_apply_state(flags, affected, user_data);
+
+	if (ret != 0 || test_only)
+		for (idx = 0; idx < dev.num_objects; idx++)
+			memcpy(dev.objects[idx]->values, saved[idx],
+			       sizeof saved[idx]);
+
+out:
+	if (ret != 0 && test_only)
+		STATS_INC(tests_failed);
+	else if (ret != 0)
+		STATS_INC(commits_failed);
+
+	return ret;
+}
+
+/* Device lifetime */
+
+static void
+fake_stats_print(void)
+{
+	const char *path = dev.config.stats;
+	FILE *fp;
+
+	if (!path || !*path)
+		return;
+
+	if (!strcmp(path, "-"))
+		fp = stderr;
+	else
+		fp = fopen(path, "a");
+	if (!fp)
+		return;
+
+	fprintf(fp, "fake-kms: %u atomic commits (%u failed), "
+		"%u TEST_ONLY (%u rejected), %u legacy calls\n",
+		dev.stats.commits, dev.stats.commits_failed,
+		dev.stats.tests, dev.stats.tests_failed, dev.legacy_calls);
+	fprintf(fp, "fake-kms: %u modesets, %u flips, %.3f ms average wait "
+		"for vblank\n",
+		dev.stats.modesets, dev.stats.flips,
+		dev.stats.flips ?
+			dev.flip_wait_ns / 1e6 / dev.stats.flips : 0.0);
+
+	if (fp != stderr)
+		fclose(fp);
+}
+
+/* For tests running in the compositor process, see fake-kms.h */
+WL_EXPORT void
+fake_kms_get_stats(struct fake_kms_stats *stats)
+{
+#define STATS_GET(field) \
+	stats->field = __atomic_load_n(&dev.stats.field, __ATOMIC_RELAXED)
+
+	STATS_GET(commits);
+	STATS_GET(commits_failed);
+	STATS_GET(tests);
+	STATS_GET(tests_failed);
+	STATS_GET(modesets);
+	STATS_GET(flips);
+
+#undef STATS_GET
+}
+
+static int
+fake_device_open(void)
+{
+	int fd;
+
+	if (!dev.initialized)
+		fake_device_init();
+
+	/* One master at a time */
+	if (dev.fd >= 0) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	memset(&dev.stats, 0, sizeof dev.stats);
+	dev.legacy_calls = 0;
+	dev.flip_wait_ns = 0;
+	dev.atomic = false;
+	__atomic_store_n(&dev.fd, fd, __ATOMIC_RELAXED);
+
+	return fd;
+}
+
+/** Like the kernel, drop the objects of the file, but keep the modes */
+static void
+fake_device_close(void)
+{
+	struct fake_dumb *dumb, *dumb_next;
+	struct fake_blob *blob;
+	struct fake_fb *fb, *fb_next;
+	int i;
+
+	fake_stats_print();
+	fake_events_clear();
+
+	for (fb = dev.fbs; fb; fb = fb_next) {
+		fb_next = fb->next;
+		free(fb);
+	}
+	dev.fbs = NULL;
+
+	for (i = 0; i < dev.num_planes; i++) {
+		fake_object_set(&dev.planes[i].base, FAKE_PROP_PLANE_FB_ID, 0);
+		fake_object_set(&dev.planes[i].base,
+				FAKE_PROP_PLANE_CRTC_ID, 0);
+	}
+
+	/* The mode and IN_FORMATS blobs in use stay, like in the kernel */
+	for (blob = dev.blobs; blob; blob = blob->next)
+		blob->orphaned = true;
+	fake_blobs_collect();
+
+	for (dumb = dev.dumbs; dumb; dumb = dumb_next) {
+		dumb_next = dumb->next;
+		REAL(close)(dumb->fd);
+		free(dumb);
+	}
+	dev.dumbs = NULL;
+
+	__atomic_store_n(&dev.fd, -1, __ATOMIC_RELAXED);
+}
+
+static void __attribute__((destructor))
+fake_device_fini(void)
+{
+	if (dev.fd >= 0)
+		fake_stats_print();
+}
+
+/* libc */
+
+static bool
+is_fake_devnode(const char *path)
+{
+	return path && !strcmp(path, FAKE_KMS_DEVNODE);
+}
+
+#define OPEN_MODE(flags, mode) \
+	do { \
+		va_list ap; \
+		if ((flags) & (O_CREAT | O_TMPFILE)) { \
+			va_start(ap, flags); \
+			mode = va_arg(ap, mode_t); \
+			va_end(ap); \
+		} \
+	} while (0)
+
+WL_EXPORT int
+open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	if (is_fake_devnode(path))
+		return fake_device_open();
+
+	OPEN_MODE(flags, mode);
+	return REAL(open)(path, flags, mode);
+}
+
+WL_EXPORT int
+open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	if (is_fake_devnode(path))
+		return fake_device_open();
+
+	OPEN_MODE(flags, mode);
+	return REAL(open64)(path, flags, mode);
+}
+
+/* Used by _FORTIFY_SOURCE when the flags are not constant */
+WL_EXPORT int
+__open_2(const char *path, int flags)
+{
+	if (is_fake_devnode(path))
+		return fake_device_open();
+
+	return REAL(open)(path, flags);
+}
+
+WL_EXPORT int
+__open64_2(const char *path, int flags)
+{
+	if (is_fake_devnode(path))
+		return fake_device_open();
+
+	return REAL(open64)(path, flags);
+}
+
+WL_EXPORT int
+close(int fd)
+{
+	if (is_fake_fd(fd))
+		fake_device_close();
+
+	return REAL(close)(fd);
+}
+
+static struct fake_dumb *
+fake_dumb_find_mapping(uint64_t offset, size_t length)
+{
+	struct fake_dumb *dumb;
+
+	for (dumb = dev.dumbs; dumb; dumb = dumb->next)
+		if (dumb->offset == offset && length <= dumb->size)
+			return dumb;
+
+	return NULL;
+}
+
+WL_EXPORT void *
+mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	struct fake_dumb *dumb;
+
+	if (!is_fake_fd(fd))
+		return REAL(mmap)(addr, length, prot, flags, fd, offset);
+
+	dumb = fake_dumb_find_mapping(offset, length);
+	if (!dumb) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	return REAL(mmap)(addr, length, prot, flags, dumb->fd, 0);
+}
+
+WL_EXPORT void *
+mmap64(void *addr, size_t length, int prot, int flags, int fd,
+       off64_t offset)
+{
+	struct fake_dumb *dumb;
+
+	if (!is_fake_fd(fd))
+		return REAL(mmap64)(addr, length, prot, flags, fd, offset);
+
+	dumb = fake_dumb_find_mapping(offset, length);
+	if (!dumb) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	return REAL(mmap64)(addr, length, prot, flags, dumb->fd, 0);
+}
+
+/* launcher-direct, the only launcher that works without a session, wants
+ * to run as root. The fake device needs no privileges. */
+WL_EXPORT uid_t
+geteuid(void)
+{
+	return 0;
+}
+
+/* libudev */
+
+WL_EXPORT struct udev_device *
+udev_device_new_from_subsystem_sysname(struct udev *udev,
+				       const char *subsystem,
+				       const char *sysname)
+{
+	if (subsystem && !strcmp(subsystem, "drm") &&
+	    sysname && !strcmp(sysname, FAKE_KMS_SYSNAME))
+		return FAKE_UDEV_DEVICE;
+
+	return REAL(udev_device_new_from_subsystem_sysname)(udev, subsystem,
+							    sysname);
+}
+
+WL_EXPORT struct udev_device *
+udev_device_ref(struct udev_device *device)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return device;
+
+	return REAL(udev_device_ref)(device);
+}
+
+WL_EXPORT struct udev_device *
+udev_device_unref(struct udev_device *device)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return NULL;
+
+	return REAL(udev_device_unref)(device);
+}
+
+WL_EXPORT const char *
+udev_device_get_devnode(struct udev_device *device)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return FAKE_KMS_DEVNODE;
+
+	return REAL(udev_device_get_devnode)(device);
+}
+
+WL_EXPORT const char *
+udev_device_get_sysname(struct udev_device *device)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return FAKE_KMS_SYSNAME;
+
+	return REAL(udev_device_get_sysname)(device);
+}
+
+WL_EXPORT const char *
+udev_device_get_sysnum(struct udev_device *device)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return "0";
+
+	return REAL(udev_device_get_sysnum)(device);
+}
+
+WL_EXPORT const char *
+udev_device_get_subsystem(struct udev_device *device)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return "drm";
+
+	return REAL(udev_device_get_subsystem)(device);
+}
+
+WL_EXPORT dev_t
+udev_device_get_devnum(struct udev_device *device)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return 0;
+
+	return REAL(udev_device_get_devnum)(device);
+}
+
+/* No sysfs node, which also keeps libbacklight away */
+WL_EXPORT const char *
+udev_device_get_syspath(struct udev_device *device)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return NULL;
+
+	return REAL(udev_device_get_syspath)(device);
+}
+
+WL_EXPORT const char *
+udev_device_get_property_value(struct udev_device *device, const char *key)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return NULL;
+
+	return REAL(udev_device_get_property_value)(device, key);
+}
+
+WL_EXPORT const char *
+udev_device_get_sysattr_value(struct udev_device *device,
+			      const char *sysattr)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return NULL;
+
+	return REAL(udev_device_get_sysattr_value)(device, sysattr);
+}
+
+WL_EXPORT struct udev_device *
+udev_device_get_parent_with_subsystem_devtype(struct udev_device *device,
+					      const char *subsystem,
+					      const char *devtype)
+{
+	if (device == FAKE_UDEV_DEVICE)
+		return NULL;
+
+	return REAL(udev_device_get_parent_with_subsystem_devtype)(device,
+								   subsystem,
+								   devtype);
+}
+
+/* libdrm: device */
+
+WL_EXPORT int
+drmIoctl(int fd, unsigned long request, void *arg)
+{
+	struct drm_mode_create_dumb *create = arg;
+	struct drm_mode_map_dumb *map = arg;
+	struct drm_mode_destroy_dumb *destroy = arg;
+	struct fake_dumb *dumb, **pos;
+	uint32_t cpp;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmIoctl)(fd, request, arg);
+
+	switch (request) {
+	case DRM_IOCTL_MODE_CREATE_DUMB:
+		cpp = (create->bpp + 7) / 8;
+		if (cpp == 0 || create->width == 0 || create->height == 0 ||
+		    create->width > FAKE_FB_SIZE_MAX ||
+		    create->height > FAKE_FB_SIZE_MAX)
+			break;
+
+		dumb = zalloc(sizeof *dumb);
+		if (!dumb) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		create->pitch = (create->width * cpp + 63) & ~63u;
+		create->size = (uint64_t) create->pitch * create->height;
+		dumb->fd = os_create_anonymous_file(create->size);
+		if (dumb->fd < 0) {
+			free(dumb);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		dumb->handle = dev.next_handle++;
+		dumb->size = create->size;
+		dumb->offset = (uint64_t) dumb->handle << 32;
+		dumb->next = dev.dumbs;
+		dev.dumbs = dumb;
+		create->handle = dumb->handle;
+		return 0;
+
+	case DRM_IOCTL_MODE_MAP_DUMB:
+		dumb = fake_dumb_find(map->handle);
+		if (!dumb) {
+			errno = ENOENT;
+			return -1;
+		}
+		map->offset = dumb->offset;
+		return 0;
+
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+		for (pos = &dev.dumbs; *pos; pos = &(*pos)->next)
+			if ((*pos)->handle == destroy->handle)
+				break;
+		dumb = *pos;
+		if (!dumb) {
+			errno = ENOENT;
+			return -1;
+		}
+		*pos = dumb->next;
+		REAL(close)(dumb->fd);
+		free(dumb);
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+WL_EXPORT int
+drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmGetCap)(fd, capability, value);
+
+	switch (capability) {
+	case DRM_CAP_DUMB_BUFFER:
+	case DRM_CAP_TIMESTAMP_MONOTONIC:
+	case DRM_CAP_ADDFB2_MODIFIERS:
+	case DRM_CAP_CRTC_IN_VBLANK_EVENT:
+		*value = 1;
+		return 0;
+	case DRM_CAP_CURSOR_WIDTH:
+	case DRM_CAP_CURSOR_HEIGHT:
+		*value = FAKE_CURSOR_SIZE;
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+WL_EXPORT int
+drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmSetClientCap)(fd, capability, value);
+
+	switch (capability) {
+	case DRM_CLIENT_CAP_ATOMIC:
+		dev.atomic = value;
+		return 0;
+	case DRM_CLIENT_CAP_UNIVERSAL_PLANES:
+	case DRM_CLIENT_CAP_ASPECT_RATIO:
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+WL_EXPORT int
+drmSetMaster(int fd)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmSetMaster)(fd);
+
+	return 0;
+}
+
+WL_EXPORT int
+drmDropMaster(int fd)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmDropMaster)(fd);
+
+	return 0;
+}
+
+WL_EXPORT int
+drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+	struct fake_dumb *dumb;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmPrimeHandleToFD)(fd, handle, flags, prime_fd);
+
+	dumb = fake_dumb_find(handle);
+	if (!dumb) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*prime_fd = fcntl(dumb->fd, F_DUPFD_CLOEXEC, 0);
+
+	return *prime_fd < 0 ? -1 : 0;
+}
+
+WL_EXPORT int
+drmWaitVBlank(int fd, drmVBlankPtr vbl)
+{
+	struct fake_crtc *crtc;
+	uint64_t now, time;
+	uint32_t seq, target;
+	int pipe;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmWaitVBlank)(fd, vbl);
+
+	if (vbl->request.type & DRM_VBLANK_SECONDARY)
+		pipe = 1;
+	else
+		pipe = (vbl->request.type & DRM_VBLANK_HIGH_CRTC_MASK) >>
+		       DRM_VBLANK_HIGH_CRTC_SHIFT;
+
+	/* Only the blocking and the query forms */
+	if (pipe >= dev.num_crtcs || !dev.crtcs[pipe].active ||
+	    (vbl->request.type & DRM_VBLANK_EVENT)) {
+		errno = EINVAL;
+		return -1;
+	}
+	crtc = &dev.crtcs[pipe];
+
+	now = now_ns();
+	seq = fake_crtc_vblank(crtc, now, &time);
+	if (vbl->request.type & DRM_VBLANK_RELATIVE)
+		target = seq + vbl->request.sequence;
+	else
+		target = vbl->request.sequence;
+
+	if ((int32_t) (target - seq) > 0) {
+		time = crtc->epoch_ns + (uint64_t) target * crtc->period_ns;
+		sleep_until_ns(time);
+		seq = target;
+	}
+
+	vbl->reply.sequence = seq;
+	vbl->reply.tval_sec = time / NSEC_PER_SEC;
+	vbl->reply.tval_usec = time % NSEC_PER_SEC / 1000;
+
+	return 0;
+}
+
+WL_EXPORT int
+drmHandleEvent(int fd, drmEventContextPtr evctx)
+{
+	struct fake_event *due = NULL, **tail = &due;
+	struct fake_event *event;
+	struct fake_crtc *crtc;
+	uint64_t expirations;
+	uint64_t now;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmHandleEvent)(fd, evctx);
+
+	if (read(fd, &expirations, sizeof expirations) < 0 &&
+	    errno != EAGAIN)
+		return -1;
+
+	now = now_ns();
+	while (dev.events && dev.events->deadline_ns <= now) {
+		event = dev.events;
+		dev.events = event->next;
+		event->next = NULL;
+		*tail = event;
+		tail = &event->next;
+
+		crtc = fake_crtc_find(event->crtc_id);
+		crtc->flip_pending = false;
+	}
+	fake_event_arm();
+
+	/* The handlers may queue new flips */
+	while (due) {
+		event = due;
+		due = event->next;
+
+		if (evctx->version >= 3 && evctx->page_flip_handler2)
+			evctx->page_flip_handler2(fd, event->sequence,
+						  event->deadline_ns /
+						  NSEC_PER_SEC,
+						  event->deadline_ns %
+						  NSEC_PER_SEC / 1000,
+						  event->crtc_id,
+						  event->user_data);
+		else if (evctx->page_flip_handler)
+			evctx->page_flip_handler(fd, event->sequence,
+						 event->deadline_ns /
+						 NSEC_PER_SEC,
+						 event->deadline_ns %
+						 NSEC_PER_SEC / 1000,
+						 event->user_data);
+		free(event);
+	}
+
+	return 0;
+}
+
+/* libdrm: resources */
+
+WL_EXPORT drmModeResPtr
+drmModeGetResources(int fd)
+{
+	drmModeRes *res;
+	struct fake_fb *fb;
+	int i;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeGetResources)(fd);
+
+	res = zalloc(sizeof *res);
+	if (!res)
+		return NULL;
+
+	for (fb = dev.fbs; fb; fb = fb->next)
+		res->count_fbs++;
+	res->count_crtcs = dev.num_crtcs;
+	res->count_connectors = dev.num_crtcs;
+	res->count_encoders = dev.num_crtcs;
+
+	res->fbs = calloc(res->count_fbs + 1, sizeof(uint32_t));
+	res->crtcs = calloc(res->count_crtcs, sizeof(uint32_t));
+	res->connectors = calloc(res->count_connectors, sizeof(uint32_t));
+	res->encoders = calloc(res->count_encoders, sizeof(uint32_t));
+	if (!res->fbs || !res->crtcs || !res->connectors || !res->encoders) {
+		drmModeFreeResources(res);
+		return NULL;
+	}
+
+	for (fb = dev.fbs, i = 0; fb; fb = fb->next, i++)
+		res->fbs[i] = fb->id;
+	for (i = 0; i < dev.num_crtcs; i++) {
+		res->crtcs[i] = dev.crtcs[i].base.id;
+		res->connectors[i] = dev.connectors[i].base.id;
+		res->encoders[i] = dev.encoders[i].id;
+	}
+
+	res->min_width = 1;
+	res->min_height = 1;
+	res->max_width = FAKE_FB_SIZE_MAX;
+	res->max_height = FAKE_FB_SIZE_MAX;
+
+	return res;
+}
+
+WL_EXPORT drmModeCrtcPtr
+drmModeGetCrtc(int fd, uint32_t crtc_id)
+{
+	struct fake_crtc *crtc;
+	drmModeCrtc *kcrtc;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeGetCrtc)(fd, crtc_id);
+
+	crtc = fake_crtc_find(crtc_id);
+	if (!crtc) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	kcrtc = zalloc(sizeof *kcrtc);
+	if (!kcrtc)
+		return NULL;
+
+	kcrtc->crtc_id = crtc->base.id;
+	kcrtc->buffer_id = fake_object_get(&crtc->primary->base,
+					   FAKE_PROP_PLANE_FB_ID);
+	kcrtc->gamma_size = FAKE_GAMMA_SIZE;
+	if (crtc->enabled) {
+		kcrtc->mode_valid = 1;
+		kcrtc->mode = crtc->mode;
+		kcrtc->width = crtc->mode.hdisplay;
+		kcrtc->height = crtc->mode.vdisplay;
+	}
+
+	return kcrtc;
+}
+
+WL_EXPORT drmModeEncoderPtr
+drmModeGetEncoder(int fd, uint32_t encoder_id)
+{
+	drmModeEncoder *encoder;
+	int i;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeGetEncoder)(fd, encoder_id);
+
+	for (i = 0; i < dev.num_crtcs; i++)
+		if (dev.encoders[i].id == encoder_id)
+			break;
+	if (i == dev.num_crtcs) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	encoder = zalloc(sizeof *encoder);
+	if (!encoder)
+		return NULL;
+
+	encoder->encoder_id = encoder_id;
+	encoder->encoder_type = DRM_MODE_ENCODER_TMDS;
+	encoder->crtc_id = dev.connectors[i].crtc_id;
+	encoder->possible_crtcs = dev.encoders[i].possible_crtcs;
+
+	return encoder;
+}
+
+WL_EXPORT drmModeConnectorPtr
+drmModeGetConnector(int fd, uint32_t connector_id)
+{
+	struct fake_connector *conn;
+	drmModeConnector *kconn;
+	int i;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeGetConnector)(fd, connector_id);
+
+	conn = fake_connector_find(connector_id);
+	if (!conn) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	kconn = zalloc(sizeof *kconn);
+	if (!kconn)
+		return NULL;
+
+	kconn->connector_id = conn->base.id;
+	kconn->encoder_id = conn->crtc_id ? conn->encoder_id : 0;
+	kconn->connector_type = DRM_MODE_CONNECTOR_HDMIA;
+	kconn->connector_type_id = conn->type_id;
+	kconn->connection = DRM_MODE_CONNECTED;
+	/* At 96 dpi */
+	kconn->mmWidth = conn->mode.hdisplay * 254 / 960;
+	kconn->mmHeight = conn->mode.vdisplay * 254 / 960;
+	kconn->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+
+	kconn->count_modes = 1;
+	kconn->modes = malloc(sizeof *kconn->modes);
+	kconn->count_props = conn->base.num_props;
+	kconn->props = calloc(kconn->count_props, sizeof(uint32_t));
+	kconn->prop_values = calloc(kconn->count_props, sizeof(uint64_t));
+	kconn->count_encoders = 1;
+	kconn->encoders = malloc(sizeof(uint32_t));
+	if (!kconn->modes || !kconn->props || !kconn->prop_values ||
+	    !kconn->encoders) {
+		drmModeFreeConnector(kconn);
+		return NULL;
+	}
+
+	kconn->modes[0] = conn->mode;
+	for (i = 0; i < kconn->count_props; i++) {
+		kconn->props[i] = conn->base.props[i]->id;
+		kconn->prop_values[i] = conn->base.values[i];
+	}
+	kconn->encoders[0] = conn->encoder_id;
+
+	return kconn;
+}
+
+WL_EXPORT drmModePlaneResPtr
+drmModeGetPlaneResources(int fd)
+{
+	drmModePlaneRes *res;
+	int i;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeGetPlaneResources)(fd);
+
+	res = zalloc(sizeof *res);
+	if (!res)
+		return NULL;
+
+	res->count_planes = dev.num_planes;
+	res->planes = calloc(dev.num_planes, sizeof(uint32_t));
+	if (!res->planes) {
+		free(res);
+		return NULL;
+	}
+
+	for (i = 0; i < dev.num_planes; i++)
+		res->planes[i] = dev.planes[i].base.id;
+
+	return res;
+}
+
+WL_EXPORT drmModePlanePtr
+drmModeGetPlane(int fd, uint32_t plane_id)
+{
+	struct fake_plane *plane;
+	drmModePlane *kplane;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeGetPlane)(fd, plane_id);
+
+	plane = fake_plane_find(plane_id);
+	if (!plane) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	kplane = zalloc(sizeof *kplane);
+	if (!kplane)
+		return NULL;
+
+	kplane->formats = calloc(plane->count_formats, sizeof(uint32_t));
+	if (!kplane->formats) {
+		free(kplane);
+		return NULL;
+	}
+
+	kplane->count_formats = plane->count_formats;
+	memcpy(kplane->formats, plane->formats,
+	       plane->count_formats * sizeof(uint32_t));
+	kplane->plane_id = plane->base.id;
+	kplane->crtc_id = fake_object_get(&plane->base,
+					  FAKE_PROP_PLANE_CRTC_ID);
+	kplane->fb_id = fake_object_get(&plane->base, FAKE_PROP_PLANE_FB_ID);
+	kplane->possible_crtcs = plane->possible_crtcs;
+
+	return kplane;
+}
+
+/* libdrm: properties */
+
+WL_EXPORT drmModeObjectPropertiesPtr
+drmModeObjectGetProperties(int fd, uint32_t object_id, uint32_t object_type)
+{
+	drmModeObjectProperties *props;
+	struct fake_object *obj;
+	int i;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeObjectGetProperties)(fd, object_id,
+							object_type);
+
+	obj = fake_object_find(object_id);
+	if (!obj || (object_type != DRM_MODE_OBJECT_ANY &&
+		     object_type != obj->type)) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	props = zalloc(sizeof *props);
+	if (!props)
+		return NULL;
+
+	props->count_props = obj->num_props;
+	props->props = calloc(obj->num_props, sizeof(uint32_t));
+	props->prop_values = calloc(obj->num_props, sizeof(uint64_t));
+	if (!props->props || !props->prop_values) {
+		drmModeFreeObjectProperties(props);
+		return NULL;
+	}
+
+	for (i = 0; i < obj->num_props; i++) {
+		props->props[i] = obj->props[i]->id;
+		props->prop_values[i] = obj->values[i];
+	}
+
+	return props;
+}
+
+WL_EXPORT drmModePropertyPtr
+drmModeGetProperty(int fd, uint32_t property_id)
+{
+	drmModePropertyRes *kprop;
+	struct fake_prop *prop;
+	int i;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeGetProperty)(fd, property_id);
+
+	prop = fake_prop_find(property_id);
+	if (!prop) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	kprop = zalloc(sizeof *kprop);
+	if (!kprop)
+		return NULL;
+
+	kprop->prop_id = prop->id;
+	kprop->flags = prop->flags;
+	snprintf(kprop->name, sizeof kprop->name, "%s", prop->name);
+
+	if (prop->flags & (DRM_MODE_PROP_RANGE | DRM_MODE_PROP_SIGNED_RANGE)) {
+		kprop->count_values = 2;
+		kprop->values = calloc(2, sizeof(uint64_t));
+		if (!kprop->values)
+			goto err;
+		kprop->values[0] = prop->min;
+		kprop->values[1] = prop->max;
+	} else if (prop->flags & DRM_MODE_PROP_OBJECT) {
+		kprop->count_values = 1;
+		kprop->values = calloc(1, sizeof(uint64_t));
+		if (!kprop->values)
+			goto err;
+		kprop->values[0] = prop->object_type;
+	} else if (prop->flags & DRM_MODE_PROP_ENUM) {
+		kprop->count_values = prop->count_enums;
+		kprop->values = calloc(prop->count_enums, sizeof(uint64_t));
+		kprop->count_enums = prop->count_enums;
+		kprop->enums = calloc(prop->count_enums,
+				      sizeof(*kprop->enums));
+		if (!kprop->values || !kprop->enums)
+			goto err;
+		for (i = 0; i < prop->count_enums; i++) {
+			kprop->values[i] = prop->enums[i].value;
+			kprop->enums[i] = prop->enums[i];
+		}
+	}
+
+	return kprop;
+
+err:
+	drmModeFreeProperty(kprop);
+	return NULL;
+}
+
+WL_EXPORT drmModePropertyBlobPtr
+drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+	drmModePropertyBlobRes *kblob;
+	struct fake_blob *blob;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeGetPropertyBlob)(fd, blob_id);
+
+	blob = fake_blob_find(blob_id);
+	if (!blob) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	kblob = zalloc(sizeof *kblob);
+	if (!kblob)
+		return NULL;
+
+	kblob->data = malloc(blob->length);
+	if (!kblob->data) {
+		free(kblob);
+		return NULL;
+	}
+
+	kblob->id = blob->id;
+	kblob->length = blob->length;
+	memcpy(kblob->data, blob->data, blob->length);
+
+	return kblob;
+}
+
+WL_EXPORT int
+drmModeCreatePropertyBlob(int fd, const void *data, size_t size,
+			  uint32_t *id)
+{
+	struct fake_blob *blob;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeCreatePropertyBlob)(fd, data, size, id);
+
+	if (size == 0 || size > UINT32_MAX)
+		return fake_error(EINVAL);
+
+	blob = fake_blob_create(data, size);
+	if (!blob)
+		return fake_error(ENOMEM);
+
+	*id = blob->id;
+
+	return 0;
+}
+
+WL_EXPORT int
+drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	struct fake_blob *blob;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeDestroyPropertyBlob)(fd, id);
+
+	blob = fake_blob_find(id);
+	if (!blob || blob->orphaned)
+		return fake_error(ENOENT);
+
+	blob->orphaned = true;
+	fake_blobs_collect();
+
+	return 0;
+}
+
+WL_EXPORT int
+drmModeConnectorSetProperty(int fd, uint32_t connector_id,
+			    uint32_t property_id, uint64_t value)
+{
+	struct fake_connector *conn;
+	int idx;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeConnectorSetProperty)(fd, connector_id,
+							 property_id, value);
+
+	dev.legacy_calls++;
+
+	conn = fake_connector_find(connector_id);
+	if (!conn)
+		return fake_error(ENOENT);
+
+	idx = fake_object_prop_index(&conn->base, property_id);
+	if (idx < 0 || conn->base.props[idx]->kind != FAKE_PROP_CONNECTOR_DPMS)
+		return fake_error(EINVAL);
+
+	if (fake_check_value(conn->base.props[idx], value))
+		return -errno;
+
+	conn->base.values[idx] = value;
+
+	return 0;
+}
+
+/* libdrm: framebuffers */
+
+static int
+fake_fb_create(uint32_t width, uint32_t height, uint32_t format,
+	       const uint32_t handles[4], uint64_t modifier, uint32_t *fb_id)
+{
+	struct fake_fb *fb;
+
+	if (width == 0 || height == 0 ||
+	    width > FAKE_FB_SIZE_MAX || height > FAKE_FB_SIZE_MAX)
+		return fake_error(EINVAL);
+
+	if (!fake_dumb_find(handles[0]))
+		return fake_error(ENOENT);
+
+	fb = zalloc(sizeof *fb);
+	if (!fb)
+		return fake_error(ENOMEM);
+
+	fb->id = dev.next_id++;
+	fb->width = width;
+	fb->height = height;
+	fb->format = format;
+	fb->modifier = modifier;
+	fb->next = dev.fbs;
+	dev.fbs = fb;
+
+	*fb_id = fb->id;
+
+	return 0;
+}
+
+WL_EXPORT int
+drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
+	     uint8_t bpp, uint32_t pitch, uint32_t bo_handle, uint32_t *buf_id)
+{
+	uint32_t handles[4] = { bo_handle };
+	uint32_t format;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeAddFB)(fd, width, height, depth, bpp, pitch,
+					  bo_handle, buf_id);
+
+	if (bpp == 32 && depth == 24)
+		format = DRM_FORMAT_XRGB8888;
+	else if (bpp == 32 && depth == 32)
+		format = DRM_FORMAT_ARGB8888;
+	else if (bpp == 16 && depth == 16)
+		format = DRM_FORMAT_RGB565;
+	else
+		return fake_error(EINVAL);
+
+	return fake_fb_create(width, height, format, handles,
+			      DRM_FORMAT_MOD_LINEAR, buf_id);
+}
+
+WL_EXPORT int
+drmModeAddFB2(int fd, uint32_t width, uint32_t height, uint32_t format,
+	      const uint32_t handles[4], const uint32_t pitches[4],
+	      const uint32_t offsets[4], uint32_t *buf_id, uint32_t flags)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmModeAddFB2)(fd, width, height, format, handles,
+					   pitches, offsets, buf_id, flags);
+
+	if (flags != 0)
+		return fake_error(EINVAL);
+
+	/* No modifier means linear for dumb buffers */
+	return fake_fb_create(width, height, format, handles,
+			      DRM_FORMAT_MOD_LINEAR, buf_id);
+}
+
+WL_EXPORT int
+drmModeAddFB2WithModifiers(int fd, uint32_t width, uint32_t height,
+			   uint32_t format, const uint32_t handles[4],
+			   const uint32_t pitches[4],
+			   const uint32_t offsets[4],
+			   const uint64_t modifier[4], uint32_t *buf_id,
+			   uint32_t flags)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmModeAddFB2WithModifiers)(fd, width, height,
+							format, handles,
+							pitches, offsets,
+							modifier, buf_id,
+							flags);
+
+	if (flags & ~DRM_MODE_FB_MODIFIERS)
+		return fake_error(EINVAL);
+
+	return fake_fb_create(width, height, format, handles,
+			      (flags & DRM_MODE_FB_MODIFIERS) ?
+				modifier[0] : DRM_FORMAT_MOD_LINEAR,
+			      buf_id);
+}
+
+WL_EXPORT int
+drmModeRmFB(int fd, uint32_t fb_id)
+{
+	struct fake_fb *fb, **pos;
+	struct fake_object *obj;
+	int i;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeRmFB)(fd, fb_id);
+
+	for (pos = &dev.fbs; *pos; pos = &(*pos)->next)
+		if ((*pos)->id == fb_id)
+			break;
+	fb = *pos;
+	if (!fb)
+		return fake_error(ENOENT);
+
+	/* Like the kernel, switch off the planes still showing it */
+	for (i = 0; i < dev.num_planes; i++) {
+		obj = &dev.planes[i].base;
+		if (fake_object_get(obj, FAKE_PROP_PLANE_FB_ID) != fb_id)
+			continue;
+		fake_object_set(obj, FAKE_PROP_PLANE_FB_ID, 0);
+		fake_object_set(obj, FAKE_PROP_PLANE_CRTC_ID, 0);
+	}
+
+	*pos = fb->next;
+	free(fb);
+
+	return 0;
+}
+
+/* libdrm: atomic */
+
+WL_EXPORT drmModeAtomicReqPtr
+drmModeAtomicAlloc(void)
+{
+	return zalloc(sizeof(struct _drmModeAtomicReq));
+}
+
+WL_EXPORT void
+drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+	if (!req)
+		return;
+
+	free(req->items);
+	free(req);
+}
+
+WL_EXPORT int
+drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id,
+			 uint32_t property_id, uint64_t value)
+{
+	void *items;
+	uint32_t size;
+
+	if (!req)
+		return -EINVAL;
+
+	if (req->cursor == req->size) {
+		size = req->size ? req->size * 2 : 16;
+		items = realloc(req->items, size * sizeof(*req->items));
+		if (!items)
+			return -ENOMEM;
+		req->items = items;
+		req->size = size;
+	}
+
+	req->items[req->cursor].object_id = object_id;
+	req->items[req->cursor].property_id = property_id;
+	req->items[req->cursor].value = value;
+	req->cursor++;
+
+	return req->cursor;
+}
+
+/* Requests come from drmModeAtomicAlloc() above, so only the fake
+ * device can take them. */
+WL_EXPORT int
+drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+		    void *user_data)
+{
+	if (!is_fake_fd(fd) || !req)
+		return fake_error(EINVAL);
+
+	return fake_atomic_commit(req, flags, user_data);
+}
+
+/* libdrm: legacy modesetting */
+
+static void
+fake_plane_show(struct fake_plane *plane, uint32_t crtc_id, uint32_t fb_id,
+		int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w,
+		uint32_t crtc_h, uint32_t src_x, uint32_t src_y,
+		uint32_t src_w, uint32_t src_h)
+{
+	struct fake_object *obj = &plane->base;
+
+	fake_object_set(obj, FAKE_PROP_PLANE_FB_ID, fb_id);
+	fake_object_set(obj, FAKE_PROP_PLANE_CRTC_ID, fb_id ? crtc_id : 0);
+	fake_object_set(obj, FAKE_PROP_PLANE_CRTC_X, (int64_t) crtc_x);
+	fake_object_set(obj, FAKE_PROP_PLANE_CRTC_Y, (int64_t) crtc_y);
+	fake_object_set(obj, FAKE_PROP_PLANE_CRTC_W, crtc_w);
+	fake_object_set(obj, FAKE_PROP_PLANE_CRTC_H, crtc_h);
+	fake_object_set(obj, FAKE_PROP_PLANE_SRC_X, src_x);
+	fake_object_set(obj, FAKE_PROP_PLANE_SRC_Y, src_y);
+	fake_object_set(obj, FAKE_PROP_PLANE_SRC_W, src_w);
+	fake_object_set(obj, FAKE_PROP_PLANE_SRC_H, src_h);
+}
+
+WL_EXPORT int
+drmModeSetCrtc(int fd, uint32_t crtc_id, uint32_t buffer_id,
+	       uint32_t x, uint32_t y, uint32_t *connectors, int count,
+	       drmModeModeInfoPtr mode)
+{
+	struct fake_connector *conn;
+	struct fake_crtc *crtc;
+	struct fake_blob *blob = NULL;
+	int i, j;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeSetCrtc)(fd, crtc_id, buffer_id, x, y,
+					    connectors, count, mode);
+
+	dev.legacy_calls++;
+
+	crtc = fake_crtc_find(crtc_id);
+	if (!crtc)
+		return fake_error(ENOENT);
+
+	if (mode) {
+		if (!fake_fb_find(buffer_id) || count <= 0)
+			return fake_error(EINVAL);
+		for (i = 0; i < count; i++)
+			if (!fake_connector_find(connectors[i]))
+				return fake_error(ENOENT);
+
+		blob = fake_blob_create(mode, sizeof *mode);
+		if (!blob)
+			return fake_error(ENOMEM);
+	}
+
+	fake_object_set(&crtc->base, FAKE_PROP_CRTC_MODE_ID,
+			blob ? blob->id : 0);
+	fake_object_set(&crtc->base, FAKE_PROP_CRTC_ACTIVE, !!blob);
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		conn = &dev.connectors[i];
+		if (conn->crtc_id == crtc_id)
+			conn->crtc_id = 0;
+		for (j = 0; j < count; j++)
+			if (connectors[j] == conn->base.id)
+				conn->crtc_id = crtc_id;
+		fake_object_set(&conn->base, FAKE_PROP_CONNECTOR_CRTC_ID,
+				conn->crtc_id);
+	}
+
+	if (mode)
+		fake_plane_show(crtc->primary, crtc_id, buffer_id,
+				0, 0, mode->hdisplay, mode->vdisplay,
+				x << 16, y << 16,
+				mode->hdisplay << 16, mode->vdisplay << 16);
+	else
+		fake_plane_show(crtc->primary, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	if (mode && (!crtc->active ||
+		     memcmp(mode, &crtc->mode, sizeof *mode))) {
+		crtc->mode = *mode;
+		crtc->epoch_ns = now_ns();
+		crtc->period_ns = fake_mode_period_ns(mode);
+		STATS_INC(modesets);
+	}
+	crtc->enabled = crtc->active = !!mode;
+
+	return 0;
+}
+
+WL_EXPORT int
+drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+		void *user_data)
+{
+	struct fake_crtc *crtc;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModePageFlip)(fd, crtc_id, fb_id, flags,
+					     user_data);
+
+	dev.legacy_calls++;
+
+	crtc = fake_crtc_find(crtc_id);
+	if (!crtc)
+		return fake_error(ENOENT);
+	if (!crtc->active || !fake_fb_find(fb_id))
+		return fake_error(EINVAL);
+	if (crtc->flip_pending)
+		return fake_error(EBUSY);
+
+	fake_object_set(&crtc->primary->base, FAKE_PROP_PLANE_FB_ID, fb_id);
+
+	if (flags & DRM_MODE_PAGE_FLIP_EVENT)
+		return fake_event_queue(crtc, now_ns(), user_data);
+
+	return 0;
+}
+
+WL_EXPORT int
+drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id,
+		uint32_t flags, int32_t crtc_x, int32_t crtc_y,
+		uint32_t crtc_w, uint32_t crtc_h, uint32_t src_x,
+		uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	struct fake_plane *plane;
+
+	if (!is_fake_fd(fd))
+		return REAL(drmModeSetPlane)(fd, plane_id, crtc_id, fb_id,
+					     flags, crtc_x, crtc_y, crtc_w,
+					     crtc_h, src_x, src_y, src_w,
+					     src_h);
+
+	dev.legacy_calls++;
+
+	plane = fake_plane_find(plane_id);
+	if (!plane || (fb_id && !fake_fb_find(fb_id)) ||
+	    (fb_id && !fake_crtc_find(crtc_id)))
+		return fake_error(ENOENT);
+
+	fake_plane_show(plane, crtc_id, fb_id, crtc_x, crtc_y, crtc_w, crtc_h,
+			src_x, src_y, src_w, src_h);
+
+	return 0;
+}
+
+WL_EXPORT int
+drmModeSetCursor(int fd, uint32_t crtc_id, uint32_t bo_handle,
+		 uint32_t width, uint32_t height)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmModeSetCursor)(fd, crtc_id, bo_handle,
+					      width, height);
+
+	dev.legacy_calls++;
+
+	if (!fake_crtc_find(crtc_id))
+		return fake_error(ENOENT);
+
+	return 0;
+}
+
+WL_EXPORT int
+drmModeMoveCursor(int fd, uint32_t crtc_id, int x, int y)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmModeMoveCursor)(fd, crtc_id, x, y);
+
+	dev.legacy_calls++;
+
+	if (!fake_crtc_find(crtc_id))
+		return fake_error(ENOENT);
+
+	return 0;
+}
+
+WL_EXPORT int
+drmModeCrtcSetGamma(int fd, uint32_t crtc_id, uint32_t size,
+		    uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+	if (!is_fake_fd(fd))
+		return REAL(drmModeCrtcSetGamma)(fd, crtc_id, size,
+						 red, green, blue);
+
+	if (!fake_crtc_find(crtc_id))
+		return fake_error(ENOENT);
+
+	if (size != FAKE_GAMMA_SIZE)
+		return fake_error(EINVAL);
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FAKE_KMS_H
+#define FAKE_KMS_H
+
+/* Counters of the fake KMS device, see fake-kms.c. Tests running against
+ * it find fake_kms_get_stats() with dlsym(); it is not there otherwise. */
+struct fake_kms_stats {
+	unsigned int commits;
+	unsigned int commits_failed;
+	unsigned int tests;
+	unsigned int tests_failed;
+	unsigned int modesets;
+	unsigned int flips;
+};
+
+#define FAKE_KMS_GET_STATS "fake_kms_get_stats"
+
+typedef void (*fake_kms_get_stats_func_t)(struct fake_kms_stats *stats);
+
+#endif /* FAKE_KMS_H */
@@ -0,0 +1,196 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libweston/libweston.h>
+#include <libweston/windowed-output-api.h>
+#include "libweston-internal.h"
+#include "compositor/weston.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "renderer-scene-helper.h"
+#include "weston-test-runner.h"
+#include "weston-test-fixture-compositor.h"
+
+#define NUM_OUTPUTS 4
+#define NUM_VIEWS 96
+#define BENCH_FRAMES 60
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.renderer = RENDERER_PIXMAN;
+	setup.width = 1280;
+	setup.height = 720;
+
+	return weston_test_harness_execute_as_plugin(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+/* The fixture starts one headless output, add the others beside it */
+static int
+add_outputs(struct weston_compositor *compositor,
+	    struct weston_output *outputs[NUM_OUTPUTS])
+{
+	const struct weston_windowed_output_api *api;
+	struct weston_output *output;
+	char name[32];
+	int i, width = 0;
+
+	api = weston_windowed_output_get_api(compositor);
+	assert(api);
+
+	for (i = wl_list_length(&compositor->output_list);
+	     i < NUM_OUTPUTS; i++) {
+		snprintf(name, sizeof name, "headless-%d", i);
+		assert(api->create_head(compositor, name) == 0);
+	}
+	weston_compositor_flush_heads_changed(compositor);
+
+	i = 0;
+	wl_list_for_each(output, &compositor->output_list, link) {
+		assert(i < NUM_OUTPUTS);
+		outputs[i++] = output;
+		width = MAX(width, output->x + output->width);
+	}
+	assert(i == NUM_OUTPUTS);
+
+	return width;
+}
+
+/* Repaint all outputs the way the repaint loop does */
+static void
+repaint_outputs(struct weston_compositor *compositor,
+		struct weston_output *outputs[NUM_OUTPUTS], bool parallel)
+{
+	struct weston_renderer *renderer = compositor->renderer;
+	int i;
+
+	compositor->parallel_repaint = parallel;
+
+	for (i = 0; i < NUM_OUTPUTS; i++)
+		renderer->repaint_output(outputs[i], &outputs[i]->region);
+	renderer->repaint_finish(compositor);
+}
+
+PLUGIN_TEST(multi_output_parallel_identical)
+{
+	/* struct weston_compositor *compositor; */
+	static const int thread_counts[] = { 1, 2, 8 };
+	struct weston_output *outputs[NUM_OUTPUTS];
+	struct scene scene;
+	uint32_t *expected[NUM_OUTPUTS], *pixels;
+	struct weston_output *output;
+	unsigned int t;
+	int width, i;
+
+	width = add_outputs(compositor, outputs);
+	scene_init(&scene, compositor, width, outputs[0]->height, NUM_VIEWS);
+
+	/* Otherwise this would compare serial against serial */
+	compositor->parallel_repaint = true;
+	assert(weston_compositor_repaint_is_deferred(compositor));
+
+	compositor->pixman_threads = 1;
+	repaint_outputs(compositor, outputs, false);
+	for (i = 0; i < NUM_OUTPUTS; i++)
+		expected[i] = read_output_pixels(outputs[i]);
+
+	for (t = 0; t < ARRAY_LENGTH(thread_counts); t++) {
+		testlog("%d threads\n", thread_counts[t]);
+
+		/* So that an output not painted at all is noticed */
+		weston_surface_set_color(scene.background, 1.0, 0.0, 1.0, 1.0);
+		repaint_outputs(compositor, outputs, false);
+		weston_surface_set_color(scene.background, 0.1, 0.2, 0.3, 1.0);
+
+		compositor->pixman_threads = thread_counts[t];
+		repaint_outputs(compositor, outputs, true);
+
+		for (i = 0; i < NUM_OUTPUTS; i++) {
+			output = outputs[i];
+			pixels = read_output_pixels(output);
+			assert(memcmp(pixels, expected[i],
+				      output->width * output->height * 4) == 0);
+			free(pixels);
+		}
+	}
+
+	for (i = 0; i < NUM_OUTPUTS; i++)
+		free(expected[i]);
+	compositor->pixman_threads = 1;
+	scene_fini(&scene);
+	compositor->parallel_repaint = false;
+}
+
+/*
+ * How long it takes until the last output is painted, with the outputs
+ * painted one after the other or in parallel.
+ */
+PLUGIN_TEST(multi_output_repaint_benchmark)
+{
+	/* struct weston_compositor *compositor; */
+	static const bool modes[] = { false, true };
+	struct weston_output *outputs[NUM_OUTPUTS];
+	struct scene scene;
+	struct timespec begin, end;
+	int64_t nsec;
+	unsigned int i;
+	int width, frame;
+
+	width = add_outputs(compositor, outputs);
+	scene_init(&scene, compositor, width, outputs[0]->height, NUM_VIEWS);
+	compositor->pixman_threads = 1;
+
+	for (i = 0; i < ARRAY_LENGTH(modes); i++) {
+		/* Start the threads outside of the measurement */
+		repaint_outputs(compositor, outputs, modes[i]);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (frame = 0; frame < BENCH_FRAMES; frame++)
+			repaint_outputs(compositor, outputs, modes[i]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		nsec = timespec_sub_to_nsec(&end, &begin);
+		testlog("%s: %d outputs of %dx%d repainted in %.3f ms\n",
+			modes[i] ? "parallel" : "serial", NUM_OUTPUTS,
+			outputs[0]->width, outputs[0]->height,
+			nsec / 1e6 / BENCH_FRAMES);
+	}
+
+	scene_fini(&scene);
+	compositor->parallel_repaint = false;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "shared/timespec-util.h"
+#include "weston-test-client-helper.h"
+#include "weston-test-fixture-compositor.h"
+#include "test-config.h"
+
+/* occluded-frame-interval in occluded-frame.ini */
+#define OCCLUDED_FRAME_MSEC 250
+#define NUM_FRAMES 4
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.config_file = TESTSUITE_OCCLUDED_FRAME_CONFIG_PATH;
+
+	return weston_test_harness_execute_as_client(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+static void
+set_opaque(struct client *client, int width, int height)
+{
+	struct wl_region *region;
+
+	region = wl_compositor_create_region(client->wl_compositor);
+	wl_region_add(region, 0, 0, width, height);
+	wl_surface_set_opaque_region(client->surface->wl_surface, region);
+	wl_region_destroy(region);
+}
+
+/* Redraw the whole surface, returns how long the frame callback took */
+static int64_t
+redraw(struct client *client)
+{
+	struct surface *surface = client->surface;
+	struct timespec commit, done;
+	int frame;
+
+	wl_surface_attach(surface->wl_surface, surface->buffer->proxy, 0, 0);
+	wl_surface_damage(surface->wl_surface, 0, 0,
+			  surface->width, surface->height);
+	frame_callback_set(surface->wl_surface, &frame);
+
+	clock_gettime(CLOCK_MONOTONIC, &commit);
+	wl_surface_commit(surface->wl_surface);
+	frame_callback_wait(client, &frame);
+	clock_gettime(CLOCK_MONOTONIC, &done);
+
+	return timespec_sub_to_msec(&done, &commit);
+}
+
+TEST(occluded_frame_callbacks_throttled)
+{
+	struct client *hidden, *cover;
+	int64_t msec;
+	int i;
+
+	hidden = create_client_and_test_surface(20, 20, 100, 100);
+	assert(hidden);
+
+	/* Test surfaces stack in creation order, the last on top */
+	cover = create_client_and_test_surface(0, 0, 200, 200);
+	assert(cover);
+	set_opaque(cover, 200, 200);
+	redraw(cover);
+
+	/* The first frame callback while hidden goes out right away */
+	redraw(hidden);
+
+	for (i = 0; i < NUM_FRAMES; i++) {
+		msec = redraw(hidden);
+		testlog("hidden surface frame callback after %" PRId64
+			" ms\n", msec);
+		/* The interval counts from the previous frame callback,
+		 * a little before this commit */
+		assert(msec >= OCCLUDED_FRAME_MSEC / 2);
+	}
+
+	/* The cover itself keeps running at the output rate */
+	msec = redraw(cover);
+	testlog("visible surface frame callback after %" PRId64 " ms\n", msec);
+	assert(msec < OCCLUDED_FRAME_MSEC);
+
+	/* Uncovered, the surface is back at the output rate */
+	move_client(cover, 200, 0);
+	redraw(hidden);
+	msec = redraw(hidden);
+	testlog("uncovered surface frame callback after %" PRId64 " ms\n",
+		msec);
+	assert(msec < OCCLUDED_FRAME_MSEC);
+
+	client_destroy(cover);
+	client_destroy(hidden);
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/xalloc.h"
+#include "pick-index.h"
+
+#define AREA_WIDTH 3840
+#define AREA_HEIGHT 2160
+#define NUM_PICKS 100000
+
+struct pick_index_test_data {
+	int num_views;
+};
+
+static const struct pick_index_test_data test_data[] = {
+	{ 10 },
+	{ 100 },
+	{ 1000 },
+};
+
+struct test_view {
+	pixman_box32_t box;
+	/* Stands in for the input region: some views let picks through */
+	bool input_hole;
+};
+
+/* Deterministic, so any mismatch is reproducible */
+static uint32_t
+next_random(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static bool
+view_accepts(void *data, void *user_data)
+{
+	struct test_view *view = data;
+	const int *point = user_data;
+
+	return !view->input_hole || (point[0] + point[1]) % 3 != 0;
+}
+
+static struct test_view *
+pick_linear(struct test_view *views, int num_views, int x, int y)
+{
+	int point[2] = { x, y };
+	int i;
+
+	for (i = 0; i < num_views; i++) {
+		if (x < views[i].box.x1 || x >= views[i].box.x2 ||
+		    y < views[i].box.y1 || y >= views[i].box.y2)
+			continue;
+
+		if (view_accepts(&views[i], point))
+			return &views[i];
+	}
+
+	return NULL;
+}
+
+TEST_P(pick_index_matches_linear_scan, test_data)
+{
+	const struct pick_index_test_data *tdata = data;
+	int num_views = tdata->num_views;
+	struct weston_pick_index index;
+	struct test_view *views;
+	struct test_view **expected, **found;
+	struct timespec t0, t1, t2;
+	int64_t linear_nsec, index_nsec;
+	uint32_t seed = 0x5eed;
+	int (*points)[2];
+	int i, w, h;
+
+	views = xzalloc(num_views * sizeof *views);
+	points = xzalloc(NUM_PICKS * sizeof *points);
+	expected = xzalloc(NUM_PICKS * sizeof *expected);
+	found = xzalloc(NUM_PICKS * sizeof *found);
+
+	/* Windows stacked over a background that covers everything */
+	for (i = 0; i < num_views - 1; i++) {
+		w = 32 + next_random(&seed) % 1200;
+		h = 32 + next_random(&seed) % 900;
+		views[i].box.x1 = next_random(&seed) % AREA_WIDTH - w / 2;
+		views[i].box.y1 = next_random(&seed) % AREA_HEIGHT - h / 2;
+		views[i].box.x2 = views[i].box.x1 + w;
+		views[i].box.y2 = views[i].box.y1 + h;
+		views[i].input_hole = next_random(&seed) % 4 == 0;
+	}
+	views[i].box.x1 = 0;
+	views[i].box.y1 = 0;
+	views[i].box.x2 = AREA_WIDTH;
+	views[i].box.y2 = AREA_HEIGHT;
+
+	/* Including some that miss everything */
+	for (i = 0; i < NUM_PICKS; i++) {
+		points[i][0] = (int)(next_random(&seed) % (AREA_WIDTH + 400)) - 200;
+		points[i][1] = (int)(next_random(&seed) % (AREA_HEIGHT + 400)) - 200;
+	}
+
+	weston_pick_index_init(&index);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < num_views; i++)
+		assert(weston_pick_index_add(&index, &views[i].box, &views[i]));
+	assert(weston_pick_index_build(&index));
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	testlog("%d views: index built in %" PRId64 " us\n", num_views,
+		timespec_sub_to_nsec(&t1, &t0) / 1000);
+
+	/* Timed in bulk, clock_gettime() costs as much as a pick */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < NUM_PICKS; i++)
+		expected[i] = pick_linear(views, num_views,
+					  points[i][0], points[i][1]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < NUM_PICKS; i++)
+		found[i] = weston_pick_index_find(&index,
+						  points[i][0], points[i][1],
+						  view_accepts, points[i]);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	for (i = 0; i < NUM_PICKS; i++)
+		assert(found[i] == expected[i]);
+
+	linear_nsec = timespec_sub_to_nsec(&t1, &t0);
+	index_nsec = timespec_sub_to_nsec(&t2, &t1);
+
+	testlog("%d views: linear %" PRId64 " ns/pick, index %" PRId64
+		" ns/pick\n", num_views, linear_nsec / NUM_PICKS,
+		index_nsec / NUM_PICKS);
+
+	weston_pick_index_release(&index);
+	free(found);
+	free(expected);
+	free(points);
+	free(views);
+}
+
+TEST(pick_index_empty)
+{
+	struct weston_pick_index index;
+
+	weston_pick_index_init(&index);
+	assert(weston_pick_index_build(&index));
+	assert(weston_pick_index_find(&index, 0, 0, NULL, NULL) == NULL);
+	weston_pick_index_release(&index);
+}
+
+TEST(pick_index_edges)
+{
+	struct weston_pick_index index;
+	pixman_box32_t box = { -10, -10, 10, 10 };
+	pixman_box32_t empty = { 5, 5, 5, 20 };
+	int a, b;
+
+	weston_pick_index_init(&index);
+	assert(weston_pick_index_add(&index, &empty, &b));
+	assert(weston_pick_index_add(&index, &box, &a));
+	assert(weston_pick_index_build(&index));
+
+	assert(weston_pick_index_find(&index, -10, -10, NULL, NULL) == &a);
+	assert(weston_pick_index_find(&index, 9, 9, NULL, NULL) == &a);
+	assert(weston_pick_index_find(&index, 10, 0, NULL, NULL) == NULL);
+	assert(weston_pick_index_find(&index, 0, 10, NULL, NULL) == NULL);
+	assert(weston_pick_index_find(&index, -11, 0, NULL, NULL) == NULL);
+
+	weston_pick_index_clear(&index);
+	assert(weston_pick_index_build(&index));
+	assert(weston_pick_index_find(&index, 0, 0, NULL, NULL) == NULL);
+	weston_pick_index_release(&index);
+}
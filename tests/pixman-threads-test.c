@@ -0,0 +1,283 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libweston/libweston.h>
+#include "libweston-internal.h"
+#include "compositor/weston.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "renderer-scene-helper.h"
+#include "weston-test-runner.h"
+#include "weston-test-fixture-compositor.h"
+
+#define NUM_VIEWS 48
+#define NUM_SHM_VIEWS 8
+#define BENCH_FRAMES 60
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.renderer = RENDERER_PIXMAN;
+	setup.width = 1280;
+	setup.height = 720;
+
+	return weston_test_harness_execute_as_plugin(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+static struct weston_output *
+get_output(struct weston_compositor *compositor)
+{
+	return container_of(compositor->output_list.next,
+			    struct weston_output, link);
+}
+
+/* The shm buffers need a client, which never connects */
+struct shm_client {
+	struct wl_client *client;
+	int peer_fd;
+	/* Its first object is the wl_display */
+	uint32_t next_id;
+};
+
+static void
+shm_client_init(struct shm_client *sc, struct weston_compositor *compositor)
+{
+	int fds[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+	sc->client = wl_client_create(compositor->wl_display, fds[0]);
+	assert(sc->client);
+	sc->peer_fd = fds[1];
+	sc->next_id = 2;
+}
+
+static void
+shm_client_fini(struct shm_client *sc)
+{
+	wl_client_destroy(sc->client);
+	close(sc->peer_fd);
+}
+
+/* A premultiplied gradient, so that a wrong source offset shows */
+static struct weston_surface *
+create_shm_surface(struct weston_compositor *compositor,
+		   struct shm_client *sc, int width, int height,
+		   uint32_t format)
+{
+	struct wl_shm_buffer *shm_buffer;
+	struct wl_resource *resource;
+	struct weston_surface *surface;
+	struct weston_buffer *buffer;
+	uint32_t *pixels;
+	int x, y;
+
+	shm_buffer = wl_shm_buffer_create(sc->client, sc->next_id,
+					  width, height, width * 4, format);
+	assert(shm_buffer);
+	resource = wl_client_get_object(sc->client, sc->next_id++);
+	assert(resource);
+
+	pixels = wl_shm_buffer_get_data(shm_buffer);
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			pixels[y * width + x] = 0xc0u << 24 |
+						(x * 0xc0 / width) << 16 |
+						(y * 0xc0 / height) << 8 |
+						((x ^ y) & 0x7f);
+
+	surface = weston_surface_create(compositor);
+	assert(surface);
+	buffer = weston_buffer_from_resource(resource);
+	assert(buffer);
+	weston_buffer_reference(&surface->buffer_ref, buffer);
+	compositor->renderer->attach(surface, buffer);
+
+	return surface;
+}
+
+/*
+ * Views of shm buffers, painted from images the bands share. A quarter
+ * are rotated and a quarter scaled, which Pixman paints with a source
+ * clip; the scaled ones and another quarter are clipped by a mask.
+ */
+static void
+scene_add_shm_views(struct scene *scene, struct shm_client *sc,
+		    struct weston_transform transforms[NUM_SHM_VIEWS])
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+	struct weston_matrix *matrix;
+	uint32_t format;
+	int i, w, h;
+
+	for (i = 0; i < NUM_SHM_VIEWS; i++) {
+		format = i % 2 ? WL_SHM_FORMAT_ARGB8888 :
+				 WL_SHM_FORMAT_XRGB8888;
+		w = 200 + i * 37;
+		h = 150 + i * 23;
+		surface = create_shm_surface(scene->compositor, sc, w, h,
+					     format);
+		view = scene_add_view(scene, surface,
+				      40 + i * 141, 30 + i * 79, w, h,
+				      i % 3 ? 1.0f : 0.6f,
+				      format == WL_SHM_FORMAT_XRGB8888);
+
+		if (i % 4 == 2 || i % 4 == 3)
+			weston_view_set_mask(view, 10, 10, w - 40, h / 2);
+
+		if (i % 4 == 1 || i % 4 == 2) {
+			matrix = &transforms[i].matrix;
+			weston_matrix_init(matrix);
+			weston_matrix_translate(matrix, -w / 2.0f, -h / 2.0f,
+						0.0f);
+			if (i % 4 == 1)
+				/* By 30 degrees */
+				weston_matrix_rotate_xy(matrix, 0.866025f,
+							0.5f);
+			else
+				weston_matrix_scale(matrix, 1.5f, 0.75f, 1.0f);
+			weston_matrix_translate(matrix, w / 2.0f, h / 2.0f,
+						0.0f);
+
+			wl_list_insert(view->geometry.transformation_list.prev,
+				       &transforms[i].link);
+			weston_view_geometry_dirty(view);
+		}
+
+		weston_view_update_transform(view);
+	}
+
+	scene_update_view_list(scene);
+}
+
+static void
+repaint(struct weston_output *output, int threads, pixman_region32_t *damage)
+{
+	output->compositor->pixman_threads = threads;
+	output->compositor->renderer->repaint_output(output, damage);
+}
+
+static void
+check_identical(struct scene *scene, struct weston_output *output,
+		int threads, pixman_region32_t *damage)
+{
+	uint32_t *expected, *pixels;
+
+	repaint(output, 1, damage);
+	expected = read_output_pixels(output);
+
+	/* So that a frame not painted at all is noticed */
+	weston_surface_set_color(scene->background, 1.0, 0.0, 1.0, 1.0);
+	repaint(output, 1, &output->region);
+	weston_surface_set_color(scene->background, 0.1, 0.2, 0.3, 1.0);
+	repaint(output, 1, &output->region);
+
+	repaint(output, threads, damage);
+	pixels = read_output_pixels(output);
+
+	assert(memcmp(pixels, expected,
+		      output->width * output->height * 4) == 0);
+
+	free(pixels);
+	free(expected);
+}
+
+PLUGIN_TEST(pixman_threads_identical)
+{
+	/* struct weston_compositor *compositor; */
+	static const int thread_counts[] = { 2, 3, 4, 8 };
+	struct weston_output *output = get_output(compositor);
+	struct weston_transform transforms[NUM_SHM_VIEWS];
+	struct shm_client sc;
+	struct scene scene;
+	pixman_region32_t damage;
+	unsigned int i;
+
+	shm_client_init(&sc, compositor);
+	scene_init(&scene, compositor, output->width, output->height,
+		   NUM_VIEWS);
+	scene_add_shm_views(&scene, &sc, transforms);
+
+	/* Band edges not aligned with anything */
+	pixman_region32_init_rect(&damage, 7, 13, 901, 611);
+	pixman_region32_union_rect(&damage, &damage, 1000, 3, 200, 50);
+
+	for (i = 0; i < ARRAY_LENGTH(thread_counts); i++) {
+		testlog("%d threads\n", thread_counts[i]);
+		check_identical(&scene, output, thread_counts[i],
+				&output->region);
+		check_identical(&scene, output, thread_counts[i], &damage);
+	}
+
+	pixman_region32_fini(&damage);
+	scene_fini(&scene);
+	shm_client_fini(&sc);
+}
+
+PLUGIN_TEST(pixman_threads_benchmark)
+{
+	/* struct weston_compositor *compositor; */
+	static const int thread_counts[] = { 1, 2, 4, 8 };
+	struct weston_output *output = get_output(compositor);
+	struct scene scene;
+	struct timespec begin, end;
+	int64_t nsec;
+	unsigned int i;
+	int frame;
+
+	scene_init(&scene, compositor, output->width, output->height,
+		   NUM_VIEWS);
+
+	for (i = 0; i < ARRAY_LENGTH(thread_counts); i++) {
+		/* Start the threads outside of the measurement */
+		repaint(output, thread_counts[i], &output->region);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (frame = 0; frame < BENCH_FRAMES; frame++)
+			repaint(output, thread_counts[i], &output->region);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		nsec = timespec_sub_to_nsec(&end, &begin);
+		testlog("%d threads: %.1f frames per second at %dx%d\n",
+			thread_counts[i], BENCH_FRAMES * 1e9 / nsec,
+			output->width, output->height);
+	}
+
+	scene_fini(&scene);
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "renderer-scene-helper.h"
+#include "libweston-internal.h"
+#include "shared/helpers.h"
+#include "shared/xalloc.h"
+
+/** Add a view of surface to the top of the scene
+ *
+ * The scene takes the surface, and destroys it in scene_fini().
+ */
+struct weston_view *
+scene_add_view(struct scene *scene, struct weston_surface *surface,
+	       int x, int y, int width, int height, float alpha, bool opaque)
+{
+	struct weston_surface **entry;
+	struct weston_view *view;
+
+	view = weston_view_create(surface);
+	assert(view);
+
+	entry = wl_array_add(&scene->surfaces, sizeof *entry);
+	assert(entry);
+	*entry = surface;
+
+	surface->width = width;
+	surface->height = height;
+	if (opaque)
+		pixman_region32_union_rect(&surface->opaque, &surface->opaque,
+					   0, 0, width, height);
+
+	view->alpha = alpha;
+	weston_view_set_position(view, x, y);
+	weston_layer_entry_insert(&scene->layer.view_list, &view->layer_link);
+	weston_view_update_transform(view);
+
+	return view;
+}
+
+/** Build the compositor view list from the scene
+ *
+ * The view list is built by the repaint loop, which does not run while a
+ * plugin test does. Call this again after adding views.
+ */
+void
+scene_update_view_list(struct scene *scene)
+{
+	struct weston_compositor *compositor = scene->compositor;
+	struct weston_view *view;
+
+	wl_list_init(&compositor->view_list);
+	wl_list_for_each(view, &scene->layer.view_list.link, layer_link.link)
+		wl_list_insert(compositor->view_list.prev, &view->link);
+}
+
+/** Fill width x height with a background and overlapping solid views
+ *
+ * A third of the views are translucent and a quarter have a view alpha,
+ * so the renderer paints with SRC, OVER and a mask. The views are the
+ * same on every run.
+ */
+void
+scene_init(struct scene *scene, struct weston_compositor *compositor,
+	   int width, int height, int num_views)
+{
+	struct weston_surface *surface;
+	unsigned int seed = 1;
+	int i, w, h;
+
+	scene->compositor = compositor;
+	scene->width = width;
+	scene->height = height;
+	wl_array_init(&scene->surfaces);
+
+	weston_layer_init(&scene->layer, compositor);
+	weston_layer_set_position(&scene->layer, WESTON_LAYER_POSITION_NORMAL);
+
+	scene->background = weston_surface_create(compositor);
+	assert(scene->background);
+	weston_surface_set_color(scene->background, 0.1, 0.2, 0.3, 1.0);
+	scene_add_view(scene, scene->background, 0, 0, width, height,
+		       1.0, true);
+
+	for (i = 0; i < num_views; i++) {
+		surface = weston_surface_create(compositor);
+		assert(surface);
+		weston_surface_set_color(surface,
+					 (rand_r(&seed) % 256) / 255.0f,
+					 (rand_r(&seed) % 256) / 255.0f,
+					 (rand_r(&seed) % 256) / 255.0f,
+					 i % 3 ? 1.0f : 0.5f);
+		w = 64 + rand_r(&seed) % MIN(width / 2, height);
+		h = 64 + rand_r(&seed) % (height / 2);
+		scene_add_view(scene, surface,
+			       rand_r(&seed) % (width - w / 2),
+			       rand_r(&seed) % (height - h / 2),
+			       w, h, i % 4 ? 1.0f : 0.7f, i % 3);
+	}
+
+	scene_update_view_list(scene);
+}
+
+void
+scene_fini(struct scene *scene)
+{
+	struct weston_surface **surface;
+
+	wl_array_for_each(surface, &scene->surfaces)
+		weston_surface_destroy(*surface);
+	wl_array_release(&scene->surfaces);
+	weston_layer_unset_position(&scene->layer);
+}
+
+/** Read back what the renderer painted on output, free() the result */
+uint32_t *
+read_output_pixels(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	uint32_t *pixels;
+	int ret;
+
+	pixels = xzalloc(output->width * output->height * 4);
+	ret = compositor->renderer->read_pixels(output,
+						compositor->read_format,
+						pixels, 0, 0,
+						output->width, output->height);
+	assert(ret == 0);
+
+	return pixels;
+}
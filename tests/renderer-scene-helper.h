@@ -0,0 +1,68 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RENDERER_SCENE_HELPER_H
+#define RENDERER_SCENE_HELPER_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-util.h>
+
+#include <libweston/libweston.h>
+
+/*
+ * Views for plugin tests that call the renderer directly, rather than
+ * through the repaint loop.
+ */
+struct scene {
+	struct weston_compositor *compositor;
+	struct weston_layer layer;
+	struct weston_surface *background;
+	/* struct weston_surface *, destroyed with the scene */
+	struct wl_array surfaces;
+	int width;
+	int height;
+};
+
+void
+scene_init(struct scene *scene, struct weston_compositor *compositor,
+	   int width, int height, int num_views);
+
+struct weston_view *
+scene_add_view(struct scene *scene, struct weston_surface *surface,
+	       int x, int y, int width, int height, float alpha, bool opaque);
+
+void
+scene_update_view_list(struct scene *scene);
+
+void
+scene_fini(struct scene *scene);
+
+uint32_t *
+read_output_pixels(struct weston_output *output);
+
+#endif /* RENDERER_SCENE_HELPER_H */
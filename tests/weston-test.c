@@ -358,11 +358,30 @@ struct test_screenshot {
 struct test_screenshot_frame_listener {
 	struct wl_listener listener;
 	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
 	struct weston_output *output;
 	weston_test_screenshot_done_func_t done;
 	void *data;
 };
 
+static void
+test_screenshot_frame_listener_destroy(struct test_screenshot_frame_listener *l)
+{
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	free(l);
+}
+
+static void
+test_screenshot_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct test_screenshot_frame_listener *l =
+		container_of(listener, struct test_screenshot_frame_listener,
+			     buffer_destroy_listener);
+
+	l->buffer = NULL;
+}
+
 static void
 copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
 {
@@ -428,40 +447,32 @@ copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
 }
 
 static void
-test_screenshot_frame_notify(struct wl_listener *listener, void *data)
+test_screenshot_read_done(void *data, const void *read_pixels)
 {
-	struct test_screenshot_frame_listener *l =
-		container_of(listener,
-			     struct test_screenshot_frame_listener, listener);
+	struct test_screenshot_frame_listener *l = data;
 	struct weston_output *output = l->output;
 	struct weston_compositor *compositor = output->compositor;
+	uint8_t *pixels = (uint8_t *) read_pixels;
 	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	uint8_t *d, *s;
 
-	weston_output_disable_planes_decr(output);
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	/* The client destroyed the buffer while the pixels were read */
+	if (l->buffer == NULL) {
+		l->done(l->data, WESTON_TEST_SCREENSHOT_BAD_BUFFER);
+		test_screenshot_frame_listener_destroy(l);
+		return;
+	}
 
 	if (pixels == NULL) {
 		l->done(l->data, WESTON_TEST_SCREENSHOT_NO_MEMORY);
-		free(l);
+		test_screenshot_frame_listener_destroy(l);
 		return;
 	}
 
-	/* FIXME: Needs to handle output transformations */
-
-	compositor->renderer->read_pixels(output,
-					  compositor->read_format,
-					  pixels,
-					  0, 0,
-					  output->current_mode->width,
-					  output->current_mode->height);
-
 	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
 
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+	s = pixels + stride * (output->current_mode->height - 1);
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
@@ -490,8 +501,34 @@ test_screenshot_frame_notify(struct wl_listener *listener, void *data)
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
 	l->done(l->data, WESTON_TEST_SCREENSHOT_SUCCESS);
-	free(pixels);
-	free(l);
+	test_screenshot_frame_listener_destroy(l);
+}
+
+static void
+test_screenshot_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct test_screenshot_frame_listener *l =
+		container_of(listener,
+			     struct test_screenshot_frame_listener, listener);
+	struct weston_output *output = l->output;
+	struct weston_compositor *compositor = output->compositor;
+	int ret;
+
+	weston_output_disable_planes_decr(output);
+	wl_list_remove(&listener->link);
+
+	/* FIXME: Needs to handle output transformations */
+
+	/* Like the screenshooter, the pixels arrive a frame later */
+	ret = weston_output_read_pixels_async(output, compositor->read_format,
+					      0, 0,
+					      output->current_mode->width,
+					      output->current_mode->height,
+					      test_screenshot_read_done, l);
+	if (ret < 0) {
+		l->done(l->data, WESTON_TEST_SCREENSHOT_NO_MEMORY);
+		test_screenshot_frame_listener_destroy(l);
+	}
 }
 
 static bool
@@ -512,9 +549,12 @@ weston_test_screenshot_shoot(struct weston_output *output,
 	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
 
-	/* Verify buffer is big enough */
+	/* Verify buffer is big enough, and its rows as long as the read
+	 * ones */
 	if (buffer->width < output->current_mode->width ||
-		buffer->height < output->current_mode->height) {
+		buffer->height < output->current_mode->height ||
+		wl_shm_buffer_get_stride(buffer->shm_buffer) !=
+		output->current_mode->width * 4) {
 		done(data, WESTON_TEST_SCREENSHOT_BAD_BUFFER);
 		return false;
 	}
@@ -528,6 +568,8 @@ weston_test_screenshot_shoot(struct weston_output *output,
 
 	/* Set up the listener */
 	l->buffer = buffer;
+	l->buffer_destroy_listener.notify = test_screenshot_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
 	l->output = output;
 	l->done = done;
 	l->data = data;
@@ -38,6 +38,10 @@
 
 #include <cairo.h>
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "wcap-decode.h"
 
 static void
@@ -85,11 +89,54 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 	decoder->p = p;
 }
 
+/* Decompresses the block of a v2 frame, returns where the next frame
+ * starts or NULL */
+static void *
+wcap_decoder_decompress_block(struct wcap_decoder *decoder,
+			      struct wcap_block_header *block)
+{
+	void *data = block + 1;
+	uint32_t *block_data;
+
+	if (block->size > decoder->block_size) {
+		block_data = realloc(decoder->block, block->size);
+		if (block_data == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return NULL;
+		}
+		decoder->block = block_data;
+		decoder->block_size = block->size;
+	}
+
+	switch (decoder->compression) {
+#ifdef HAVE_ZSTD
+	case WCAP_COMPRESSION_ZSTD: {
+		size_t size;
+
+		size = ZSTD_decompress(decoder->block, decoder->block_size,
+				       data, block->compressed_size);
+		if (ZSTD_isError(size) || size != block->size) {
+			fprintf(stderr, "corrupt zstd block\n");
+			return NULL;
+		}
+		break;
+	}
+#endif
+	default:
+		fprintf(stderr, "unsupported compression %u\n",
+			decoder->compression);
+		return NULL;
+	}
+
+	return (char *) data + ((block->compressed_size + 3) & ~3u);
+}
+
 int
 wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
+	void *next = NULL;
 	uint32_t i;
 
 	if (decoder->p == decoder->end)
@@ -101,9 +148,22 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 
 	rects = (void *) (header + 1);
 	decoder->p = (uint32_t *) (rects + header->nrects);
+
+	if (decoder->compression != WCAP_COMPRESSION_NONE) {
+		next = wcap_decoder_decompress_block(decoder, decoder->p);
+		if (next == NULL) {
+			decoder->p = decoder->end;
+			return 0;
+		}
+		decoder->p = decoder->block;
+	}
+
 	for (i = 0; i < header->nrects; i++)
 		wcap_decoder_decode_rectangle(decoder, &rects[i]);
 
+	if (next)
+		decoder->p = next;
+
 	return 1;
 }
 
@@ -143,6 +203,16 @@ wcap_decoder_create(const char *filename)
 	decoder->height = header->height;
 	decoder->p = header + 1;
 	decoder->end = decoder->map + decoder->size;
+	decoder->compression = WCAP_COMPRESSION_NONE;
+	decoder->block = NULL;
+	decoder->block_size = 0;
+
+	if (header->magic == WCAP_HEADER_MAGIC_V2) {
+		struct wcap_header_v2 *header_v2 = decoder->p;
+
+		decoder->compression = header_v2->compression;
+		decoder->p = header_v2 + 1;
+	}
 
 	frame_size = header->width * header->height * 4;
 	decoder->frame = malloc(frame_size);
@@ -161,6 +231,7 @@ wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
 	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
+	free(decoder->block);
 	free(decoder->frame);
 	free(decoder);
 }
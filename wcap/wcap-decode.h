@@ -29,6 +29,10 @@
 #include <stdint.h>
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
+
+#define WCAP_COMPRESSION_NONE	0
+#define WCAP_COMPRESSION_ZSTD	1
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -41,6 +45,11 @@ struct wcap_header {
 	uint32_t width, height;
 };
 
+/* Follows struct wcap_header with WCAP_HEADER_MAGIC_V2 */
+struct wcap_header_v2 {
+	uint32_t compression;
+};
+
 struct wcap_frame_header {
 	uint32_t msecs;
 	uint32_t nrects;
@@ -50,12 +59,23 @@ struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
 
+/* Follows the rectangles of a frame in v2 files, then compressed_size
+ * bytes of the run-length encoded rectangles, padded to 4 bytes */
+struct wcap_block_header {
+	uint32_t size;
+	uint32_t compressed_size;
+};
+
 struct wcap_decoder {
 	int fd;
 	size_t size;
 	void *map, *p, *end;
 	uint32_t *frame;
 	uint32_t format;
+	uint32_t compression;
+	/* Decompressed run-length encoded rectangles of a frame */
+	uint32_t *block;
+	size_t block_size;
 	uint32_t msecs;
 	uint32_t count;
 	int width, height;